@@ -4,6 +4,7 @@
 #include "defs.h"
 #include "bblocks.h"
 #include "schd/thread-pool.h"
+#include "perf/mem-account.h"
 
 namespace bblocks {
 
@@ -130,6 +131,7 @@ struct CompletionQueue##TSUFFIX : CHandle							\
 		Guard _(&lock_);								\
 												\
 		q_.push_back(CompletionEvent(TARG(t,n)));					\
+		MemAccount::Charge(MemAccount::CQUEUE, EventBytes());				\
 												\
 		if (!inprogress_) {								\
 			ASSERT(q_.size() == 1);							\
@@ -158,20 +160,29 @@ struct CompletionQueue##TSUFFIX : CHandle							\
 		}										\
 												\
 		ASSERT(!q.empty());								\
+		MemAccount::Release(MemAccount::CQUEUE, q.size() * EventBytes());		\
 												\
 		for (auto it = q.begin(); it != q.end(); ++it) {				\
 		    CompletionEvent & e = *it;							\
+		    AsyncCtx::Scope _(e.actx_);							\
 		    (h_->*fn_)(TARGEX(e.t,_,n));						\
 		}										\
 												\
 		BBlocks::Yield(this, &This::ProcessEvents, /*arg=*/ 0);				\
 	}											\
 												\
+	/* an event and its list node */							\
+	static size_t EventBytes()								\
+	{											\
+		return sizeof(CompletionEvent) + 2 * sizeof(void *);				\
+	}											\
+												\
 	struct CompletionEvent									\
 	{											\
-	    CompletionEvent(TPARAM(T,t,n)) : TASSIGN(t,n) {}					\
+	    CompletionEvent(TPARAM(T,t,n)) : TASSIGN(t,n), actx_(AsyncCtx::Current()) {}	\
 												\
 	    TMEMBERDEF(T,t,n)									\
+	    AsyncCtx actx_;									\
 	};											\
 												\
 	SpinMutex lock_;									\
@@ -215,6 +226,7 @@ struct CompletionHandler##TSUFFIX								\
 		, q_(NULL)									\
 		, qWithCtx_(NULL)								\
 		, ctx_(0)									\
+		, actx_(AsyncCtx::Current())							\
 	{}											\
 												\
 	CompletionHandler##TSUFFIX(Type type, CHandle * h,					\
@@ -227,6 +239,7 @@ struct CompletionHandler##TSUFFIX								\
 	    , q_(NULL)										\
 	    , qWithCtx_(NULL)									\
 	    , ctx_(ctx)										\
+	    , actx_(AsyncCtx::Current())							\
 	{}											\
 												\
 	CompletionHandler##TSUFFIX(CQueue##TSUFFIX<TENUM(T,n)> * q)				\
@@ -235,6 +248,7 @@ struct CompletionHandler##TSUFFIX								\
 	    , fn_(NULL), fnWithCtx_(NULL)							\
 	    , q_(q), qWithCtx_(NULL)								\
 	    , ctx_(0)										\
+	    , actx_(AsyncCtx::Current())							\
 	{}											\
 												\
 	CompletionHandler##TSUFFIX(CQueueWithCtx##TSUFFIX<TENUM(T,n), uintptr_t> * q,		\
@@ -244,11 +258,13 @@ struct CompletionHandler##TSUFFIX								\
 	    , fn_(NULL), fnWithCtx_(NULL)							\
 	    , q_(NULL), qWithCtx_(q)								\
 	    , ctx_(ctx)										\
+	    , actx_(AsyncCtx::Current())							\
 	{}											\
 												\
 	void Interrupt(TPARAM(T,t,n))								\
 	{											\
 		INVARIANT(type_ == Type::INTERRUPT);						\
+		AsyncCtx::Scope _(actx_);							\
 		(h_->*fn_)(TARG(t,n));								\
 	}											\
 												\
@@ -258,7 +274,10 @@ struct CompletionHandler##TSUFFIX								\
 		       || ((fn_ && !fnWithCtx_) || (!fn_ && fnWithCtx_)));			\
 		ASSERT(type_ != Type::QUEUE || ((q_ && !qWithCtx_)				\
 		       || (!q_ && qWithCtx_)));							\
-				    								\
+												\
+		/* The handler runs, or is scheduled, in the context it was made in */		\
+		AsyncCtx::Scope _(actx_);							\
+												\
 		if (type_ == Type::INTERRUPT) {							\
 			fn_ ? (h_->*fn_)(TARG(t,n))						\
 			    : (h_->*fnWithCtx_)(TARG(t,n), ctx_);				\
@@ -273,6 +292,20 @@ struct CompletionHandler##TSUFFIX								\
 		}										\
 	}											\
 												\
+	/* Like Wakeup, but an async handler is scheduled on the given core. A core of	\
+	 * -1 falls back to Wakeup. */								\
+	void WakeupOn(const int core, TPARAM(T,t,n))						\
+	{											\
+		if (type_ != Type::ASYNCSCHEDULE || core < 0) {					\
+			Wakeup(TARG(t,n));							\
+			return;									\
+		}										\
+												\
+		AsyncCtx::Scope _(actx_);							\
+		fn_ ? BBlocks::ScheduleOn(core, h_, fn_, TARG(t,n))				\
+		    : BBlocks::ScheduleOn(core, h_, fnWithCtx_, TARG(t,n), ctx_);		\
+	}											\
+												\
 	template<class X>									\
 	void SetCtx(const X & x)								\
 	{											\
@@ -308,6 +341,7 @@ struct CompletionHandler##TSUFFIX								\
 	CompletionQueue##TSUFFIX<TENUM(T,n)> * q_;						\
 	CompletionQueueWithCtx##TSUFFIX<TENUM(T,n), uintptr_t> * qWithCtx_;			\
 	uintptr_t ctx_;										\
+	AsyncCtx actx_;										\
 };												\
 												\
 template<TDEF(T,n)>										\
@@ -3,6 +3,24 @@
 
 using namespace bblocks;
 
+void
+BBlocks::Init()
+{
+	if (!Logger::IsInit()) {
+		LogHelper::InitConsoleLogger();
+	}
+
+	RRCpuId::Init();
+	NonBlockingThreadPool::Init();
+	OffloadPool::Init();
+}
+
+void
+BBlocks::Destroy()
+{
+	SingletonRegistry::DestroyAll();
+}
+
 void
 BBlocks::Start()
 {
@@ -12,6 +30,14 @@ BBlocks::Start()
 void
 BBlocks::Start(const uint32_t ncores)
 {
+	Start(ncores, ncores);
+}
+
+void
+BBlocks::Start(const uint32_t ncores, const uint32_t minActive)
+{
+	Init();
+
 	/*
 	 * Prime up the GetHz function
 	 */
@@ -22,12 +48,17 @@ BBlocks::Start(const uint32_t ncores)
 	 */
 	ThreadCtx::Init(/*tinst=*/ NULL);
 
-	NonBlockingThreadPool::Instance().Start(ncores);
+	NonBlockingThreadPool::Instance().Start(ncores, minActive);
+	OffloadPool::Instance().Start();
 }
 
 void
 BBlocks::Shutdown()
 {
+	/*
+	 * Offloaded work completes on the thread pool, drain it first
+	 */
+	OffloadPool::Instance().Shutdown();
 	NonBlockingThreadPool::Instance().Shutdown();
 	ThreadCtx::Cleanup();
 }
@@ -50,6 +81,54 @@ BBlocks::Schedule(ThreadRoutine * r)
 	NonBlockingThreadPool::Instance().Schedule(r);
 }
 
+void
+BBlocks::ScheduleWithDeadline(const uint32_t msec, ThreadRoutine * r)
+{
+	NonBlockingThreadPool::Instance().ScheduleWithDeadline(msec, r);
+}
+
+bool
+BBlocks::TrySchedule(ThreadRoutine * r)
+{
+	return NonBlockingThreadPool::Instance().TrySchedule(r);
+}
+
+void
+BBlocks::SetAdmission(const size_t maxDepth, const uint32_t targetDelayInMicroSec)
+{
+	NonBlockingThreadPool::Instance().SetAdmission(maxDepth, targetDelayInMicroSec);
+}
+
+bool
+BBlocks::IsSaturated()
+{
+	return NonBlockingThreadPool::Instance().IsSaturated();
+}
+
+void
+BBlocks::ScheduleIn(const uint32_t msec, ThreadRoutine * r)
+{
+	NonBlockingThreadPool::Instance().ScheduleIn(msec, r);
+}
+
+bool
+BBlocks::CancelTimer(ThreadRoutine * r)
+{
+	return NonBlockingThreadPool::Instance().CancelTimer(r);
+}
+
+void
+BBlocks::SetOffloadThreads(const size_t minth, const size_t maxth)
+{
+	OffloadPool::Instance().SetLimits(minth, maxth);
+}
+
+void
+BBlocks::SetSpinPolicy(const SpinPolicy::Mode mode)
+{
+	SpinPolicy::Set(mode);
+}
+
 void
 BBlocks::ScheduleBarrier(ThreadRoutine * r)
 {
@@ -2,6 +2,7 @@
 
 #include "defs.h"
 #include "schd/thread-pool.h"
+#include "schd/offload-pool.h"
 
 namespace bblocks {
 
@@ -13,9 +14,27 @@ class BBlocks
 {
 public:
 
+	/**
+	 * Initialize the core singletons in dependency order (logger, cpu id, thread pool).
+	 * Singletons that are already initialized are left alone. Start calls this if needed.
+	 */
+	static void Init();
+
+	/**
+	 * Destroy all singletons in the reverse order of initialization. Must be called after
+	 * Shutdown.
+	 */
+	static void Destroy();
+
 	static void Start(const uint32_t ncores);
 	static void Start();
 
+	/**
+	 * Start with an elastic pool, that runs between minActive and ncores threads depending
+	 * on load. See NonBlockingThreadPool::Start.
+	 */
+	static void Start(const uint32_t ncores, const uint32_t minActive);
+
 	static void Shutdown();
 
 	static void Wait();
@@ -30,6 +49,27 @@ public:
 	}											\
 												\
 	template<class _OBJ_, TDEF(T,n)>							\
+	static bool TrySchedule(_OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)), TPARAM(T,t,n))	\
+	{											\
+		return NonBlockingThreadPool::Instance().TrySchedule(obj, fn, TARG(t,n));	\
+	}											\
+												\
+	template<class _OBJ_, TDEF(T,n)>							\
+	static void ScheduleWithDeadline(const uint32_t msec, _OBJ_ * obj,			\
+					 void (_OBJ_::*fn)(TENUM(T,n)), TPARAM(T,t,n))		\
+	{											\
+		NonBlockingThreadPool::Instance().ScheduleWithDeadline(msec, obj, fn,		\
+								      TARG(t,n));		\
+	}											\
+												\
+	template<class _OBJ_, TDEF(T,n)>							\
+	static void ScheduleOn(const uint32_t core, _OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)),	\
+			       TPARAM(T,t,n))							\
+	{											\
+		NonBlockingThreadPool::Instance().ScheduleOn(core, obj, fn, TARG(t,n));		\
+	}											\
+												\
+	template<class _OBJ_, TDEF(T,n)>							\
 	static void ScheduleIn(const uint32_t msec, _OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)), \
 			       TPARAM(T,t,n))							\
 	{											\
@@ -49,6 +89,51 @@ public:
 	TP_SCHEDULE(4) // void Schedule<T1,T2,T3,T4>(...)
 
 	static void Schedule(ThreadRoutine * r);
+	static bool TrySchedule(ThreadRoutine * r);
+
+	/**
+	 * Schedule to the deadline lane, see NonBlockingThreadPool::ScheduleWithDeadline
+	 */
+	static void ScheduleWithDeadline(const uint32_t msec, ThreadRoutine * r);
+
+	/**
+	 * Let TrySchedule refuse work when the pool is overloaded, by queue depth per thread or
+	 * by queue delay. See NonBlockingThreadPool::SetAdmission.
+	 */
+	static void SetAdmission(const size_t maxDepth, const uint32_t targetDelayInMicroSec);
+
+	/**
+	 * No thread admits more work. Sources of new work, like a listener, should hold off.
+	 */
+	static bool IsSaturated();
+
+	/**
+	 * Arm a timer with a caller owned routine. Until the timer fires it can be disarmed with
+	 * CancelTimer, which returns false once the routine is on its way to run.
+	 */
+	static void ScheduleIn(const uint32_t msec, ThreadRoutine * r);
+	static bool CancelTimer(ThreadRoutine * r);
+
+	/**
+	 * Run fn on the blocking offload pool and pass its result to h. Use it for calls that
+	 * may block (name resolution, open, fsync, synchronous IO), they must not run on the
+	 * non-blocking cores. An async handler runs on the core that offloaded the work.
+	 *
+	 * Shutdown stops the offload pool first, from then on the work is refused, Offload returns
+	 * false and h is not called.
+	 */
+	template<class FN, class T>
+	static bool Offload(FN fn, const CompletionHandler<T> & h)
+	{
+		return OffloadPool::Instance().Offload(fn, h);
+	}
+
+	static void SetOffloadThreads(const size_t minth, const size_t maxth);
+
+	/**
+	 * How hard idle pool threads spin for work before they sleep
+	 */
+	static void SetSpinPolicy(const SpinPolicy::Mode mode);
 
 	#define TP_SCHEDULE_BARRIER(n)								\
 	template<class _OBJ_, TDEF(T,n)>							\
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <new>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
+#include <stdlib.h>
+
+#include "util.h"
+#include "buf/bufpool.h"
+#include "schd/async-ctx.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//....................................................................................... Arena ....
+
+/**
+ * @class Arena
+ *
+ * Bump pointer allocator for objects that die together, like the temporaries of a request.
+ *
+ * Memory is carved out of chunks that come from BufferPool, requests too large for a chunk get
+ * a block of their own from the heap. Nothing is freed one by one, Reset runs the destructors of
+ * the objects made with New, last first, and hands all the memory back at once.
+ *
+ * An arena is not thread safe. It goes with a request through AsyncCtx, so the hops of a request
+ * can draw from it as long as they don't run at the same time.
+ *
+ * Usage :
+ *
+ *	Arena arena;
+ *	AsyncCtx::Scope _(AsyncCtx::Begin(id, tenant, budget, &arena));
+ *	...
+ *	Ctx * ctx = Arena::Current()->New<Ctx>(...);
+ *	...
+ *	arena.Reset();
+ */
+class Arena
+{
+public:
+
+	/*
+	 * A chunk is the largest slab of BufferPool
+	 */
+	static const size_t CHUNK_SIZE = SLAB_DEPTH * 512;
+	static const size_t MAX_ALIGN = 64;
+
+	Arena()
+		: chunks_(NULL), large_(NULL), dtors_(NULL), pos_(0), end_(0), size_(0), nchunks_(0)
+	{}
+
+	~Arena()
+	{
+		Reset();
+	}
+
+	/**
+	 * Arena of the request the calling thread works for, NULL if none
+	 */
+	static Arena * Current()
+	{
+		return AsyncCtx::Current().arena_;
+	}
+
+	/**
+	 * size bytes aligned to align, a power of 2 up to MAX_ALIGN. A zero sized allocation
+	 * gets a byte, so it is a distinct pointer and never NULL, as with operator new.
+	 */
+	void * Alloc(const size_t size, const size_t align = alignof(max_align_t))
+	{
+		ASSERT(align && !(align & (align - 1)) && align <= MAX_ALIGN);
+
+		/*
+		 * Before the first chunk pos_ and end_ are 0, and 0 bytes would fit at address 0
+		 */
+		const size_t n = size ? size : 1;
+		const uintptr_t p = (pos_ + align - 1) & ~(uintptr_t) (align - 1);
+
+		if (p + n <= end_ && p >= pos_) {
+			pos_ = p + n;
+			size_ += n;
+			return (void *) p;
+		}
+
+		return AllocSlow(n, align);
+	}
+
+	/**
+	 * Construct a T in the arena, it is destroyed on Reset
+	 */
+	template<class T, class... ARGS>
+	T * New(ARGS &&... args)
+	{
+		T * t = ::new (Alloc(sizeof(T), alignof(T))) T(std::forward<ARGS>(args)...);
+
+		if (!is_trivially_destructible<T>::value) {
+			Dtor * d = ::new (Alloc(sizeof(Dtor), alignof(Dtor))) Dtor();
+			d->fn_ = &Arena::Destroy<T>;
+			d->obj_ = t;
+			d->next_ = dtors_;
+			dtors_ = d;
+		}
+
+		return t;
+	}
+
+	/**
+	 * Destroy the objects and release all the memory
+	 */
+	void Reset()
+	{
+		while (dtors_) {
+			Dtor * d = dtors_;
+			dtors_ = d->next_;
+			(*d->fn_)(d->obj_);
+		}
+
+		while (large_) {
+			Large * l = large_;
+			large_ = l->next_;
+			::free(l);
+		}
+
+		while (chunks_) {
+			Chunk * c = chunks_;
+			chunks_ = c->next_;
+
+			if (ThreadCtx::pool_) {
+				BufferPool::Dalloc<Chunk>(c);
+			} else {
+				::free(c);
+			}
+		}
+
+		pos_ = end_ = 0;
+		size_ = 0;
+		nchunks_ = 0;
+	}
+
+	/**
+	 * Bytes handed out since the last Reset
+	 */
+	size_t Size() const
+	{
+		return size_;
+	}
+
+	size_t Chunks() const
+	{
+		return nchunks_;
+	}
+
+private:
+
+	Arena(const Arena &);
+	Arena & operator=(const Arena &);
+
+	struct Chunk
+	{
+		Chunk * next_;
+		uint8_t data_[CHUNK_SIZE - sizeof(Chunk *)];
+	};
+
+	static_assert(sizeof(Chunk) == CHUNK_SIZE, "Chunk is not a slab");
+
+	/*
+	 * Header of a block of its own, the data follows at MAX_ALIGN
+	 */
+	struct Large
+	{
+		Large * next_;
+	};
+
+	struct Dtor
+	{
+		void (*fn_)(void *);
+		void * obj_;
+		Dtor * next_;
+	};
+
+	template<class T>
+	static void Destroy(void * t)
+	{
+		((T *) t)->~T();
+	}
+
+	void * AllocSlow(const size_t size, const size_t align)
+	{
+		if (size > sizeof(Chunk::data_) / 4) {
+			/*
+			 * Would waste too much of a chunk
+			 */
+			void * ptr = NULL;
+			const int status = posix_memalign(&ptr, MAX_ALIGN, MAX_ALIGN + size);
+			INVARIANT(!status && ptr);
+
+			Large * l = (Large *) ptr;
+			l->next_ = large_;
+			large_ = l;
+
+			size_ += size;
+			return (uint8_t *) ptr + MAX_ALIGN;
+		}
+
+		void * ptr = NULL;
+		if (ThreadCtx::pool_) {
+			ptr = BufferPool::Alloc<Chunk>();
+		} else {
+			/*
+			 * Off the pool threads, freeable with either
+			 */
+			const int status = posix_memalign(&ptr, 512, sizeof(Chunk));
+			INVARIANT(!status && ptr);
+		}
+
+		Chunk * c = (Chunk *) ptr;
+		c->next_ = chunks_;
+		chunks_ = c;
+		++nchunks_;
+
+		pos_ = (uintptr_t) c->data_;
+		end_ = pos_ + sizeof(c->data_);
+
+		return Alloc(size, align);
+	}
+
+	Chunk * chunks_;
+	Large * large_;
+	Dtor * dtors_;			// objects to destroy, last made first
+	uintptr_t pos_;			// free space of the current chunk
+	uintptr_t end_;
+	size_t size_;
+	size_t nchunks_;
+};
+
+//.......................................................................... ArenaAllocator<T> ....
+
+/**
+ * @class ArenaAllocator
+ *
+ * Standard allocator over an Arena, for containers of request scoped data. Deallocation is a
+ * no-op, the memory goes with the arena. Without an arena it allocates from the heap, so the
+ * same container type serves both. The allocator moves with the contents on assignment and
+ * swap.
+ *
+ * Containers have to be destroyed before the arena is reset, or be made with Arena::New.
+ */
+template<class T>
+class ArenaAllocator
+{
+public:
+
+	typedef T value_type;
+	typedef true_type propagate_on_container_copy_assignment;
+	typedef true_type propagate_on_container_move_assignment;
+	typedef true_type propagate_on_container_swap;
+
+	ArenaAllocator(Arena * arena = NULL) : arena_(arena) {}
+
+	template<class U>
+	ArenaAllocator(const ArenaAllocator<U> & rhs) : arena_(rhs.arena_) {}
+
+	T * allocate(const size_t n)
+	{
+		if (arena_) {
+			return (T *) arena_->Alloc(n * sizeof(T), alignof(T));
+		}
+
+		return (T *) ::operator new(n * sizeof(T));
+	}
+
+	void deallocate(T * p, const size_t n)
+	{
+		if (!arena_) {
+			::operator delete(p);
+		}
+	}
+
+	template<class U>
+	bool operator==(const ArenaAllocator<U> & rhs) const
+	{
+		return arena_ == rhs.arena_;
+	}
+
+	template<class U>
+	bool operator!=(const ArenaAllocator<U> & rhs) const
+	{
+		return arena_ != rhs.arena_;
+	}
+
+	Arena * arena_;
+};
+
+}
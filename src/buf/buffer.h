@@ -7,6 +7,8 @@
 #include <sys/mman.h>
 #include <sstream>
 
+#include "perf/mem-account.h"
+
 namespace bblocks {
 
 //..................................................................................... IOBuffer ...
@@ -30,10 +32,15 @@ public:
 	 */
 	struct Dalloc
 	{
+		Dalloc(const size_t size) : size_(size) {}
+
 		void operator()(uint8_t * data)
 		{
 			::free(data);
+			MemAccount::Release(MemAccount::IOBUFFER, size_);
 		}
+
+		const size_t size_;
 	};
 
 	struct MappedDalloc
@@ -44,6 +51,7 @@ public:
 		{
 			int status = munmap(data, size_);
 			INVARIANT(status == 0);
+			MemAccount::Release(MemAccount::IOBUFFER, size_);
 		}
 
 		const size_t size_;
@@ -57,7 +65,20 @@ public:
 		void * ptr;
 		int status = posix_memalign(&ptr, 512, size);
 		INVARIANT(status != -1);
-		return IOBuffer(shared_ptr<uint8_t>((uint8_t *) ptr, Dalloc()), size);
+		MemAccount::Charge(MemAccount::IOBUFFER, size);
+		return IOBuffer(shared_ptr<uint8_t>((uint8_t *) ptr, Dalloc(size)), size);
+	}
+
+	/**
+	 * Alloc, or no buffer if IOBuffers are over their hard limit
+	 */
+	static IOBuffer TryAlloc(const size_t size)
+	{
+		if (MemAccount::IsOverHard(MemAccount::IOBUFFER)) {
+			return IOBuffer();
+		}
+
+		return Alloc(size);
 	}
 
 	static IOBuffer AllocMappedMem(const size_t size)
@@ -65,6 +86,7 @@ public:
 		void * ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
 			          /*fd=*/ -1, /*offset=*/ 0);
 		INVARIANT(ptr != MAP_FAILED);
+		MemAccount::Charge(MemAccount::IOBUFFER, size);
 		return IOBuffer(shared_ptr<uint8_t>((uint8_t *) ptr, MappedDalloc(size)), size);
 	}
 
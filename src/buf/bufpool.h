@@ -6,6 +6,7 @@
 #include "schd/thread-ctx.h"
 #include "util.h"
 #include "lock.h"
+#include "perf/mem-account.h"
 
 namespace bblocks {
 
@@ -32,6 +33,7 @@ public:
 		}
 
 		ThreadCtx::statHits_.Update(id);
+		MemAccount::Release(MemAccount::BUFPOOL, size);
 
 		uint8_t * data = ThreadCtx::pool_[id].front();
 		ThreadCtx::pool_[id].pop_front();
@@ -46,11 +48,15 @@ public:
 		const size_t size = Math::Roundup(sizeof(T), 512);
 		const size_t id = (size / 512) - 1;
 
-		if (id >= SLAB_DEPTH) {
+		if (id >= SLAB_DEPTH || MemAccount::IsBufferPressure()) {
+			/*
+			 * Too large to cache, or memory is short
+			 */
 			::free((void *) t);
 			return;
 		}
 
+		MemAccount::Charge(MemAccount::BUFPOOL, size);
 		ThreadCtx::pool_[id].push_back((uint8_t *) t);
 	}
 };
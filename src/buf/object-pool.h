@@ -0,0 +1,382 @@
+#pragma once
+
+#include <new>
+#include <vector>
+#include <atomic>
+#include <utility>
+#include <typeinfo>
+#include <stdlib.h>
+
+#include "util.h"
+#include "logger.h"
+#include "lock.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//............................................................................... ObjectPool<T> ....
+
+/**
+ * @class ObjectPool
+ *
+ * Free objects of type T, for the classes that are allocated and released on the hot path.
+ *
+ * Every thread keeps a cache of up to CACHE_SIZE free objects and allocates and frees from it
+ * without synchronization. An empty cache is refilled and a full cache is drained BATCH_SIZE
+ * objects at a time through the depot shared by the threads, the depot keeps up to its capacity
+ * and returns the rest to the heap. A thread that exits hands its cache to the depot.
+ *
+ * The pool deals in memory, New and Delete construct and destroy T on it. Objects handed out
+ * and not freed are accounted, Live reports them and the pool logs what is leaked when it goes.
+ *
+ * The pool is a singleton set up on first use and torn down with the others by BBlocks::Destroy,
+ * when the threads that use it are done. A thread that carries on afterwards starts over with a
+ * new pool.
+ *
+ * Classes opt in by deriving from PoolObject<T>, new and delete then go through the pool.
+ *
+ * Usage :
+ *
+ *	struct Op : PoolObject<Op> { ... };
+ *
+ *	Op * op = new Op(...);
+ *	...
+ *	delete op;
+ */
+template<class T>
+class ObjectPool : public Singleton<ObjectPool<T> >
+{
+public:
+
+	typedef ObjectPool<T> This;
+
+	friend class Singleton<This>;
+
+	static const size_t CACHE_SIZE = 32;
+	static const size_t BATCH_SIZE = CACHE_SIZE / 2;
+	static const size_t DEFAULT_DEPOT_SIZE = 1024;
+
+	static This & Instance()
+	{
+		if (!Singleton<This>::IsInit()) {
+			Singleton<This>::Init();
+		}
+
+		return Singleton<This>::Instance();
+	}
+
+	/**
+	 * Memory for a T
+	 */
+	static void * Alloc()
+	{
+		Cache * c = Self();
+
+		if (!c->n_) {
+			Instance().Refill(c);
+		}
+
+		c->live_.store(c->live_.load(memory_order_relaxed) + 1, memory_order_relaxed);
+
+		if (c->n_) {
+			return c->objs_[--c->n_];
+		}
+
+		return NewObject();
+	}
+
+	/**
+	 * Release memory from Alloc, on any thread
+	 */
+	static void Free(void * ptr)
+	{
+		ASSERT(ptr);
+
+		Cache * c = Self();
+
+		if (c->n_ == CACHE_SIZE) {
+			Instance().Drain(c);
+		}
+
+		c->objs_[c->n_++] = ptr;
+		c->live_.store(c->live_.load(memory_order_relaxed) - 1, memory_order_relaxed);
+	}
+
+	template<class... ARGS>
+	static T * New(ARGS &&... args)
+	{
+		return ::new (Alloc()) T(std::forward<ARGS>(args)...);
+	}
+
+	static void Delete(T * t)
+	{
+		if (!t) return;
+
+		t->~T();
+		Free(t);
+	}
+
+	/**
+	 * Fill the depot up to n free objects, and keep room for them. Reserves don't add up, the
+	 * depot keeps what the largest asked for.
+	 */
+	void Reserve(const size_t n)
+	{
+		Guard _(&lock_);
+
+		max_ = max(max_, n);
+
+		while (depot_.size() < n) {
+			depot_.push_back(NewObject());
+		}
+	}
+
+	/**
+	 * Objects handed out and not freed
+	 */
+	int64_t Live()
+	{
+		Guard _(&lock_);
+
+		int64_t live = orphaned_;
+		for (auto c : caches_) {
+			live += c->live_.load(memory_order_relaxed);
+		}
+
+		return live;
+	}
+
+	/**
+	 * Free objects in the depot
+	 */
+	size_t DepotSize()
+	{
+		Guard _(&lock_);
+		return depot_.size();
+	}
+
+private:
+
+	/*
+	 * Free objects of a thread, live_ is written by the thread only
+	 */
+	struct Cache
+	{
+		Cache() : n_(0), live_(0), gen_(0) {}
+
+		void * objs_[CACHE_SIZE];
+		size_t n_;
+		atomic<int64_t> live_;
+		uint64_t gen_;			// pool the cache is registered with
+	};
+
+	/*
+	 * Hands the cache to the depot when the thread exits
+	 */
+	struct CacheOwner
+	{
+		CacheOwner() : cache_(NULL) {}
+
+		~CacheOwner()
+		{
+			if (!cache_) return;
+
+			if (cache_->gen_ == gen_.load(memory_order_relaxed)) {
+				Instance().Release(cache_);
+			} else {
+				/*
+				 * The pool is gone, it took the free objects with it
+				 */
+				ASSERT(!cache_->n_);
+				delete cache_;
+			}
+
+			cache_ = NULL;
+			ObjectPool<T>::cache_ = NULL;
+		}
+
+		Cache * cache_;
+	};
+
+	ObjectPool()
+		: log_("/objectpool/" + string(typeid(T).name()))
+		, lock_(/*isRecursive=*/ false)
+		, max_(DEFAULT_DEPOT_SIZE)
+		, orphaned_(0)
+	{}
+
+	~ObjectPool()
+	{
+		/*
+		 * Threads still around keep their cache, they register it with the next pool
+		 */
+		for (auto c : caches_) {
+			orphaned_ += c->live_.load(memory_order_relaxed);
+			c->live_.store(0, memory_order_relaxed);
+
+			while (c->n_) {
+				::free(c->objs_[--c->n_]);
+			}
+		}
+
+		if (orphaned_) {
+			ERROR(log_) << orphaned_ << " objects leaked";
+		}
+
+		for (auto ptr : depot_) {
+			::free(ptr);
+		}
+
+		gen_.fetch_add(1, memory_order_relaxed);
+	}
+
+	ObjectPool(const This &);
+	This & operator=(const This &);
+
+	static Cache * Self()
+	{
+		if (cache_ && cache_->gen_ == gen_.load(memory_order_relaxed)) {
+			return cache_;
+		}
+
+		if (cache_) {
+			/*
+			 * Outlived the pool it was registered with
+			 */
+			Instance().Register(cache_);
+			return cache_;
+		}
+
+		Cache * c = new Cache();
+		Instance().Register(c);
+
+		/*
+		 * Function local, gcc does not take two thread_local static members of templates in
+		 * one translation unit
+		 */
+		static thread_local CacheOwner owner;
+
+		cache_ = c;
+		owner.cache_ = c;
+
+		return c;
+	}
+
+	static void * NewObject()
+	{
+		void * ptr = NULL;
+		const size_t align = alignof(T) > sizeof(void *) ? alignof(T) : sizeof(void *);
+		const int status = posix_memalign(&ptr, align, sizeof(T));
+		INVARIANT(!status && ptr);
+		return ptr;
+	}
+
+	void Register(Cache * c)
+	{
+		Guard _(&lock_);
+		c->gen_ = gen_.load(memory_order_relaxed);
+		caches_.push_back(c);
+	}
+
+	void Release(Cache * c)
+	{
+		Drain(c, /*n=*/ c->n_);
+
+		Guard _(&lock_);
+
+		/*
+		 * What the thread did not free is accounted as the pool's from now on
+		 */
+		orphaned_ += c->live_.load(memory_order_relaxed);
+
+		for (size_t i = 0; i < caches_.size(); ++i) {
+			if (caches_[i] == c) {
+				caches_[i] = caches_.back();
+				caches_.pop_back();
+				break;
+			}
+		}
+
+		delete c;
+	}
+
+	void Refill(Cache * c)
+	{
+		Guard _(&lock_);
+
+		while (c->n_ < BATCH_SIZE && !depot_.empty()) {
+			c->objs_[c->n_++] = depot_.back();
+			depot_.pop_back();
+		}
+	}
+
+	void Drain(Cache * c, size_t n = BATCH_SIZE)
+	{
+		ASSERT(n <= c->n_);
+
+		{
+			Guard _(&lock_);
+
+			while (n && depot_.size() < max_) {
+				depot_.push_back(c->objs_[--c->n_]);
+				--n;
+			}
+		}
+
+		/*
+		 * The depot is full, back to the heap
+		 */
+		while (n--) {
+			::free(c->objs_[--c->n_]);
+		}
+	}
+
+	const string log_;
+	PThreadMutex lock_;
+	vector<void *> depot_;
+	vector<Cache *> caches_;
+	size_t max_;			// depot capacity
+	int64_t orphaned_;		// live objects of threads that have exited
+
+	static __thread Cache * cache_;
+	static atomic<uint64_t> gen_;		// pools torn down so far
+};
+
+template<class T>
+__thread typename ObjectPool<T>::Cache * ObjectPool<T>::cache_;
+
+template<class T>
+atomic<uint64_t> ObjectPool<T>::gen_(0);
+
+//............................................................................... PoolObject<T> ....
+
+/**
+ * @class PoolObject
+ *
+ * CRTP base that sends new and delete of T to ObjectPool<T>. Classes derived from T can't
+ * inherit it, they are of another size.
+ */
+template<class T>
+class PoolObject
+{
+public:
+
+	static void * operator new(size_t size)
+	{
+		INVARIANT(size == sizeof(T));
+		return ObjectPool<T>::Alloc();
+	}
+
+	static void * operator new(size_t size, void * ptr)
+	{
+		return ptr;
+	}
+
+	static void operator delete(void * ptr)
+	{
+		if (ptr) ObjectPool<T>::Free(ptr);
+	}
+};
+
+}
@@ -8,6 +8,15 @@
 
 #define ALIGNED(x) __attribute__((aligned(sizeof(x))))
 
+#define CACHELINE_SIZE 64
+#define CACHELINE_ALIGNED __attribute__((aligned(CACHELINE_SIZE)))
+
+#if defined(__i386__) || defined(__x86_64__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
 #if defined(DEBUG_BUILD)
 #define DEBUG(path) LogMessage(Logger::LEVEL_DEBUG, path)
 #else
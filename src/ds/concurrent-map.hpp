@@ -0,0 +1,433 @@
+#pragma once
+
+#include <new>
+#include <atomic>
+#include <functional>
+#include <stdlib.h>
+
+#include "defs.h"
+#include "util.h"
+#include "lock.h"
+#include "schd/epoch.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//...................................................................... ConcurrentMap<K, V, H> ....
+
+/**
+ * @class ConcurrentMap
+ *
+ * Hash map for read mostly lookup tables shared across threads.
+ *
+ * Reads are lock free. They do not write to any shared cache line, readers only announce their
+ * epoch on a thread private slot (see Epoch). Writes are serialized per lock stripe, so writers
+ * to different stripes do not contend. Nodes are immutable once published, an update publishes
+ * a new node and retires the old one, so a reader always sees a consistent key-value pair.
+ *
+ * The table doubles when a stripe passes the load factor. Growing locks all the stripes, copies
+ * the nodes to a new table and retires the old table. Readers in flight continue to walk the old
+ * table until they leave their critical section.
+ *
+ * Iteration (ForEach) is weakly consistent and is safe against concurrent updates.
+ *
+ * The stripes cost a cache line each. A small map embedded per object should ask for a few
+ * stripes and buckets.
+ *
+ * K needs operator== and V needs to be copyable.
+ */
+template<class K, class V, class H = std::hash<K> >
+class ConcurrentMap
+{
+public:
+
+	static const size_t NSTRIPES = 64;
+	static const size_t DEFAULT_BUCKETS = 1024;
+	static const size_t LOAD_FACTOR = 1;
+
+	/**
+	 * @param	nbuckets	Initial buckets, rounded up to a power of 2 and nstripes
+	 * @param	nstripes	Lock stripes, rounded up to a power of 2
+	 */
+	explicit ConcurrentMap(const size_t nbuckets = DEFAULT_BUCKETS,
+			       const size_t nstripes = NSTRIPES)
+		: nstripes_(RoundupPow2(nstripes))
+		, table_(new Table(Math::Roundup(RoundupPow2(nbuckets), nstripes_)))
+	{
+		/*
+		 * operator new does not honour the alignment of Stripe
+		 */
+		void * buf = NULL;
+		const int status = posix_memalign(&buf, CACHELINE_SIZE, nstripes_ * sizeof(Stripe));
+		INVARIANT(!status && buf);
+
+		stripes_ = (Stripe *) buf;
+		for (size_t i = 0; i < nstripes_; ++i) {
+			new (&stripes_[i]) Stripe();
+		}
+	}
+
+	/*
+	 * Caller has to ensure there are no readers or writers left
+	 */
+	~ConcurrentMap()
+	{
+		delete table_.load();
+
+		for (size_t i = 0; i < nstripes_; ++i) {
+			stripes_[i].~Stripe();
+		}
+
+		free(stripes_);
+	}
+
+	/**
+	 * Lookup key
+	 *
+	 * @param	k	Key
+	 * @param	v	Value copied out if the key is found
+	 * @return	true if the key was found
+	 */
+	bool Get(const K & k, V & v) const
+	{
+		Epoch::Guard _;
+
+		const Node * n = Find(table_.load(memory_order_acquire), k);
+
+		if (!n) return false;
+
+		v = n->v_;
+		return true;
+	}
+
+	bool Contains(const K & k) const
+	{
+		Epoch::Guard _;
+		return Find(table_.load(memory_order_acquire), k);
+	}
+
+	/**
+	 * Insert key if not already present
+	 *
+	 * @return	true if inserted, false if the key already exists
+	 */
+	bool Insert(const K & k, const V & v)
+	{
+		return Update(k, v, /*replace=*/ false);
+	}
+
+	/**
+	 * Insert key or replace the value of an existing key
+	 *
+	 * @return	true if inserted, false if an existing value was replaced
+	 */
+	bool Put(const K & k, const V & v)
+	{
+		return Update(k, v, /*replace=*/ true);
+	}
+
+	/**
+	 * Remove key
+	 *
+	 * @return	true if the key was found and removed
+	 */
+	bool Erase(const K & k)
+	{
+		V v;
+		return Erase(k, v);
+	}
+
+	/**
+	 * Remove key and copy out its value. Of racing erases of a key only one finds it.
+	 *
+	 * @return	true if the key was found and removed
+	 */
+	bool Erase(const K & k, V & v)
+	{
+		const size_t h = hash_(k);
+		Stripe & s = stripes_[h & (nstripes_ - 1)];
+		Node * victim = NULL;
+
+		{
+			AutoLock _(&s.lock_);
+
+			Table * t = table_.load(memory_order_relaxed);
+
+			atomic<Node *> * prev = &t->Bucket(h);
+			for (Node * n = prev->load(memory_order_relaxed); n;
+			     prev = &n->next_, n = prev->load(memory_order_relaxed)) {
+				if (n->k_ == k) {
+					v = n->v_;
+					prev->store(n->next_.load(memory_order_relaxed),
+						    memory_order_release);
+					s.count_.fetch_sub(1, memory_order_relaxed);
+					victim = n;
+					break;
+				}
+			}
+		}
+
+		if (!victim) return false;
+
+		Epoch::Retire(victim);
+		return true;
+	}
+
+	/**
+	 * Remove all keys
+	 */
+	void Clear()
+	{
+		LockAll();
+
+		Table * t = table_.load(memory_order_relaxed);
+		table_.store(new Table(t->nbuckets_), memory_order_release);
+
+		for (size_t i = 0; i < nstripes_; ++i) {
+			stripes_[i].count_.store(0, memory_order_relaxed);
+		}
+
+		UnlockAll();
+
+		Epoch::Retire(t);
+	}
+
+	/**
+	 * Visit all entries. Weakly consistent, entries updated during the walk may or may not be
+	 * seen. The visitor runs inside a read side critical section and must not block.
+	 */
+	template<class FN>
+	void ForEach(FN fn) const
+	{
+		Epoch::Guard _;
+
+		const Table * t = table_.load(memory_order_acquire);
+
+		for (size_t i = 0; i < t->nbuckets_; ++i) {
+			for (const Node * n = t->buckets_[i].load(memory_order_acquire); n;
+			     n = n->next_.load(memory_order_acquire)) {
+				fn(n->k_, n->v_);
+			}
+		}
+	}
+
+	/**
+	 * Approximate number of entries
+	 */
+	size_t Size() const
+	{
+		size_t size = 0;
+		for (size_t i = 0; i < nstripes_; ++i) {
+			size += stripes_[i].count_.load(memory_order_relaxed);
+		}
+
+		return size;
+	}
+
+	bool IsEmpty() const
+	{
+		return !Size();
+	}
+
+	size_t Buckets() const
+	{
+		Epoch::Guard _;
+		return table_.load(memory_order_acquire)->nbuckets_;
+	}
+
+private:
+
+	ConcurrentMap(const ConcurrentMap &);
+	ConcurrentMap & operator=(const ConcurrentMap &);
+
+	struct Node
+	{
+		Node(const K & k, const V & v, Node * next)
+			: k_(k), v_(v), next_(next)
+		{}
+
+		const K k_;
+		const V v_;
+		atomic<Node *> next_;
+	};
+
+	struct Table
+	{
+		explicit Table(const size_t nbuckets)
+			: nbuckets_(nbuckets)
+			, buckets_(new atomic<Node *>[nbuckets])
+		{
+			ASSERT(!(nbuckets_ & (nbuckets_ - 1)));
+
+			for (size_t i = 0; i < nbuckets_; ++i) {
+				buckets_[i].store(NULL, memory_order_relaxed);
+			}
+		}
+
+		~Table()
+		{
+			for (size_t i = 0; i < nbuckets_; ++i) {
+				Node * n = buckets_[i].load(memory_order_relaxed);
+				while (n) {
+					Node * next = n->next_.load(memory_order_relaxed);
+					delete n;
+					n = next;
+				}
+			}
+
+			delete[] buckets_;
+		}
+
+		/*
+		 * The table size is a multiple of the stripes, so a bucket maps to the same
+		 * stripe irrespective of the table size
+		 */
+		atomic<Node *> & Bucket(const size_t h)
+		{
+			return buckets_[h & (nbuckets_ - 1)];
+		}
+
+		const size_t nbuckets_;
+		atomic<Node *> * buckets_;
+	};
+
+	/*
+	 * A cache line each so writers on neighbouring stripes do not false share
+	 */
+	struct Stripe
+	{
+		Stripe() : count_(0) {}
+
+		SpinLock lock_;
+		atomic<size_t> count_;
+	} CACHELINE_ALIGNED;
+
+	static size_t RoundupPow2(const size_t n)
+	{
+		size_t v = 1;
+		while (v < n) v <<= 1;
+		return v;
+	}
+
+	size_t Threshold(const Table * t) const
+	{
+		return (t->nbuckets_ / nstripes_) * LOAD_FACTOR;
+	}
+
+	const Node * Find(Table * t, const K & k) const
+	{
+		for (const Node * n = t->Bucket(hash_(k)).load(memory_order_acquire); n;
+		     n = n->next_.load(memory_order_acquire)) {
+			if (n->k_ == k) return n;
+		}
+
+		return NULL;
+	}
+
+	bool Update(const K & k, const V & v, const bool replace)
+	{
+		const size_t h = hash_(k);
+		const size_t id = h & (nstripes_ - 1);
+		Stripe & s = stripes_[id];
+		Node * victim = NULL;
+		bool grow = false;
+
+		{
+			AutoLock _(&s.lock_);
+
+			Table * t = table_.load(memory_order_relaxed);
+			atomic<Node *> & head = t->Bucket(h);
+
+			atomic<Node *> * prev = &head;
+			for (Node * n = prev->load(memory_order_relaxed); n;
+			     prev = &n->next_, n = prev->load(memory_order_relaxed)) {
+				if (!(n->k_ == k)) continue;
+
+				if (!replace) return false;
+
+				/*
+				 * Publish a new node in place of the old one, readers either see
+				 * the old or the new pair but never a torn value
+				 */
+				Node * r = new Node(k, v, n->next_.load(memory_order_relaxed));
+				prev->store(r, memory_order_release);
+				victim = n;
+				break;
+			}
+
+			if (!victim) {
+				head.store(new Node(k, v, head.load(memory_order_relaxed)),
+					   memory_order_release);
+				grow = s.count_.fetch_add(1, memory_order_relaxed) + 1 > Threshold(t);
+			}
+		}
+
+		if (victim) {
+			Epoch::Retire(victim);
+			return false;
+		}
+
+		if (grow) {
+			Grow(id);
+		}
+
+		return true;
+	}
+
+	void Grow(const size_t id)
+	{
+		LockAll();
+
+		Table * t = table_.load(memory_order_relaxed);
+
+		if (stripes_[id].count_.load(memory_order_relaxed) <= Threshold(t)) {
+			/*
+			 * Someone beat us to it
+			 */
+			UnlockAll();
+			return;
+		}
+
+		Table * nt = new Table(t->nbuckets_ * 2);
+
+		for (size_t i = 0; i < t->nbuckets_; ++i) {
+			for (Node * n = t->buckets_[i].load(memory_order_relaxed); n;
+			     n = n->next_.load(memory_order_relaxed)) {
+				atomic<Node *> & head = nt->Bucket(hash_(n->k_));
+				head.store(new Node(n->k_, n->v_, head.load(memory_order_relaxed)),
+					   memory_order_relaxed);
+			}
+		}
+
+		table_.store(nt, memory_order_release);
+
+		UnlockAll();
+
+		/*
+		 * The old table owns the old nodes, they go together
+		 */
+		Epoch::Retire(t);
+	}
+
+	void LockAll()
+	{
+		for (size_t i = 0; i < nstripes_; ++i) {
+			stripes_[i].lock_.Lock();
+		}
+	}
+
+	void UnlockAll()
+	{
+		for (size_t i = nstripes_; i > 0; --i) {
+			stripes_[i - 1].lock_.Unlock();
+		}
+	}
+
+	H hash_;
+	const size_t nstripes_;		// power of 2
+	atomic<Table *> table_;
+	Stripe * stripes_;		// nstripes_ of them, cache line aligned
+};
+
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <functional>
+
+#include "defs.h"
+#include "util.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//............................................................................ InHashElement<T> ....
+
+/**
+ * Base class for an element which will be inserted into an InHashTable.
+ *
+ * Usage : class X : public InHashElement<X> {}
+ */
+template<class T>
+struct InHashElement
+{
+	InHashElement() : hnext_(NULL) {}
+
+	T * hnext_;
+};
+
+//.............................................................................. InHashTable<> ....
+
+/**
+ * Intrusive hash table with unique keys.
+ *
+ * The key is a data member of the element, given as a pointer to member so that lookups compile
+ * down to a field access. Elements are chained through their hook, the only allocation is the
+ * bucket array which doubles when the table passes a load factor of 1. Not thread safe.
+ *
+ * Usage :
+ *
+ *	struct Conn : InHashElement<Conn> { fd_t fd_; ... };
+ *	InHashTable<fd_t, Conn, &Conn::fd_> conns;
+ */
+template<class K, class T, K T::*KEY, class H = std::hash<K> >
+class InHashTable
+{
+public:
+
+	static const size_t DEFAULT_BUCKETS = 64;
+
+	explicit InHashTable(const size_t nbuckets = DEFAULT_BUCKETS)
+		: nbuckets_(RoundupPow2(nbuckets))
+		, buckets_(new T *[nbuckets_]())
+		, size_(0)
+	{}
+
+	~InHashTable()
+	{
+		INVARIANT(!size_);
+		delete[] buckets_;
+	}
+
+	/**
+	 * Insert element
+	 *
+	 * @return	false if an element with the same key is already present
+	 */
+	bool Insert(T * t)
+	{
+		ASSERT(t);
+		ASSERT(!t->hnext_);
+
+		T ** head = &Bucket(t->*KEY);
+
+		for (T * n = *head; n; n = n->hnext_) {
+			if (n->*KEY == t->*KEY) return false;
+		}
+
+		t->hnext_ = *head;
+		*head = t;
+
+		if (++size_ > nbuckets_) {
+			Rehash(nbuckets_ * 2);
+		}
+
+		return true;
+	}
+
+	T * Find(const K & k) const
+	{
+		for (T * n = Bucket(k); n; n = n->hnext_) {
+			if (n->*KEY == k) return n;
+		}
+
+		return NULL;
+	}
+
+	/**
+	 * Unlink element by key
+	 *
+	 * @return	Unlinked element or NULL if not found
+	 */
+	T * Erase(const K & k)
+	{
+		for (T ** prev = &Bucket(k); *prev; prev = &(*prev)->hnext_) {
+			T * n = *prev;
+			if (n->*KEY == k) {
+				*prev = n->hnext_;
+				n->hnext_ = NULL;
+				--size_;
+				return n;
+			}
+		}
+
+		return NULL;
+	}
+
+	void Unlink(T * t)
+	{
+		ASSERT(t);
+		T * n = Erase(t->*KEY);
+		INVARIANT(n == t);
+	}
+
+	/**
+	 * Visit all elements. The visitor may not modify the table.
+	 */
+	template<class FN>
+	void ForEach(FN fn) const
+	{
+		for (size_t i = 0; i < nbuckets_; ++i) {
+			for (T * n = buckets_[i]; n; n = n->hnext_) {
+				fn(n);
+			}
+		}
+	}
+
+	inline bool IsEmpty() const
+	{
+		return !size_;
+	}
+
+	inline size_t Size() const
+	{
+		return size_;
+	}
+
+private:
+
+	InHashTable(const InHashTable &);
+	InHashTable & operator=(const InHashTable &);
+
+	static size_t RoundupPow2(const size_t n)
+	{
+		size_t v = 1;
+		while (v < n) v <<= 1;
+		return v;
+	}
+
+	T *& Bucket(const K & k) const
+	{
+		return buckets_[hash_(k) & (nbuckets_ - 1)];
+	}
+
+	void Rehash(const size_t nbuckets)
+	{
+		T ** buckets = new T *[nbuckets]();
+
+		for (size_t i = 0; i < nbuckets_; ++i) {
+			T * n = buckets_[i];
+			while (n) {
+				T * next = n->hnext_;
+				T ** head = &buckets[hash_(n->*KEY) & (nbuckets - 1)];
+				n->hnext_ = *head;
+				*head = n;
+				n = next;
+			}
+		}
+
+		delete[] buckets_;
+		buckets_ = buckets;
+		nbuckets_ = nbuckets;
+	}
+
+	size_t nbuckets_;
+	T ** buckets_;
+	size_t size_;
+	H hash_;
+};
+
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include "defs.h"
+#include "util.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//........................................................................... InSListElement<T> ....
+
+/**
+ * Base class for an element which will be inserted into intrusive singly linked containers
+ * (InStack, InSQueue). The hook is independent of InListElement, so an element can be on an InList
+ * and an InStack at the same time.
+ *
+ * Usage : class X : public InSListElement<X> {}
+ */
+template<class T>
+struct InSListElement
+{
+	InSListElement() : snext_(NULL) {}
+
+	T * snext_;
+};
+
+//................................................................................. InStack<T> ....
+
+/**
+ * Intrusive LIFO stack. Push and pop are O(1) and do not allocate. Not thread safe.
+ */
+template<class T>
+class InStack
+{
+public:
+
+	InStack() : top_(NULL), size_(0) {}
+
+	~InStack()
+	{
+		INVARIANT(!top_);
+	}
+
+	inline void Push(T * t)
+	{
+		ASSERT(t);
+		ASSERT(!t->snext_);
+
+		t->snext_ = top_;
+		top_ = t;
+		++size_;
+	}
+
+	inline T * Pop()
+	{
+		ASSERT(top_);
+
+		T * t = top_;
+		top_ = t->snext_;
+		t->snext_ = NULL;
+		--size_;
+
+		return t;
+	}
+
+	inline T * Top() const
+	{
+		return top_;
+	}
+
+	inline bool IsEmpty() const
+	{
+		return !top_;
+	}
+
+	inline size_t Size() const
+	{
+		return size_;
+	}
+
+private:
+
+	T * top_;
+	size_t size_;
+};
+
+//................................................................................ InSQueue<T> ....
+
+/**
+ * Intrusive FIFO queue. Elements are pushed to the tail and popped from the head. A queue can be
+ * spliced onto another in O(1), which makes it suitable for batching elements across threads.
+ * Not thread safe.
+ */
+template<class T>
+class InSQueue
+{
+public:
+
+	InSQueue() : head_(NULL), tail_(NULL), size_(0) {}
+
+	~InSQueue()
+	{
+		INVARIANT(!head_);
+		INVARIANT(!tail_);
+	}
+
+	inline void Push(T * t)
+	{
+		ASSERT(t);
+		ASSERT(!t->snext_);
+		ASSERT((!head_ && !tail_) || (head_ && tail_));
+
+		if (tail_) {
+			tail_->snext_ = t;
+		} else {
+			head_ = t;
+		}
+
+		tail_ = t;
+		++size_;
+	}
+
+	inline T * Pop()
+	{
+		ASSERT(head_ && tail_);
+
+		T * t = head_;
+		head_ = t->snext_;
+		if (!head_) tail_ = NULL;
+
+		t->snext_ = NULL;
+		--size_;
+
+		return t;
+	}
+
+	/**
+	 * Move all elements of q to the tail of this queue. q is empty on return.
+	 */
+	inline void Append(InSQueue<T> & q)
+	{
+		if (q.IsEmpty()) return;
+
+		if (tail_) {
+			tail_->snext_ = q.head_;
+		} else {
+			head_ = q.head_;
+		}
+
+		tail_ = q.tail_;
+		size_ += q.size_;
+
+		q.head_ = q.tail_ = NULL;
+		q.size_ = 0;
+	}
+
+	/**
+	 * Unlink t from anywhere in the queue. O(n), meant for the rare abort of a queued element.
+	 *
+	 * @return	false if t is not in the queue
+	 */
+	inline bool Remove(T * t)
+	{
+		ASSERT(t);
+
+		T * prev = NULL;
+		for (T * p = head_; p; prev = p, p = p->snext_) {
+			if (p != t) continue;
+
+			if (prev) {
+				prev->snext_ = t->snext_;
+			} else {
+				head_ = t->snext_;
+			}
+
+			if (tail_ == t) tail_ = prev;
+
+			t->snext_ = NULL;
+			--size_;
+
+			return true;
+		}
+
+		return false;
+	}
+
+	inline T * Front() const
+	{
+		return head_;
+	}
+
+	inline bool IsEmpty() const
+	{
+		return !head_;
+	}
+
+	inline size_t Size() const
+	{
+		return size_;
+	}
+
+private:
+
+	T * head_; // pop
+	T * tail_; // push
+	size_t size_;
+};
+
+}
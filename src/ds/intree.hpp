@@ -0,0 +1,378 @@
+#pragma once
+
+#include <functional>
+
+#include "defs.h"
+#include "util.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//............................................................................ InTreeElement<T> ....
+
+/**
+ * Base class for an element which will be inserted into an InTree.
+ *
+ * Usage : class X : public InTreeElement<X> {}
+ */
+template<class T>
+struct InTreeElement
+{
+	InTreeElement() : left_(NULL), right_(NULL), parent_(NULL), red_(false) {}
+
+	T * left_;
+	T * right_;
+	T * parent_;
+	bool red_;
+};
+
+//................................................................................ InTree<T, L> ....
+
+/**
+ * Intrusive red-black tree.
+ *
+ * Elements are ordered by LESS, duplicates are allowed and are kept in insertion order (multiset
+ * semantics). Insert and Unlink are O(log n) and do not allocate. The smallest element is cached,
+ * so Min is O(1), which makes the tree a good fit for timer and deadline queues. Not thread safe.
+ *
+ * The elements are expected to have fields left_, right_, parent_ and red_ defined. Typically you
+ * would extend InTreeElement<T>
+ */
+template<class T, class LESS = std::less<T> >
+class InTree
+{
+public:
+
+	InTree(const LESS & less = LESS())
+		: root_(NULL), min_(NULL), size_(0), less_(less)
+	{}
+
+	~InTree()
+	{
+		INVARIANT(!root_);
+	}
+
+	void Insert(T * z)
+	{
+		ASSERT(z);
+		ASSERT(!IsLinked(z));
+
+		T * y = NULL;
+		T * x = root_;
+
+		while (x) {
+			y = x;
+			x = less_(*z, *x) ? x->left_ : x->right_;
+		}
+
+		z->parent_ = y;
+		z->left_ = z->right_ = NULL;
+		z->red_ = true;
+
+		if (!y) {
+			root_ = z;
+		} else if (less_(*z, *y)) {
+			y->left_ = z;
+		} else {
+			y->right_ = z;
+		}
+
+		/*
+		 * Equal elements go to the right, so min_ only changes for a strictly smaller element
+		 */
+		if (!min_ || less_(*z, *min_)) {
+			min_ = z;
+		}
+
+		InsertFixup(z);
+		++size_;
+	}
+
+	void Unlink(T * z)
+	{
+		ASSERT(z);
+		ASSERT(IsLinked(z));
+
+		if (min_ == z) {
+			min_ = Next(z);
+		}
+
+		T * y = z;
+		T * x = NULL;
+		T * xp = NULL;
+		bool yred = y->red_;
+
+		if (!z->left_) {
+			x = z->right_;
+			xp = z->parent_;
+			Transplant(z, z->right_);
+		} else if (!z->right_) {
+			x = z->left_;
+			xp = z->parent_;
+			Transplant(z, z->left_);
+		} else {
+			y = Leftmost(z->right_);
+			yred = y->red_;
+			x = y->right_;
+
+			if (y->parent_ == z) {
+				xp = y;
+			} else {
+				xp = y->parent_;
+				Transplant(y, y->right_);
+				y->right_ = z->right_;
+				y->right_->parent_ = y;
+			}
+
+			Transplant(z, y);
+			y->left_ = z->left_;
+			y->left_->parent_ = y;
+			y->red_ = z->red_;
+		}
+
+		if (!yred) {
+			UnlinkFixup(x, xp);
+		}
+
+		z->left_ = z->right_ = z->parent_ = NULL;
+		z->red_ = false;
+		--size_;
+	}
+
+	/**
+	 * Unlink and return the smallest element
+	 */
+	T * Pop()
+	{
+		ASSERT(min_);
+
+		T * t = min_;
+		Unlink(t);
+		return t;
+	}
+
+	inline T * Min() const
+	{
+		return min_;
+	}
+
+	/**
+	 * In order successor of t, NULL if t is the largest element
+	 */
+	static T * Next(T * t)
+	{
+		ASSERT(t);
+
+		if (t->right_) return Leftmost(t->right_);
+
+		T * p = t->parent_;
+		while (p && t == p->right_) {
+			t = p;
+			p = p->parent_;
+		}
+
+		return p;
+	}
+
+	/**
+	 * Check if t is linked into this tree
+	 */
+	inline bool IsLinked(const T * t) const
+	{
+		return t->parent_ || root_ == t;
+	}
+
+	inline bool IsEmpty() const
+	{
+		return !root_;
+	}
+
+	inline size_t Size() const
+	{
+		return size_;
+	}
+
+private:
+
+	InTree(const InTree &);
+	InTree & operator=(const InTree &);
+
+	static T * Leftmost(T * t)
+	{
+		while (t->left_) t = t->left_;
+		return t;
+	}
+
+	void RotateLeft(T * x)
+	{
+		T * y = x->right_;
+
+		x->right_ = y->left_;
+		if (y->left_) y->left_->parent_ = x;
+
+		Transplant(x, y);
+
+		y->left_ = x;
+		x->parent_ = y;
+	}
+
+	void RotateRight(T * x)
+	{
+		T * y = x->left_;
+
+		x->left_ = y->right_;
+		if (y->right_) y->right_->parent_ = x;
+
+		Transplant(x, y);
+
+		y->right_ = x;
+		x->parent_ = y;
+	}
+
+	/*
+	 * Replace subtree u with subtree v in u's parent
+	 */
+	void Transplant(T * u, T * v)
+	{
+		if (!u->parent_) {
+			root_ = v;
+		} else if (u == u->parent_->left_) {
+			u->parent_->left_ = v;
+		} else {
+			u->parent_->right_ = v;
+		}
+
+		if (v) v->parent_ = u->parent_;
+	}
+
+	static bool IsRed(const T * t)
+	{
+		return t && t->red_;
+	}
+
+	void InsertFixup(T * z)
+	{
+		while (IsRed(z->parent_)) {
+			T * p = z->parent_;
+			T * g = p->parent_;
+
+			if (p == g->left_) {
+				T * u = g->right_;
+				if (IsRed(u)) {
+					p->red_ = u->red_ = false;
+					g->red_ = true;
+					z = g;
+					continue;
+				}
+
+				if (z == p->right_) {
+					z = p;
+					RotateLeft(z);
+					p = z->parent_;
+				}
+
+				p->red_ = false;
+				g->red_ = true;
+				RotateRight(g);
+			} else {
+				T * u = g->left_;
+				if (IsRed(u)) {
+					p->red_ = u->red_ = false;
+					g->red_ = true;
+					z = g;
+					continue;
+				}
+
+				if (z == p->left_) {
+					z = p;
+					RotateRight(z);
+					p = z->parent_;
+				}
+
+				p->red_ = false;
+				g->red_ = true;
+				RotateLeft(g);
+			}
+		}
+
+		root_->red_ = false;
+	}
+
+	/*
+	 * x can be NULL (a leaf), so its parent is tracked separately
+	 */
+	void UnlinkFixup(T * x, T * xp)
+	{
+		while (x != root_ && !IsRed(x)) {
+			if (x == xp->left_) {
+				T * w = xp->right_;
+
+				if (IsRed(w)) {
+					w->red_ = false;
+					xp->red_ = true;
+					RotateLeft(xp);
+					w = xp->right_;
+				}
+
+				if (!IsRed(w->left_) && !IsRed(w->right_)) {
+					w->red_ = true;
+					x = xp;
+					xp = x->parent_;
+					continue;
+				}
+
+				if (!IsRed(w->right_)) {
+					w->left_->red_ = false;
+					w->red_ = true;
+					RotateRight(w);
+					w = xp->right_;
+				}
+
+				w->red_ = xp->red_;
+				xp->red_ = false;
+				w->right_->red_ = false;
+				RotateLeft(xp);
+				x = root_;
+			} else {
+				T * w = xp->left_;
+
+				if (IsRed(w)) {
+					w->red_ = false;
+					xp->red_ = true;
+					RotateRight(xp);
+					w = xp->left_;
+				}
+
+				if (!IsRed(w->left_) && !IsRed(w->right_)) {
+					w->red_ = true;
+					x = xp;
+					xp = x->parent_;
+					continue;
+				}
+
+				if (!IsRed(w->left_)) {
+					w->right_->red_ = false;
+					w->red_ = true;
+					RotateLeft(w);
+					w = xp->left_;
+				}
+
+				w->red_ = xp->red_;
+				xp->red_ = false;
+				w->left_->red_ = false;
+				RotateRight(xp);
+				x = root_;
+			}
+		}
+
+		if (x) x->red_ = false;
+	}
+
+	T * root_;
+	T * min_;
+	size_t size_;
+	LESS less_;
+};
+
+}
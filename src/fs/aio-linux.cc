@@ -2,7 +2,9 @@
 #include <fcntl.h>
 
 #include "fs/aio-linux.h"
+#include "perf/trace.h"
 #include "schd/thread-pool.h"
+#include "bblocks.h"
 
 using namespace bblocks;
 
@@ -134,12 +136,20 @@ LinuxAioProcessor::Write(Op * op)
 	            << " off: " << op->off_
 		    << " size: " << op->size_;
 
+	TRACE_INSTANT("aio-submit", op->size_);
+
 	aio_context_t & ctx = ctxs_[rand() % ctxs_.size()];
 	long status = io_submit(ctx, /*n=*/ 1, op->piocb_);
 
 	if (status != 1) {
 		ERROR(log_) << "Failed to submit io. PWRITE op: " << (uint64_t) op
 			    << " strerror: " << strerror(errno);
+
+		/*
+		 * No event comes for the op, take it back
+		 */
+		Guard _(&lock_);
+		ops_.Unlink(op);
 	}
 
 	return status;
@@ -173,12 +183,20 @@ LinuxAioProcessor::Read(Op * op)
 		    << " off: " << op->off_
 		    << " size: " << op->size_;
 
+	TRACE_INSTANT("aio-submit", op->size_);
+
 	aio_context_t & ctx = ctxs_[rand() % ctxs_.size()];
 	long status = io_submit(ctx, /*n=*/ 1, op->piocb_);
 
 	if (status != 1) {
 	    ERROR(log_) << "Failed to submit io. PREAD op: " << (uint64_t) op
 		        << " strerror: " << strerror(errno);
+
+	    /*
+	     * No event comes for the op, take it back
+	     */
+	    Guard _(&lock_);
+	    ops_.Unlink(op);
 	}
 
 	return status;
@@ -235,6 +253,8 @@ LinuxAioProcessor::PollThread::ThreadMain()
 				ops_.Unlink(op);
 			}
 
+			TRACE_INSTANT("aio-complete", ev.res);
+
 			/*
 			 * Callback interrupt
 			 */
@@ -280,13 +300,7 @@ int
 SpinningDevice::Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks,
 		      const Fn<int> & cb)
 {
-	INVARIANT((off + nblks) <= nsectors_);
-
-	Op * op = new Op(fd_, buf, off * SECTOR_SIZE, nblks * SECTOR_SIZE,
-			 intr_fn(this, &SpinningDevice::WriteDone), cb);
-
-	int status = aio_->Write(op);
-	return status;
+	return Write(buf, off, nblks, cb, OpCtl());
 }
 
 int
@@ -301,13 +315,69 @@ SpinningDevice::Write(const IOBuffer & buf, const diskoff_t off, const size_t nb
 int
 SpinningDevice::Read(IOBuffer & buf, const diskoff_t off, const size_t nblks,
 		     const Fn<int> & cb)
+{
+	return Read(buf, off, nblks, cb, OpCtl());
+}
+
+int
+SpinningDevice::Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks,
+		      const Fn<int> & cb, const OpCtl & ctl)
+{
+	INVARIANT((off + nblks) <= nsectors_);
+
+	Op * op = new Op(fd_, buf, off * SECTOR_SIZE, nblks * SECTOR_SIZE,
+			 intr_fn(this, &SpinningDevice::WriteDone), cb);
+
+	return Submit(op, /*isWrite=*/ true, ctl);
+}
+
+int
+SpinningDevice::Read(IOBuffer & buf, const diskoff_t off, const size_t nblks,
+		     const Fn<int> & cb, const OpCtl & ctl)
 {
 	INVARIANT((off + nblks) <= nsectors_);
 
 	Op * op = new Op(fd_, buf, off * SECTOR_SIZE, nblks * SECTOR_SIZE,
 	                intr_fn(this, &SpinningDevice::WriteDone), cb);
 
-	int status = aio_->Read(op);
+	return Submit(op, /*isWrite=*/ false, ctl);
+}
+
+int
+SpinningDevice::Submit(Op * op, const bool isWrite, const OpCtl & ctl)
+{
+	bool isArmed;
+
+	{
+		/*
+		 * Armed before submit, the device may complete the op right away
+		 */
+		Guard _(&op->lock_);
+		isArmed = op->aborts_.Arm(op, ctl);
+	}
+
+	if (!isArmed) {
+		op->isDone_ = true;
+		op->PutRef();
+		return CANCELLED;
+	}
+
+	/*
+	 * The device keeps its own reference to the buffer until the IO is done, the kernel may
+	 * still be using the memory after the op is completed early
+	 */
+	const int status = isWrite ? aio_->Write(op) : aio_->Read(op);
+
+	if (status != 1) {
+		/*
+		 * The error is returned to the caller, the handler is not to be invoked. The
+		 * processor took the op back, put back the reference held by the device.
+		 */
+		op->isDone_ = true;
+		op->Disarm();
+		op->PutRef();
+	}
+
 	return status;
 }
 
@@ -316,10 +386,58 @@ SpinningDevice::WriteDone(int res, AioProcessor::Op * op)
 {
 	Op * wop = (Op *) op;
 
-	wop->clientch_.Wakeup(res);
+	wop->Disarm();
+	wop->Complete(res);
 
 	/*
-	 * we don't track the ops
+	 * Reference held by the device
 	 */
-	delete wop;
+	wop->PutRef();
+}
+
+//.......................................................................... SpinningDevice::Op ....
+
+void
+SpinningDevice::Op::AbortOp(aborts_t::Timer * t, uint64_t id, int status)
+{
+	ASSERT(id == id_);
+
+	{
+		Guard _(&lock_);
+		aborts_t::TimerFired(this, t);
+	}
+
+	Complete(status);
+	PutRef();
+}
+
+void
+SpinningDevice::Op::Disarm()
+{
+	/*
+	 * If the token or the timer fired already the abort in flight holds a reference
+	 */
+	Guard _(&lock_);
+	aborts_.Disarm(this);
+}
+
+void
+SpinningDevice::Op::Complete(const int status)
+{
+	if (isDone_.exchange(true)) {
+		/*
+		 * Completed already by the device, the deadline or the token
+		 */
+		return;
+	}
+
+	clientch_.Wakeup(status);
+}
+
+void
+SpinningDevice::Op::PutRef()
+{
+	if (aborts_.PutRef()) {
+		delete this;
+	}
 }
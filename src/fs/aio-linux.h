@@ -7,7 +7,11 @@
 #include "logger.h"
 #include "inlist.hpp"
 #include "buf/buffer.h"
+#include "buf/object-pool.h"
 #include "schd/thread.h"
+#include "schd/thread-pool.h"
+#include "schd/cancel-token.h"
+#include "schd/op-aborts.hpp"
 
 namespace bblocks {
 
@@ -29,6 +33,20 @@ public:
 	virtual int Read(IOBuffer & buf, const diskoff_t off, const size_t size,
 			 const Fn<int> & ch) = 0;
 
+	/*
+	 * With a deadline and/or a cancellation token the handler is invoked with TIMEDOUT or
+	 * CANCELLED if the op does not complete in time or is cancelled. The IO already handed to
+	 * the device still runs to completion in the background, so a write that was timed out or
+	 * cancelled may or may not have reached the disk. Returns CANCELLED without a callback if
+	 * the token is already cancelled.
+	 */
+
+	virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t size,
+			  const Fn<int> & h, const OpCtl & ctl) = 0;
+
+	virtual int Read(IOBuffer & buf, const diskoff_t off, const size_t size,
+			 const Fn<int> & ch, const OpCtl & ctl) = 0;
+
 	virtual disksize_t GetDeviceSize() = 0;
 };
 
@@ -161,6 +179,10 @@ public:
 	virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks);
 	virtual int Read(IOBuffer & buf, const diskoff_t off, const size_t nblks,
 			 const Fn<int> & ch);
+	virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks,
+			  const Fn<int> & ch, const OpCtl & ctl);
+	virtual int Read(IOBuffer & buf, const diskoff_t off, const size_t nblks,
+			 const Fn<int> & ch, const OpCtl & ctl);
 
 	virtual disksize_t GetDeviceSize()
 	{
@@ -169,17 +191,42 @@ public:
 
 private:
 
-	struct Op : AioProcessor::Op
+	/*
+	 * The op can be completed by the device, its deadline or its token, whichever comes
+	 * first. Each op is its own OpAborts owner, the device and the aborts in flight hold a
+	 * reference and the op is released with the last one. The lock serializes the device
+	 * completing the op with its timer firing.
+	 */
+	struct Op : AioProcessor::Op, OpAborts<Op>::Op, PoolObject<Op>
 	{
+		typedef OpAborts<Op> aborts_t;
+
 		Op(fd_t fd, const IOBuffer & buf, const diskoff_t off, const size_t size,
 		   const Fn2<int, AioProcessor::Op*> & opch, const Fn<int> & clientch)
 			: AioProcessor::Op(fd, buf, off, size, opch)
 			, clientch_(clientch)
-		{}
+			, isDone_(false)
+			, aborts_(this)
+		{
+			/*
+			 * Reference held by the device
+			 */
+			aborts_.GetRef();
+		}
+
+		void AbortOp(aborts_t::Timer * t, uint64_t id, int status);
+		void Disarm();
+		void Complete(const int status);
+		void PutRef();
 
 		Fn<int> clientch_;
+		SpinLock lock_;
+		atomic<bool> isDone_;
+		aborts_t aborts_;
 	};
 
+	int Submit(Op * op, const bool isWrite, const OpCtl & ctl);
+
 	//.... completion handlers ....//
 
 	__interrupt__ void WriteDone(int res, AioProcessor::Op * op);
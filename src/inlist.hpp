@@ -109,33 +109,112 @@ private:
 	T * tail_; // push
 };
 
+// ................................................................................. SpinPolicy ....
+
+/**
+ * Process wide policy for how hard queue consumers spin before they sleep
+ *
+ * LATENCY   Always spin, at least the default budget. Lowest wakeup latency, burns idle CPU.
+ * BALANCED  Spin while spinning pays off and arrivals are close enough together.
+ * POWER     Spin briefly and only for queues with very frequent arrivals.
+ */
+class SpinPolicy
+{
+public:
+
+	enum Mode
+	{
+		LATENCY = 0,
+		BALANCED,
+		POWER,
+	};
+
+	static void Set(const Mode mode)
+	{
+		ModeRef() = mode;
+	}
+
+	static Mode Get()
+	{
+		return (Mode) ModeRef().load(memory_order_relaxed);
+	}
+
+private:
+
+	static atomic<int> & ModeRef()
+	{
+		static atomic<int> mode(BALANCED);
+		return mode;
+	}
+};
+
 // ................................................................................. InQueue<T> ....
 
 /**
  * In list used as queue. Provides all the same benefits and requirements of
  * inlist, but provide the interface for a queue.
  *
- * This is meant to be a fast queue, so we employ adaptive spinning.
+ * This is meant to be a fast queue, so we employ adaptive spinning. The spin budget of a queue
+ * follows what the recent spins took to find an element: a hit raises the budget to twice what
+ * it took, a miss halves it, and a pop that finds an element without spinning lets it decay. The
+ * budget is clamped by the SpinPolicy, which also skips spinning altogether when elements arrive
+ * too far apart for a spin to catch one. The inter-arrival time is sampled every GAP_SAMPLE
+ * pushes, outside the lock.
  */
 template<class T>
 class InQueue
 {
 public:
 
+	static const unsigned int MIN_SPIN = 16;
 	static const unsigned int MAX_SPIN = 10000;
-
-	InQueue(const string & name) : log_("/q/" + name), maxSpin_(1000) {}
+	static const unsigned int DEFAULT_SPIN = 1000;
+	static const unsigned int POWER_MAX_SPIN = 100;
+
+	static const uint64_t BALANCED_MAX_GAP_US = 1000;	// spin if arrivals are closer
+	static const uint64_t POWER_MAX_GAP_US = 50;
+	static const uint64_t GAP_SAMPLE = 8;			// pushes per arrival sample
+
+	InQueue(const string & name)
+		: log_("/q/" + name)
+		, size_(0)
+		, maxSpin_(MAX_SPIN)
+		, spin_(DEFAULT_SPIN)
+		, npush_(0)
+		, lastSampleInMicroSec_(0)
+		, gapInMicroSec_(0)
+		, spinHits_(0)
+		, spinMisses_(0)
+	{}
 
 	inline void Push(T * t)
 	{
 		lock_.Lock();
 		q_.Push(t);
+		++size_;
+		const bool sample = (npush_++ % GAP_SAMPLE) == 0;
 		lock_.Unlock();
 
 		conditionEmpty_.Signal();
+
+		if (sample) {
+			SampleArrival();
+		}
 	}
 
 	inline T * Pop()
+	{
+		NoSleepGuard guard;
+		return Pop(guard);
+	}
+
+	/**
+	 * Pop, calling guard.Sleep() before the consumer goes to sleep on an empty queue and
+	 * guard.Wake() once it is back with an element. Neither is called if an element is found
+	 * while spinning.
+	 */
+	template<class GUARD>
+	inline T * Pop(GUARD & guard)
 	{
 		T * t = TryPop();
 
@@ -152,14 +231,25 @@ public:
 		 */
 		lock_.Lock();
 
+		bool slept = false;
 		while (q_.IsEmpty()) {
+			if (!slept) {
+				guard.Sleep();
+				slept = true;
+			}
+
 			conditionEmpty_.Wait(&lock_);
 		}
 
 		t = q_.Pop();
+		--size_;
 
 		lock_.Unlock();
 
+		if (slept) {
+			guard.Wake();
+		}
+
 		return t;
 	}
 
@@ -195,6 +285,7 @@ public:
 		}
 
 		t = q_.Pop();
+		--size_;
 
 		lock_.Unlock();
 
@@ -210,8 +301,60 @@ public:
 		return ret;
 	}
 
+	/**
+	 * Number of queued elements, read without the lock
+	 */
+	inline size_t Size() const
+	{
+		return size_;
+	}
+
+	/**
+	 * Cap on the iterations to spin before the consumer goes to sleep, 0 sleeps right away
+	 */
+	inline void SetMaxSpin(const unsigned int maxSpin)
+	{
+		maxSpin_ = maxSpin;
+	}
+
+	/**
+	 * Iterations the next spin will take at most
+	 */
+	inline unsigned int SpinBudget() const
+	{
+		unsigned int spin = spin_;
+
+		switch (SpinPolicy::Get()) {
+		case SpinPolicy::LATENCY:
+			spin = max(spin, DEFAULT_SPIN + 0);
+			break;
+		case SpinPolicy::BALANCED:
+			if (gapInMicroSec_ > BALANCED_MAX_GAP_US) {
+				spin = 0;
+			}
+			break;
+		case SpinPolicy::POWER:
+			spin = gapInMicroSec_ > POWER_MAX_GAP_US ? 0 : min(spin, POWER_MAX_SPIN + 0);
+			break;
+		}
+
+		return min(spin, maxSpin_.load());
+	}
+
+	/*
+	 * Spins that found an element and spins that gave up
+	 */
+	inline uint64_t SpinHits() const { return spinHits_; }
+	inline uint64_t SpinMisses() const { return spinMisses_; }
+
 private:
 
+	struct NoSleepGuard
+	{
+		void Sleep() {}
+		void Wake() {}
+	};
+
 	inline T * TryPop()
 	{
 		/*
@@ -219,19 +362,62 @@ private:
 		 * a loaded system since the cost of sleeping and waking is fairly high for a job
 		 * scheduler algorithm
 		 */
-		for (unsigned int i = 0; i < maxSpin_; ++i) {
-			lock_.Lock();
-			if (!q_.IsEmpty()) {
-				T * t = q_.Pop();
+		const unsigned int budget = SpinBudget();
+
+		for (unsigned int i = 0; i < budget; ++i) {
+			if (size_) {
+				lock_.Lock();
+				if (!q_.IsEmpty()) {
+					T * t = q_.Pop();
+					--size_;
+					lock_.Unlock();
+
+					if (i) {
+						/*
+						 * Spinning paid off, allow twice as long next time
+						 */
+						++spinHits_;
+						spin_ = min(max(2 * i, MIN_SPIN + 0), MAX_SPIN + 0);
+					} else {
+						/*
+						 * No spin needed, let the budget decay
+						 */
+						const unsigned int spin = spin_;
+						spin_ = max(spin - spin / 8, MIN_SPIN + 0);
+					}
+
+					return t;
+				}
 				lock_.Unlock();
-				return t;
 			}
-			lock_.Unlock();
 			sched_yield();
 		}
 
+		if (budget) {
+			++spinMisses_;
+			spin_ = max(spin_ / 2, MIN_SPIN + 0);
+		}
+
 		return NULL;
-    }
+	}
+
+	/*
+	 * Moving average of the inter-arrival time, over the GAP_SAMPLE pushes since the last
+	 * sample. The first gap seeds the average. Racing samples are rare and at worst skew one
+	 * update.
+	 */
+	void SampleArrival()
+	{
+		const uint64_t now = Rdtsc::NowInMicroSec();
+		const uint64_t last = lastSampleInMicroSec_.exchange(now, memory_order_relaxed);
+
+		if (last) {
+			const uint64_t gap = Rdtsc::Elapsed(now, last) / GAP_SAMPLE;
+			const uint64_t avg = gapInMicroSec_.load(memory_order_relaxed);
+			gapInMicroSec_.store(avg ? avg - avg / 8 + gap / 8 : gap,
+					     memory_order_relaxed);
+		}
+	}
 
 	InQueue();
 
@@ -239,7 +425,14 @@ private:
 	mutable PThreadMutex lock_;
 	WaitCondition conditionEmpty_;
 	InList<T> q_;
-	unsigned int maxSpin_;
+	atomic<size_t> size_;
+	atomic<unsigned int> maxSpin_;
+	atomic<unsigned int> spin_;		// adaptive spin budget
+	uint64_t npush_;			// pushes, under the lock
+	atomic<uint64_t> lastSampleInMicroSec_;
+	atomic<uint64_t> gapInMicroSec_;	// average inter-arrival time
+	atomic<uint64_t> spinHits_;
+	atomic<uint64_t> spinMisses_;
 };
 
 // ............................................................... Queue<T> ....
@@ -2,6 +2,8 @@
 #define _CORE_LOCK_H_
 
 #include <inttypes.h>
+#include <string.h>
+#include <type_traits>
 
 #include "perf/perf-counter.h"
 #include "logger.h"
@@ -13,6 +15,12 @@ namespace bblocks {
 
 class WaitCondition;
 
+/*
+ * Core of the calling NonBlockingThreadPool thread, -1 for any other thread. Defined with the
+ * pool (schd/thread-pool.cc), declared here for the locks that shard by core.
+ */
+int CurrentPoolCore();
+
 // ...................................................................................... Mutex ....
 
 class Mutex
@@ -172,9 +180,20 @@ public:
 
     WaitCondition()
     {
-        int status = pthread_cond_init(&cond_, /*attr=*/ NULL);
+        /*
+         * Timed waits take a deadline from Time::GetTimeSpec, which is on the monotonic clock
+         */
+        pthread_condattr_t attr;
+        int status = pthread_condattr_init(&attr);
         (void) status;
         ASSERT(status == 0);
+        status = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        ASSERT(status == 0);
+
+        status = pthread_cond_init(&cond_, &attr);
+        ASSERT(status == 0);
+
+        pthread_condattr_destroy(&attr);
     }
 
     ~WaitCondition()
@@ -297,6 +316,75 @@ protected:
     PerfCounter statSpinTime_;
 };
 
+// ................................................................................... SpinLock ....
+
+/**
+ * Bare bone spin lock.
+ *
+ * Unlike SpinMutex, this carries no name or stats. It is meant to be embedded in large numbers
+ * (lock striping, per object locks) where the footprint of the lock matters more than the
+ * diagnostics.
+ */
+class SpinLock : public Mutex
+{
+public:
+
+    SpinLock()
+        : locked_(false)
+        , owner_(0)
+    {}
+
+    bool TryLock()
+    {
+        if (locked_.load(memory_order_relaxed)
+            || locked_.exchange(true, memory_order_acquire)) {
+            return false;
+        }
+
+        owner_ = pthread_self();
+        return true;
+    }
+
+    virtual void Lock() override
+    {
+        ASSERT(!IsOwner());
+
+        unsigned int spins = 0;
+        while (!TryLock()) {
+            /*
+             * Spin on a plain load so we do not bounce the cache line while the lock is held.
+             * Back off to the scheduler if the owner looks preempted.
+             */
+            while (locked_.load(memory_order_relaxed)) {
+                if (++spins % MAX_SPIN) {
+                    CPU_RELAX();
+                } else {
+                    sched_yield();
+                }
+            }
+        }
+    }
+
+    virtual void Unlock() override
+    {
+        ASSERT(IsOwner());
+        owner_ = 0;
+        locked_.store(false, memory_order_release);
+    }
+
+    virtual bool IsOwner() override
+    {
+        return locked_.load(memory_order_relaxed) && pthread_equal(owner_, pthread_self());
+    }
+
+private:
+
+    static const unsigned int MAX_SPIN = 1024;
+
+    atomic<bool> locked_;
+    pthread_t owner_;
+};
+
 // ..................................................................................... RWLock ....
 
 class RWLock
@@ -344,7 +432,7 @@ public:
 
     void WriteLock()
     {
-        int status = pthread_rwlock_rdlock(&rwlock_);
+        int status = pthread_rwlock_wrlock(&rwlock_);
         (void) status;
         ASSERT(status == 0);
     }
@@ -354,6 +442,186 @@ protected:
     pthread_rwlock_t rwlock_;
 };
 
+// .......................................................................... DistributedRWLock ....
+
+/**
+ * Reader biased reader-writer lock for read mostly data (configuration, routing tables).
+ *
+ * The reader count is distributed over cache line sized slots. The non-blocking pool threads
+ * count on the slot of their core, so readers touch a core local line and only read the writer
+ * word, which sits on a line of its own. Other threads spread over OTHER_SLOTS slots past the
+ * cores by a per thread index, they never share a line with a pool thread. A writer publishes
+ * itself in the writer word and sweeps all the slots waiting for the readers to drain, so writes
+ * are expensive and should be rare.
+ *
+ * Writers are preferred, a reader backs off while a writer is waiting. The lock is not recursive
+ * for readers or writers.
+ */
+class DistributedRWLock : public RWLock
+{
+public:
+
+    static const size_t OTHER_SLOTS = 16;
+
+    DistributedRWLock()
+        : writer_(0)
+        , ncores_(sysconf(_SC_NPROCESSORS_ONLN))
+        , nslots_(ncores_ + OTHER_SLOTS)
+    {
+        ASSERT(ncores_ >= 1);
+
+        /*
+         * operator new does not honour the alignment of Slot
+         */
+        void * buf = NULL;
+        const int status = posix_memalign(&buf, CACHELINE_SIZE, nslots_ * sizeof(Slot));
+        INVARIANT(!status && buf);
+
+        slots_ = (Slot *) buf;
+        for (size_t i = 0; i < nslots_; ++i) {
+            new (&slots_[i]) Slot();
+        }
+    }
+
+    ~DistributedRWLock()
+    {
+        ASSERT(!writer_);
+
+        for (size_t i = 0; i < nslots_; ++i) {
+            ASSERT(!slots_[i].readers_);
+            slots_[i].~Slot();
+        }
+
+        free(slots_);
+    }
+
+    virtual void ReadLock() override
+    {
+        Slot & s = slots_[SlotIndex()];
+
+        while (true) {
+            /*
+             * Announce the reader before checking for a writer. The writer does the
+             * opposite, so either the reader sees the writer or the writer sees the reader.
+             */
+            s.readers_.fetch_add(1, memory_order_seq_cst);
+
+            if (!writer_.load(memory_order_seq_cst)) {
+                return;
+            }
+
+            s.readers_.fetch_sub(1, memory_order_release);
+
+            unsigned int spins = 0;
+            while (writer_.load(memory_order_relaxed)) {
+                Backoff(++spins);
+            }
+        }
+    }
+
+    virtual void WriteLock() override
+    {
+        wlock_.Lock();
+
+        writer_.store(ThreadToken(), memory_order_seq_cst);
+
+        unsigned int spins = 0;
+        for (size_t i = 0; i < nslots_; ++i) {
+            while (slots_[i].readers_.load(memory_order_acquire)) {
+                Backoff(++spins);
+            }
+        }
+    }
+
+    /*
+     * The writer word tells a writer from a reader. Only the writer finds its own token
+     * there, a reader finds no writer or another thread's token.
+     */
+    virtual void Unlock() override
+    {
+        if (writer_.load(memory_order_relaxed) == ThreadToken()) {
+            writer_.store(0, memory_order_release);
+            wlock_.Unlock();
+            return;
+        }
+
+        Slot & s = slots_[SlotIndex()];
+
+        ASSERT(s.readers_.load(memory_order_relaxed));
+        s.readers_.fetch_sub(1, memory_order_release);
+    }
+
+private:
+
+    DistributedRWLock(const DistributedRWLock &);
+    DistributedRWLock & operator=(const DistributedRWLock &);
+
+    struct Slot
+    {
+        Slot() : readers_(0) {}
+
+        atomic<uint64_t> readers_;
+    } CACHELINE_ALIGNED;
+
+    static const unsigned int MAX_SPIN = 1024;
+
+    /*
+     * Spin for a while, then give the cpu away in case the thread we wait on is preempted
+     */
+    static void Backoff(const unsigned int spins)
+    {
+        if (spins % MAX_SPIN) {
+            CPU_RELAX();
+        } else {
+            sched_yield();
+        }
+    }
+
+    /*
+     * Slot of the calling thread, it has to stay the same from ReadLock to Unlock. Pool
+     * threads are pinned to their core.
+     */
+    size_t SlotIndex() const
+    {
+        const int core = CurrentPoolCore();
+
+        if (core >= 0 && (size_t) core < ncores_) {
+            return core;
+        }
+
+        return ncores_ + ThreadIndex() % OTHER_SLOTS;
+    }
+
+    /*
+     * Stable per thread index, threads are numbered in the order they first take a lock
+     */
+    static size_t ThreadIndex()
+    {
+        static atomic<size_t> next(0);
+        static __thread size_t index = SIZE_MAX;
+
+        if (index == SIZE_MAX) {
+            index = next.fetch_add(1, memory_order_relaxed);
+        }
+
+        return index;
+    }
+
+    /*
+     * Non zero token of the calling thread
+     */
+    static uint64_t ThreadToken()
+    {
+        return ThreadIndex() + 1;
+    }
+
+    atomic<uint64_t> writer_ CACHELINE_ALIGNED;	// token of the writer, read by every reader
+    const size_t ncores_;
+    const size_t nslots_;
+    Slot * slots_;
+    SpinLock wlock_ CACHELINE_ALIGNED;
+};
+
 // ............................................................................... AutoReadLock ....
 
 class AutoReadLock
@@ -422,6 +690,81 @@ private:
     RWLock * rwlock_;
 };
 
+// ................................................................................. SeqLock<T> ....
+
+/**
+ * Sequence lock for small, trivially copyable state that is read far more often than it is
+ * written (counters, configuration knobs, time bases).
+ *
+ * Readers never write to shared memory. A reader copies the value and retries if a writer was
+ * active during the copy, so readers cannot starve writers but a reader may spin while a writer
+ * is updating. Writers are serialized with a SpinLock.
+ */
+template<class T>
+class SeqLock
+{
+public:
+
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock needs a trivially copyable type");
+
+    explicit SeqLock(const T & t = T())
+        : seq_(0)
+    {
+        memcpy(&t_, &t, sizeof(T));
+    }
+
+    T Read() const
+    {
+        T t;
+        uint64_t seq;
+
+        do {
+            unsigned int spins = 0;
+            while ((seq = seq_.load(memory_order_acquire)) & 1) {
+                if (++spins % MAX_SPIN) {
+                    CPU_RELAX();
+                } else {
+                    sched_yield();
+                }
+            }
+
+            memcpy(&t, (const void *) &t_, sizeof(T));
+
+            /*
+             * Order the copy before the re-check of the sequence
+             */
+            atomic_thread_fence(memory_order_acquire);
+        } while (seq_.load(memory_order_relaxed) != seq);
+
+        return t;
+    }
+
+    void Write(const T & t)
+    {
+        AutoLock _(&lock_);
+
+        const uint64_t seq = seq_.load(memory_order_relaxed);
+
+        seq_.store(seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        memcpy(&t_, &t, sizeof(T));
+
+        seq_.store(seq + 2, memory_order_release);
+    }
+
+private:
+
+    static const unsigned int MAX_SPIN = 1024;
+
+    SeqLock(const SeqLock &);
+    SeqLock & operator=(const SeqLock &);
+
+    atomic<uint64_t> seq_;
+    T t_;
+    SpinLock lock_;
+};
+
 }
 
 #endif
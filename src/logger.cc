@@ -0,0 +1,26 @@
+#include "logger.h"
+
+using namespace std;
+using namespace bblocks;
+
+//...................................................................................... Logger ....
+
+atomic<uint64_t> Logger::version_(1);
+__thread set<string> * Logger::tlogrc_ = NULL;
+__thread uint64_t Logger::tversion_ = 0;
+__thread bool Logger::tisExiting_ = false;
+thread_local Logger::LogrcOwner Logger::owner_;
+
+Logger::LogrcOwner::~LogrcOwner()
+{
+	ASSERT(logrc_ == tlogrc_);
+
+	delete logrc_;
+	logrc_ = NULL;
+
+	/*
+	 * Thread local destructors that run after us may still log, they go through the lock
+	 */
+	tlogrc_ = NULL;
+	tisExiting_ = true;
+}
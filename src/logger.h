@@ -12,6 +12,7 @@
 #include <atomic>
 
 #include "util.h"
+#include "schd/snapshot.hpp"
 
 /**
  TODO:
@@ -79,8 +80,115 @@ public:
         writer_->Append(msg, p);
     }
 
+    /**
+     * Enable debug and verbose logs for path at runtime
+     */
+    void EnableDebug(const string & path)
+    {
+        LockLogrc();
+        set<string> * logrc = new set<string>(*logrc_.Get());
+        logrc->insert(path);
+        Publish(logrc);
+        UnlockLogrc();
+    }
+
+    void DisableDebug(const string & path)
+    {
+        LockLogrc();
+        set<string> * logrc = new set<string>(*logrc_.Get());
+        logrc->erase(path);
+        Publish(logrc);
+        UnlockLogrc();
+    }
+
+    /**
+     * Check if debug and verbose logs are enabled for path. This is consulted for every debug
+     * log message. Pool threads are online with Epoch and look up without a lock. Any thread
+     * can log, and a guard would pin an Epoch slot to each of them, so the other threads keep
+     * a copy of logrc and check it against the published version, they take the lock only to
+     * refresh the copy.
+     */
+    bool IsDebugEnabled(const string & path) const
+    {
+        if (Epoch::IsOnline()) {
+            return IsIn(*logrc_.Get(), path);
+        }
+
+        if (!tisExiting_) {
+            if (tversion_ != version_.load(memory_order_acquire)) {
+                Refresh();
+            }
+
+            return IsIn(*tlogrc_, path);
+        }
+
+        /*
+         * The copy is gone with the thread, this is the last of its logging
+         */
+        LockLogrc();
+        const bool ret = IsIn(*logrc_.Get(), path);
+        UnlockLogrc();
+
+        return ret;
+    }
+
 private:
 
+    /*
+     * Frees the copy of logrc when the thread exits
+     */
+    struct LogrcOwner
+    {
+        LogrcOwner() : logrc_(NULL) {}
+        ~LogrcOwner();
+
+        set<string> * logrc_;
+    };
+
+    static bool IsIn(const set<string> & logrc, const string & path)
+    {
+        return logrc.find(path) != logrc.end();
+    }
+
+    void LockLogrc() const
+    {
+        bool expected = false;
+        while (!logrcLock_.compare_exchange_weak(expected, true, memory_order_acquire)) {
+            expected = false;
+            sched_yield();
+        }
+    }
+
+    void UnlockLogrc() const
+    {
+        logrcLock_.store(false, memory_order_release);
+    }
+
+    /*
+     * Set a new version of logrc, under the lock
+     */
+    void Publish(set<string> * logrc)
+    {
+        logrc_.Set(logrc);
+        version_.store(version_.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+    /*
+     * Copy the published logrc for the calling thread
+     */
+    void Refresh() const
+    {
+        LockLogrc();
+        set<string> * logrc = new set<string>(*logrc_.Get());
+        const uint64_t version = version_.load(memory_order_relaxed);
+        UnlockLogrc();
+
+        delete tlogrc_;
+        tlogrc_ = logrc;
+        tversion_ = version;
+        owner_.logrc_ = logrc;
+    }
+
     void LoadLogrc()
     {
         string filename = string(getenv("HOME")) + "/.bblogrc";
@@ -94,6 +202,8 @@ private:
 
         cerr << "Loading ~/.bblogrc" << endl;
 
+        set<string> * logrc = new set<string>();
+
         string line;
         while (getline(f, line)) {
             cout << line << endl;
@@ -102,18 +212,35 @@ private:
 
             cerr << "Enabel debug/verbose for " << line << endl;
 
-            logrc_.insert(line);
+            logrc->insert(line);
         }
 
         f.close();
+
+        LockLogrc();
+        Publish(logrc);
+        UnlockLogrc();
     }
 
     Logger()
+        : logrcLock_(false)
     {
 	LoadLogrc();
+
+	/*
+	 * Copies taken from an earlier logger are stale
+	 */
+	version_.fetch_add(1, memory_order_release);
     }
 
-    set<string> logrc_;
+    mutable atomic<bool> logrcLock_;	// held to update logrc_, and to copy it off the pool
+    Snapshot<set<string> > logrc_;
+
+    static atomic<uint64_t> version_;		// of logrc_, outlives the logger
+    static __thread set<string> * tlogrc_;	// copy of logrc_ for a thread off the pool
+    static __thread uint64_t tversion_;		// version of the copy, 0 for none
+    static __thread bool tisExiting_;		// the copy is gone
+    static thread_local LogrcOwner owner_;
     SharedPtr<LogWriter> writer_;
 };
 
@@ -132,11 +259,11 @@ public:
 
     ~LogMessage()
     {
-	auto logger = Logger::Instance();
+	const Logger & logger = Logger::Instance();
 
 	if (type_ == Logger::LogType::LEVEL_DEBUG
 	    || type_ == Logger::LogType::LEVEL_VERBOSE) {
-		if (logger.logrc_.find(path_) == logger.logrc_.end()) {
+		if (!logger.IsDebugEnabled(path_)) {
 			return;
 		}
 	}
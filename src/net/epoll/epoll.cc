@@ -1,7 +1,6 @@
-#include <list>
-
 #include "logger.h"
 #include "net/epoll/epoll.h"
+#include "perf/trace.h"
 #include "schd/thread-pool.h"
 
 using namespace std;
@@ -9,10 +8,13 @@ using namespace bblocks;
 
 //....................................................................................... Epoll ....
 
+__thread Epoll * Epoll::tpoller_ = NULL;
+
 Epoll::Epoll(const string & logPath)
 	: Thread("/epoll/" + STR(this))
 	, log_(logPath + "/epoll")
 	, lock_("/epoll" + logPath)
+	, dispatchFd_(-1)
 {
 	fd_ = epoll_create(/*size=*/ MAX_EPOLL_EVENT);
 
@@ -50,7 +52,7 @@ Epoll::~Epoll()
 		 * Empty trash can (fds marked for deletion)
 		 */
 		Guard _(&lock_);
-		INVARIANT(fdmap_.empty());
+		INVARIANT(fdmap_.IsEmpty());
 		EmptyTrashcan();
 	}
 }
@@ -70,8 +72,8 @@ Epoll::Add(const fd_t fd, const uint32_t events, const fn_t & chandler)
 		 * Insert to fdmap
 		 */
 		Guard _(&lock_);
-		INVARIANT(fdmap_.find(fd) == fdmap_.end());
-		fdmap_.insert(make_pair(fd, fdrec));
+		const bool ok = fdmap_.Insert(fdrec);
+		INVARIANT(ok);
 	}
 
 	/*
@@ -89,6 +91,11 @@ Epoll::Add(const fd_t fd, const uint32_t events, const fn_t & chandler)
 		/*
 		 * It is safe to trash fdrec since the epoll add failed
 		 */
+		{
+			Guard _(&lock_);
+			fdmap_.Unlink(fdrec);
+		}
+
 		delete fdrec;
 		return false;
 	}
@@ -111,10 +118,8 @@ Epoll::Remove(const fd_t fd)
 		 */
 		Guard _(&lock_);
 
-		auto it = fdmap_.find(fd);
-		INVARIANT(it != fdmap_.end() && it->second);
-		fdrec = it->second;
-		fdmap_.erase(it);
+		fdrec = fdmap_.Erase(fd);
+		INVARIANT(fdrec);
 
 		/*
 		 * mute callbacks
@@ -141,7 +146,7 @@ Epoll::Remove(const fd_t fd)
 		 * being woken up by the epoll.
 		 */
 		Guard _(&lock_);
-		trashcan_.push_back(fdrec);
+		trashcan_.Push(fdrec);
 	}
 
 	return true;
@@ -162,9 +167,8 @@ Epoll::AddEvent(const fd_t fd, const uint32_t events)
 		 * Update fdmap
 		 */
 		Guard _(&lock_);
-		auto it = fdmap_.find(fd);
-		INVARIANT(it != fdmap_.end() && it->second);
-		fdrec = it->second;
+		fdrec = fdmap_.Find(fd);
+		INVARIANT(fdrec);
 		fdrec->events_ |= events;
 	}
 
@@ -199,9 +203,8 @@ Epoll::RemoveEvent(const fd_t fd, const uint32_t events)
 		 * Update fdmap
 		 */
 		Guard _(&lock_);
-		auto it = fdmap_.find(fd);
-		INVARIANT(it != fdmap_.end() && it->second);
-		fdrec = it->second;
+		fdrec = fdmap_.Find(fd);
+		INVARIANT(fdrec);
 		fdrec->events_ &= ~events;
 	}
 
@@ -221,16 +224,36 @@ Epoll::RemoveEvent(const fd_t fd, const uint32_t events)
 	return (status != -1);
 }
 
+void
+Epoll::Drain(const fd_t fd)
+{
+	ASSERT(!lock_.IsOwner());
+
+	if (tpoller_ == this) {
+		/*
+		 * Called from a callback of this poller, nothing else of ours is in flight
+		 */
+		return;
+	}
+
+	/*
+	 * Remove muted the fd before we got here. The poller publishes the fd before it checks
+	 * for mute, so either it saw the mute or we see the fd until its callback is done.
+	 */
+	while (dispatchFd_.load() == fd) {
+		sched_yield();
+	}
+}
+
 void Epoll::EmptyTrashcan()
 {
 	INVARIANT(lock_.IsOwner());
 
-	for (auto fdrec : trashcan_) {
+	while (!trashcan_.IsEmpty()) {
+		FDRecord * fdrec = trashcan_.Pop();
 		INVARIANT(fdrec->mute_);
 		delete fdrec;
 	}
-
-	trashcan_.clear();
 }
 
 //
@@ -242,6 +265,8 @@ Epoll::ThreadMain()
 	vector<epoll_event> events;
 	events.resize(MAX_EPOLL_EVENT);
 
+	tpoller_ = this;
+
 	while (true) {
 		int nfds = epoll_wait(fd_, &events[0], MAX_EPOLL_EVENT, /*ms=*/ -1);
 
@@ -272,6 +297,8 @@ Epoll::ThreadMain()
 
 		DEFENSIVE_CHECK(nfds > 0);
 
+		TRACE_BEGIN("epoll", nfds);
+
 		/*
 		 * Wakeup completion handlers
 		 */
@@ -281,17 +308,21 @@ Epoll::ThreadMain()
 			INVARIANT(fdrec);
 
 			/*
-			 * Ignore callback if muted
+			 * Ignore callback if muted. The record lives till the end of the batch
 			 */
-			{
-				Guard _(&lock_);
-				if (fdrec->mute_) continue;
+			dispatchFd_.store(fdrec->fd_);
+
+			if (fdrec->mute_.load()) {
+				dispatchFd_.store(-1);
+				continue;
 			}
 
 			DEBUG(log_) << "Active fd. fd=" << fdrec->fd_
 				    << " events=" << fdrec->events_; 
 
 			fdrec->fn_.Wakeup(fdrec->fd_, events_mask);
+
+			dispatchFd_.store(-1);
 		}
 
 		/*
@@ -300,6 +331,8 @@ Epoll::ThreadMain()
 		Guard _(&lock_);
 		EmptyTrashcan();
 
+		TRACE_END("epoll", nfds);
+
 		EnableThreadCancellation();
 	}
 
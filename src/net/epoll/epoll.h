@@ -1,13 +1,13 @@
 #pragma once
 
-#include <map>
 #include <sys/epoll.h>
 #include <stdint.h>
-#include <tr1/unordered_map>
 
 #include "util.h"
 #include "lock.h"
 #include "async.h"
+#include "ds/inhash.hpp"
+#include "ds/inslist.hpp"
 #include "schd/thread.h"
 #include "net/fdpoll.h"
 
@@ -37,15 +37,17 @@ public:
 	virtual bool Remove(const fd_t fd) override;
 	virtual bool AddEvent(const fd_t fd, const uint32_t events) override;
 	virtual bool RemoveEvent(const fd_t fd, const uint32_t events) override;
+	virtual void Drain(const fd_t fd) override;
 
 private:
 
 	static const int MAX_EPOLL_EVENT = 10 * 1024; // C10K
 
 	/**
-	 *  Represent the Fd being polled on and its related information
+	 *  Represent the Fd being polled on and its related information. The record is linked
+	 *  into the fd table and later into the trash can without any further allocation.
 	 */
-	struct FDRecord
+	struct FDRecord : InHashElement<FDRecord>, InSListElement<FDRecord>
 	{
 		FDRecord(const fd_t fd, const uint32_t events, const fn_t & fn)
 			: fd_(fd), events_(events), fn_(fn), mute_(false)
@@ -63,11 +65,11 @@ private:
 		fd_t fd_;               // Registered file descriptor
 		uint32_t events_;       // Registered events
 		fn_t fn_;		// Completion handler
-		bool mute_;             // Don't invoke handler
+		atomic<bool> mute_;     // Don't invoke handler, see Drain
 	};
 
-	typedef tr1::unordered_map<fd_t, FDRecord *> fd_map_t;
-	typedef list<FDRecord *> fdrec_list_t;
+	typedef InHashTable<fd_t, FDRecord, &FDRecord::fd_> fd_map_t;
+	typedef InSQueue<FDRecord> fdrec_list_t;
 
 	/**
 	 * Epoll thread entry method
@@ -79,9 +81,12 @@ private:
 	 */
 	void EmptyTrashcan();
 
+	static __thread Epoll * tpoller_;	// the poller the thread runs, if any
+
 	string log_;		    // Log file
 	SpinMutex lock_;	    // Default lock
 	fd_t fd_;		    // Epoll fd
+	atomic<fd_t> dispatchFd_;   // fd whose callback is running, -1 if none, see Drain
 	fd_map_t fdmap_;	    // fd <-> FDRecord map
 	fdrec_list_t trashcan_;	    // FDRecords to be trashed
 };
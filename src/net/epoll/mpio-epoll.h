@@ -1,10 +1,10 @@
 #pragma once
 
 #include <memory>
-#include <map>
 
 #include "net/fdpoll.h"
 #include "net/epoll/epoll.h"
+#include "ds/concurrent-map.hpp"
 
 namespace bblocks {
 
@@ -16,8 +16,8 @@ public:
 	using FdPoll::fn_t;
 
 	MultiPathEpoll(const size_t npollth, const string & logpath = "mp-epoll/")
-		: lock_(logpath)
-		, log_(logpath)
+		: log_(logpath)
+		, idx_(0)
 	{
 		for (size_t i = 0; i < npollth; ++i) {
 			auto epoll = shared_ptr<Epoll>(new Epoll(logpath + STR(i)));
@@ -27,63 +27,77 @@ public:
 
 	virtual ~MultiPathEpoll()
 	{
-		{
-			Guard _(&lock_);
-			epolls_.clear();
-		}
+		epolls_.clear();
 	}
 
 	virtual bool Add(const fd_t fd, const uint32_t events, const fn_t & fn) override
 	{
-		Guard _(&lock_);
+		const size_t id = ++idx_ % epolls_.size();
 
-		INVARIANT(fdmap_.find(fd) == fdmap_.end());
+		DEBUG(log_) << "Add. fd=" << fd << " epoll=" << id;
 
-		const size_t id = ++idx_ % epolls_.size();
+		/*
+		 * The callback may look up the fd as soon as the poller has it, so the map goes
+		 * first and is rolled back if the poller refuses the fd
+		 */
+		bool ok = fdmap_.Insert(fd, id);
+		INVARIANT(ok);
 
-		INFO(log_) << id;
+		if (!epolls_[id]->Add(fd, events, fn)) {
+			ok = fdmap_.Erase(fd);
+			INVARIANT(ok);
+			return false;
+		}
 
-		fdmap_[fd] = id;
-		return epolls_[id]->Add(fd, events, fn);
+		return true;
 	}
 
 	virtual bool Remove(const fd_t fd) override
 	{
-		Guard _(&lock_);
+		const size_t id = Lookup(fd);
 
-		auto it = fdmap_.find(fd);
-		INVARIANT(it != fdmap_.end());
+		const bool ok = fdmap_.Erase(fd);
+		INVARIANT(ok);
 
-		const size_t id = it->second;
-		fdmap_.erase(it);
 		return epolls_[id]->Remove(fd);
 	}
 
-	virtual bool AddEvent(const fd_t fd, const uint32_t events) override
+	virtual void Drain(const fd_t fd) override
 	{
-		Guard _(&lock_);
-
-		auto it = fdmap_.find(fd);
-		INVARIANT(it != fdmap_.end());
+		/*
+		 * The fd is out of the map once removed, a drain costs a load per poller
+		 */
+		for (auto & epoll : epolls_) {
+			epoll->Drain(fd);
+		}
+	}
 
-		return epolls_[it->second]->AddEvent(fd, events);
+	virtual bool AddEvent(const fd_t fd, const uint32_t events) override
+	{
+		return epolls_[Lookup(fd)]->AddEvent(fd, events);
 	}
 
 	virtual bool RemoveEvent(const fd_t fd, const uint32_t events) override
 	{
-		Guard _(&lock_);
-
-		auto it = fdmap_.find(fd);
-		INVARIANT(it != fdmap_.end());
-
-		return epolls_[it->second]->RemoveEvent(fd, events);
+		return epolls_[Lookup(fd)]->RemoveEvent(fd, events);
 	}
 
 private:
 
-	typedef map<fd_t, size_t> fdmap_t;
+	/*
+	 * fd to epoll instance map. The map is consulted for every event update, so lookups are
+	 * lock free.
+	 */
+	typedef ConcurrentMap<fd_t, size_t> fdmap_t;
+
+	size_t Lookup(const fd_t fd) const
+	{
+		size_t id = 0;
+		const bool ok = fdmap_.Get(fd, id);
+		INVARIANT(ok);
+		return id;
+	}
 
-	SpinMutex lock_;
 	string log_;
 	atomic<size_t> idx_;
 	vector<shared_ptr<Epoll> > epolls_;
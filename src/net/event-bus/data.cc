@@ -24,3 +24,40 @@ String::Decode(IOBuffer & buf, size_t & pos)
 	}
 }
 
+
+void
+ArenaString::Encode(IOBuffer & buf, size_t & pos)
+{
+	buf.UpdateInt<uint32_t>(v_.size(), pos);
+	for (size_t i = 0; i < v_.size(); ++i) {
+		buf.Update(v_[i], pos);
+	}
+}
+
+void
+ArenaString::Decode(IOBuffer & buf, size_t & pos)
+{
+	uint32_t size;
+	buf.ReadInt(size, pos);
+
+	v_.resize(size);
+
+	for (size_t i = 0; i < size; ++i) {
+		buf.Read(v_[i], pos);
+	}
+}
+
+void
+ArenaString::Decode(IOBuffer & buf, size_t & pos, Arena & arena)
+{
+	uint32_t size;
+	buf.ReadInt(size, pos);
+
+	string_t v(size, /*ch=*/ 0, ArenaAllocator<char>(&arena));
+
+	for (size_t i = 0; i < size; ++i) {
+		buf.Read(v[i], pos);
+	}
+
+	v_.swap(v);
+}
@@ -2,6 +2,7 @@
 
 #include "util.h"
 #include "buf/buffer.h"
+#include "buf/arena.h"
 
 namespace bblocks
 {
@@ -33,6 +34,15 @@ struct Serializeable
 		Decode(buf, pos);
 	}
 
+	/**
+	 * Decode drawing the memory the value needs from arena. Values that don't allocate decode
+	 * as usual.
+	 */
+	virtual void Decode(IOBuffer & buf, size_t & pos, Arena & arena)
+	{
+		Decode(buf, pos);
+	}
+
 	virtual size_t Size() const = 0;
 };
 
@@ -151,6 +161,38 @@ struct String : Serializeable
 	string v_;
 };
 
+// ................................................................................ ArenaString ....
+
+/**
+ * String that can live in an Arena
+ */
+struct ArenaString : Serializeable
+{
+	typedef basic_string<char, char_traits<char>, ArenaAllocator<char> > string_t;
+
+	explicit ArenaString(Arena * arena = NULL) : v_(ArenaAllocator<char>(arena)) {}
+
+	virtual void Encode(IOBuffer & buf, size_t & pos);
+	virtual void Decode(IOBuffer & buf, size_t & pos);
+	virtual void Decode(IOBuffer & buf, size_t & pos, Arena & arena);
+
+	virtual size_t Size() const
+	{
+		return v_.size() + sizeof(uint32_t);
+	}
+
+	bool operator==(const string & str) const
+	{
+		return v_.size() == str.size() && !memcmp(v_.data(), str.data(), str.size());
+	}
+
+	bool operator==(const ArenaString & rhs) const { return v_ == rhs.v_; }
+	void Set(const string & v) { v_.assign(v.data(), v.size()); }
+	const string_t & Get() const { return v_; }
+
+	string_t v_;
+};
+
 // .................................................................................... List<T> ....
 
 template<class T>
@@ -197,4 +239,80 @@ struct List : Serializeable
 	vector<T> v_;
 };
 
+// ............................................................................... ArenaList<T> ....
+
+/**
+ * List that can live in an Arena, its elements decode into the same arena
+ */
+template<class T>
+struct ArenaList : Serializeable
+{
+	typedef vector<T, ArenaAllocator<T> > vector_t;
+
+	explicit ArenaList(Arena * arena = NULL) : v_(ArenaAllocator<T>(arena)) {}
+
+	void
+	Encode(IOBuffer & buf, size_t & pos)
+	{
+		buf.UpdateInt<uint32_t>(v_.size(), pos);
+		for (size_t i = 0; i < v_.size(); ++i) {
+			v_[i].Encode(buf, pos);
+		}
+	}
+
+	void
+	Decode(IOBuffer & buf, size_t & pos)
+	{
+		Arena * arena = v_.get_allocator().arena_;
+
+		if (arena) {
+			Decode(buf, pos, *arena);
+			return;
+		}
+
+		uint32_t size;
+		buf.ReadInt(size, pos);
+
+		v_.resize(size);
+
+		for (size_t i = 0; i < size; ++i) {
+			v_[i].Decode(buf, pos);
+		}
+	}
+
+	void
+	Decode(IOBuffer & buf, size_t & pos, Arena & arena)
+	{
+		uint32_t size;
+		buf.ReadInt(size, pos);
+
+		vector_t v(size, T(), ArenaAllocator<T>(&arena));
+
+		for (size_t i = 0; i < size; ++i) {
+			static_cast<Serializeable &>(v[i]).Decode(buf, pos, arena);
+		}
+
+		v_.swap(v);
+	}
+
+	virtual size_t Size() const
+	{
+		size_t size = sizeof(uint32_t);
+		for (size_t i = 0; i < v_.size(); ++i) {
+			size += v_[i].Size();
+		}
+
+		return size;
+	}
+
+	bool operator==(const vector<T> & rhs) const
+	{
+		return v_.size() == rhs.size() && equal(v_.begin(), v_.end(), rhs.begin());
+	}
+
+	const vector_t & Get() const { return v_; }
+
+	vector_t v_;
+};
+
 }
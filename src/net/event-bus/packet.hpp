@@ -15,6 +15,13 @@ class NetPacket : public Serializeable
 {
 public:
 
+	/**
+	 * The list of vars is drawn from arena if there is one
+	 */
+	explicit NetPacket(Arena * arena = NULL)
+		: vars_(ArenaAllocator<Serializeable *>(arena))
+	{}
+
 	void Add(Serializeable & var)
 	{
 		vars_.push_back(&var);
@@ -34,6 +41,13 @@ public:
 		}
 	}
 
+	virtual void Decode(IOBuffer & buf, size_t & pos, Arena & arena) override
+	{
+		for (auto it = vars_.begin(); it != vars_.end(); ++it) {
+			(*it)->Decode(buf, pos, arena);
+		}
+	}
+
 	virtual size_t Size() const override
 	{
 		size_t size = 0;
@@ -46,7 +60,7 @@ public:
 
 private:
 
-    list<Serializeable *> vars_;
+    list<Serializeable *, ArenaAllocator<Serializeable *> > vars_;
 };
 
 // ................................................................................ EventPacket ....
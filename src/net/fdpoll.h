@@ -1,6 +1,8 @@
 #pragma once
 
 #include "async.h"
+#include "util.h"
+#include "perf/perf-counter.h"
 
 namespace bblocks {
 
@@ -11,6 +13,19 @@ public:
 	typedef int fd_t;
 	typedef Fn2<int, uint32_t> fn_t;
 
+	FdPoll()
+		: statReadSize_("stat/read-io", "bytes", PerfCounter::BYTES)
+		, statWriteSize_("stat/write-io", "bytes", PerfCounter::BYTES)
+		, statWriteBatch_("stat/write-batch", "msgs", PerfCounter::COUNTER)
+	{}
+
+	virtual ~FdPoll()
+	{
+		VERBOSE("/fdpoll") << statReadSize_;
+		VERBOSE("/fdpoll") << statWriteSize_;
+		VERBOSE("/fdpoll") << statWriteBatch_;
+	}
+
 	/**
 	 * Add a given file descriptor to the epoll list
 	 *
@@ -29,6 +44,14 @@ public:
 	 */
 	virtual bool Remove(const fd_t fd) = 0;
 
+	/**
+	 * Wait out the callback in flight for a removed fd. Once drained the fd's callback is not
+	 * running and does not run again, so its handler can go. The fd must stay open until then.
+	 * A callback of the same poller does not wait, the poller runs one callback at a time and
+	 * that is the caller's own. Callbacks of two pollers must not drain each other's fds.
+	 */
+	virtual void Drain(const fd_t fd) = 0;
+
 	/**
 	 * Remove a given event from the registered fd
 	 */
@@ -38,6 +61,18 @@ public:
 	 * Unregister a given event from the registered events for a specific fd
 	 */
 	virtual bool RemoveEvent(const fd_t fd, const uint32_t events) = 0;
+
+	/*
+	 * IO size of all channels served by this poller. Channels account here instead of carrying
+	 * their own counters, which would cost more than the channel itself.
+	 */
+	PerfCounter statReadSize_;
+	PerfCounter statWriteSize_;
+
+	/*
+	 * Messages sent per write syscall. Count is the number of syscalls.
+	 */
+	PerfCounter statWriteBatch_;
 };
 
 }
@@ -39,6 +39,19 @@ public:
 		return flag;
 	}
 
+	static bool SetTcpCork(const int fd, const bool enable)
+	{
+		const int flag = enable;
+		int status = setsockopt(fd, IPPROTO_TCP, TCP_CORK, &flag, sizeof(int));
+		return status != -1;
+	}
+
+	static bool SetTcpNotSentLowat(const int fd, const int bytes)
+	{
+		int status = setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(int));
+		return status != -1;
+	}
+
 	static bool SetTcpWindow(const int fd, const int size)
 	{
 		// Set out buffer size
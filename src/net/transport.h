@@ -5,6 +5,7 @@
 
 #include "async.h"
 #include "net/socket.h"
+#include "schd/cancel-token.h"
 
 namespace bblocks {
 
@@ -44,6 +45,16 @@ public:
 	 */
 	virtual int Read(IOBuffer & buf, const ReadDoneHandle & h) = 0;
 
+	/**
+	 * Read with a deadline and/or a cancellation token
+	 *
+	 * If the read does not complete in time the handle is invoked with TIMEDOUT, if the token
+	 * is cancelled with CANCELLED. Either way the channel lets go of the buffer and passes it
+	 * back to the handle, bytes read so far are lost to the stream. Returns CANCELLED without
+	 * a callback if the token is already cancelled.
+	 */
+	virtual int Read(IOBuffer & buf, const ReadDoneHandle & h, const OpCtl & ctl) = 0;
+
 	/**
 	 * Invoke asynchronous write operation to the byte stream
 	 *
@@ -56,6 +67,21 @@ public:
 	 */
 	virtual int Write(IOBuffer & buf, const WriteDoneHandle & h) = 0;
 
+	/**
+	 * Write with a deadline and/or a cancellation token
+	 *
+	 * A write that has not started to go out is dropped on deadline or cancellation and the
+	 * handle is invoked with TIMEDOUT or CANCELLED. A write that has partially gone out is not
+	 * interrupted, since that would break the stream. Returns CANCELLED without a callback if
+	 * the token is already cancelled.
+	 *
+	 * Writes are refused with NOMEM, without a callback, while queued writes hold the transport
+	 * over its hard memory limit, see MemAccount. Writes queued before the refusal are not
+	 * affected and complete as usual. The caller keeps the buffer and retries, in the order the
+	 * writes were refused, once MemAccount::WaitForSpace(MemAccount::TRANSPORT, r) runs r.
+	 */
+	virtual int Write(IOBuffer & buf, const WriteDoneHandle & h, const OpCtl & ctl) = 0;
+
 	/**
 	 * Stop transport
 	 *
@@ -0,0 +1,592 @@
+#include <map>
+
+#include "net/transport/loopback.h"
+#include "bblocks.h"
+
+using namespace std;
+using namespace bblocks;
+
+static const string _log("/loopback");
+
+namespace {
+
+/*
+ * Acceptors by the address they accept on, set up with the first acceptor
+ */
+class Listeners : public Singleton<Listeners>
+{
+public:
+
+	static Listeners & Instance()
+	{
+		if (!IsInit()) {
+			Init();
+		}
+
+		return Singleton<Listeners>::Instance();
+	}
+
+	static uint64_t Key(const sockaddr_in & addr)
+	{
+		return ((uint64_t) addr.sin_addr.s_addr << 16) | addr.sin_port;
+	}
+
+	SpinLock lock_;
+	map<uint64_t, LoopbackAcceptor *> acceptors_;
+};
+
+}
+
+//....................................................................... LoopbackChannel::Ring ....
+
+size_t
+LoopbackChannel::Ring::Put(const uint8_t * p, const size_t size)
+{
+	const size_t n = min(size, Space());
+	const size_t tail = (head_ + size_) % buf_.size();
+	const size_t first = min(n, buf_.size() - tail);
+
+	memcpy(&buf_[tail], p, first);
+	memcpy(&buf_[0], p + first, n - first);
+
+	size_ += n;
+	return n;
+}
+
+size_t
+LoopbackChannel::Ring::Get(uint8_t * p, const size_t size, const bool peek)
+{
+	const size_t n = min(size, size_);
+	const size_t first = min(n, buf_.size() - head_);
+
+	memcpy(p, &buf_[head_], first);
+	memcpy(p + first, &buf_[0], n - first);
+
+	if (!peek) {
+		head_ = (head_ + n) % buf_.size();
+		size_ -= n;
+	}
+
+	return n;
+}
+
+//............................................................................. LoopbackChannel ....
+
+void
+LoopbackChannel::NewPair(LoopbackChannel ** a, LoopbackChannel ** b, const size_t ringSize)
+{
+	ASSERT(ringSize);
+
+	Pipe * pipe = new Pipe(ringSize);
+
+	*a = pipe->ends_[0] = new LoopbackChannel(pipe, /*side=*/ 0);
+	*b = pipe->ends_[1] = new LoopbackChannel(pipe, /*side=*/ 1);
+}
+
+LoopbackChannel::LoopbackChannel(Pipe * pipe, const int side)
+	: pipe_(pipe)
+	, side_(side)
+	, rctx_(NULL)
+	, isStopped_(false)
+	, aborts_(this)
+{}
+
+LoopbackChannel::~LoopbackChannel()
+{
+	bool isLast;
+
+	{
+		Guard _(&pipe_->lock_);
+
+		/*
+		 * Stop failed our ops and its handle came back with the last timer or abort, there
+		 * is nothing left that could reach us
+		 */
+		INVARIANT(isStopped_);
+		INVARIANT(aborts_.IsIdle());
+		INVARIANT(!rctx_ && wpending_.IsEmpty());
+
+		isLast = !--pipe_->nends_;
+	}
+
+	if (isLast) {
+		delete pipe_;
+	}
+}
+
+int
+LoopbackChannel::Write(IOBuffer & buf, const WriteDoneHandle & h)
+{
+	return Write(buf, h, OpCtl());
+}
+
+int
+LoopbackChannel::Write(IOBuffer & buf, const WriteDoneHandle & h, const OpCtl & ctl)
+{
+	ASSERT(buf);
+
+	done_t done;
+	int ret = 0;
+
+	{
+		Guard _(&pipe_->lock_);
+
+		if (isStopped_ || !peer()) {
+			return -1;
+		}
+
+		if (MemAccount::IsOverHard(MemAccount::TRANSPORT)) {
+			/*
+			 * As on TCPChannel, queued writes still go out
+			 */
+			return NOMEM;
+		}
+
+		WriteCtx * w = new WriteCtx(buf, h);
+
+		if (!aborts_.Arm(w, ctl)) {
+			delete w;
+			return CANCELLED;
+		}
+
+		if (!wpending_.IsEmpty()) {
+			/*
+			 * Behind the backlog
+			 */
+			wpending_.Push(w);
+		} else if (Drain(w)) {
+			/*
+			 * There is no backlog and all of it fit, done synchronously
+			 */
+			ret = w->bytes_;
+			aborts_.Disarm(w);
+			delete w;
+		} else {
+			ret = w->bytes_;
+			wpending_.Push(w);
+		}
+
+		/*
+		 * Hand the data to a read the peer has pending
+		 */
+		Pump(pipe_, done);
+	}
+
+	Notify(done);
+
+	return ret;
+}
+
+int
+LoopbackChannel::Read(IOBuffer & data, const ReadDoneHandle & h)
+{
+	return Read(data, h, /*peek=*/ false, OpCtl());
+}
+
+int
+LoopbackChannel::Read(IOBuffer & data, const ReadDoneHandle & h, const OpCtl & ctl)
+{
+	return Read(data, h, /*peek=*/ false, ctl);
+}
+
+int
+LoopbackChannel::Peek(IOBuffer & data, const ReadDoneHandle & h)
+{
+	return Read(data, h, /*peek=*/ true, OpCtl());
+}
+
+int
+LoopbackChannel::Read(const IOBuffer & data, const ReadDoneHandle & h, const bool peek,
+		      const OpCtl & ctl)
+{
+	ASSERT(data);
+
+	done_t done;
+	int ret = 0;
+
+	{
+		Guard _(&pipe_->lock_);
+
+		INVARIANT(!rctx_);
+
+		if (isStopped_) {
+			return -1;
+		}
+
+		if (peek && data.Size() > rx().Capacity()) {
+			/*
+			 * The ring never holds that much, the peek would wait forever
+			 */
+			return -1;
+		}
+
+		ReadCtx * r = new ReadCtx(data, h, peek);
+
+		if (!aborts_.Arm(r, ctl)) {
+			delete r;
+			return CANCELLED;
+		}
+
+		if (Fill(r)) {
+			ret = r->bytes_;
+			aborts_.Disarm(r);
+			delete r;
+		} else if (!peer()) {
+			/*
+			 * Nothing more is coming
+			 */
+			ret = -1;
+			aborts_.Disarm(r);
+			delete r;
+		} else {
+			ret = r->bytes_;
+			rctx_ = r;
+		}
+
+		/*
+		 * Room has been made for writes the peer has pending
+		 */
+		Pump(pipe_, done);
+	}
+
+	Notify(done);
+
+	return ret;
+}
+
+bool
+LoopbackChannel::Fill(ReadCtx * r)
+{
+	ASSERT(pipe_->lock_.IsOwner());
+
+	const size_t size = r->buf_.Size();
+
+	if (r->isPeek_) {
+		/*
+		 * A peek sees the data only once all of it is there
+		 */
+		if (rx().Size() < size) {
+			return false;
+		}
+
+		r->bytes_ = rx().Get(r->buf_.Ptr(), size, /*peek=*/ true);
+		return true;
+	}
+
+	r->bytes_ += rx().Get(r->buf_.Ptr() + r->bytes_, size - r->bytes_, /*peek=*/ false);
+	return r->bytes_ == size;
+}
+
+bool
+LoopbackChannel::Drain(WriteCtx * w)
+{
+	ASSERT(pipe_->lock_.IsOwner());
+
+	const size_t size = w->buf_.Size();
+	w->bytes_ += tx().Put(w->buf_.Ptr() + w->bytes_, size - w->bytes_);
+	return w->bytes_ == size;
+}
+
+void
+LoopbackChannel::Pump(Pipe * pipe, done_t & done)
+{
+	ASSERT(pipe->lock_.IsOwner());
+
+	/*
+	 * Reading makes room for writes and writing feeds reads, go until nothing moves
+	 */
+	bool isMoved = true;
+
+	while (isMoved) {
+		isMoved = false;
+
+		for (int side = 0; side < 2; ++side) {
+			LoopbackChannel * ch = pipe->ends_[side];
+
+			if (!ch) continue;
+
+			if (ch->rctx_) {
+				ReadCtx * r = ch->rctx_;
+				const size_t bytes = r->bytes_;
+
+				if (ch->Fill(r)) {
+					ch->rctx_ = NULL;
+					ch->Complete(r, r->bytes_, done);
+					isMoved = true;
+				} else if (!ch->peer()) {
+					ch->rctx_ = NULL;
+					ch->Complete(r, /*status=*/ -1, done);
+				} else if (r->bytes_ != bytes) {
+					isMoved = true;
+				}
+			}
+
+			while (!ch->wpending_.IsEmpty()) {
+				WriteCtx * w = ch->wpending_.Front();
+				const size_t bytes = w->bytes_;
+
+				if (!ch->peer()) {
+					ch->wpending_.Pop();
+					ch->Complete(w, /*status=*/ -1, done);
+					continue;
+				}
+
+				if (!ch->Drain(w)) {
+					isMoved |= w->bytes_ != bytes;
+					break;
+				}
+
+				ch->wpending_.Pop();
+				ch->Complete(w, w->bytes_, done);
+				isMoved = true;
+			}
+		}
+	}
+}
+
+void
+LoopbackChannel::Complete(OpCtx * op, const int status, done_t & done)
+{
+	ASSERT(pipe_->lock_.IsOwner());
+
+	done.push_back(Done(op->h_, status, op->buf_));
+	aborts_.Disarm(op);
+	delete op;
+}
+
+void
+LoopbackChannel::Notify(done_t & done)
+{
+	for (auto & d : done) {
+		d.h_.Wakeup(d.status_, d.buf_);
+	}
+}
+
+void
+LoopbackChannel::FailOps(done_t & done)
+{
+	ASSERT(pipe_->lock_.IsOwner());
+
+	if (rctx_) {
+		ReadCtx * r = rctx_;
+		rctx_ = NULL;
+		Complete(r, /*status=*/ -1, done);
+	}
+
+	while (!wpending_.IsEmpty()) {
+		Complete(wpending_.Pop(), /*status=*/ -1, done);
+	}
+}
+
+//............................................................................. Deadline/Cancel ....
+
+void
+LoopbackChannel::AbortOp(aborts_t::Timer * t, uint64_t id, int status)
+{
+	done_t done;
+	StopDoneHandle * h = NULL;
+
+	{
+		Guard _(&pipe_->lock_);
+
+		OpCtx * op = static_cast<OpCtx *>(aborts_t::Find(id, rctx_, wpending_));
+		aborts_t::TimerFired(op, t);
+
+		if (!op) {
+			/*
+			 * Op completed before the abort got here
+			 */
+		} else if (op == rctx_) {
+			rctx_ = NULL;
+			Complete(op, status, done);
+		} else if (!op->bytes_) {
+			/*
+			 * A write that is partially out runs to completion, as on TCPChannel
+			 */
+			const bool ok = wpending_.Remove(static_cast<WriteCtx *>(op));
+			INVARIANT(ok);
+			Complete(op, status, done);
+		}
+
+		h = aborts_.PutStopRef();
+	}
+
+	Notify(done);
+	aborts_t::StopDone(h);
+}
+
+int
+LoopbackChannel::Stop(const StopDoneHandle & h)
+{
+	ASSERT(h)
+
+	done_t done;
+
+	{
+		Guard _(&pipe_->lock_);
+
+		INVARIANT(!isStopped_);
+
+		isStopped_ = true;
+		pipe_->ends_[side_] = NULL;
+
+		/*
+		 * Fail our ops, and the ops of the peer that can't complete without us
+		 */
+		FailOps(done);
+		Pump(pipe_, done);
+
+		aborts_.Park(h);
+	}
+
+	Notify(done);
+
+	/*
+	 * Complete asynchronously, as on TCPChannel
+	 */
+	BBlocks::Schedule(this, &This::BarrierDone, /*nonce=*/ 0);
+
+	return 0;
+}
+
+void
+LoopbackChannel::BarrierDone(int)
+{
+	StopDoneHandle * h = NULL;
+
+	{
+		Guard _(&pipe_->lock_);
+
+		/*
+		 * If timers or aborts are in flight the last of them completes the stop
+		 */
+		h = aborts_.PutStopRef();
+	}
+
+	aborts_t::StopDone(h);
+}
+
+//............................................................................ LoopbackAcceptor ....
+
+int
+LoopbackAcceptor::Accept(const SocketAddress & addr, const AcceptDoneHandle & h)
+{
+	Listeners & l = Listeners::Instance();
+
+	Guard _(&l.lock_);
+
+	INVARIANT(!isAccepting_);
+
+	key_ = Listeners::Key(addr.LocalAddr());
+
+	if (!l.acceptors_.insert(make_pair(key_, this)).second) {
+		ERROR(_log) << "Address is in use";
+		return -1;
+	}
+
+	h_ = h;
+	isAccepting_ = true;
+
+	INFO(_log) << "Loopback acceptor started.";
+
+	return 0;
+}
+
+int
+LoopbackAcceptor::Stop(const StopDoneHandle & h)
+{
+	Listeners & l = Listeners::Instance();
+
+	Guard _(&l.lock_);
+
+	INVARIANT(isAccepting_);
+
+	l.acceptors_.erase(key_);
+	isAccepting_ = false;
+
+	if (nrefs_) {
+		/*
+		 * A connect is handing us a channel, it completes the stop
+		 */
+		isStopping_ = true;
+		stopHandle_ = h;
+		return 0;
+	}
+
+	BBlocks::Schedule(this, &This::BarrierDone, h);
+	return 0;
+}
+
+void
+LoopbackAcceptor::BarrierDone(StopDoneHandle h)
+{
+	h.Wakeup(/*status=*/ 0);
+}
+
+//........................................................................... LoopbackConnector ....
+
+int
+LoopbackConnector::Connect(const SocketAddress & addr, const ConnectDoneHandle & h)
+{
+	Listeners & l = Listeners::Instance();
+
+	LoopbackAcceptor * a;
+	LoopbackAcceptor::AcceptDoneHandle ah;
+
+	{
+		Guard _(&l.lock_);
+
+		auto it = l.acceptors_.find(Listeners::Key(addr.RemoteAddr()));
+
+		if (it == l.acceptors_.end()) {
+			ERROR(_log) << "Connection refused";
+			return -1;
+		}
+
+		a = it->second;
+		ah = a->h_;
+		++a->nrefs_;
+	}
+
+	LoopbackChannel * client;
+	LoopbackChannel * server;
+	LoopbackChannel::NewPair(&client, &server, a->ringSize_);
+
+	ah.Wakeup(/*status=*/ 0, static_cast<UnicastTransportChannel *>(server));
+
+	ConnectDoneHandle ch(h);
+	ch.Wakeup(/*status=*/ 0, static_cast<UnicastTransportChannel *>(client));
+
+	LoopbackAcceptor::StopDoneHandle sh;
+
+	{
+		Guard _(&l.lock_);
+
+		if (--a->nrefs_ || !a->isStopping_) {
+			return 0;
+		}
+
+		a->isStopping_ = false;
+		sh = a->stopHandle_;
+	}
+
+	BBlocks::Schedule(a, &LoopbackAcceptor::BarrierDone, sh);
+
+	return 0;
+}
+
+int
+LoopbackConnector::Stop(const StopDoneHandle & h)
+{
+	/*
+	 * Connects complete before they return, there is nothing pending
+	 */
+	BBlocks::Schedule(this, &This::BarrierDone, h);
+	return 0;
+}
+
+void
+LoopbackConnector::BarrierDone(StopDoneHandle h)
+{
+	h.Wakeup(/*status=*/ 0);
+}
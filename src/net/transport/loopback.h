@@ -0,0 +1,282 @@
+#pragma once
+
+#include <vector>
+
+#include "util.h"
+#include "async.h"
+#include "lock.h"
+#include "schd/thread-pool.h"
+#include "buf/buffer.h"
+#include "net/transport.h"
+#include "ds/inslist.hpp"
+#include "schd/op-aborts.hpp"
+
+namespace bblocks {
+
+//............................................................................. LoopbackChannel ....
+
+/**
+ * @class LoopbackChannel
+ *
+ * Transport channel connected to its peer through in-process byte rings, no kernel in the way.
+ * Meant for measuring the cost of the handler chains above the transport and for unit tests
+ * that need a deterministic transport.
+ *
+ * The channel keeps the semantics of TCPChannel. An op that can complete when it is issued
+ * returns its size and there is no callback, otherwise it returns the bytes done so far and
+ * completes through its handle. Writes block once the ring towards the peer is full, that is
+ * the socket buffer. Deadlines and cancellation behave as on TCPChannel. Stopping a channel
+ * fails its pending ops, and the peer's ops that can no longer complete, with -1.
+ *
+ * A peek completes once all of its bytes are in the ring, so a peek larger than the ring could
+ * never complete and fails with -1 when it is issued.
+ *
+ * The two ends share a lock. Data moves on the thread issuing the op and handles are invoked
+ * after the lock is released.
+ *
+ * A channel is destroyed only once its stop has completed. The stop waits for the deadline
+ * timers and aborts in flight, so none of them reaches a destroyed channel.
+ */
+class LoopbackChannel : public CompletionHandle, public UnicastTransportChannel
+{
+public:
+
+	friend class OpAborts<LoopbackChannel>;
+
+	using This = LoopbackChannel;
+
+	using UnicastTransportChannel::ReadDoneHandle;
+	using UnicastTransportChannel::WriteDoneHandle;
+	using UnicastTransportChannel::StopDoneHandle;
+
+	static const size_t DEFAULT_RING_SIZE = 64 * 1024;
+
+	virtual ~LoopbackChannel();
+
+	/**
+	 * Two channels connected back to back, with ringSize bytes in flight each way
+	 */
+	static void NewPair(LoopbackChannel ** a, LoopbackChannel ** b,
+			    const size_t ringSize = DEFAULT_RING_SIZE);
+
+	virtual int Peek(IOBuffer & data, const ReadDoneHandle & h) override;
+	virtual int Read(IOBuffer & buf, const ReadDoneHandle & h) override;
+	virtual int Read(IOBuffer & buf, const ReadDoneHandle & h, const OpCtl & ctl) override;
+	virtual int Write(IOBuffer & buf, const WriteDoneHandle & h) override;
+	virtual int Write(IOBuffer & buf, const WriteDoneHandle & h, const OpCtl & ctl) override;
+	virtual int Stop(const StopDoneHandle & cb) override;
+
+private:
+
+	__DISABLE_ASSIGN_AND_COPY__(LoopbackChannel)
+	__STATELESS_ASYNC_PROCESSOR__
+
+	struct Pipe;
+
+	LoopbackChannel(Pipe * pipe, const int side);
+
+	/**
+	 * Bytes in flight in one direction
+	 */
+	class Ring
+	{
+	public:
+
+		Ring(const size_t size) : buf_(size), head_(0), size_(0) {}
+
+		size_t Size() const { return size_; }
+		size_t Space() const { return buf_.size() - size_; }
+		size_t Capacity() const { return buf_.size(); }
+
+		/**
+		 * Copy in as much of size bytes as there is space for
+		 */
+		size_t Put(const uint8_t * p, const size_t size);
+
+		/**
+		 * Copy out up to size bytes, consume them unless peek
+		 */
+		size_t Get(uint8_t * p, const size_t size, const bool peek);
+
+	private:
+
+		vector<uint8_t> buf_;
+		size_t head_;
+		size_t size_;
+	};
+
+	/**
+	 * State the two ends share, deleted by the last end to go
+	 */
+	struct Pipe
+	{
+		Pipe(const size_t ringSize)
+			: rings_{Ring(ringSize), Ring(ringSize)}, ends_{NULL, NULL}, nends_(2)
+		{}
+
+		SpinLock lock_;
+		Ring rings_[2];			// rings_[i] carries data to ends_[i]
+		LoopbackChannel * ends_[2];	// NULL once the end has stopped
+		int nends_;			// ends not yet destroyed
+	};
+
+	/**
+	 * A handle to invoke once the lock is released
+	 */
+	struct Done
+	{
+		Done(const ReadDoneHandle & h, const int status, const IOBuffer & buf)
+			: h_(h), status_(status), buf_(buf)
+		{}
+
+		ReadDoneHandle h_;
+		int status_;
+		IOBuffer buf_;
+	};
+
+	typedef vector<Done> done_t;
+
+	typedef OpAborts<LoopbackChannel> aborts_t;
+
+	/**
+	 * State of an op, reads and writes move bytes the same way
+	 */
+	struct OpCtx : aborts_t::Op
+	{
+		OpCtx(const IOBuffer & buf, const ReadDoneHandle & h)
+			: buf_(buf), bytes_(0), h_(h)
+		{}
+
+		IOBuffer buf_;
+		size_t bytes_;			// bytes done
+		ReadDoneHandle h_;
+	};
+
+	struct ReadCtx : OpCtx
+	{
+		ReadCtx(const IOBuffer & buf, const ReadDoneHandle & h, const bool isPeek)
+			: OpCtx(buf, h), isPeek_(isPeek)
+		{}
+
+		bool isPeek_;
+	};
+
+	struct WriteCtx : InSListElement<WriteCtx>, OpCtx
+	{
+		WriteCtx(const IOBuffer & buf, const WriteDoneHandle & h)
+			: OpCtx(buf, h), charged_(sizeof(WriteCtx) + buf.Size())
+		{
+			MemAccount::Charge(MemAccount::TRANSPORT, charged_);
+		}
+
+		~WriteCtx()
+		{
+			MemAccount::Release(MemAccount::TRANSPORT, charged_);
+		}
+
+		const size_t charged_;	// bytes accounted to the transport
+	};
+
+	int Read(const IOBuffer & buf, const ReadDoneHandle & h, const bool peek,
+		 const OpCtl & ctl);
+	void AbortOp(aborts_t::Timer * t, uint64_t id, int status);
+	void BarrierDone(int);
+	void Complete(OpCtx * op, const int status, done_t & done);
+	void FailOps(done_t & done);
+	bool Fill(ReadCtx * r);
+	bool Drain(WriteCtx * w);
+	static void Pump(Pipe * pipe, done_t & done);
+	static void Notify(done_t & done);
+
+	Ring & rx() { return pipe_->rings_[side_]; }
+	Ring & tx() { return pipe_->rings_[!side_]; }
+	LoopbackChannel * peer() { return pipe_->ends_[!side_]; }
+
+	Pipe * pipe_;
+	const int side_;
+	ReadCtx * rctx_;		// pending read, if any
+	InSQueue<WriteCtx> wpending_;	// pending writes
+	bool isStopped_;
+	aborts_t aborts_;		// deadlines, cancellations and the pending stop
+};
+
+//............................................................................ LoopbackAcceptor ....
+
+/**
+ * @class LoopbackAcceptor
+ *
+ * Accepts loopback connections on the local address, in process. Addresses are names only, an
+ * acceptor can take any address that no other loopback acceptor has.
+ */
+class LoopbackAcceptor : public CompletionHandle, public UnicastAcceptor
+{
+public:
+
+	friend class LoopbackConnector;
+
+	using This = LoopbackAcceptor;
+
+	using UnicastAcceptor::AcceptDoneHandle;
+	using UnicastAcceptor::StopDoneHandle;
+
+	LoopbackAcceptor(const size_t ringSize = LoopbackChannel::DEFAULT_RING_SIZE)
+		: ringSize_(ringSize), key_(0), isAccepting_(false), isStopping_(false)
+		, nrefs_(0)
+	{}
+
+	virtual ~LoopbackAcceptor()
+	{
+		INVARIANT(!isAccepting_);
+	}
+
+	virtual int Accept(const SocketAddress & addr, const AcceptDoneHandle & h) override;
+	virtual int Stop(const StopDoneHandle & h) override;
+
+private:
+
+	LoopbackAcceptor(const LoopbackAcceptor &);
+	LoopbackAcceptor & operator=(const LoopbackAcceptor &);
+
+	void BarrierDone(StopDoneHandle h);
+
+	const size_t ringSize_;
+	uint64_t key_;
+	AcceptDoneHandle h_;
+	bool isAccepting_;
+	bool isStopping_;		// stopped while connects were notifying us
+	uint32_t nrefs_;		// connects notifying us, stop waits for them
+	StopDoneHandle stopHandle_;
+};
+
+//........................................................................... LoopbackConnector ....
+
+/**
+ * @class LoopbackConnector
+ *
+ * Connects to a LoopbackAcceptor listening on the remote address. Fails right away with -1 if
+ * there is none, as a refused connection would.
+ */
+class LoopbackConnector : public CompletionHandle, public UnicastConnector
+{
+public:
+
+	using This = LoopbackConnector;
+
+	using UnicastConnector::ConnectDoneHandle;
+	using UnicastConnector::StopDoneHandle;
+
+	LoopbackConnector() {}
+	virtual ~LoopbackConnector() {}
+
+	virtual int Connect(const SocketAddress & addr, const ConnectDoneHandle & h) override;
+	virtual int Stop(const StopDoneHandle & h) override;
+
+private:
+
+	LoopbackConnector(const LoopbackConnector &);
+	LoopbackConnector & operator=(const LoopbackConnector &);
+
+	void BarrierDone(StopDoneHandle h);
+};
+
+}
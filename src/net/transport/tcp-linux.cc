@@ -6,23 +6,31 @@ using namespace bblocks;
 
 //.................................................................................. TCPChannel ....
 
-TCPChannel::TCPChannel(const string & name, int fd, FdPoll & epoll)
-	: name_(name)
-	, lock_(name_)
-	, fd_(fd)
+static const string _log("/tcp/ch");
+
+void
+TCPChannel::Reserve(const size_t n)
+{
+	ObjectPool<TCPChannel>::Instance().Reserve(n);
+}
+
+bool
+TCPChannel::IsIdle()
+{
+	Guard _(&lock_);
+	return !rctx_ && wpending_.IsEmpty();
+}
+
+TCPChannel::TCPChannel(int fd, FdPoll & epoll)
+	: fd_(fd)
+	, isStopped_(false)
 	, epoll_(epoll)
-	/* Perf Counters */
-	, statReadSize_("stat/read-io", "bytes", PerfCounter::BYTES)
-	, statWriteSize_("stat/write-io", "bytes", PerfCounter::BYTES)
+	, rctx_(NULL)
+	, coalesce_(NULL)
+	, aborts_(this)
 {
 	ASSERT(fd_ >= 0);
 
-	INFO(name_) << "TCP send buffer size is " << SocketOptions::GetTcpRcvBuffer(fd_) << " B";
-	INFO(name_) << "TCP receive buffer size is "
-		    << SocketOptions::GetTcpSendBuffer(fd_) << " B";
-	INFO(name_) << "TCP no delay is "
-		    << (SocketOptions::GetTcpNoDelay(fd_) ? "enabled" : "disabled");
-
 	const bool ok= epoll_.Add(fd_, EPOLLIN | EPOLLOUT | EPOLLET,
 				  intr_fn(this, &TCPChannel::HandleFdEvent));
 	INVARIANT(ok);
@@ -30,71 +38,277 @@ TCPChannel::TCPChannel(const string & name, int fd, FdPoll & epoll)
 
 TCPChannel::~TCPChannel()
 {
-    VERBOSE(name_) << statReadSize_;
-    VERBOSE(name_) << statWriteSize_;
+	Guard _(&lock_);
+
+	/*
+	 * Stop failed our ops and its handle came back with the last timer or abort, there is
+	 * nothing left that could reach us
+	 */
+	INVARIANT(isStopped_);
+	INVARIANT(aborts_.IsIdle());
+	INVARIANT(!rctx_ && wpending_.IsEmpty());
+	INVARIANT(!coalesce_ || !coalesce_->isTimerArmed_);
+
+	delete coalesce_;
 }
 
 int
 TCPChannel::Write(IOBuffer & buf, const WriteDoneHandle & h)
+{
+	return Write(buf, h, OpCtl());
+}
+
+int
+TCPChannel::Write(IOBuffer & buf, const WriteDoneHandle & h, const OpCtl & ctl)
 {
 	ASSERT(buf);
 
 	Guard _(&lock_);
 
-	if (wpending_.empty()) {
+	if (MemAccount::IsOverHard(MemAccount::TRANSPORT)) {
+		/*
+		 * Push back on the writer until the backlogs drain. Checked under the lock, so the
+		 * write is refused after the writes queued before it and they still go out.
+		 */
+		return NOMEM;
+	}
+
+	const bool isIdle = wpending_.IsEmpty();
+
+	WriteCtx * w = new WriteCtx(buf, h);
+
+	if (!aborts_.Arm(w, ctl)) {
+		delete w;
+		return CANCELLED;
+	}
+
+	wpending_.Push(w);
+
+	if (coalesce_) {
+		/*
+		 * Hold the write until the batch is full or the timer fires
+		 */
+		coalesce_->bytes_ += buf.Size();
+
+		if (coalesce_->bytes_ >= coalesce_->opts_.maxBytes_) {
+			FlushLocked();
+		} else if (coalesce_->opts_.maxDelayMs_ && !coalesce_->isTimerArmed_) {
+			coalesce_->isTimerArmed_ = true;
+			aborts_.GetRef();
+			BBlocks::ScheduleIn(coalesce_->opts_.maxDelayMs_, this, &This::FlushTimer,
+					    /*nonce=*/ 0);
+		}
+
+		return 0;
+	}
+
+	if (isIdle) {
 		/*
 		 * There is no backlog, trying writing synchronously
 		 */
-		 wpending_.push_back(WriteCtx(buf, h));
 		 return WriteDataToSocket(/*isasync=*/ false);
 	}
 
-	wpending_.push_back(WriteCtx(buf, h));
-
 	/*
-	 * Kick fd handler to write data out
+	 * Kick the backlog out
 	 */
-	HandleFdEvent(fd_, EPOLLOUT);
+	WriteDataToSocket(/*isasync=*/ true);
 
 	return 0;
 }
 
+void
+TCPChannel::EnableCoalescing(const CoalesceOptions & opts)
+{
+	Guard _(&lock_);
+
+	INVARIANT(!coalesce_);
+	coalesce_ = new CoalesceCtx(opts);
+
+	if (opts.cork_ && !SocketOptions::SetTcpCork(fd_, /*enable=*/ true)) {
+		ERROR(_log) << "Error setting TCP_CORK. fd=" << fd_ << " " << strerror(errno);
+	}
+
+	if (opts.notSentLowat_
+	    && !SocketOptions::SetTcpNotSentLowat(fd_, opts.notSentLowat_)) {
+		ERROR(_log) << "Error setting TCP_NOTSENT_LOWAT. fd=" << fd_ << " "
+			    << strerror(errno);
+	}
+}
+
+int
+TCPChannel::Flush()
+{
+	Guard _(&lock_);
+	return FlushLocked();
+}
+
+int
+TCPChannel::FlushLocked()
+{
+	ASSERT(lock_.IsOwner());
+
+	if (!coalesce_) {
+		/*
+		 * Nothing is held back
+		 */
+		return 0;
+	}
+
+	coalesce_->bytes_ = 0;
+
+	const int status = WriteDataToSocket(/*isasync=*/ true);
+
+	if (coalesce_->opts_.cork_) {
+		/*
+		 * Pull the cork to push out the partial segment and put it back
+		 */
+		SocketOptions::SetTcpCork(fd_, /*enable=*/ false);
+		SocketOptions::SetTcpCork(fd_, /*enable=*/ true);
+	}
+
+	return status;
+}
+
+void
+TCPChannel::FlushTimer(int)
+{
+	StopDoneHandle * h = NULL;
+
+	{
+		Guard _(&lock_);
+
+		ASSERT(coalesce_ && coalesce_->isTimerArmed_);
+		coalesce_->isTimerArmed_ = false;
+
+		if (!aborts_.IsStopping()) {
+			FlushLocked();
+		}
+
+		h = aborts_.PutStopRef();
+	}
+
+	aborts_t::StopDone(h);
+}
+
 int
 TCPChannel::Read(IOBuffer & data, const ReadDoneHandle & h)
 {
-	return Read(data, h, /*peek=*/ false);
+	return Read(data, h, /*peek=*/ false, OpCtl());
+}
+
+int
+TCPChannel::Read(IOBuffer & data, const ReadDoneHandle & h, const OpCtl & ctl)
+{
+	return Read(data, h, /*peek=*/ false, ctl);
 }
 
 int
 TCPChannel::Peek(IOBuffer & data, const ReadDoneHandle & h)
 {
-	return Read(data, h, /*peek=*/ true);
+	return Read(data, h, /*peek=*/ true, OpCtl());
 }
 
 int
-TCPChannel::Read(const IOBuffer & data, const ReadDoneHandle & h, const bool peek)
+TCPChannel::Read(const IOBuffer & data, const ReadDoneHandle & h, const bool peek,
+		 const OpCtl & ctl)
 {
 	ASSERT(data);
 
 	Guard _(&lock_);
 
-	INVARIANT(!rpending_.buf_ && !rpending_.bytesRead_);
-    
-	rpending_ = ReadCtx(data, h, peek);
+	INVARIANT(!rctx_);
+
+	ReadCtx * r = new ReadCtx(data, h, peek);
+
+	if (!aborts_.Arm(r, ctl)) {
+		delete r;
+		return CANCELLED;
+	}
+
+	rctx_ = r;
 
 	return ReadDataFromSocket(/*isasync=*/ false);
 }
 
+//............................................................................. Deadline/Cancel ....
+
+void
+TCPChannel::AbortOp(aborts_t::Timer * t, uint64_t id, int status)
+{
+	StopDoneHandle * h = NULL;
+
+	{
+		Guard _(&lock_);
+
+		aborts_t::Op * op = aborts_t::Find(id, rctx_, wpending_);
+		aborts_t::TimerFired(op, t);
+
+		if (!op) {
+			/*
+			 * Op completed before the abort got here
+			 */
+		} else if (op == rctx_) {
+			rctx_->h_.Wakeup(status, rctx_->buf_);
+			ReadDone();
+		} else {
+			WriteCtx * w = static_cast<WriteCtx *>(op);
+
+			if (!w->isStarted_) {
+				const bool ok = wpending_.Remove(w);
+				INVARIANT(ok);
+
+				if (coalesce_) {
+					ASSERT(coalesce_->bytes_ >= w->buf_.Size());
+					coalesce_->bytes_ -= w->buf_.Size();
+				}
+
+				w->h_.Wakeup(status, w->buf_);
+				aborts_.Disarm(w);
+				delete w;
+			}
+
+			/*
+			 * A write that is partially out can not be pulled back without breaking the
+			 * stream, it runs to completion
+			 */
+		}
+
+		h = aborts_.PutStopRef();
+	}
+
+	aborts_t::StopDone(h);
+}
+
 int
 TCPChannel::Stop(const StopDoneHandle & h)
 {
 	ASSERT(h)
 
+	{
+		/*
+		 * Send out held writes. The flush timer checks for the stop under the lock, it
+		 * flushes no more once it sees it.
+		 */
+		Guard _(&lock_);
+
+		INVARIANT(!isStopped_);
+
+		isStopped_ = true;
+		aborts_.Park(h);
+
+		FlushLocked();
+	}
+
 	const bool status = epoll_.Remove(fd_);
 	INVARIANT(status);
 
-	INVARIANT(!stoph_);
-	stoph_ = h;
+	/*
+	 * The barrier covers the pool threads only, an event the poller picked up before the
+	 * remove could still reach HandleFdEvent once the channel is gone. The fd stays open till
+	 * BarrierDone.
+	 */
+	epoll_.Drain(fd_);
 
 	BBlocks::ScheduleBarrier(this, &TCPChannel::BarrierDone, /*nonce=*/ 0);
 
@@ -104,27 +318,35 @@ TCPChannel::Stop(const StopDoneHandle & h)
 void
 TCPChannel::BarrierDone(int)
 {
+	StopDoneHandle * h = NULL;
+
 	{
 		Guard _(&lock_);
 
 		Close();
 		FailOps();
 
-		INVARIANT(wpending_.empty());
-		INVARIANT(!rpending_.h_);
+		INVARIANT(wpending_.IsEmpty());
+		INVARIANT(!rctx_);
+
+		/*
+		 * If timers or aborts are in flight the last of them completes the stop
+		 */
+		h = aborts_.PutStopRef();
 	}
 
-	stoph_.Wakeup(/*status=*/ 0);
-	stoph_ = NULL;
+	aborts_t::StopDone(h);
 }
 
 void
 TCPChannel::Close()
 {
-	DEBUG(name_) << "Closing channel " << fd_;
+	DEBUG(_log) << "Closing channel " << fd_;
 
 	::shutdown(fd_, SHUT_RDWR);
 	::close(fd_);
+
+	fd_ = -1;
 }
 
 void
@@ -133,7 +355,7 @@ TCPChannel::HandleFdEvent(int fd, uint32_t events)
 	ASSERT(fd == fd_);
 	ASSERT(!(events & ~(EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR)));
 
-	DEBUG(name_) << "Epoll Notification: fd=" << fd_ << " events:" << events;
+	DEBUG(_log) << "Epoll Notification: fd=" << fd_ << " events:" << events;
 
 	Guard _(&lock_);
 
@@ -154,20 +376,33 @@ TCPChannel::HandleFdEvent(int fd, uint32_t events)
 	}
 }
 
+void
+TCPChannel::ReadDone()
+{
+	ASSERT(lock_.IsOwner());
+	ASSERT(rctx_);
+
+	aborts_.Disarm(rctx_);
+	delete rctx_;
+	rctx_ = NULL;
+}
+
 void
 TCPChannel::FailOps()
 {
 	ASSERT(lock_.IsOwner());
 
-	if (rpending_.h_) {
-		rpending_.h_.Wakeup(/*status=*/ -1, rpending_.buf_);
-		rpending_.Reset();
+	if (rctx_) {
+		rctx_->h_.Wakeup(/*status=*/ -1, rctx_->buf_);
+		ReadDone();
 	}
 
-	for (auto w : wpending_) {
-		w.h_.Wakeup(/*status=*/ -1, w.buf_);
+	while (!wpending_.IsEmpty()) {
+		WriteCtx * w = wpending_.Pop();
+		w->h_.Wakeup(/*status=*/ -1, w->buf_);
+		aborts_.Disarm(w);
+		delete w;
 	}
-	wpending_.clear();
 }
 
 int
@@ -175,18 +410,17 @@ TCPChannel::ReadDataFromSocket(const bool isasync)
 {
 	INVARIANT(lock_.IsOwner());
 
-	if (!rpending_.buf_) {
-		INVARIANT(!rpending_.bytesRead_);
+	if (!rctx_) {
 		return -1;
 	}
 
 	while (true)
 	{
-		ASSERT(rpending_.bytesRead_ < rpending_.buf_.Size());
-		uint8_t * p = rpending_.buf_.Ptr() + rpending_.bytesRead_;
-		size_t size = rpending_.buf_.Size() - rpending_.bytesRead_;
+		ASSERT(rctx_->bytesRead_ < rctx_->buf_.Size());
+		uint8_t * p = rctx_->buf_.Ptr() + rctx_->bytesRead_;
+		size_t size = rctx_->buf_.Size() - rctx_->bytesRead_;
 
-		int status = recv(fd_, p, size, rpending_.isPeek_ ? MSG_PEEK : 0);
+		int status = recv(fd_, p, size, rctx_->isPeek_ ? MSG_PEEK : 0);
 
 		if (status == -1) {
 			if (errno == EAGAIN) {
@@ -196,19 +430,22 @@ TCPChannel::ReadDataFromSocket(const bool isasync)
 				return false;
 			}
 
-			ERROR(name_) << "Error reading from socket. " << strerror(errno);
+			ERROR(_log) << "Error reading from socket. fd=" << fd_ << " "
+				    << strerror(errno);
 
 			/*
 			 * notify error and return
 			 */
 			if (isasync) {
-				rpending_.h_.Wakeup(/*status=*/ -1, IOBuffer());
+				rctx_->h_.Wakeup(/*status=*/ -1, IOBuffer());
 			}
 
+			ReadDone();
+
 			return -1;
 		}
 
-		statReadSize_.Update(status);
+		epoll_.statReadSize_.Update(status);
 
 		if (status == 0) {
 			/*
@@ -218,26 +455,26 @@ TCPChannel::ReadDataFromSocket(const bool isasync)
 		}
 
 		DEFENSIVE_CHECK(status);
-		DEFENSIVE_CHECK(rpending_.bytesRead_ + status <= rpending_.buf_.Size());
+		DEFENSIVE_CHECK(rctx_->bytesRead_ + status <= rctx_->buf_.Size());
 
-		rpending_.bytesRead_ += status;
+		rctx_->bytesRead_ += status;
 
-		if (rpending_.bytesRead_ == rpending_.buf_.Size()) {
+		if (rctx_->bytesRead_ == rctx_->buf_.Size()) {
 			if (isasync) {
-				rpending_.h_.Wakeup((int) rpending_.bytesRead_, rpending_.buf_);
+				rctx_->h_.Wakeup((int) rctx_->bytesRead_, rctx_->buf_);
 			}
 
-			int retstatus = rpending_.bytesRead_;
+			int retstatus = rctx_->bytesRead_;
 
-			rpending_.Reset();
+			ReadDone();
 
 			return retstatus;
 		}
 	}
 
-	INVARIANT(rpending_.buf_);
+	INVARIANT(rctx_->buf_);
 
-	return rpending_.bytesRead_;
+	return rctx_->bytesRead_;
 }
 
 int
@@ -248,27 +485,21 @@ TCPChannel::WriteDataToSocket(const bool isasync)
 	int bytesWritten = 0;
 
 	while (true) {
-		if (wpending_.empty()) {
+		if (wpending_.IsEmpty()) {
 			/*
 			 * nothing to write
 			 */
 			break;
 		}
 
-		unsigned int iovlen = wpending_.size() > IOV_MAX ? IOV_MAX : wpending_.size();
+		unsigned int iovlen = wpending_.Size() > IOV_MAX ? IOV_MAX : wpending_.Size();
 		iovec iovecs[iovlen];
 
 		unsigned int i = 0;
-		for (auto it = wpending_.begin(); it != wpending_.end(); ++it) {
-			IOBuffer & data = it->buf_;
-			iovecs[i].iov_base = data.Ptr();
-			iovecs[i].iov_len = data.Size();
-
+		for (WriteCtx * w = wpending_.Front(); w && i < iovlen; w = w->snext_) {
+			iovecs[i].iov_base = w->buf_.Ptr();
+			iovecs[i].iov_len = w->buf_.Size();
 			++i;
-
-			if (i >= iovlen) {
-				break;
-			}
 		}
 
 		/*
@@ -284,20 +515,21 @@ TCPChannel::WriteDataToSocket(const bool isasync)
 				continue;
 			}
 
-			ERROR(name_) << "Error writing. " << strerror(errno);
+			ERROR(_log) << "Error writing. fd=" << fd_ << " " << strerror(errno);
 
 			/*
 			 * notify error to client
 			 */
 			if (isasync) {
-				WriteCtx & wctx = wpending_.front();
-				wctx.h_.Wakeup(/*status=*/ -1, wctx.buf_);
+				WriteCtx * w = wpending_.Front();
+				w->h_.Wakeup(/*status=*/ -1, w->buf_);
 			}
 
 			return -1;
 		}
 
-		statWriteSize_.Update(status);
+		epoll_.statWriteSize_.Update(status);
+		epoll_.statWriteBatch_.Update(iovlen);
 
 		if (status == 0) {
 		    /*
@@ -313,26 +545,33 @@ TCPChannel::WriteDataToSocket(const bool isasync)
 		 */
 		uint32_t bytes = status;
 		while (true) {
-			ASSERT(!wpending_.empty());
+			ASSERT(!wpending_.IsEmpty());
 
-			if (bytes >= wpending_.front().buf_.Size()) {
-				WriteCtx wctx = wpending_.front();
-				wpending_.pop_front();
-				bytes -= wctx.buf_.Size();
+			if (bytes >= wpending_.Front()->buf_.Size()) {
+				WriteCtx * w = wpending_.Pop();
+				bytes -= w->buf_.Size();
 
 				if (isasync) {
-					wctx.h_.Wakeup(wctx.buf_.Size(), wctx.buf_);
+					w->h_.Wakeup(w->buf_.Size(), w->buf_);
 				}
 
+				aborts_.Disarm(w);
+				delete w;
+
 				if (bytes == 0) break;
 			} else {
-				wpending_.front().buf_.Cut(bytes);
+				wpending_.Front()->buf_.Cut(bytes);
+				wpending_.Front()->isStarted_ = true;
 				bytes = 0;
 				break;
 			}
 		}
 	}
 
+	if (coalesce_ && wpending_.IsEmpty()) {
+		coalesce_->bytes_ = 0;
+	}
+
 	return bytesWritten;
 }
 
@@ -361,6 +600,17 @@ TCPServer::Accept(const SocketAddress & addr, const AcceptDoneHandle & h)
 	    return -1;
 	}
 
+	/*
+	 * Short lived connections leave the port in TIME_WAIT, do not let that block a restart
+	 */
+	const int enable = 1;
+	status = setsockopt(sockfd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+	if (status != 0) {
+	    ERROR(name_) << "Socket error." << strerror(errno);
+	    return -1;
+	}
+
 	status = ::bind(sockfd_, (struct sockaddr *) &saddr, sizeof(sockaddr_in));
 
 	if (status != 0) {
@@ -401,43 +651,132 @@ TCPServer::HandleFdEvent(int fd, uint32_t events)
 	INVARIANT(events == EPOLLIN);
 	INVARIANT(fd == sockfd_);
 
-	sockaddr_in addr;
-	socklen_t len = sizeof(sockaddr_in);
-	memset(&addr, 0, len);
-
-	int clientfd = accept4(sockfd_, (sockaddr *) &addr, &len, SOCK_NONBLOCK);
-	if (clientfd == -1) {
+	if (isStopped_) {
 		/*
-		 * error accepting connection, return error to client
+		 * Picked up before Stop removed the socket, Stop waits for us to leave
 		 */
-		ERROR(name_) << "Error accepting client connection. " << strerror(errno);
-		h_.Wakeup(/*status=*/ -1, static_cast<UnicastTransportChannel *>(NULL));
 		return;
 	}
 
-	DEFENSIVE_CHECK(clientfd != -1);
-
 	/*
-	 * Accepted. Create a channel object and return to client
+	 * Drain the backlog in batches. The listening socket is level triggered, so anything left
+	 * behind is notified again.
 	 */
-	UnicastTransportChannel * ch = new TCPChannel(name(clientfd), clientfd, epoll_);
-	INVARIANT(ch);
+	for (size_t i = 0; i < MAX_ACCEPT_BATCH; ++i) {
+		if (BBlocks::IsSaturated()) {
+			/*
+			 * A new connection is only more work the pool can not take, leave it in
+			 * the backlog
+			 */
+			PauseAccept();
+			return;
+		}
+
+		int clientfd = accept4(sockfd_, /*addr=*/ NULL, /*len=*/ NULL, SOCK_NONBLOCK);
+
+		if (clientfd == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/*
+				 * backlog is drained
+				 */
+				return;
+			}
+
+			if (errno == EINTR || errno == ECONNABORTED) {
+				/*
+				 * transient, try the next connection
+				 */
+				continue;
+			}
+
+			/*
+			 * error accepting connection, return error to client
+			 */
+			ERROR(name_) << "Error accepting client connection. " << strerror(errno);
+			h_.Wakeup(/*status=*/ -1, static_cast<UnicastTransportChannel *>(NULL));
+			return;
+		}
+
+		/*
+		 * Accepted. Create a channel object and return to client
+		 */
+		UnicastTransportChannel * ch = new TCPChannel(clientfd, epoll_);
+		INVARIANT(ch);
 
-	h_.Wakeup(/*status=*/ 0, ch);
+		h_.Wakeup(/*status=*/ 0, ch);
 
-	DEBUG(name_) << "Accepted. clientfd=" << clientfd;
+		DEBUG(name_) << "Accepted. clientfd=" << clientfd;
+	}
+}
+
+void
+TCPServer::PauseAccept()
+{
+	ASSERT(!isPaused_);
+
+	const bool ok = epoll_.RemoveEvent(sockfd_, EPOLLIN);
+	INVARIANT(ok);
+
+	isPaused_ = true;
+	BBlocks::ScheduleIn(ACCEPT_BACKOFF_MS, &resume_);
+
+	DEBUG(name_) << "Thread pool saturated, paused accepting";
+}
+
+void
+TCPServer::ResumeAccept()
+{
+	Guard _(&lock_);
+
+	INVARIANT(isPaused_);
+	isPaused_ = false;
+
+	if (isStopping_) {
+		/*
+		 * Stop could not cancel us, complete it
+		 */
+		BBlocks::Schedule(this, &This::BarrierDone, stopHandle_);
+		return;
+	}
+
+	if (isStopped_) {
+		/*
+		 * Stop is on its way, the socket is no longer ours to rearm. Stop sees we are
+		 * not paused and completes itself.
+		 */
+		return;
+	}
+
+	const bool ok = epoll_.AddEvent(sockfd_, EPOLLIN);
+	INVARIANT(ok);
+
+	DEBUG(name_) << "Resumed accepting";
 }
 
 int
 TCPServer::Stop(const StopDoneHandle & h)
 {
-	Guard _(&lock_);
+	{
+		Guard _(&lock_);
+
+		INVARIANT(!isStopped_);
+		isStopped_ = true;
+
+		/*
+		 * unregister from epoll so no new connections are delivered
+		 */
+		const bool ok = epoll_.Remove(sockfd_);
+		INVARIANT(ok);
+	}
 
 	/*
-	 * unregister from epoll so no new connections are delivered
+	 * An event the poller picked up before the remove may be waiting for the lock in
+	 * HandleFdEvent, it backs off once it sees the stop. Wait for it to leave before the socket
+	 * is closed, outside the lock it waits for.
 	 */
-	const bool ok = epoll_.Remove(sockfd_);
-	INVARIANT(ok);
+	epoll_.Drain(sockfd_);
+
+	Guard _(&lock_);
 
 	/*
 	 * Tear down the socket safely
@@ -445,6 +784,17 @@ TCPServer::Stop(const StopDoneHandle & h)
 	::shutdown(sockfd_, SHUT_RDWR);
 	::close(sockfd_);
 
+	if (isPaused_ && !BBlocks::CancelTimer(&resume_)) {
+		/*
+		 * Resume is on its way to run, it completes the stop
+		 */
+		isStopping_ = true;
+		stopHandle_ = h;
+		return 0;
+	}
+
+	isPaused_ = false;
+
 	/*
 	 * Drain pending notifictions
 	 */
@@ -485,14 +835,10 @@ TCPConnector::Connect(const SocketAddress & addr, const ConnectDoneHandle & h)
 	status = connect(fd, (sockaddr *) &addr.RemoteAddr(), sizeof(sockaddr_in));
 	INVARIANT(status == -1 && errno == EINPROGRESS);
 
-	{
-		Guard _(&lock_);
-		INVARIANT(pendingConnects_.find(fd) == pendingConnects_.end());
-		const bool ok = pendingConnects_.insert(make_pair(fd, h)).second;
-		INVARIANT(ok);
-	}
+	bool ok = pendingConnects_.Insert(fd, h);
+	INVARIANT(ok);
 
-	const bool ok = epoll_.Add(fd, EPOLLOUT, intr_fn(this, &TCPConnector::HandleFdEvent));
+	ok = epoll_.Add(fd, EPOLLOUT, intr_fn(this, &TCPConnector::HandleFdEvent));
 	INVARIANT(ok);
 
 	return 0;
@@ -501,7 +847,7 @@ TCPConnector::Connect(const SocketAddress & addr, const ConnectDoneHandle & h)
 void
 TCPConnector::HandleFdEvent(int fd, uint32_t events)
 {
-	INFO(name_) << "connected: events=" << events << " fd=" << fd;
+	DEBUG(name_) << "connected: events=" << events << " fd=" << fd;
 
 	/*
 	 * Remove the connector from polling list
@@ -514,13 +860,11 @@ TCPConnector::HandleFdEvent(int fd, uint32_t events)
 	 */
 	ConnectDoneHandle h;
 
-	{
-		Guard _(&lock_);
-
-		auto it = pendingConnects_.find(fd);
-		INVARIANT(it != pendingConnects_.end());
-		h = it->second;
-		pendingConnects_.erase(it);
+	if (!pendingConnects_.Erase(fd, h)) {
+		/*
+		 * Stop got to it first and fails the connect
+		 */
+		return;
 	}
 
 	/*
@@ -532,7 +876,7 @@ TCPConnector::HandleFdEvent(int fd, uint32_t events)
 		 */
 		DEBUG(name_) << "TCP Client connected. fd=" << fd;
 
-		TCPChannel * ch = new TCPChannel("/tcp/ch/" + STR(fd), fd, epoll_);
+		TCPChannel * ch = new TCPChannel(fd, epoll_);
 		h.Wakeup(/*status=*/ 0, ch); 
 		return;
 	}
@@ -547,17 +891,24 @@ TCPConnector::HandleFdEvent(int fd, uint32_t events)
 	h.Wakeup(/*status=*/ -1, /*ch=*/ NULL);
 }
 
+vector<fd_t>
+TCPConnector::PendingFds() const
+{
+	vector<fd_t> fds;
+	pendingConnects_.ForEach([&fds](const fd_t fd, const ConnectDoneHandle &) {
+		fds.push_back(fd);
+	});
+
+	return fds;
+}
+
 int
 TCPConnector::Stop(const StopDoneHandle & h)
 {
-	Guard _(&lock_);
-
 	/*
 	 * Unplug from epoll
 	 */
-	for (auto conn : pendingConnects_) {
-		const int & fd = conn.first;
-
+	for (auto fd : PendingFds()) {
 		/*
 		 * remove client from epoll
 		 */
@@ -582,18 +933,16 @@ TCPConnector::Stop(const StopDoneHandle & h)
 void
 TCPConnector::BarrierDone(StopDoneHandle h)
 {
-	Guard _(&lock_);
-
 	/*
 	 * Notify error to all pending connects
 	 */
-	 for (auto conn : pendingConnects_) {
-		ConnectDoneHandle & connh = conn.second;
-		connh.Wakeup(/*status=*/ -1, /*ch=*/ NULL);
-	 }
-
-	 pendingConnects_.clear();
+	for (auto fd : PendingFds()) {
+		ConnectDoneHandle connh;
+		if (pendingConnects_.Erase(fd, connh)) {
+			connh.Wakeup(/*status=*/ -1, /*ch=*/ NULL);
+		}
+	}
 
-	 h.Wakeup(/*status=*/ 0);
+	h.Wakeup(/*status=*/ 0);
 }
 
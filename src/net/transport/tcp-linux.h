@@ -15,8 +15,12 @@
 #include "net/epoll/epoll.h"
 #include "net/fdpoll.h"
 #include "buf/buffer.h"
+#include "buf/object-pool.h"
 #include "perf/perf-counter.h"
 #include "net/transport.h"
+#include "ds/inslist.hpp"
+#include "ds/concurrent-map.hpp"
+#include "schd/op-aborts.hpp"
 
 namespace bblocks {
 
@@ -24,13 +28,25 @@ namespace bblocks {
 
 /**
  * @class TCPChannel
+ *
+ * Servers may hold a very large number of mostly idle channels, so the channel is kept small.
+ * State for an operation is allocated when the operation is issued and released on completion,
+ * IO stats are accounted to the poller and the lock is a plain spin lock.
+ *
+ * Channel and op objects are recycled through ObjectPool, which TCPServer fills up front with
+ * channels, so a burst of short lived connections does not go to the allocator.
+ *
+ * A channel may only be deleted after its Stop handler has run. The stop waits for the deadline
+ * timers, aborts and the flush timer in flight, so none of them reaches a deleted channel.
  */
-class TCPChannel : public CompletionHandle, public UnicastTransportChannel
+class TCPChannel : public CompletionHandle, public UnicastTransportChannel,
+		   public PoolObject<TCPChannel>
 {
 public:
 
 	friend class TCPConnector;
 	friend class TCPServer;
+	friend class OpAborts<TCPChannel>;
 
 	using This = TCPChannel;
 
@@ -38,26 +54,71 @@ public:
 	using UnicastTransportChannel::WriteDoneHandle;
 	using UnicastTransportChannel::StopDoneHandle;
 
-	explicit TCPChannel(const string & name, int fd, FdPoll & epoll);
+	explicit TCPChannel(int fd, FdPoll & epoll);
 	virtual ~TCPChannel();
 
 	virtual int Peek(IOBuffer & data, const ReadDoneHandle & h) override;
 	virtual int Read(IOBuffer & buf, const ReadDoneHandle & h) override;
+	virtual int Read(IOBuffer & buf, const ReadDoneHandle & h, const OpCtl & ctl) override;
 	virtual int Write(IOBuffer & buf, const WriteDoneHandle & h) override;
+	virtual int Write(IOBuffer & buf, const WriteDoneHandle & h, const OpCtl & ctl) override;
 	virtual int Stop(const StopDoneHandle & cb) override;
 
+	/**
+	 * Options for write coalescing
+	 */
+	struct CoalesceOptions
+	{
+		CoalesceOptions(const size_t maxBytes = 16 * 1024, const uint32_t maxDelayMs = 1,
+				const bool cork = false, const uint32_t notSentLowat = 0)
+			: maxBytes_(maxBytes)
+			, maxDelayMs_(maxDelayMs)
+			, cork_(cork)
+			, notSentLowat_(notSentLowat)
+		{}
+
+		size_t maxBytes_;	// flush once this many bytes are held
+		uint32_t maxDelayMs_;	// flush this long after a write is held, 0 waits for Flush
+		bool cork_;		// hold partial segments in the kernel with TCP_CORK
+		uint32_t notSentLowat_;	// TCP_NOTSENT_LOWAT in bytes, 0 keeps the default
+	};
+
+	/**
+	 * Hold writes and send them out in batches, once maxBytes_ are held, maxDelayMs_ after the
+	 * first held write or on Flush, whichever comes first. In this mode Write returns 0 and all
+	 * writes complete through their handle. Held writes are flushed on Stop.
+	 */
+	void EnableCoalescing(const CoalesceOptions & opts);
+
+	/**
+	 * Send out held writes
+	 *
+	 * @return  bytes written
+	 */
+	int Flush();
+
+	/**
+	 * Preallocate n channel objects into the pool
+	 */
+	static void Reserve(const size_t n);
+
+	/**
+	 * No read or write is in flight, the channel holds no op state
+	 */
+	bool IsIdle();
+
     private:
 
 	__DISABLE_ASSIGN_AND_COPY__(TCPChannel)
 	__STATELESS_ASYNC_PROCESSOR__
 
+	typedef OpAborts<TCPChannel> aborts_t;
+
 	/**
 	 * represent read operation context
 	 */
-	struct ReadCtx
+	struct ReadCtx : aborts_t::Op, PoolObject<ReadCtx>
 	{
-		ReadCtx() : bytesRead_(0) {}
-
 		ReadCtx(const IOBuffer & buf, const ReadDoneHandle & h, const bool isPeek)
 			: buf_(buf)
 			, bytesRead_(0)
@@ -65,13 +126,6 @@ public:
 			, isPeek_(isPeek)
 		{}
 
-		void Reset()
-		{
-			buf_.Reset();
-			bytesRead_ = 0;
-			h_ = NULL;
-		}
-
 		IOBuffer buf_;
 		uint32_t bytesRead_;
 		ReadDoneHandle h_;
@@ -79,41 +133,64 @@ public:
 	};
 
 	/**
-	 * Represent write operation
+	 * Write coalescing state
 	 */
-	struct WriteCtx
+	struct CoalesceCtx
 	{
-		WriteCtx() {}
+		CoalesceCtx(const CoalesceOptions & opts)
+			: opts_(opts), bytes_(0), isTimerArmed_(false)
+		{}
+
+		const CoalesceOptions opts_;
+		size_t bytes_;
+		bool isTimerArmed_;
+	};
 
+	/**
+	 * Represent write operation
+	 */
+	struct WriteCtx : InSListElement<WriteCtx>, aborts_t::Op, PoolObject<WriteCtx>
+	{
 		WriteCtx(const IOBuffer & buf, const WriteDoneHandle & h)
-		    : buf_(buf), h_(h)
+		    : buf_(buf), h_(h), isStarted_(false)
+		    , charged_(sizeof(WriteCtx) + buf.Size())
 		{
 			ASSERT(buf);
+			MemAccount::Charge(MemAccount::TRANSPORT, charged_);
+		}
+
+		~WriteCtx()
+		{
+			MemAccount::Release(MemAccount::TRANSPORT, charged_);
 		}
 
 		IOBuffer buf_;
 		WriteDoneHandle h_;
+		bool isStarted_;	// part of the buffer has gone out
+		const size_t charged_;	// bytes accounted to the transport
 	};
 
-	int Read(const IOBuffer & buf, const ReadDoneHandle & h, const bool peek);
+	int Read(const IOBuffer & buf, const ReadDoneHandle & h, const bool peek,
+		 const OpCtl & ctl);
+	void AbortOp(aborts_t::Timer * t, uint64_t id, int status);
 	void HandleFdEvent(int fd, uint32_t events) __intr_fn__;
 	int ReadDataFromSocket(const bool isasync);
 	int WriteDataToSocket(const bool isasync);
 	void BarrierDone(int);
+	void FlushTimer(int);
+	int FlushLocked();
+	void ReadDone();
 	void FailOps();
 	void Close();
 
-
-	const string name_;
-	SpinMutex lock_;
+	SpinLock lock_;
 	int fd_;
+	bool isStopped_;		// Stop was called, sits in the padding after fd_
 	FdPoll & epoll_;
-	list<WriteCtx> wpending_;
-	ReadCtx rpending_;
-	StopDoneHandle stoph_;
-
-	PerfCounter statReadSize_;
-	PerfCounter statWriteSize_;
+	ReadCtx * rctx_;		// pending read, if any
+	InSQueue<WriteCtx> wpending_;	// pending writes
+	CoalesceCtx * coalesce_;	// write coalescing, if enabled
+	aborts_t aborts_;		// deadlines, cancellations and the pending stop
 };
 
 //................................................................................... TCPServer ....
@@ -135,9 +212,16 @@ public:
 	using UnicastAcceptor::AcceptDoneHandle;
 	using UnicastAcceptor::StopDoneHandle;
 
-	TCPServer(FdPoll & epoll)
-		: name_(name()), lock_(name_), epoll_(epoll)
-	{}
+	/**
+	 * @param	nprealloc	Channels to preallocate for accept bursts. The channel pool
+	 *				is shared by the process and keeps them, so it is opt in.
+	 */
+	TCPServer(FdPoll & epoll, const size_t nprealloc = 0)
+		: name_(name()), lock_(name_), epoll_(epoll), resume_(this)
+		, isPaused_(false), isStopped_(false), isStopping_(false)
+	{
+		TCPChannel::Reserve(nprealloc);
+	}
 
 	virtual ~TCPServer() {}
 
@@ -145,6 +229,10 @@ public:
 	 * Accept --> epoll.Add(fd, event) --> kernel
 	 * kernel --> epoll --> HandleFdEvent *--> AcceptDoneHandle
 	 * Stop *--> BarrierDone *--> StopDoneHandle 
+	 *
+	 * While the thread pool is saturated the server stops accepting. New connections wait in
+	 * the kernel backlog and accepting resumes ACCEPT_BACKOFF_MS later.
+	 * HandleFdEvent --> epoll.RemoveEvent --> (ACCEPT_BACKOFF_MS) ResumeAccept --> epoll.AddEvent
 	 */
 
 	virtual int Accept(const SocketAddress & addr, const AcceptDoneHandle & h) override;
@@ -153,20 +241,43 @@ public:
     private:
 
 	static const size_t MAXBACKLOG = 1024;
+	static const size_t MAX_ACCEPT_BATCH = 64;
+	static const uint32_t ACCEPT_BACKOFF_MS = 10;
 
 	typedef int socket_t;
 
+	/*
+	 * Resumes accepting after a back off
+	 */
+	struct ResumeRoutine : ThreadRoutine
+	{
+		ResumeRoutine(TCPServer * server) : server_(server) {}
+
+		virtual void Run() override
+		{
+			server_->ResumeAccept();
+		}
+
+		TCPServer * server_;
+	};
+
 	void HandleFdEvent(int fd, uint32_t events) __intr_fn__;
+	void PauseAccept();
+	void ResumeAccept();
 	void BarrierDone(StopDoneHandle h);
 
 	const string name() const { return "/tcpserver/" + STR(this); }
-	const string name(int fd) const { return name() + "/ch/" + STR(fd); }
 
 	const string name_;
 	SpinMutex lock_;
 	FdPoll & epoll_;
 	socket_t sockfd_;
 	AcceptDoneHandle h_;
+	ResumeRoutine resume_;
+	bool isPaused_;			// not accepting, resume_ is armed
+	bool isStopped_;		// Stop was called, events are ignored
+	bool isStopping_;		// stopped while resume_ was on its way to run
+	StopDoneHandle stopHandle_;
 };
 
 //................................................................................ TCPConnector ....
@@ -188,12 +299,13 @@ public:
 	using UnicastConnector::StopDoneHandle;
 
 	TCPConnector(FdPoll & epoll, const string & name = "/tcp/connector")
-	    : name_(name), lock_(name), epoll_(epoll)
+	    : name_(name), epoll_(epoll)
+	    , pendingConnects_(PENDING_BUCKETS, PENDING_STRIPES)
 	{}
 
 	virtual ~TCPConnector()
 	{
-	    INVARIANT(pendingConnects_.empty());
+	    INVARIANT(pendingConnects_.IsEmpty());
 	}
 
 	/*
@@ -209,13 +321,20 @@ public:
 
 	__DISABLE_ASSIGN_AND_COPY__(TCPConnector);
 
-	typedef map<fd_t, ConnectDoneHandle> pending_map_t;
+	/*
+	 * Connects in flight. Whoever erases the fd, the connect completing or Stop, notifies its
+	 * handle. The map is per connector, it is kept to a few cache lines.
+	 */
+	typedef ConcurrentMap<fd_t, ConnectDoneHandle> pending_map_t;
+
+	static const size_t PENDING_BUCKETS = 16;
+	static const size_t PENDING_STRIPES = 4;
 
 	void HandleFdEvent(int fd, uint32_t events) __intr_fn__;
 	void BarrierDone(StopDoneHandle h);
+	vector<fd_t> PendingFds() const;
 
 	const string name_;
-	SpinMutex lock_;
 	FdPoll & epoll_;
 	pending_map_t pendingConnects_;
 };
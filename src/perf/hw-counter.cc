@@ -0,0 +1,373 @@
+#include <map>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include <cxxabi.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "util.h"
+#include "logger.h"
+#include "lock.h"
+#include "perf/hw-counter.h"
+
+using namespace std;
+using namespace bblocks;
+
+// .................................................................................. HwCounters ....
+
+int
+HwCounters::OpenEvent(const uint32_t type, const uint64_t config)
+{
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.exclude_hv = 1;
+
+	const int leader = index_[CYCLES] != -1 ? fds_[CYCLES] : -1;
+
+	/*
+	 * Count the kernel side too if we are allowed to, user space only otherwise
+	 */
+	for (int excludeKernel = 0; excludeKernel < 2; ++excludeKernel) {
+		attr.exclude_kernel = excludeKernel;
+
+		const int fd = syscall(__NR_perf_event_open, &attr, /*pid=*/ 0, /*cpu=*/ -1, leader,
+				       /*flags=*/ 0);
+		if (fd != -1) {
+			return fd;
+		}
+	}
+
+	return -1;
+}
+
+HwCounters::Mode
+HwCounters::Open(const Mode mode)
+{
+	ASSERT(mode_ == NONE);
+	ASSERT(mode != NONE);
+
+	struct Def
+	{
+		uint32_t type_;
+		uint64_t config_;
+	};
+
+	static const Def hw[MAX_EVENTS] = {
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	};
+
+	static const Def sw[MAX_EVENTS] = {
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+		{ PERF_TYPE_MAX, 0 },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	};
+
+	for (Mode m = mode; m != NONE; m = (m == HARDWARE ? SOFTWARE : NONE)) {
+		const Def * defs = m == HARDWARE ? hw : sw;
+
+		int n = 0;
+		for (int i = 0; i < MAX_EVENTS; ++i) {
+			if (defs[i].type_ == PERF_TYPE_MAX) continue;
+
+			const int fd = OpenEvent(defs[i].type_, defs[i].config_);
+
+			if (fd == -1) {
+				/*
+				 * Without the leader there is no group, try the next mode
+				 */
+				if (i == CYCLES) break;
+				continue;
+			}
+
+			fds_[i] = fd;
+			index_[i] = n++;
+		}
+
+		if (n) {
+			mode_ = m;
+			return mode_;
+		}
+	}
+
+	return NONE;
+}
+
+void
+HwCounters::Close()
+{
+	for (int i = 0; i < MAX_EVENTS; ++i) {
+		if (fds_[i] != -1) {
+			::close(fds_[i]);
+		}
+
+		fds_[i] = -1;
+		index_[i] = -1;
+	}
+
+	mode_ = NONE;
+}
+
+bool
+HwCounters::Read(Sample & s) const
+{
+	ASSERT(mode_ != NONE);
+
+	/*
+	 * PERF_FORMAT_GROUP : nr followed by the values in the order the events were opened
+	 */
+	uint64_t buf[1 + MAX_EVENTS];
+
+	const ssize_t size = ::read(fds_[CYCLES], buf, sizeof(buf));
+	if (size < (ssize_t) sizeof(uint64_t)) {
+		return false;
+	}
+
+	for (int i = 0; i < MAX_EVENTS; ++i) {
+		s.val_[i] = index_[i] != -1 && (uint64_t) index_[i] < buf[0] ? buf[1 + index_[i]] : 0;
+	}
+
+	return true;
+}
+
+const char *
+HwCounters::Name(const Event e, const Mode mode)
+{
+	static const char * const hw[MAX_EVENTS] = {
+		"cycles", "instructions", "cache-misses", "context-switches"
+	};
+
+	static const char * const sw[MAX_EVENTS] = {
+		"task-clock-ns", NULL, "page-faults", "context-switches"
+	};
+
+	switch (mode) {
+	case HARDWARE:
+		return hw[e];
+	case SOFTWARE:
+		return sw[e];
+	case NONE:
+		return NULL;
+	}
+
+	DEADEND
+}
+
+// .................................................................................. HwProfiler ....
+
+struct HwProfiler::ThreadState
+{
+	ThreadState() : isStarted_(false) {}
+
+	HwCounters counters_;
+	bool isStarted_;
+	HwCounters::Sample start_;
+
+	SpinLock lock_;				// stats, the owner against the report
+	unordered_map<const char *, Stats> ops_;
+};
+
+namespace {
+
+/*
+ * Guards the states of the threads and the stats of the retired ones
+ */
+PThreadMutex lock_(/*isRecursive=*/ false);
+
+const string _log = "/hwprofiler";
+
+string
+Demangle(const char * name)
+{
+	int status = 0;
+	char * s = abi::__cxa_demangle(name, /*buf=*/ NULL, /*len=*/ NULL, &status);
+
+	if (status || !s) {
+		return name;
+	}
+
+	const string ret(s);
+	free(s);
+	return ret;
+}
+
+}
+
+atomic<bool> HwProfiler::enabled_(false);
+atomic<int> HwProfiler::mode_(HwCounters::NONE);
+
+vector<HwProfiler::ThreadState *> HwProfiler::states_;
+map<string, HwProfiler::Stats> HwProfiler::retired_;
+
+__thread HwProfiler::ThreadState * HwProfiler::self_;
+thread_local HwProfiler::StateOwner HwProfiler::owner_;
+
+HwProfiler::StateOwner::~StateOwner()
+{
+	if (!state_) return;
+
+	{
+		AutoLock _(&lock_);
+
+		states_.erase(find(states_.begin(), states_.end(), state_));
+		Fold(state_, retired_);
+	}
+
+	delete state_;
+	state_ = NULL;
+	self_ = NULL;
+}
+
+HwProfiler::ThreadState *
+HwProfiler::Self()
+{
+	if (self_) {
+		return self_;
+	}
+
+	ThreadState * s = new ThreadState();
+
+	{
+		AutoLock _(&lock_);
+
+		/*
+		 * The first thread decides the mode, the rest follow so that the counts add up
+		 */
+		const HwCounters::Mode mode = HwProfiler::mode();
+		s->counters_.Open(mode == HwCounters::NONE ? HwCounters::HARDWARE : mode);
+
+		if (mode == HwCounters::NONE) {
+			mode_ = s->counters_.mode();
+
+			if (s->counters_.mode() == HwCounters::NONE) {
+				ERROR(_log) << "perf_event is not available. " << strerror(errno);
+			} else {
+				INFO(_log) << "Counters opened in "
+					   << (s->counters_.mode() == HwCounters::HARDWARE
+					       ? "hardware" : "software") << " mode";
+			}
+		} else if (s->counters_.mode() != mode) {
+			/*
+			 * Fell back to another mode, its counts don't add up with the rest
+			 */
+			ERROR(_log) << "Counters of the thread are not in the mode of the others,"
+				    << " not measuring the thread";
+			s->counters_.Close();
+		}
+
+		states_.push_back(s);
+	}
+
+	self_ = s;
+	owner_.state_ = s;
+
+	return s;
+}
+
+void
+HwProfiler::Start()
+{
+	ThreadState * s = Self();
+
+	s->isStarted_ = s->counters_.mode() != HwCounters::NONE
+			&& s->counters_.Read(s->start_);
+}
+
+void
+HwProfiler::Stop(const char * op)
+{
+	ThreadState * s = Self();
+
+	if (!s->isStarted_) {
+		return;
+	}
+
+	s->isStarted_ = false;
+
+	HwCounters::Sample end;
+	if (!s->counters_.Read(end)) {
+		return;
+	}
+
+	Guard _(&s->lock_);
+
+	Stats & stats = s->ops_[op];
+	++stats.nops_;
+	for (int i = 0; i < HwCounters::MAX_EVENTS; ++i) {
+		stats.sum_.val_[i] += end.val_[i] - s->start_.val_[i];
+	}
+}
+
+void
+HwProfiler::Fold(ThreadState * s, map<string, Stats> & ops)
+{
+	Guard _(&s->lock_);
+
+	for (auto & op : s->ops_) {
+		Stats & stats = ops[Demangle(op.first)];
+		stats.nops_ += op.second.nops_;
+		stats.sum_ += op.second.sum_;
+	}
+}
+
+map<string, HwProfiler::Stats>
+HwProfiler::Collect()
+{
+	AutoLock _(&lock_);
+
+	map<string, Stats> ops = retired_;
+
+	for (auto s : states_) {
+		Fold(s, ops);
+	}
+
+	return ops;
+}
+
+HwProfiler::Stats
+HwProfiler::Get(const string & op)
+{
+	const map<string, Stats> ops = Collect();
+
+	auto it = ops.find(op);
+	return it != ops.end() ? it->second : Stats();
+}
+
+void
+HwProfiler::Print(ostream & os)
+{
+	const HwCounters::Mode mode = HwProfiler::mode();
+	const map<string, Stats> ops = Collect();
+
+	for (auto & op : ops) {
+		const Stats & stats = op.second;
+
+		if (!stats.nops_) continue;
+
+		os << op.first << " ops " << stats.nops_;
+
+		for (int i = 0; i < HwCounters::MAX_EVENTS; ++i) {
+			const char * name = HwCounters::Name((HwCounters::Event) i, mode);
+			if (!name) continue;
+
+			os << " " << name << "/op " << stats.sum_.val_[i] / double(stats.nops_);
+		}
+
+		if (mode == HwCounters::HARDWARE && stats.sum_.val_[HwCounters::CYCLES]) {
+			os << " ipc "
+			   << stats.sum_.val_[HwCounters::INSTRUCTIONS]
+			      / double(stats.sum_.val_[HwCounters::CYCLES]);
+		}
+
+		os << endl;
+	}
+}
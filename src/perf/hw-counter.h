@@ -0,0 +1,227 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <atomic>
+#include <string.h>
+
+#include "defs.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// .................................................................................. HwCounters ....
+
+/**
+ * @class HwCounters
+ *
+ * perf_event counters of the calling thread: cycles, instructions, cache misses and context
+ * switches, read together as one group.
+ *
+ * Hardware counters are often not there (virtual machines, containers, perf_event_paranoid).
+ * Software events stand in then: the task clock (in ns) for cycles and page faults for cache
+ * misses, there is nothing for instructions. Context switches are a software event either way.
+ */
+class HwCounters
+{
+public:
+
+	enum Event
+	{
+		CYCLES = 0,
+		INSTRUCTIONS,
+		CACHE_MISSES,
+		CONTEXT_SWITCHES,
+		MAX_EVENTS,
+	};
+
+	enum Mode
+	{
+		NONE = 0,
+		HARDWARE,
+		SOFTWARE,
+	};
+
+	struct Sample
+	{
+		Sample()
+		{
+			memset(val_, 0, sizeof(val_));
+		}
+
+		Sample & operator+=(const Sample & s)
+		{
+			for (int i = 0; i < MAX_EVENTS; ++i) {
+				val_[i] += s.val_[i];
+			}
+			return *this;
+		}
+
+		uint64_t val_[MAX_EVENTS];
+	};
+
+	HwCounters()
+		: mode_(NONE)
+	{
+		for (int i = 0; i < MAX_EVENTS; ++i) {
+			fds_[i] = -1;
+			index_[i] = -1;
+		}
+	}
+
+	~HwCounters()
+	{
+		Close();
+	}
+
+	/**
+	 * Open the counters for the calling thread, in the mode asked for or software if the
+	 * hardware counters can't be opened
+	 *
+	 * @return	Mode the counters are open in, NONE if perf_event is not available
+	 */
+	Mode Open(const Mode mode = HARDWARE);
+
+	void Close();
+
+	Mode mode() const
+	{
+		return mode_;
+	}
+
+	/**
+	 * Current values, one syscall
+	 */
+	bool Read(Sample & s) const;
+
+	/**
+	 * What an event counts in a mode, NULL if not counted
+	 */
+	static const char * Name(const Event e, const Mode mode);
+
+private:
+
+	HwCounters(const HwCounters &);
+	HwCounters & operator=(const HwCounters &);
+
+	int OpenEvent(const uint32_t type, const uint64_t config);
+
+	Mode mode_;
+	int fds_[MAX_EVENTS];
+	int index_[MAX_EVENTS];		// position of the event in the group read, -1 if not open
+};
+
+// .................................................................................. HwProfiler ....
+
+/**
+ * @class HwProfiler
+ *
+ * Counters per operation. The pool threads report every routine as an operation named after its
+ * type, so the report has IPC and misses per routine type. Anything else can be measured by
+ * bracketing it with Start and Stop on one thread.
+ *
+ * Every thread opens its own counters the first time it measures, the mode is decided by the
+ * first thread and a thread that can't open its counters in that mode is not measured. The stats
+ * of a thread are folded into the report when it exits. Measuring costs two reads of the
+ * counters, a syscall each, so it is meant to be turned on for a run, not left on.
+ *
+ * Usage :
+ *
+ *	HwProfiler::Enable();
+ *	...
+ *	HwProfiler::Start();
+ *	... work ...
+ *	HwProfiler::Stop("work");
+ *	...
+ *	HwProfiler::Print(cout);
+ */
+class HwProfiler
+{
+public:
+
+	struct Stats
+	{
+		Stats() : nops_(0) {}
+
+		uint64_t nops_;
+		HwCounters::Sample sum_;
+	};
+
+	static void Enable()
+	{
+		enabled_.store(true, memory_order_relaxed);
+	}
+
+	static void Disable()
+	{
+		enabled_.store(false, memory_order_relaxed);
+	}
+
+	static bool IsEnabled()
+	{
+		return enabled_.load(memory_order_relaxed);
+	}
+
+	/**
+	 * Mode of the counters, NONE until the first thread has opened its counters or if they
+	 * could not be opened
+	 */
+	static HwCounters::Mode mode()
+	{
+		return (HwCounters::Mode) mode_.load();
+	}
+
+	/**
+	 * Start measuring an operation on the calling thread
+	 */
+	static void Start();
+
+	/**
+	 * Charge what was counted since Start to op. op is the key and has to stay valid, a
+	 * string literal or a type_info name.
+	 */
+	static void Stop(const char * op);
+
+	/**
+	 * Stats of op summed over the threads, op can be a demangled name
+	 */
+	static Stats Get(const string & op);
+
+	/**
+	 * Per operation report: ops, counts per op and IPC
+	 */
+	static void Print(ostream & os);
+
+private:
+
+	struct ThreadState;
+
+	/*
+	 * Folds the stats of the thread into the report and frees its state when it exits
+	 */
+	struct StateOwner
+	{
+		StateOwner() : state_(NULL) {}
+		~StateOwner();
+
+		ThreadState * state_;
+	};
+
+	static ThreadState * Self();
+	static map<string, Stats> Collect();
+	static void Fold(ThreadState * s, map<string, Stats> & ops);
+
+	static atomic<bool> enabled_;
+	static atomic<int> mode_;
+
+	static vector<ThreadState *> states_;	// threads measuring
+	static map<string, Stats> retired_;	// stats of the threads that exited
+
+	static __thread ThreadState * self_;
+	static thread_local StateOwner owner_;
+};
+
+}
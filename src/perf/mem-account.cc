@@ -0,0 +1,176 @@
+#include <vector>
+
+#include "util.h"
+#include "logger.h"
+#include "lock.h"
+#include "bblocks.h"
+#include "perf/mem-account.h"
+
+using namespace std;
+using namespace bblocks;
+
+static const string _log("/memaccount");
+
+// .................................................................................. MemAccount ....
+
+struct MemAccount::Waiters
+{
+	SpinLock lock_;
+	vector<ThreadRoutine *> routines_;
+};
+
+MemAccount::Counter MemAccount::tags_[MAX_TAGS];
+MemAccount::Waiters MemAccount::waiters_[MAX_TAGS];
+atomic<int> MemAccount::npressure_(0);
+
+__thread int64_t MemAccount::delta_[MAX_TAGS];
+__thread bool MemAccount::isRegistered_;
+thread_local MemAccount::DeltaOwner MemAccount::owner_;
+
+void
+MemAccount::Register()
+{
+	/*
+	 * Construct the owner, so the charges are flushed when the thread exits
+	 */
+	(void) &owner_;
+	isRegistered_ = true;
+}
+
+void
+MemAccount::Flush()
+{
+	for (int i = 0; i < MAX_TAGS; ++i) {
+		if (delta_[i]) {
+			Flush((Tag) i);
+		}
+	}
+}
+
+void
+MemAccount::Flush(const Tag tag)
+{
+	tags_[tag].bytes_.fetch_add(delta_[tag]);
+	delta_[tag] = 0;
+
+	UpdateLevel(tag);
+}
+
+void
+MemAccount::SetLimits(const Tag tag, const int64_t soft, const int64_t hard)
+{
+	INVARIANT(!hard || hard >= soft);
+
+	tags_[tag].soft_ = soft;
+	tags_[tag].hard_ = hard;
+
+	UpdateLevel(tag);
+}
+
+void
+MemAccount::UpdateLevel(const Tag tag)
+{
+	Counter & c = tags_[tag];
+
+	int prev = c.level_.load(memory_order_relaxed);
+	int64_t bytes;
+	int level;
+
+	/*
+	 * The level is recomputed from the published bytes on every try. A thread that read the
+	 * bytes before a racing flush loses the exchange and looks again, a stale level can not
+	 * win. The pressure count follows the transitions that did win and stays balanced.
+	 */
+	do {
+		bytes = c.bytes_.load();
+
+		const int64_t soft = c.soft_.load(memory_order_relaxed);
+		const int64_t hard = c.hard_.load(memory_order_relaxed);
+
+		level = hard && bytes >= hard ? HARD : (soft && bytes >= soft ? SOFT : NORMAL);
+
+		if (prev == level) {
+			return;
+		}
+	} while (!c.level_.compare_exchange_weak(prev, level));
+
+	if (prev == NORMAL && level != NORMAL) {
+		++npressure_;
+	} else if (prev != NORMAL && level == NORMAL) {
+		--npressure_;
+	}
+
+	if (level > prev) {
+		ERROR(_log) << Name(tag) << " over its " << (level == HARD ? "hard" : "soft")
+			    << " limit. bytes=" << bytes;
+	}
+
+	if (prev == HARD && level != HARD) {
+		WakeWaiters(tag);
+	}
+}
+
+void
+MemAccount::WaitForSpace(const Tag tag, ThreadRoutine * r)
+{
+	ASSERT(r);
+
+	{
+		Waiters & w = waiters_[tag];
+		Guard _(&w.lock_);
+
+		/*
+		 * The level is checked under the lock the waiters are woken up with, a wakeup
+		 * can not slip in between
+		 */
+		if (IsOverHard(tag)) {
+			w.routines_.push_back(r);
+			return;
+		}
+	}
+
+	BBlocks::Schedule(r);
+}
+
+void
+MemAccount::WakeWaiters(const Tag tag)
+{
+	vector<ThreadRoutine *> routines;
+
+	{
+		Waiters & w = waiters_[tag];
+		Guard _(&w.lock_);
+		routines.swap(w.routines_);
+	}
+
+	for (auto r : routines) {
+		BBlocks::Schedule(r);
+	}
+}
+
+const char *
+MemAccount::Name(const Tag tag)
+{
+	static const char * const names[MAX_TAGS] = {
+		"bufpool", "iobuffer", "transport", "cqueue"
+	};
+
+	return names[tag];
+}
+
+void
+MemAccount::Print(ostream & os)
+{
+	for (int i = 0; i < MAX_TAGS; ++i) {
+		const Counter & c = tags_[i];
+
+		os << Name((Tag) i) << " bytes " << c.bytes_.load(memory_order_relaxed);
+
+		if (c.soft_ || c.hard_) {
+			os << " soft " << c.soft_.load(memory_order_relaxed)
+			   << " hard " << c.hard_.load(memory_order_relaxed);
+		}
+
+		os << endl;
+	}
+}
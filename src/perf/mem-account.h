@@ -0,0 +1,182 @@
+#pragma once
+
+#include <atomic>
+#include <ostream>
+#include <inttypes.h>
+
+#include "defs.h"
+
+namespace bblocks {
+
+using namespace std;
+
+class ThreadRoutine;
+
+//.................................................................................. MemAccount ....
+
+/**
+ * @class MemAccount
+ *
+ * Bytes held per subsystem, with a soft and a hard limit each.
+ *
+ *	BUFPOOL		free slabs cached in the ThreadCtx pools
+ *	IOBUFFER	IOBuffers allocated and not yet released
+ *	TRANSPORT	writes queued on transport channels, buffers and op state
+ *	CQUEUE		events backlogged on completion queues
+ *
+ * Subsystems react to the limits themselves. Over a soft limit on BUFPOOL or IOBUFFER, the
+ * BufferPool stops caching slabs and the pool threads trim their caches, at most every
+ * ThreadCtx::GC_PRESSURE_MS. Over its hard limit a subsystem that can refuse work does:
+ * TCPChannel::Write fails with NOMEM and IOBuffer::TryAlloc returns no buffer. WaitForSpace
+ * tells a refused caller when to retry.
+ *
+ * Charges are batched per thread up to BATCH_BYTES either way before they reach the shared
+ * counters, so the counters may be off by that much per thread and the hot paths don't share a
+ * cache line. Releases are not held back while a subsystem is over its soft limit, the bytes
+ * that bring it down must show up or the refused callers wait for good. Flush publishes the
+ * calling thread's charges, a thread flushes when it exits.
+ */
+class MemAccount
+{
+public:
+
+	enum Tag
+	{
+		BUFPOOL = 0,
+		IOBUFFER,
+		TRANSPORT,
+		CQUEUE,
+		MAX_TAGS,
+	};
+
+	enum Level
+	{
+		NORMAL = 0,
+		SOFT,
+		HARD,
+	};
+
+	static const int64_t BATCH_BYTES = 64 * 1024;
+
+	/**
+	 * Account bytes to tag, negative to release
+	 */
+	static void Charge(const Tag tag, const int64_t bytes)
+	{
+		if (!isRegistered_) {
+			Register();
+		}
+
+		int64_t & delta = delta_[tag];
+		delta += bytes;
+
+		if (delta >= BATCH_BYTES || delta <= -BATCH_BYTES
+		    || (bytes < 0 && level(tag) != NORMAL)) {
+			Flush(tag);
+		}
+	}
+
+	static void Release(const Tag tag, const int64_t bytes)
+	{
+		Charge(tag, -bytes);
+	}
+
+	/**
+	 * Publish the charges of the calling thread
+	 */
+	static void Flush();
+
+	/**
+	 * Bytes held by the subsystem, as published
+	 */
+	static int64_t Bytes(const Tag tag)
+	{
+		return tags_[tag].bytes_.load(memory_order_relaxed);
+	}
+
+	/**
+	 * Limits in bytes, 0 for none. The hard limit is at least the soft limit.
+	 */
+	static void SetLimits(const Tag tag, const int64_t soft, const int64_t hard);
+
+	static Level level(const Tag tag)
+	{
+		return (Level) tags_[tag].level_.load(memory_order_relaxed);
+	}
+
+	static bool IsOverHard(const Tag tag)
+	{
+		return level(tag) == HARD;
+	}
+
+	/**
+	 * Schedule r once the subsystem is back under its hard limit, right away if it is under
+	 * it already. Levels follow the published bytes, releases are published right away over
+	 * the soft limit so r runs as soon as enough memory is freed.
+	 */
+	static void WaitForSpace(const Tag tag, ThreadRoutine * r);
+
+	/**
+	 * Some subsystem is over its soft limit, caches should let go of memory
+	 */
+	static bool IsUnderPressure()
+	{
+		return npressure_.load(memory_order_relaxed);
+	}
+
+	/**
+	 * Buffer memory is over its soft limit, slab caches should let go. Pressure elsewhere,
+	 * e.g. a transport backlog, is not relieved by trimming the caches.
+	 */
+	static bool IsBufferPressure()
+	{
+		return level(BUFPOOL) != NORMAL || level(IOBUFFER) != NORMAL;
+	}
+
+	static const char * Name(const Tag tag);
+
+	/**
+	 * Bytes and limits per subsystem
+	 */
+	static void Print(ostream & os);
+
+private:
+
+	struct Counter
+	{
+		Counter() : bytes_(0), soft_(0), hard_(0), level_(NORMAL) {}
+
+		atomic<int64_t> bytes_;
+		atomic<int64_t> soft_;
+		atomic<int64_t> hard_;
+		atomic<int> level_;
+	} CACHELINE_ALIGNED;
+
+	/*
+	 * Flushes the thread's charges when it exits
+	 */
+	struct DeltaOwner
+	{
+		~DeltaOwner()
+		{
+			Flush();
+		}
+	};
+
+	struct Waiters;
+
+	static void Register();
+	static void Flush(const Tag tag);
+	static void UpdateLevel(const Tag tag);
+	static void WakeWaiters(const Tag tag);
+
+	static Counter tags_[MAX_TAGS];
+	static Waiters waiters_[MAX_TAGS];	// routines waiting for the tag to leave HARD
+	static atomic<int> npressure_;		// tags over their soft limit
+
+	static __thread int64_t delta_[MAX_TAGS];
+	static __thread bool isRegistered_;
+	static thread_local DeltaOwner owner_;
+};
+
+}
@@ -63,6 +63,16 @@ public:
 		UpdateBucket(val);
 	}
 
+	uint64_t Count() const
+	{
+		return count_.load();
+	}
+
+	uint64_t Value() const
+	{
+		return val_.load();
+	}
+
 	friend ostream & operator<<(ostream & os, const PerfCounter & pc)
 	{
 		os << "Perfcoutner: " << pc.name_ << endl;
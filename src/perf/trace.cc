@@ -0,0 +1,276 @@
+#include <fstream>
+#include <signal.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "util.h"
+#include "logger.h"
+#include "lock.h"
+#include "perf/trace.h"
+
+using namespace std;
+using namespace bblocks;
+
+namespace {
+
+/*
+ * Rings of all the threads that ever recorded. Rings are never freed, a ring released by an
+ * exiting thread is reused by the next new thread.
+ */
+PThreadMutex lock_(/*isRecursive=*/ false);
+vector<void *> rings_;
+
+uint64_t baseTsc_ = 0;
+
+/*
+ * Dump on signal
+ */
+sem_t sem_;
+string path_;
+bool isDumpThreadStarted_ = false;
+
+const string _log = "/trace";
+
+void
+WriteJsonString(ostream & os, const char * s)
+{
+	os << '"';
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\') {
+			os << '\\';
+		}
+		os << *s;
+	}
+	os << '"';
+}
+
+}
+
+//....................................................................................... Trace ....
+
+atomic<bool> Trace::enabled_(false);
+atomic<size_t> Trace::ringSize_(Trace::DEFAULT_RING_SIZE);
+
+__thread Trace::Ring * Trace::self_;
+__thread char Trace::name_[Trace::MAX_NAME_SIZE];
+thread_local Trace::RingOwner Trace::owner_;
+
+Trace::RingOwner::~RingOwner()
+{
+	if (!ring_) return;
+
+	ring_->inuse_.store(false, memory_order_release);
+	ring_ = NULL;
+	self_ = NULL;
+}
+
+void
+Trace::Enable(const size_t ringSize)
+{
+	ASSERT(ringSize);
+
+	size_t size = 1;
+	while (size < ringSize) {
+		size <<= 1;
+	}
+
+	{
+		AutoLock _(&lock_);
+
+		ringSize_ = size;
+
+		if (!baseTsc_) {
+			baseTsc_ = Rdtsc::rdtsc();
+		}
+	}
+
+	enabled_.store(true, memory_order_relaxed);
+}
+
+void
+Trace::SetThreadName(const string & name)
+{
+	snprintf(name_, MAX_NAME_SIZE, "%s", name.c_str());
+
+	if (self_) {
+		AutoLock _(&lock_);
+		snprintf(self_->name_, MAX_NAME_SIZE, "%s", name_);
+	}
+}
+
+Trace::Ring *
+Trace::Acquire()
+{
+	AutoLock _(&lock_);
+
+	Ring * r = NULL;
+
+	for (auto p : rings_) {
+		bool expected = false;
+		if (((Ring *) p)->inuse_.compare_exchange_strong(expected, true)) {
+			r = (Ring *) p;
+			break;
+		}
+	}
+
+	if (!r) {
+		r = new Ring(ringSize_);
+		r->inuse_ = true;
+		rings_.push_back(r);
+	}
+
+	/*
+	 * The events of the previous owner are dropped, a dump is never in progress here
+	 */
+	r->head_.store(0, memory_order_relaxed);
+	r->tid_ = syscall(SYS_gettid);
+	snprintf(r->name_, MAX_NAME_SIZE, "%s", name_[0] ? name_ : STR(r->tid_).c_str());
+
+	return r;
+}
+
+void
+Trace::Dump(ostream & os)
+{
+	AutoLock _(&lock_);
+
+	const pid_t pid = getpid();
+	const double ticksPerMicroSec = System::GetHz() / double(1000 * 1000);
+	const ios::fmtflags flags = os.flags();
+
+	os << "{\"traceEvents\":[" << endl;
+
+	bool isFirst = true;
+
+	for (auto p : rings_) {
+		const Ring * r = (const Ring *) p;
+
+		if (!isFirst) os << "," << endl;
+		isFirst = false;
+
+		os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+		   << ",\"tid\":" << r->tid_ << ",\"args\":{\"name\":";
+		WriteJsonString(os, r->name_);
+		os << "}}";
+
+		/*
+		 * Copy out the window, then drop what the owner may have overwritten while we
+		 * were copying. The slot at the head is the one being written.
+		 */
+		const uint64_t head = r->head_.load(memory_order_acquire);
+		const uint64_t size = r->mask_ + 1;
+		uint64_t start = head > size ? head - size : 0;
+
+		vector<Event> events;
+		events.reserve(head - start);
+		for (uint64_t i = start; i < head; ++i) {
+			events.push_back(r->events_[i & r->mask_]);
+		}
+
+		const uint64_t now = r->head_.load(memory_order_acquire);
+		const uint64_t skip = now + 1 > start + size ? now + 1 - (start + size) : 0;
+
+		for (uint64_t i = skip; i < events.size(); ++i) {
+			const Event & e = events[i];
+
+			if (e.tsc_ < baseTsc_) continue;
+
+			os << "," << endl
+			   << "{\"name\":";
+			WriteJsonString(os, e.name_);
+			os << ",\"ph\":\"" << e.ph_ << "\""
+			   << ",\"ts\":" << fixed << (e.tsc_ - baseTsc_) / ticksPerMicroSec
+			   << ",\"pid\":" << pid << ",\"tid\":" << r->tid_;
+
+			if (e.ph_ == INSTANT) {
+				os << ",\"s\":\"t\"";
+			}
+
+			os << ",\"args\":{\"arg\":" << e.arg_ << "}}";
+		}
+	}
+
+	os << endl << "]}" << endl;
+
+	os.flags(flags);
+}
+
+bool
+Trace::Dump(const string & path)
+{
+	ofstream file(path.c_str(), ios::trunc);
+
+	if (!file.is_open()) {
+		ERROR(_log) << "Error opening " << path << ". " << strerror(errno);
+		return false;
+	}
+
+	Dump(file);
+
+	INFO(_log) << "Trace written to " << path;
+
+	return file.good();
+}
+
+void
+Trace::DumpOnSignal(const int signo, const string & path)
+{
+	{
+		AutoLock _(&lock_);
+
+		path_ = path;
+
+		if (!isDumpThreadStarted_) {
+			int status = sem_init(&sem_, /*pshared=*/ 0, /*value=*/ 0);
+			INVARIANT(!status);
+
+			pthread_t tid;
+			status = pthread_create(&tid, /*attr=*/ NULL, DumpThreadMain, /*arg=*/ NULL);
+			INVARIANT(!status);
+			pthread_detach(tid);
+
+			isDumpThreadStarted_ = true;
+		}
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = OnSignal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	int status = sigaction(signo, &sa, /*oldact=*/ NULL);
+	INVARIANT(!status);
+
+	INFO(_log) << "Trace dumps on signal " << signo << " to " << path;
+}
+
+void
+Trace::OnSignal(int)
+{
+	/*
+	 * Only async signal safe calls in here
+	 */
+	sem_post(&sem_);
+}
+
+void *
+Trace::DumpThreadMain(void *)
+{
+	while (true) {
+		if (sem_wait(&sem_) && errno == EINTR) {
+			continue;
+		}
+
+		string path;
+		{
+			AutoLock _(&lock_);
+			path = path_;
+		}
+
+		Dump(path);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <string>
+#include <ostream>
+#include <atomic>
+#include <vector>
+
+#include "defs.h"
+#include "util.h"
+
+namespace bblocks {
+
+using namespace std;
+
+/*
+ * Trace points. The name has to be a string literal, only the pointer is recorded.
+ */
+#define TRACE_BEGIN(name, arg)								\
+do {											\
+	if (Trace::IsEnabled()) {							\
+		Trace::Record(name, Trace::BEGIN, (uint64_t) (arg));			\
+	}										\
+} while (0)
+
+#define TRACE_END(name, arg)								\
+do {											\
+	if (Trace::IsEnabled()) {							\
+		Trace::Record(name, Trace::END, (uint64_t) (arg));			\
+	}										\
+} while (0)
+
+#define TRACE_INSTANT(name, arg)							\
+do {											\
+	if (Trace::IsEnabled()) {							\
+		Trace::Record(name, Trace::INSTANT, (uint64_t) (arg));			\
+	}										\
+} while (0)
+
+//....................................................................................... Trace ....
+
+/**
+ * @class Trace
+ *
+ * Timeline of what the threads are doing, exported in the Chrome trace-event format (viewable
+ * in chrome://tracing and Perfetto).
+ *
+ * Every thread records into a ring of its own, so recording is lock free and touches no shared
+ * cache line: a timestamp counter read and a few stores. The ring keeps the last events of the
+ * thread and overwrites the oldest. With tracing disabled a trace point is a relaxed load and a
+ * branch, cheap enough to be compiled in everywhere and enabled in canary.
+ *
+ * The library traces routine run and queue push/pop on the pool threads, timer dispatch in the
+ * time keeper, epoll wakeups, and aio submit/complete.
+ *
+ * Usage :
+ *
+ *	Trace::Enable();
+ *	Trace::DumpOnSignal(SIGUSR2, "/tmp/bblocks.trace.json");
+ *	...
+ *	TRACE_BEGIN("parse", len);
+ *	...
+ *	TRACE_END("parse", len);
+ *	...
+ *	Trace::Dump("/tmp/bblocks.trace.json");
+ */
+class Trace
+{
+public:
+
+	static const size_t DEFAULT_RING_SIZE = 16 * 1024;
+	static const size_t MAX_NAME_SIZE = 64;
+
+	enum Phase : char
+	{
+		BEGIN = 'B',
+		END = 'E',
+		INSTANT = 'i',
+	};
+
+	/**
+	 * Start recording. Rings created from here on hold ringSize events (rounded up to a power
+	 * of two).
+	 */
+	static void Enable(const size_t ringSize = DEFAULT_RING_SIZE);
+
+	/**
+	 * Stop recording, the recorded events are kept for dumping
+	 */
+	static void Disable()
+	{
+		enabled_.store(false, memory_order_relaxed);
+	}
+
+	static bool IsEnabled()
+	{
+		return enabled_.load(memory_order_relaxed);
+	}
+
+	static void Record(const char * name, const Phase ph, const uint64_t arg)
+	{
+		Ring * r = Self();
+
+		const uint64_t h = r->head_.load(memory_order_relaxed);
+		Event & e = r->events_[h & r->mask_];
+		e.tsc_ = Rdtsc::rdtsc();
+		e.name_ = name;
+		e.arg_ = arg;
+		e.ph_ = ph;
+		r->head_.store(h + 1, memory_order_release);
+	}
+
+	/**
+	 * Name of the calling thread in the trace
+	 */
+	static void SetThreadName(const string & name);
+
+	/**
+	 * Write the events of all threads as Chrome trace JSON. Safe to call while the threads
+	 * record, events overwritten during the dump are left out.
+	 */
+	static void Dump(ostream & os);
+	static bool Dump(const string & path);
+
+	/**
+	 * Dump to path every time the process receives signo. The dump is done by a helper
+	 * thread, the signal handler only wakes it up.
+	 */
+	static void DumpOnSignal(const int signo, const string & path);
+
+private:
+
+	struct Event
+	{
+		uint64_t tsc_;
+		const char * name_;
+		uint64_t arg_;
+		char ph_;
+	};
+
+	struct Ring
+	{
+		Ring(const size_t size)
+			: events_(size), mask_(size - 1), head_(0), tid_(0), inuse_(false)
+		{
+			name_[0] = 0;
+		}
+
+		vector<Event> events_;
+		const uint64_t mask_;
+		atomic<uint64_t> head_;			// events recorded (owner writes)
+		pid_t tid_;
+		char name_[MAX_NAME_SIZE];
+		atomic<bool> inuse_;			// ring is owned by a thread
+	};
+
+	/*
+	 * Releases the ring when the thread exits, the events stay for the dump
+	 */
+	struct RingOwner
+	{
+		RingOwner() : ring_(NULL) {}
+		~RingOwner();
+
+		Ring * ring_;
+	};
+
+	static Ring * Self()
+	{
+		if (!self_) {
+			self_ = Acquire();
+			owner_.ring_ = self_;
+		}
+
+		return self_;
+	}
+
+	static Ring * Acquire();
+	static void * DumpThreadMain(void *);
+	static void OnSignal(int);
+
+	static atomic<bool> enabled_;
+	static atomic<size_t> ringSize_;
+
+	static __thread Ring * self_;
+	static __thread char name_[MAX_NAME_SIZE];
+	static thread_local RingOwner owner_;
+};
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "util.h"
+
+namespace bblocks {
+
+class Arena;
+
+//.................................................................................... AsyncCtx ....
+
+/**
+ * @class AsyncCtx
+ *
+ * Identity of the request a piece of work is done for: the request id, the tenant it belongs to,
+ * the deadline it has to complete by and the arena its temporary objects are drawn from.
+ *
+ * The context of the running thread is captured by every ThreadRoutine when it is created and by
+ * every completion handler, and restored around ThreadRoutine::Run and the handler's wakeup. So
+ * the context follows a request as it hops across Schedule, completion queues, channels and
+ * devices without the code in between knowing about it. The pool accounts the time spent in
+ * routines to the tenant of their context, see CtxAccounting.
+ *
+ * A context is four words, copying it is the whole cost per hop. Every routine and handler
+ * carries one, on x86-64 a ThreadRoutine is 112 bytes and a Fn<int> 104, so a scheduled member
+ * function still fits a single 512 byte BufferPool slab.
+ */
+struct AsyncCtx
+{
+	constexpr AsyncCtx()
+		: requestId_(0), startInMicroSec_(0), tenant_(0), budgetInMilliSec_(0), arena_(NULL)
+	{}
+
+	/**
+	 * Context for a new request starting now, with budgetInMilliSec to complete (0 for no
+	 * deadline). Request ids start at 1. The arena, if any, is owned by whoever owns the
+	 * request and has to outlive the work done for it.
+	 */
+	static AsyncCtx Begin(const uint64_t requestId, const uint32_t tenant,
+			      const uint32_t budgetInMilliSec = 0, Arena * arena = NULL)
+	{
+		ASSERT(requestId);
+
+		AsyncCtx ctx;
+		ctx.requestId_ = requestId;
+		ctx.startInMicroSec_ = Rdtsc::NowInMicroSec();
+		ctx.tenant_ = tenant;
+		ctx.budgetInMilliSec_ = budgetInMilliSec;
+		ctx.arena_ = arena;
+		return ctx;
+	}
+
+	bool IsSet() const
+	{
+		return requestId_;
+	}
+
+	bool HasDeadline() const
+	{
+		return budgetInMilliSec_;
+	}
+
+	uint64_t DeadlineInMicroSec() const
+	{
+		ASSERT(HasDeadline());
+		return startInMicroSec_ + budgetInMilliSec_ * 1000ULL;
+	}
+
+	/**
+	 * Context of the calling thread
+	 */
+	static const AsyncCtx & Current()
+	{
+		return tctx_;
+	}
+
+	class Scope;
+
+	uint64_t requestId_;		// 0 for no context
+	uint64_t startInMicroSec_;	// when the request started
+	uint32_t tenant_;
+	uint32_t budgetInMilliSec_;	// time to complete in, 0 for no deadline
+	Arena * arena_;			// request scoped memory, NULL for none
+
+private:
+
+	static __thread AsyncCtx tctx_;
+};
+
+static_assert(sizeof(AsyncCtx) <= 4 * sizeof(uint64_t), "AsyncCtx is copied on every hop");
+
+//............................................................................. AsyncCtx::Scope ....
+
+/**
+ * Makes ctx the context of the calling thread for the life of the scope
+ */
+class AsyncCtx::Scope
+{
+public:
+
+	explicit Scope(const AsyncCtx & ctx)
+		: saved_(tctx_)
+	{
+		tctx_ = ctx;
+	}
+
+	~Scope()
+	{
+		tctx_ = saved_;
+	}
+
+private:
+
+	Scope(const Scope &);
+	Scope & operator=(const Scope &);
+
+	const AsyncCtx saved_;
+};
+
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "util.h"
+#include "lock.h"
+#include "inlist.hpp"
+
+namespace bblocks {
+
+//................................................................................. Cancellable ....
+
+/**
+ * Pending operation that can be cancelled through a CancelToken
+ */
+struct Cancellable : InListElement<Cancellable>
+{
+	Cancellable() : isRegistered_(false) {}
+	virtual ~Cancellable() {}
+
+	/**
+	 * Invoked once with the token lock held. Implementations must not block or call into user
+	 * code, they are expected to hand off the cancellation to a routine.
+	 */
+	virtual void Cancel() = 0;
+
+	bool isRegistered_;
+};
+
+//................................................................................. CancelToken ....
+
+/**
+ * @class CancelToken
+ *
+ * Cancellation signal shared by the issuer of asynchronous operations and the operations. An
+ * operation registers with the token while it is pending and unregisters when it completes.
+ * Cancel() notifies every registered operation, operations issued after that fail right away.
+ * A token can be shared by any number of operations and has to outlive them.
+ */
+class CancelToken
+{
+public:
+
+	CancelToken() : isCancelled_(false) {}
+
+	~CancelToken()
+	{
+		INVARIANT(ops_.IsEmpty());
+	}
+
+	void Cancel()
+	{
+		Guard _(&lock_);
+
+		isCancelled_ = true;
+
+		while (!ops_.IsEmpty()) {
+			Cancellable * op = ops_.Pop();
+			op->isRegistered_ = false;
+			op->Cancel();
+		}
+	}
+
+	bool IsCancelled() const
+	{
+		return isCancelled_;
+	}
+
+	/**
+	 * Register a pending operation. Returns false if the token is already cancelled.
+	 */
+	bool Register(Cancellable * op)
+	{
+		Guard _(&lock_);
+
+		if (isCancelled_) {
+			return false;
+		}
+
+		ASSERT(!op->isRegistered_);
+		op->isRegistered_ = true;
+		ops_.Push(op);
+
+		return true;
+	}
+
+	/**
+	 * Unregister a completed operation. Returns false if the operation was already notified of
+	 * cancellation.
+	 */
+	bool Unregister(Cancellable * op)
+	{
+		Guard _(&lock_);
+
+		if (!op->isRegistered_) {
+			return false;
+		}
+
+		op->isRegistered_ = false;
+		ops_.Unlink(op);
+
+		return true;
+	}
+
+private:
+
+	CancelToken(const CancelToken &);
+	CancelToken & operator=(const CancelToken &);
+
+	SpinLock lock_;
+	atomic<bool> isCancelled_;
+	InList<Cancellable> ops_;
+};
+
+//....................................................................................... OpCtl ....
+
+/**
+ * Deadline and cancellation control for an asynchronous operation
+ */
+struct OpCtl
+{
+	OpCtl(const uint32_t timeoutMs = 0, CancelToken * token = NULL)
+		: timeoutMs_(timeoutMs), token_(token)
+	{}
+
+	uint32_t timeoutMs_;	// complete with TIMEDOUT after this long, 0 for no deadline
+	CancelToken * token_;	// complete with CANCELLED when cancelled, optional
+};
+
+}
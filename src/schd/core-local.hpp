@@ -0,0 +1,137 @@
+#pragma once
+
+#include <new>
+#include <stdlib.h>
+
+#include "defs.h"
+#include "lock.h"
+#include "schd/schd-helper.h"
+#include "schd/thread-pool.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//................................................................................ CoreLocal<T> ....
+
+/**
+ * @class CoreLocal
+ *
+ * One instance of T per core of the NonBlockingThreadPool, the basis for sharded state like
+ * counters, caches and allocator magazines.
+ *
+ * A pool thread owns the instance at its core id and works on it without synchronization. Each
+ * instance sits on cache lines of its own, so the cores do not contend on the same line.
+ * Threads outside the pool share one extra instance, their updates are serialized by a lock.
+ *
+ * Visit and Aggregate walk all instances while the owners may be updating them. What they see
+ * is consistent only for T that is safe to read concurrently, like atomics updated with relaxed
+ * ordering, or once the pool is quiet.
+ */
+template<class T>
+class CoreLocal
+{
+public:
+
+	typedef CoreLocal<T> This;
+
+	CoreLocal()
+		: nslots_(SysConf::NumCores() + 1)
+	{
+		void * buf = NULL;
+		const int status = posix_memalign(&buf, CACHELINE_SIZE, nslots_ * sizeof(Slot));
+		INVARIANT(!status && buf);
+
+		slots_ = (Slot *) buf;
+		for (size_t i = 0; i < nslots_; ++i) {
+			new (&slots_[i]) Slot();
+		}
+	}
+
+	~CoreLocal()
+	{
+		for (size_t i = 0; i < nslots_; ++i) {
+			slots_[i].~Slot();
+		}
+
+		free(slots_);
+	}
+
+	/**
+	 * Instance of the calling pool thread
+	 */
+	T & Local()
+	{
+		const int core = NonBlockingThreadPool::CurrentCore();
+		INVARIANT(core >= 0 && (size_t) core < nslots_ - 1);
+
+		return slots_[core].t_;
+	}
+
+	/**
+	 * Call fn(T &) on the instance of the calling thread. Pool threads do it without a lock,
+	 * other threads under the lock of the shared instance.
+	 */
+	template<class FN>
+	void Update(FN fn)
+	{
+		const int core = NonBlockingThreadPool::CurrentCore();
+
+		if (core >= 0) {
+			ASSERT((size_t) core < nslots_ - 1);
+			fn(slots_[core].t_);
+			return;
+		}
+
+		Guard _(&lock_);
+		fn(slots_[nslots_ - 1].t_);
+	}
+
+	/**
+	 * Call fn(const T &) on every instance
+	 */
+	template<class FN>
+	void Visit(FN fn) const
+	{
+		for (size_t i = 0; i < nslots_; ++i) {
+			fn(slots_[i].t_);
+		}
+	}
+
+	/**
+	 * Fold the instances into a value, result = fn(result, t) starting from init
+	 */
+	template<class R, class FN>
+	R Aggregate(const R & init, FN fn) const
+	{
+		R result = init;
+		Visit([&result, &fn](const T & t) { result = fn(result, t); });
+		return result;
+	}
+
+	/**
+	 * Instances, the cores and the one shared by the threads outside the pool
+	 */
+	size_t size() const
+	{
+		return nslots_;
+	}
+
+private:
+
+	CoreLocal(const This &);
+	This & operator=(const This &);
+
+	struct Slot
+	{
+		Slot() : t_() {}
+
+		T t_;
+	} CACHELINE_ALIGNED;
+
+	const size_t nslots_;
+	Slot * slots_;
+	SpinLock lock_;		// serializes the threads outside the pool
+};
+
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <ostream>
+
+#include "schd/async-ctx.h"
+#include "schd/core-local.hpp"
+
+namespace bblocks {
+
+using namespace std;
+
+//............................................................................... CtxAccounting ....
+
+/**
+ * @class CtxAccounting
+ *
+ * Resource use per tenant, taken from the AsyncCtx of the work.
+ *
+ * The pool charges the time every routine with a context runs to the tenant. Requests report
+ * their end with Finish, which accounts the latency and whether the deadline was met. The
+ * counters are per core, so charging is a few additions on a line the core owns. Tenants from
+ * MAX_TENANTS up share the last slot. It is a singleton set up with the NonBlockingThreadPool.
+ */
+class CtxAccounting : public Singleton<CtxAccounting>
+{
+public:
+
+	static const uint32_t MAX_TENANTS = 256;
+
+	struct Stats
+	{
+		Stats()
+			: cpuInMicroSec_(0), nroutines_(0), nrequests_(0), latencyInMicroSec_(0)
+			, nlate_(0)
+		{}
+
+		Stats & operator+=(const Stats & s)
+		{
+			cpuInMicroSec_ += s.cpuInMicroSec_;
+			nroutines_ += s.nroutines_;
+			nrequests_ += s.nrequests_;
+			latencyInMicroSec_ += s.latencyInMicroSec_;
+			nlate_ += s.nlate_;
+			return *this;
+		}
+
+		uint64_t cpuInMicroSec_;	// time in routines
+		uint64_t nroutines_;		// routines run
+		uint64_t nrequests_;		// requests finished
+		uint64_t latencyInMicroSec_;	// sum of the latency of the finished requests
+		uint64_t nlate_;		// requests finished past their deadline
+	};
+
+	/**
+	 * Charge a routine that ran for elapsedInMicroSec
+	 */
+	void Charge(const AsyncCtx & ctx, const uint64_t elapsedInMicroSec)
+	{
+		ASSERT(ctx.IsSet());
+
+		stats_.Update([&ctx, elapsedInMicroSec](Table & t) {
+				      Stats & s = t.tenants_[Slot(ctx.tenant_)];
+				      s.cpuInMicroSec_ += elapsedInMicroSec;
+				      ++s.nroutines_;
+			      });
+	}
+
+	/**
+	 * The request of ctx is complete
+	 */
+	void Finish(const AsyncCtx & ctx)
+	{
+		ASSERT(ctx.IsSet());
+
+		const uint64_t now = Rdtsc::NowInMicroSec();
+		const uint64_t latency = Rdtsc::Elapsed(now, ctx.startInMicroSec_);
+		const bool isLate = ctx.HasDeadline() && now > ctx.DeadlineInMicroSec();
+
+		stats_.Update([&ctx, latency, isLate](Table & t) {
+				      Stats & s = t.tenants_[Slot(ctx.tenant_)];
+				      ++s.nrequests_;
+				      s.latencyInMicroSec_ += latency;
+				      s.nlate_ += isLate;
+			      });
+	}
+
+	/**
+	 * Stats of a tenant summed over the cores
+	 */
+	Stats Get(const uint32_t tenant) const
+	{
+		const size_t slot = Slot(tenant);
+
+		return stats_.Aggregate(Stats(), [slot](Stats r, const Table & t) {
+						return r += t.tenants_[slot];
+					});
+	}
+
+	friend ostream & operator<<(ostream & os, const CtxAccounting & a)
+	{
+		for (uint32_t i = 0; i < MAX_TENANTS; ++i) {
+			const Stats s = a.Get(i);
+
+			if (!s.nroutines_ && !s.nrequests_) {
+				continue;
+			}
+
+			os << "tenant " << i << (i == MAX_TENANTS - 1 ? "+" : "")
+			   << " cpu " << s.cpuInMicroSec_ << " us"
+			   << " routines " << s.nroutines_
+			   << " requests " << s.nrequests_
+			   << " avg-latency "
+			   << (s.nrequests_ ? s.latencyInMicroSec_ / s.nrequests_ : 0) << " us"
+			   << " late " << s.nlate_ << endl;
+		}
+
+		return os;
+	}
+
+private:
+
+	struct Table
+	{
+		Stats tenants_[MAX_TENANTS];
+	};
+
+	static size_t Slot(const uint32_t tenant)
+	{
+		return tenant < MAX_TENANTS ? tenant : MAX_TENANTS - 1;
+	}
+
+	CoreLocal<Table> stats_;
+};
+
+}
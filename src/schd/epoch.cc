@@ -0,0 +1,182 @@
+#include <vector>
+
+#include "util.h"
+#include "lock.h"
+#include "schd/epoch.h"
+
+using namespace std;
+using namespace bblocks;
+
+namespace {
+
+struct Retired
+{
+	Retired(void * ptr, void (*fn)(void *), const uint64_t epoch)
+		: ptr_(ptr), fn_(fn), epoch_(epoch)
+	{}
+
+	void * ptr_;
+	void (*fn_)(void *);
+	uint64_t epoch_;
+};
+
+/*
+ * Retired objects waiting for their grace period. Kept out of the header so that the header
+ * can be used by the logger, which sits below the lock primitives.
+ */
+PThreadMutex lock_(/*isRecursive=*/ false);
+vector<Retired> retired_;
+
+}
+
+//....................................................................................... Epoch ....
+
+atomic<uint64_t> Epoch::epoch_(1);
+atomic<size_t> Epoch::nslots_(0);
+atomic<size_t> Epoch::npending_(0);
+Epoch::Slot Epoch::slots_[Epoch::MAX_THREADS];
+
+__thread Epoch::Slot * Epoch::self_;
+thread_local Epoch::SlotOwner Epoch::owner_;
+
+Epoch::SlotOwner::~SlotOwner()
+{
+	if (!slot_) return;
+
+	ASSERT(!slot_->nesting_);
+
+	slot_->online_ = false;
+	slot_->epoch_.store(QUIESCENT, memory_order_release);
+	slot_->inuse_.store(false, memory_order_release);
+	slot_ = NULL;
+	self_ = NULL;
+}
+
+Epoch::Slot *
+Epoch::Acquire()
+{
+	for (size_t i = 0; i < MAX_THREADS; ++i) {
+		bool expected = false;
+		if (!slots_[i].inuse_.compare_exchange_strong(expected, true)) {
+			continue;
+		}
+
+		slots_[i].epoch_.store(QUIESCENT, memory_order_relaxed);
+		slots_[i].nesting_ = 0;
+		slots_[i].online_ = false;
+
+		/*
+		 * Grow the scan window to include this slot
+		 */
+		size_t n = nslots_.load();
+		while (n < i + 1 && !nslots_.compare_exchange_weak(n, i + 1));
+
+		return &slots_[i];
+	}
+
+	/*
+	 * We have run out of slots. This is a configuration error.
+	 */
+	DEADEND
+}
+
+uint64_t
+Epoch::MinActiveEpoch()
+{
+	atomic_thread_fence(memory_order_seq_cst);
+
+	uint64_t min = UINT64_MAX;
+	const size_t n = nslots_.load(memory_order_acquire);
+
+	for (size_t i = 0; i < n; ++i) {
+		const uint64_t e = slots_[i].epoch_.load(memory_order_acquire);
+		if (e != QUIESCENT && e < min) min = e;
+	}
+
+	return min;
+}
+
+void
+Epoch::Retire(void * ptr, void (*fn)(void *))
+{
+	ASSERT(ptr);
+	ASSERT(fn);
+
+	/*
+	 * The object is already unlinked. Make sure the unlink is visible before we sample the
+	 * epoch, a reader who enters a newer epoch cannot observe the object.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	size_t npending;
+
+	{
+		AutoLock _(&lock_);
+		retired_.push_back(Retired(ptr, fn, epoch_.load()));
+		npending = ++npending_;
+	}
+
+	if (npending >= RECLAIM_THRESHOLD) {
+		Reclaim();
+	}
+}
+
+size_t
+Epoch::Reclaim()
+{
+	vector<Retired> expired;
+
+	{
+		AutoLock _(&lock_);
+
+		if (retired_.empty()) return 0;
+
+		/*
+		 * Move the world to a new epoch so threads entering from here on do not hold back
+		 * the objects retired so far
+		 */
+		epoch_.fetch_add(1);
+
+		const uint64_t min = MinActiveEpoch();
+
+		size_t j = 0;
+		for (size_t i = 0; i < retired_.size(); ++i) {
+			if (retired_[i].epoch_ < min) {
+				expired.push_back(retired_[i]);
+			} else {
+				retired_[j++] = retired_[i];
+			}
+		}
+
+		retired_.erase(retired_.begin() + j, retired_.end());
+		npending_ -= expired.size();
+	}
+
+	/*
+	 * Release outside the lock, the destructors are free to retire more objects
+	 */
+	for (auto it = expired.begin(); it != expired.end(); ++it) {
+		(*it->fn_)(it->ptr_);
+	}
+
+	return expired.size();
+}
+
+void
+Epoch::Synchronize()
+{
+	ASSERT(!self_ || !self_->nesting_);
+
+	while (Pending()) {
+		/*
+		 * An online thread would otherwise wait on its own announced epoch
+		 */
+		if (IsOnline()) {
+			Quiesce();
+		}
+
+		if (!Reclaim()) {
+			sched_yield();
+		}
+	}
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <atomic>
+
+#include "defs.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//....................................................................................... Epoch ....
+
+/**
+ * Epoch based memory reclamation.
+ *
+ * Lock free readers announce the global epoch they observed for the duration of their read side
+ * critical section. Writers unlink objects from the shared structure and retire them with the
+ * epoch at which they were unlinked. A retired object is released only after every thread has
+ * either left its critical section or entered a newer epoch, at which point no reader can hold a
+ * reference to it.
+ *
+ * Read side is a store and a fence on a thread private cache line, there is no shared write.
+ *
+ * Threads that run short non-blocking routines in a loop (NonBlockingThread) can instead go
+ * online and report a quiescent state between routines (QSBR). An online thread is always inside
+ * a critical section, Enter and Exit cost nothing, and the thread pays a load per routine to
+ * report quiescence. An online thread must go offline before it blocks or it holds back the
+ * reclamation for everyone.
+ *
+ * Usage :
+ *
+ *	{
+ *		Epoch::Guard _;
+ *		... traverse lock free structure ...
+ *	}
+ *
+ *	... unlink t ...
+ *	Epoch::Retire(t);
+ */
+class Epoch
+{
+public:
+
+	static const size_t MAX_THREADS = 1024;
+	static const size_t RECLAIM_THRESHOLD = 128;
+
+	//.... Guard ....//
+
+	class Guard
+	{
+	public:
+
+		Guard() { Epoch::Enter(); }
+		~Guard() { Epoch::Exit(); }
+
+	private:
+
+		Guard(const Guard &);
+		Guard & operator=(const Guard &);
+	};
+
+	/**
+	 * Enter read side critical section. Calls can be nested.
+	 */
+	static void Enter()
+	{
+		Slot * s = Self();
+
+		if (s->online_ || s->nesting_++) return;
+
+		s->epoch_.store(epoch_.load(memory_order_relaxed), memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+
+	/**
+	 * Leave read side critical section.
+	 */
+	static void Exit()
+	{
+		Slot * s = Self();
+
+		if (s->online_) return;
+
+		ASSERT(s->nesting_);
+
+		if (--s->nesting_) return;
+
+		s->epoch_.store(QUIESCENT, memory_order_release);
+	}
+
+	/**
+	 * Announce that the calling thread holds no references to shared objects. The thread
+	 * remains in a critical section from here until the next quiescent state.
+	 */
+	static void Quiesce()
+	{
+		Slot * s = Self();
+
+		ASSERT(s->online_);
+
+		const uint64_t e = epoch_.load(memory_order_relaxed);
+
+		/*
+		 * Nothing to do unless the world moved on, the fence has been paid for already
+		 */
+		if (s->epoch_.load(memory_order_relaxed) == e) return;
+
+		/*
+		 * The release keeps the reads of the routines that ran before from moving past the
+		 * announcement, the fence keeps the reads that follow from moving ahead of it
+		 */
+		s->epoch_.store(e, memory_order_release);
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+
+	/**
+	 * Switch the calling thread to quiescent state based reclamation
+	 */
+	static void Online()
+	{
+		Slot * s = Self();
+
+		ASSERT(!s->online_);
+		ASSERT(!s->nesting_);
+
+		s->online_ = true;
+		s->epoch_.store(epoch_.load(memory_order_relaxed), memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+
+	/**
+	 * Leave quiescent state based reclamation. Must be called before the thread blocks.
+	 */
+	static void Offline()
+	{
+		Slot * s = Self();
+
+		ASSERT(s->online_);
+
+		s->online_ = false;
+		s->epoch_.store(QUIESCENT, memory_order_release);
+	}
+
+	static bool IsOnline()
+	{
+		return self_ && self_->online_;
+	}
+
+	/**
+	 * Retire an object that has been unlinked from the shared structure. The object is deleted
+	 * once it is safe to do so.
+	 */
+	template<class T>
+	static void Retire(T * t)
+	{
+		Retire((void *) t, &Delete<T>);
+	}
+
+	static void Retire(void * ptr, void (*fn)(void *));
+
+	/**
+	 * Release retired objects whose grace period has expired.
+	 *
+	 * @return	Number of objects released
+	 */
+	static size_t Reclaim();
+
+	/**
+	 * Wait until all retired objects are released. Must not be called from within a critical
+	 * section.
+	 */
+	static void Synchronize();
+
+	/**
+	 * Number of retired objects waiting for their grace period to expire.
+	 */
+	static size_t Pending()
+	{
+		return npending_.load(memory_order_relaxed);
+	}
+
+private:
+
+	static const uint64_t QUIESCENT = 0;
+
+	struct Slot
+	{
+		atomic<uint64_t> epoch_;	// Epoch observed or QUIESCENT
+		atomic<bool> inuse_;		// Slot is owned by a thread
+		uint32_t nesting_;		// Critical section nesting (owner only)
+		bool online_;			// Quiescent state based (owner only)
+	} CACHELINE_ALIGNED;
+
+	/*
+	 * Releases the thread slot when the thread exits
+	 */
+	struct SlotOwner
+	{
+		SlotOwner() : slot_(NULL) {}
+		~SlotOwner();
+
+		Slot * slot_;
+	};
+
+	template<class T>
+	static void Delete(void * ptr)
+	{
+		delete (T *) ptr;
+	}
+
+	static Slot * Self()
+	{
+		if (!self_) {
+			self_ = Acquire();
+			owner_.slot_ = self_;
+		}
+
+		return self_;
+	}
+
+	static Slot * Acquire();
+	static uint64_t MinActiveEpoch();
+
+	static atomic<uint64_t> epoch_;
+	static atomic<size_t> nslots_;
+	static atomic<size_t> npending_;
+	static Slot slots_[MAX_THREADS];
+
+	static __thread Slot * self_;
+	static thread_local SlotOwner owner_;
+};
+
+}
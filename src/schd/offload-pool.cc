@@ -0,0 +1,281 @@
+#include <algorithm>
+
+#include "schd/offload-pool.h"
+
+using namespace std;
+using namespace bblocks;
+
+//
+// OffloadThread
+//
+void *
+OffloadThread::ThreadMain()
+{
+	pool_.Work(this);
+	return NULL;
+}
+
+//
+// OffloadManager
+//
+void *
+OffloadManager::ThreadMain()
+{
+	pool_.Manage();
+	return NULL;
+}
+
+//
+// OffloadPool
+//
+OffloadPool::OffloadPool()
+	: statQueueDepth_("/offload/queue-depth", "routines", PerfCounter::COUNTER)
+	, statQueueTime_("/offload/queue-time", "microsec", PerfCounter::TIME)
+	, statRunTime_("/offload/run-time", "microsec", PerfCounter::TIME)
+	, statThreads_("/offload/threads", "threads", PerfCounter::COUNTER)
+	, log_("/offload")
+	, lock_(/*isRecursive=*/ false)
+	, qsize_(0)
+	, minth_(DEFAULT_MIN_THREADS)
+	, maxth_(DEFAULT_MAX_THREADS)
+	, nthreads_(0)
+	, nidle_(0)
+	, ngrow_(0)
+	, nextId_(0)
+	, isStopping_(false)
+	, manager_(NULL)
+{
+}
+
+OffloadPool::~OffloadPool()
+{
+	INVARIANT(!nthreads_);
+	INVARIANT(q_.IsEmpty());
+	INVARIANT(threads_.empty());
+	INVARIANT(retired_.empty());
+	INVARIANT(!manager_);
+}
+
+void
+OffloadPool::Start()
+{
+	Guard _(&lock_);
+
+	INVARIANT(!nthreads_ && !manager_);
+	isStopping_ = false;
+	ngrow_ = 0;
+
+	for (size_t i = 0; i < minth_; ++i) {
+		AddThread()->StartBlockingThread();
+	}
+
+	manager_ = new OffloadManager(log_ + "/manager", *this);
+	manager_->StartBlockingThread();
+
+	INFO(log_) << "Offload pool started. min " << minth_ << " max " << maxth_;
+}
+
+void
+OffloadPool::Shutdown()
+{
+	{
+		Guard _(&lock_);
+
+		isStopping_ = true;
+		condWork_.Broadcast();
+		condGrow_.Signal();
+
+		/*
+		 * Threads drain the queue before they exit
+		 */
+		while (nthreads_) {
+			condExit_.Wait(&lock_);
+		}
+
+		INVARIANT(q_.IsEmpty());
+		INVARIANT(threads_.empty());
+	}
+
+	/*
+	 * The manager starts no threads once it sees the stop
+	 */
+	manager_->Stop();
+	delete manager_;
+	manager_ = NULL;
+
+	Reap();
+
+	INFO(log_) << statQueueDepth_;
+	INFO(log_) << statQueueTime_;
+	INFO(log_) << statRunTime_;
+	INFO(log_) << statThreads_;
+}
+
+void
+OffloadPool::SetLimits(const size_t minth, const size_t maxth)
+{
+	INVARIANT(minth && minth <= maxth);
+
+	Guard _(&lock_);
+
+	minth_ = minth;
+	maxth_ = maxth;
+
+	/*
+	 * Wake up idle threads so the ones above the limit can retire
+	 */
+	condWork_.Broadcast();
+}
+
+bool
+OffloadPool::Push(Routine * r)
+{
+	ASSERT(r);
+
+	r->queuedAtInMicroSec_ = Rdtsc::NowInMicroSec();
+
+	Guard _(&lock_);
+
+	if (isStopping_) {
+		/*
+		 * BBlocks::Shutdown stops us before the thread pool, routines still running there
+		 * may offload
+		 */
+		return false;
+	}
+
+	q_.Push(r);
+	++qsize_;
+
+	statQueueDepth_.Update(qsize_);
+
+	if (qsize_ > nidle_ && nthreads_ + ngrow_ < maxth_) {
+		/*
+		 * Every thread is busy or already spoken for. Work is pushed from the
+		 * non-blocking cores, the manager creates the thread.
+		 */
+		++ngrow_;
+		condGrow_.Signal();
+	} else {
+		condWork_.Signal();
+	}
+
+	return true;
+}
+
+OffloadThread *
+OffloadPool::AddThread()
+{
+	OffloadThread * th = new OffloadThread(log_ + "/th/" + STR(nextId_++), *this);
+	threads_.push_back(th);
+	++nthreads_;
+
+	statThreads_.Update(nthreads_);
+
+	return th;
+}
+
+void
+OffloadPool::Manage()
+{
+	while (true) {
+		OffloadThread * th = NULL;
+
+		{
+			Guard _(&lock_);
+
+			while (!ngrow_ && !isStopping_) {
+				condGrow_.Wait(&lock_);
+			}
+
+			if (isStopping_) {
+				return;
+			}
+
+			--ngrow_;
+			th = AddThread();
+		}
+
+		/*
+		 * The thread is accounted, start it out of the lock
+		 */
+		th->StartBlockingThread();
+	}
+}
+
+void
+OffloadPool::Reap()
+{
+	threads_t retired;
+
+	{
+		Guard _(&lock_);
+		retired.swap(retired_);
+	}
+
+	/*
+	 * The threads are past their last use of the pool, the join is quick. Joins happen on
+	 * the pool threads or at shutdown, never on the non-blocking cores.
+	 */
+	for (auto th : retired) {
+		th->Stop();
+		delete th;
+	}
+}
+
+void
+OffloadPool::Work(OffloadThread * th)
+{
+	while (true) {
+		Reap();
+
+		Routine * r = NULL;
+
+		{
+			Guard _(&lock_);
+
+			while (q_.IsEmpty()) {
+				const bool isExtra = nthreads_ > maxth_;
+
+				if (isStopping_ || isExtra) {
+					break;
+				}
+
+				++nidle_;
+				const bool isSignalled = condWork_.Wait(&lock_, IDLE_TIMEOUT_MS);
+				--nidle_;
+
+				if (!isSignalled && q_.IsEmpty() && nthreads_ > minth_) {
+					/*
+					 * Idle for too long
+					 */
+					break;
+				}
+			}
+
+			if (q_.IsEmpty()) {
+				/*
+				 * Retire
+				 */
+				threads_.erase(find(threads_.begin(), threads_.end(), th));
+				retired_.push_back(th);
+				--nthreads_;
+
+				DEBUG(log_) << "Retiring thread. nthreads " << nthreads_;
+
+				condExit_.Broadcast();
+				return;
+			}
+
+			r = static_cast<Routine *>(q_.Pop());
+			--qsize_;
+		}
+
+		const uint64_t startInMicroSec = Rdtsc::NowInMicroSec();
+		statQueueTime_.Update(Rdtsc::Elapsed(startInMicroSec, r->queuedAtInMicroSec_));
+
+		r->Run();
+
+		statRunTime_.Update(Rdtsc::Elapsed(Rdtsc::NowInMicroSec(), startInMicroSec));
+	}
+}
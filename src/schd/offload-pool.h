@@ -0,0 +1,183 @@
+#pragma once
+
+#include <vector>
+
+#include "util.h"
+#include "lock.h"
+#include "perf/perf-counter.h"
+#include "schd/thread-pool.h"
+
+namespace bblocks {
+
+template<class T1> struct CompletionHandler;
+
+class OffloadPool;
+
+//............................................................................... OffloadThread ....
+
+class OffloadThread : public Thread
+{
+public:
+
+	OffloadThread(const string & path, OffloadPool & pool)
+		: Thread(path), pool_(pool)
+	{}
+
+	virtual void * ThreadMain() override;
+
+private:
+
+	OffloadPool & pool_;
+};
+
+//.............................................................................. OffloadManager ....
+
+/*
+ * Grows the pool on behalf of the threads that push work
+ */
+class OffloadManager : public Thread
+{
+public:
+
+	OffloadManager(const string & path, OffloadPool & pool)
+		: Thread(path), pool_(pool)
+	{}
+
+	virtual void * ThreadMain() override;
+
+private:
+
+	OffloadPool & pool_;
+};
+
+//................................................................................. OffloadPool ....
+
+/**
+ * @class OffloadPool
+ *
+ * Elastic pool of blocking threads for work that can not run on the non-blocking cores, like
+ * getaddrinfo, open, fsync or a synchronous device write. The pool grows by a thread whenever
+ * work is queued with no idle thread to pick it up, up to the configured maximum, and threads
+ * idle for longer than IDLE_TIMEOUT_MS retire down to the minimum. Threads are created by a
+ * manager thread of the pool, pushing work never waits on thread creation.
+ *
+ * The result of the work is delivered through a completion handler. Asynchronous handlers are
+ * scheduled on the core the work was offloaded from, so the caller's state stays core local.
+ * Interrupt handlers are invoked on the blocking thread.
+ */
+class OffloadPool : public Singleton<OffloadPool>
+{
+public:
+
+	friend class OffloadThread;
+	friend class OffloadManager;
+
+	static const size_t DEFAULT_MIN_THREADS = 1;
+	static const size_t DEFAULT_MAX_THREADS = 64;
+	static const uint32_t IDLE_TIMEOUT_MS = 5 * 1000; // 5s
+
+	/*
+	 * Work item, carries the time it was queued for the latency stats
+	 */
+	struct Routine : ThreadRoutine
+	{
+		uint64_t queuedAtInMicroSec_;
+	};
+
+	template<class FN, class T>
+	struct FnRoutine : Routine
+	{
+		FnRoutine(FN fn, const CompletionHandler<T> & h, const int core)
+			: fn_(fn), h_(h), core_(core)
+		{}
+
+		virtual void Run() override
+		{
+			h_.WakeupOn(core_, fn_());
+			delete this;
+		}
+
+		FN fn_;
+		CompletionHandler<T> h_;
+		const int core_;
+	};
+
+	OffloadPool();
+	~OffloadPool();
+
+	void Start();
+
+	/**
+	 * Drain the queued work and stop all threads
+	 */
+	void Shutdown();
+
+	/**
+	 * Bounds for the number of threads. Can be changed while the pool is running, extra
+	 * threads retire as they go idle.
+	 */
+	void SetLimits(const size_t minth, const size_t maxth);
+
+	/**
+	 * Run fn on a blocking thread and pass its result to h
+	 *
+	 * @return	false if the pool is shutting down, fn is not run and h is not called
+	 */
+	template<class FN, class T>
+	bool Offload(FN fn, const CompletionHandler<T> & h)
+	{
+		FnRoutine<FN, T> * r = new FnRoutine<FN, T>(fn, h,
+							    NonBlockingThreadPool::CurrentCore());
+
+		if (!Push(r)) {
+			delete r;
+			return false;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Queue r, or refuse it once the pool is shutting down
+	 */
+	bool Push(Routine * r);
+
+	size_t nthreads() const
+	{
+		return nthreads_;
+	}
+
+	PerfCounter statQueueDepth_;	// queued work, sampled on push
+	PerfCounter statQueueTime_;	// time from push to start
+	PerfCounter statRunTime_;	// time to run
+	PerfCounter statThreads_;	// threads, sampled when a thread is added
+
+private:
+
+	typedef vector<OffloadThread *> threads_t;
+
+	OffloadThread * AddThread();
+	void Work(OffloadThread * th);
+	void Manage();
+	void Reap();
+
+	const string log_;
+	PThreadMutex lock_;
+	WaitCondition condWork_;
+	WaitCondition condExit_;
+	WaitCondition condGrow_;
+	InList<ThreadRoutine> q_;
+	size_t qsize_;
+	size_t minth_;
+	size_t maxth_;
+	size_t nthreads_;
+	size_t nidle_;
+	size_t ngrow_;		// threads asked of the manager
+	uint64_t nextId_;
+	bool isStopping_;
+	threads_t threads_;	// live threads
+	threads_t retired_;	// exited threads waiting to be joined
+	OffloadManager * manager_;
+};
+
+}
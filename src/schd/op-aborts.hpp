@@ -0,0 +1,264 @@
+#pragma once
+
+#include <atomic>
+
+#include "async.h"
+#include "ds/inslist.hpp"
+#include "schd/cancel-token.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//................................................................................. OpAborts<T> ....
+
+/**
+ * @class OpAborts
+ *
+ * Deadline and cancellation bookkeeping for the ops of T, shared by the transport channels and
+ * the block devices.
+ *
+ * Ops derive from OpAborts<T>::Op. They are armed with their OpCtl when issued and disarmed when
+ * they complete. A deadline or a cancellation is delivered from a routine, never with a lock
+ * held, as
+ *
+ *	void T::AbortOp(OpAborts<T>::Timer * t, uint64_t id, int status)
+ *
+ * with the timer that fired, or NULL for a cancellation. AbortOp looks the op up by id, so an
+ * abort that comes after the op completed finds nothing, hands the timer back with TimerFired
+ * and puts back its reference.
+ *
+ * Timers and aborts in flight hold a reference, T has to stay until they are back. A stop waits
+ * for them: Park holds the stop handle with a reference of its own, the handle comes back out of
+ * PutStopRef with the last reference.
+ *
+ * Arm, TimerFired and the stop calls are serialized by T, channels call them under their lock.
+ * AbortOp is private to T, which befriends OpAborts<T>.
+ */
+template<class T>
+class OpAborts
+{
+public:
+
+	typedef Fn<int> StopDoneHandle;
+
+	/**
+	 * Fires the deadline of an op
+	 */
+	struct Timer : ThreadRoutine
+	{
+		Timer(T * owner, const uint64_t id) : owner_(owner), id_(id) {}
+
+		virtual void Run() override
+		{
+			owner_->AbortOp(this, id_, TIMEDOUT);
+		}
+
+		T * owner_;
+		const uint64_t id_;
+	};
+
+	/**
+	 * Deadline and cancellation state of an op
+	 */
+	struct Op : Cancellable
+	{
+		Op() : aborts_(NULL), id_(0), token_(NULL), timer_(NULL) {}
+
+		virtual void Cancel() override
+		{
+			/*
+			 * Called with the token lock held, abort from a routine
+			 */
+			aborts_->Abort(id_, CANCELLED);
+		}
+
+		OpAborts<T> * aborts_;
+		uint64_t id_;
+		CancelToken * token_;
+		Timer * timer_;
+	};
+
+	explicit OpAborts(T * owner)
+		: owner_(owner), lastOpId_(0), nrefs_(0), stoph_(NULL)
+	{}
+
+	~OpAborts()
+	{
+		ASSERT(!nrefs_);
+		delete stoph_;
+	}
+
+	/**
+	 * Give the op an id and arm its deadline and token
+	 *
+	 * @return	false if the token is cancelled already
+	 */
+	bool Arm(Op * op, const OpCtl & ctl)
+	{
+		op->aborts_ = this;
+		op->id_ = ++lastOpId_;
+
+		if (ctl.token_) {
+			if (!ctl.token_->Register(op)) {
+				return false;
+			}
+
+			op->token_ = ctl.token_;
+		}
+
+		if (ctl.timeoutMs_) {
+			op->timer_ = new Timer(owner_, op->id_);
+			++nrefs_;
+			BBlocks::ScheduleIn(ctl.timeoutMs_, op->timer_);
+		}
+
+		return true;
+	}
+
+	/**
+	 * The op completed, call off its deadline and token
+	 */
+	void Disarm(Op * op)
+	{
+		if (op->token_) {
+			/*
+			 * If the token has fired already the abort is in flight and finds no op
+			 */
+			op->token_->Unregister(op);
+			op->token_ = NULL;
+		}
+
+		if (op->timer_) {
+			if (BBlocks::CancelTimer(op->timer_)) {
+				delete op->timer_;
+				--nrefs_;
+			}
+
+			/*
+			 * Otherwise the timer is on its way to run, AbortOp hands it back
+			 */
+			op->timer_ = NULL;
+		}
+	}
+
+	/**
+	 * AbortOp is done with timer t, op is the op it found or NULL
+	 */
+	static void TimerFired(Op * op, Timer * t)
+	{
+		if (!t) return;
+
+		if (op && op->timer_) {
+			ASSERT(op->timer_ == t);
+			op->timer_ = NULL;
+		}
+
+		delete t;
+	}
+
+	/**
+	 * Pending op of a channel with the id, its read or one of its queued writes
+	 */
+	template<class R, class W>
+	static Op * Find(const uint64_t id, R * rctx, const InSQueue<W> & wpending)
+	{
+		if (rctx && rctx->id_ == id) {
+			return rctx;
+		}
+
+		for (W * w = wpending.Front(); w; w = w->snext_) {
+			if (w->id_ == id) {
+				return w;
+			}
+		}
+
+		return NULL;
+	}
+
+	void GetRef()
+	{
+		++nrefs_;
+	}
+
+	/**
+	 * @return	true if that was the last reference
+	 */
+	bool PutRef()
+	{
+		ASSERT(nrefs_);
+		return !--nrefs_;
+	}
+
+	/**
+	 * Hold the stop handle until the references are back. Takes a reference, to be put back
+	 * once T is done stopping.
+	 */
+	void Park(const StopDoneHandle & h)
+	{
+		INVARIANT(!stoph_);
+		stoph_ = new StopDoneHandle(h);
+		++nrefs_;
+	}
+
+	bool IsStopping() const
+	{
+		return stoph_;
+	}
+
+	/**
+	 * No timer, abort or stop in flight, T can go
+	 */
+	bool IsIdle() const
+	{
+		return !nrefs_ && !stoph_;
+	}
+
+	/**
+	 * Put back a reference, the parked stop handle comes with the last one. The caller
+	 * wakes it up and deletes it.
+	 */
+	StopDoneHandle * PutStopRef()
+	{
+		if (!PutRef() || !stoph_) {
+			return NULL;
+		}
+
+		StopDoneHandle * h = stoph_;
+		stoph_ = NULL;
+		return h;
+	}
+
+	/**
+	 * Wake up and free the stop handle PutStopRef handed out, if any. Call without the lock.
+	 */
+	static void StopDone(StopDoneHandle * h)
+	{
+		if (h) {
+			h->Wakeup(/*status=*/ 0);
+			delete h;
+		}
+	}
+
+private:
+
+	OpAborts(const OpAborts<T> &);
+	OpAborts<T> & operator=(const OpAborts<T> &);
+
+	void Abort(const uint64_t id, const int status)
+	{
+		++nrefs_;
+
+		Timer * t = NULL;
+		uint64_t opid = id;
+		int st = status;
+		BBlocks::Schedule(owner_, &T::AbortOp, t, opid, st);
+	}
+
+	T * owner_;
+	uint64_t lastOpId_;		// id of the last op armed
+	atomic<uint32_t> nrefs_;	// timers, aborts and stop in flight
+	StopDoneHandle * stoph_;	// parked stop, if any
+};
+
+}
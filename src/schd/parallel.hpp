@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+
+#include "async.h"
+#include "lock.h"
+
+namespace bblocks {
+
+using namespace std;
+
+/**
+ * Data parallel loops on the thread pool
+ *
+ * The range [begin, end) is split recursively in halves until the pieces are no larger than the
+ * grain. Every split hands the upper half to the pool as a new routine and keeps the lower half,
+ * so the work fans out across the threads in log steps. Every routine runs exactly one piece and
+ * returns to its thread, the routines queued for other work get their turn in between pieces.
+ * Pick a grain that keeps a piece well within the watchdog budget.
+ *
+ * Completion is reported through a Fn, nothing blocks waiting for the pieces.
+ */
+
+//.............................................................................. ParallelForCtx ....
+
+template<class FN>
+class ParallelForCtx
+{
+public:
+
+	typedef ParallelForCtx<FN> This;
+
+	ParallelForCtx(const size_t grain, FN fn, const Fn<int> & done)
+		: grain_(grain), fn_(fn), done_(done), pending_(1)
+	{
+		INVARIANT(grain_);
+	}
+
+	void Run(size_t begin, size_t end)
+	{
+		while (end - begin > grain_) {
+			size_t mid = begin + (end - begin) / 2;
+
+			++pending_;
+			BBlocks::Schedule(this, &This::Run, mid, end);
+
+			end = mid;
+		}
+
+		fn_(begin, end);
+
+		if (!--pending_) {
+			done_.Wakeup(/*status=*/ 0);
+			delete this;
+		}
+	}
+
+private:
+
+	const size_t grain_;
+	FN fn_;
+	Fn<int> done_;
+	atomic<size_t> pending_;
+};
+
+//................................................................................. ParallelFor ....
+
+/**
+ * Invoke fn(begin, end) on pieces of [begin, end) no larger than grain, in parallel. done is
+ * woken up with 0 once every piece has run.
+ */
+template<class FN>
+void
+ParallelFor(const size_t begin, const size_t end, const size_t grain, FN fn, const Fn<int> & done)
+{
+	if (begin >= end) {
+		Fn<int> h(done);
+		h.Wakeup(/*status=*/ 0);
+		return;
+	}
+
+	size_t b = begin, e = end;
+	BBlocks::Schedule(new ParallelForCtx<FN>(grain, fn, done),
+			  &ParallelForCtx<FN>::Run, b, e);
+}
+
+//........................................................................... ParallelReduceCtx ....
+
+template<class T, class MAP, class COMBINE>
+class ParallelReduceCtx : public CompletionHandle
+{
+public:
+
+	typedef ParallelReduceCtx<T, MAP, COMBINE> This;
+
+	ParallelReduceCtx(const T & identity, MAP map, COMBINE combine, const Fn<T> & done)
+		: lock_("/parallel-reduce"), result_(identity)
+		, map_(map), combine_(combine), done_(done)
+	{}
+
+	/*
+	 * Map a piece and fold it into the result
+	 */
+	void operator()(const size_t begin, const size_t end)
+	{
+		const T t = map_(begin, end);
+
+		Guard _(&lock_);
+		result_ = combine_(result_, t);
+	}
+
+	void Done(int) __async_fn__
+	{
+		done_.Wakeup(result_);
+		delete this;
+	}
+
+private:
+
+	SpinMutex lock_;
+	T result_;
+	MAP map_;
+	COMBINE combine_;
+	Fn<T> done_;
+};
+
+//.............................................................................. ParallelReduce ....
+
+/**
+ * Reduce [begin, end) in parallel. map(begin, end) reduces a piece no larger than grain to a T
+ * and combine(T, T) folds two of them. The pieces are folded in no particular order, so combine
+ * has to be associative and commutative. done is woken up with the result.
+ */
+template<class T, class MAP, class COMBINE>
+void
+ParallelReduce(const size_t begin, const size_t end, const size_t grain, const T & identity,
+	       MAP map, COMBINE combine, const Fn<T> & done)
+{
+	typedef ParallelReduceCtx<T, MAP, COMBINE> ctx_t;
+
+	ctx_t * ctx = new ctx_t(identity, map, combine, done);
+
+	/*
+	 * The loop body refers to the context, which outlives the loop
+	 */
+	ParallelFor(begin, end, grain,
+		    [ctx](const size_t b, const size_t e) { (*ctx)(b, e); },
+		    intr_fn(ctx, &ctx_t::Done));
+}
+
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+#include "defs.h"
+#include "schd/epoch.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//................................................................................. Snapshot<T> ....
+
+/**
+ * @class Snapshot
+ *
+ * RCU style holder for read mostly state.
+ *
+ * Readers get a pointer to an immutable version of T with a single load. Writers publish a new
+ * version with an atomic pointer swap and retire the old version to Epoch, which releases it once
+ * every reader has passed a quiescent state. NonBlockingThreads are always online with Epoch, so
+ * routines running on the thread pool can read without any guard. Other threads have to hold an
+ * Epoch::Guard across the use of the pointer, or use Read().
+ *
+ * Writers are not serialized against each other by a lock, Update() retries on conflict.
+ */
+template<class T>
+class Snapshot
+{
+public:
+
+	explicit Snapshot(T * t = new T())
+		: t_(t)
+	{
+		ASSERT(t);
+	}
+
+	/*
+	 * Caller has to ensure there are no readers left
+	 */
+	~Snapshot()
+	{
+		delete t_.load(memory_order_relaxed);
+	}
+
+	/**
+	 * Current version. Valid until the calling thread leaves its read side critical section.
+	 */
+	const T * Get() const
+	{
+		return t_.load(memory_order_acquire);
+	}
+
+	/**
+	 * Invoke fn with the current version inside a read side critical section
+	 */
+	template<class FN>
+	auto Read(FN fn) const -> decltype(fn(declval<const T &>()))
+	{
+		Epoch::Guard _;
+		return fn(*Get());
+	}
+
+	/**
+	 * Publish a new version. The snapshot takes ownership of t.
+	 */
+	void Set(T * t)
+	{
+		ASSERT(t);
+		Epoch::Retire(t_.exchange(t, memory_order_acq_rel));
+	}
+
+	/**
+	 * Copy, modify and publish. fn may be invoked more than once if there are concurrent
+	 * writers.
+	 */
+	template<class FN>
+	void Update(FN fn)
+	{
+		Epoch::Guard _;
+
+		T * old = t_.load(memory_order_acquire);
+
+		while (true) {
+			T * t = new T(*old);
+			fn(*t);
+
+			if (t_.compare_exchange_strong(old, t, memory_order_acq_rel)) {
+				break;
+			}
+
+			delete t;
+		}
+
+		Epoch::Retire(old);
+	}
+
+private:
+
+	Snapshot(const Snapshot &);
+	Snapshot & operator=(const Snapshot &);
+
+	atomic<T *> t_;
+};
+
+}
@@ -0,0 +1,375 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "async.h"
+#include "lock.h"
+#include "bblocks.h"
+#include "perf/perf-counter.h"
+
+namespace bblocks {
+
+using namespace std;
+
+/**
+ * Staged event pipeline on the thread pool
+ *
+ * A stage is a bounded queue of events and a handler. The handler runs in routines on the
+ * NonBlockingThreadPool, at most share of them at a time, so a stage never takes more than its
+ * share of the cores. A routine moves up to a batch of events out of the queue under a single
+ * lock acquisition, handles them, pushes everything they produced to the next stage in one go
+ * and yields back to the pool.
+ *
+ * A stage whose next stage is full stops draining its own queue until the next stage has
+ * drained below half its capacity. Its queue then fills up in turn, so backpressure travels
+ * upstream stage by stage until it reaches the producer, which sees TryPush fail.
+ */
+
+//.............................................................................. StageInput<IN> ....
+
+/**
+ * @class StageInput
+ *
+ * The queue side of a stage, what the producer or the previous stage pushes to.
+ */
+template<class IN>
+class StageInput : public CompletionHandle
+{
+public:
+
+	StageInput(const string & path, const size_t capacity, const size_t share,
+		   const size_t batch)
+		: statQueueDepth_(path + "/queue-depth", "events", PerfCounter::COUNTER)
+		, statQueueTime_(path + "/queue-time", "microsec", PerfCounter::TIME)
+		, statBatch_(path + "/batch", "events", PerfCounter::COUNTER)
+		, statBlocked_(path + "/blocked", "stalls", PerfCounter::COUNTER)
+		, log_(path)
+		, capacity_(capacity)
+		, share_(share)
+		, batch_(batch)
+		, lock_(path)
+		, size_(0)
+		, nactive_(0)
+		, isBlocked_(false)
+	{
+		INVARIANT(capacity_ && share_ && batch_);
+	}
+
+	virtual ~StageInput()
+	{
+		INVARIANT(q_.empty());
+		INVARIANT(!nactive_);
+		INVARIANT(waiters_.empty());
+
+		INFO(log_) << statQueueDepth_;
+		INFO(log_) << statQueueTime_;
+		INFO(log_) << statBatch_;
+		INFO(log_) << statBlocked_;
+	}
+
+	/**
+	 * Queue an event, fails if the stage is at capacity. The producer can use WaitForSpace to
+	 * learn when to retry.
+	 */
+	bool TryPush(const IN & e)
+	{
+		size_t nworkers;
+
+		{
+			Guard _(&lock_);
+
+			if (q_.size() >= capacity_) {
+				return false;
+			}
+
+			q_.push_back(Item(e));
+			nworkers = Grow();
+		}
+
+		Kick(nworkers);
+		return true;
+	}
+
+	/**
+	 * Wake up h with 0 once the stage has drained below half its capacity, right away if it
+	 * already has
+	 */
+	void WaitForSpace(const Fn<int> & h)
+	{
+		{
+			Guard _(&lock_);
+
+			if (q_.size() > capacity_ / 2) {
+				waiters_.push_back(h);
+				return;
+			}
+		}
+
+		Fn<int> fn(h);
+		fn.Wakeup(/*status=*/ 0);
+	}
+
+	bool IsFull() const
+	{
+		return size_ >= capacity_;
+	}
+
+	size_t Size() const
+	{
+		return size_;
+	}
+
+	/**
+	 * No event queued or being handled
+	 */
+	bool IsIdle() const
+	{
+		return !size_ && !nactive_;
+	}
+
+	/*
+	 * Batch from the previous stage. The previous stage checks for room before it takes a
+	 * batch, so the queue can go over capacity by at most a batch per routine of the previous
+	 * stage.
+	 */
+	template<class OUT>
+	void PushBatch(vector<OUT> & events)
+	{
+		size_t nworkers;
+
+		{
+			Guard _(&lock_);
+
+			const uint64_t nowInMicroSec = Rdtsc::NowInMicroSec();
+			for (auto & e : events) {
+				q_.push_back(Item(e, nowInMicroSec));
+			}
+
+			nworkers = Grow();
+		}
+
+		events.clear();
+		Kick(nworkers);
+	}
+
+	PerfCounter statQueueDepth_;	// events queued, sampled on push
+	PerfCounter statQueueTime_;	// time from push to handle
+	PerfCounter statBatch_;		// events moved out of the queue per routine
+	PerfCounter statBlocked_;	// stalls on a full next stage
+
+protected:
+
+	typedef StageInput<IN> This;
+
+	struct Item
+	{
+		Item(const IN & e, const uint64_t queuedAtInMicroSec = Rdtsc::NowInMicroSec())
+			: e_(e), queuedAtInMicroSec_(queuedAtInMicroSec)
+		{}
+
+		IN e_;
+		uint64_t queuedAtInMicroSec_;
+	};
+
+	typedef vector<Item> items_t;
+
+	virtual void Drain(int) = 0;
+
+	/*
+	 * Take the next batch off the queue, false when the queue is empty and the routine has
+	 * to exit
+	 */
+	bool Take(items_t & items)
+	{
+		vector<Fn<int>> waiters;
+
+		{
+			Guard _(&lock_);
+
+			if (q_.empty()) {
+				--nactive_;
+				return false;
+			}
+
+			while (!q_.empty() && items.size() < batch_) {
+				items.push_back(q_.front());
+				q_.pop_front();
+			}
+
+			size_ = q_.size();
+
+			if (q_.size() <= capacity_ / 2) {
+				waiters.swap(waiters_);
+			}
+		}
+
+		statBatch_.Update(items.size());
+
+		for (auto & h : waiters) {
+			h.Wakeup(/*status=*/ 0);
+		}
+
+		return true;
+	}
+
+	/*
+	 * The next stage is full, park the routine. The first routine to park waits for the next
+	 * stage to drain.
+	 */
+	template<class OUT>
+	void Block(StageInput<OUT> * next)
+	{
+		bool isFirst;
+
+		{
+			Guard _(&lock_);
+
+			--nactive_;
+			isFirst = !isBlocked_;
+			isBlocked_ = true;
+		}
+
+		if (isFirst) {
+			statBlocked_.Update(/*val=*/ 1);
+			next->WaitForSpace(intr_fn(this, &This::Resume));
+		}
+	}
+
+	void Resume(int) __intr_fn__
+	{
+		size_t nworkers;
+
+		{
+			Guard _(&lock_);
+
+			isBlocked_ = false;
+			nworkers = Grow();
+		}
+
+		Kick(nworkers);
+	}
+
+	/*
+	 * Routines to add for the queued events, called with the lock held
+	 */
+	size_t Grow()
+	{
+		size_ = q_.size();
+		statQueueDepth_.Update(size_);
+
+		if (isBlocked_) {
+			return 0;
+		}
+
+		size_t n = 0;
+		while (nactive_ < share_ && nactive_ * batch_ < q_.size()) {
+			++nactive_;
+			++n;
+		}
+
+		return n;
+	}
+
+	void Kick(size_t n)
+	{
+		while (n--) {
+			BBlocks::Schedule(this, &This::Drain, /*val=*/ 0);
+		}
+	}
+
+	const string log_;
+	const size_t capacity_;
+	const size_t share_;		// max routines running the stage
+	const size_t batch_;		// max events moved per routine
+	SpinMutex lock_;
+	deque<Item> q_;
+	atomic<size_t> size_;		// q_.size(), readable without the lock
+	atomic<size_t> nactive_;	// routines scheduled or running
+	bool isBlocked_;		// waiting for the next stage to drain
+	vector<Fn<int>> waiters_;	// waiting for the queue to drain
+};
+
+//.............................................................................. Stage<IN, OUT> ....
+
+/**
+ * @class Stage
+ *
+ * A stage handling events of type IN and producing events of type OUT for the next stage. The
+ * last stage of a pipeline has no next stage and produces nothing.
+ */
+template<class IN, class OUT = IN>
+class Stage : public StageInput<IN>
+{
+public:
+
+	typedef StageInput<IN> Base;
+
+	static const size_t DEFAULT_CAPACITY = 1024;
+	static const size_t DEFAULT_SHARE = 1;
+	static const size_t DEFAULT_BATCH = 32;
+
+	Stage(const string & path, const size_t capacity = DEFAULT_CAPACITY,
+	      const size_t share = DEFAULT_SHARE, const size_t batch = DEFAULT_BATCH)
+		: Base(path, capacity, share, batch)
+		, next_(NULL)
+	{}
+
+	virtual ~Stage() {}
+
+	/**
+	 * Connect the stage that takes the events this stage produces, before any event is pushed
+	 */
+	void SetNext(StageInput<OUT> * next)
+	{
+		INVARIANT(next && !next_);
+		next_ = next;
+	}
+
+protected:
+
+	/**
+	 * Handle an event, the events for the next stage are appended to out
+	 */
+	virtual void Handle(IN & e, vector<OUT> & out) = 0;
+
+private:
+
+	typedef typename Base::items_t items_t;
+
+	virtual void Drain(int) override
+	{
+		if (next_ && next_->IsFull()) {
+			Base::Block(next_);
+			return;
+		}
+
+		items_t items;
+		if (!Base::Take(items)) {
+			return;
+		}
+
+		vector<OUT> out;
+		const uint64_t nowInMicroSec = Rdtsc::NowInMicroSec();
+		for (auto & item : items) {
+			Base::statQueueTime_.Update(Rdtsc::Elapsed(nowInMicroSec,
+								   item.queuedAtInMicroSec_));
+			Handle(item.e_, out);
+		}
+
+		if (!out.empty()) {
+			INVARIANT(next_);
+			next_->PushBatch(out);
+		}
+
+		/*
+		 * Yield to the pool between batches
+		 */
+		Base::Kick(/*n=*/ 1);
+	}
+
+	StageInput<OUT> * next_;
+};
+
+}
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "async.h"
+#include "bblocks.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//................................................................................... TaskGraph ....
+
+/**
+ * @class TaskGraph
+ *
+ * Runs a set of tasks with dependencies between them, like reading from three devices, merging
+ * the data and writing the result to two channels.
+ *
+ * A task is either a CPU task, a function run on the thread pool, or an async task, a function
+ * that starts an operation and reports its status through the Fn<int> it is handed. Every task
+ * carries a join counter of its unfinished dependencies. The task that brings a counter to zero
+ * schedules the dependent on the core it completed on, so the data it produced is still in the
+ * cache when the dependent runs. Completions reported on a thread outside the pool are scheduled
+ * on any core.
+ *
+ * A failed async task fails the graph. Tasks that are not started yet are skipped, the ones
+ * already running are left to complete, and done is woken up with the first error once nothing
+ * is left in flight.
+ *
+ * The graph is built from a single thread and can be run once. It has to outlive the completion.
+ */
+class TaskGraph
+{
+public:
+
+	typedef TaskGraph This;
+	typedef size_t TaskId;
+
+	TaskGraph() : status_(0), pending_(0), isStarted_(false) {}
+
+	~TaskGraph()
+	{
+		INVARIANT(!pending_);
+
+		for (auto t : tasks_) {
+			delete t;
+		}
+	}
+
+	/**
+	 * Add a task that runs fn() on the thread pool
+	 */
+	template<class FN>
+	TaskId AddTask(FN fn)
+	{
+		return Add(new CpuTask<FN>(fn));
+	}
+
+	/**
+	 * Add a task that starts an operation with fn(done), the operation wakes up done with its
+	 * status when it completes
+	 */
+	template<class FN>
+	TaskId AddAsyncTask(FN fn)
+	{
+		return Add(new AsyncTask<FN>(fn));
+	}
+
+	/**
+	 * Task to can not start until task from has completed
+	 */
+	void AddEdge(const TaskId from, const TaskId to)
+	{
+		INVARIANT(!isStarted_);
+		INVARIANT(from < tasks_.size() && to < tasks_.size() && from != to);
+
+		tasks_[from]->next_.push_back(tasks_[to]);
+		++tasks_[to]->ndeps_;
+	}
+
+	/**
+	 * Start the tasks with no dependencies. done is woken up with 0 once every task has
+	 * completed, or with the status of the first failed task.
+	 */
+	void Run(const Fn<int> & done)
+	{
+		INVARIANT(!isStarted_);
+		INVARIANT(IsAcyclic());
+
+		isStarted_ = true;
+		done_ = done;
+
+		if (tasks_.empty()) {
+			done_.Wakeup(/*status=*/ 0);
+			return;
+		}
+
+		pending_ = tasks_.size();
+
+		vector<Task *> roots;
+		for (auto t : tasks_) {
+			t->pending_ = t->ndeps_;
+			if (!t->ndeps_) {
+				roots.push_back(t);
+			}
+		}
+
+		/*
+		 * The last root can complete the graph, nothing of the graph can be touched once
+		 * they are all scheduled
+		 */
+		for (auto t : roots) {
+			BBlocks::Schedule(this, &This::Start, t);
+		}
+	}
+
+	size_t size() const
+	{
+		return tasks_.size();
+	}
+
+private:
+
+	struct Task : CompletionHandle
+	{
+		Task() : graph_(NULL), id_(0), ndeps_(0), pending_(0) {}
+		virtual ~Task() {}
+
+		virtual void Start() = 0;
+
+		void Done(int status) __intr_fn__
+		{
+			graph_->Complete(this, status);
+		}
+
+		TaskGraph * graph_;
+		TaskId id_;
+		vector<Task *> next_;		// dependents
+		uint32_t ndeps_;		// dependencies
+		atomic<uint32_t> pending_;	// dependencies yet to complete
+	};
+
+	template<class FN>
+	struct CpuTask : Task
+	{
+		CpuTask(FN fn) : fn_(fn) {}
+
+		virtual void Start() override
+		{
+			fn_();
+			Task::Done(/*status=*/ 0);
+		}
+
+		FN fn_;
+	};
+
+	template<class FN>
+	struct AsyncTask : Task
+	{
+		AsyncTask(FN fn) : fn_(fn) {}
+
+		virtual void Start() override
+		{
+			fn_(intr_fn(static_cast<Task *>(this), &Task::Done));
+		}
+
+		FN fn_;
+	};
+
+	TaskId Add(Task * t)
+	{
+		INVARIANT(!isStarted_);
+
+		t->graph_ = this;
+		t->id_ = tasks_.size();
+		tasks_.push_back(t);
+		return t->id_;
+	}
+
+	void Start(Task * t)
+	{
+		if (status_) {
+			/*
+			 * The graph has failed, skip the task
+			 */
+			Complete(t, /*status=*/ 0);
+			return;
+		}
+
+		t->Start();
+	}
+
+	void Complete(Task * t, const int status)
+	{
+		if (status) {
+			int ok = 0;
+			status_.compare_exchange_strong(ok, status);
+		}
+
+		const int core = NonBlockingThreadPool::CurrentCore();
+
+		for (auto next : t->next_) {
+			if (--next->pending_) {
+				continue;
+			}
+
+			/*
+			 * Last dependency, run the task where the data is
+			 */
+			if (core >= 0) {
+				BBlocks::ScheduleOn(core, this, &This::Start, next);
+			} else {
+				BBlocks::Schedule(this, &This::Start, next);
+			}
+		}
+
+		if (!--pending_) {
+			done_.Wakeup(status_.load());
+		}
+	}
+
+	bool IsAcyclic() const
+	{
+		/*
+		 * Kahn's algorithm, every task has to be reachable in topological order
+		 */
+		vector<uint32_t> ndeps;
+		vector<const Task *> ready;
+		for (auto t : tasks_) {
+			ndeps.push_back(t->ndeps_);
+			if (!t->ndeps_) {
+				ready.push_back(t);
+			}
+		}
+
+		size_t nvisited = 0;
+		while (!ready.empty()) {
+			const Task * t = ready.back();
+			ready.pop_back();
+			++nvisited;
+
+			for (auto next : t->next_) {
+				if (!--ndeps[next->id_]) {
+					ready.push_back(next);
+				}
+			}
+		}
+
+		return nvisited == tasks_.size();
+	}
+
+	vector<Task *> tasks_;
+	Fn<int> done_;
+	atomic<int> status_;
+	atomic<size_t> pending_;	// tasks yet to complete
+	bool isStarted_;
+};
+
+}
@@ -3,7 +3,9 @@
 #include <inttypes.h>
 
 #include "logger.h"
+#include "schd/epoch.h"
 #include "schd/thread.h"
+#include "perf/mem-account.h"
 
 namespace bblocks {
 
@@ -34,6 +36,7 @@ struct ThreadCtx
 	static __thread Thread * tinst_;
 
 	static const int GC_TIMEOUT_MS = 1000; // every 1s
+	static const int GC_PRESSURE_MS = 10; // every 10ms while buffer memory is short
 
 	static void Init(Thread * tinst)
 	{
@@ -83,6 +86,7 @@ struct ThreadCtx
 				::free(*it);
 			}
 
+			MemAccount::Release(MemAccount::BUFPOOL, l.size() * (i + 1) * 512);
 			l.clear();
 		}
 
@@ -95,6 +99,7 @@ struct ThreadCtx
 		INVARIANT(ThreadCtx::pool_);
 
 		static __thread uint64_t lastInMilliSec = Rdtsc::NowInMilliSec();
+		static __thread uint64_t lastTrimInMilliSec = Rdtsc::NowInMilliSec();
 
 		uint64_t nowInMilliSec = Rdtsc::NowInMilliSec();
 
@@ -104,24 +109,47 @@ struct ThreadCtx
 			/*
 			 * Timeout. Delete all unused memory
 			 */
-			size_t bytes = 0;
-			for (int i = 0; i < SLAB_DEPTH; ++i) {
-				pool_t & pool = ThreadCtx::pool_[i];
+			TrimSlabs();
 
-				for (auto ptr : pool) {
-					::free((void *) ptr);
-					bytes += (i + 1) * 512; 
-				}
-
-				pool.clear();
+			/*
+			 * Release objects retired to Epoch, so they don't linger if nobody is
+			 * retiring anymore
+			 */
+			if (Epoch::Pending()) {
+				Epoch::Reclaim();
 			}
 
-			statGC_.Update(bytes);
+			lastInMilliSec = lastTrimInMilliSec = nowInMilliSec;
+		} else if (Rdtsc::Elapsed(nowInMilliSec, lastTrimInMilliSec) > GC_PRESSURE_MS
+			   && MemAccount::IsBufferPressure()) {
+			/*
+			 * Buffer memory is short, hand the cached slabs back sooner. Epoch is left
+			 * to the periodic pass, reclaiming walks every thread.
+			 */
+			TrimSlabs();
+
+			lastTrimInMilliSec = nowInMilliSec;
+		}
+	}
+
+	static void TrimSlabs()
+	{
+		size_t bytes = 0;
+		for (int i = 0; i < SLAB_DEPTH; ++i) {
+			pool_t & pool = ThreadCtx::pool_[i];
 
-			lastInMilliSec = nowInMilliSec;
+			for (auto ptr : pool) {
+				::free((void *) ptr);
+				bytes += (i + 1) * 512; 
+			}
 
-			DEBUG(log_) << bytes << " B reclaimed by GC on thread " << tinst_;
+			pool.clear();
 		}
+
+		statGC_.Update(bytes);
+		MemAccount::Release(MemAccount::BUFPOOL, bytes);
+
+		DEBUG(log_) << bytes << " B reclaimed by GC on thread " << tinst_;
 	}
 
 	static string log_;
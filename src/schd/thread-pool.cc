@@ -1,6 +1,12 @@
 #include "schd/thread-pool.h"
 
+#include <typeinfo>
+
 #include "async.h"
+#include "perf/hw-counter.h"
+#include "perf/mem-account.h"
+#include "schd/ctx-accounting.h"
+#include "schd/epoch.h"
 #include "schd/schd-helper.h"
 #include "schd/watchdog.hpp"
 
@@ -18,20 +24,41 @@ string ThreadCtx::log_("/threadctx");
 PerfCounter ThreadCtx::statGC_("/threadctx/gc", "B", PerfCounter::BYTES);
 PerfCounter ThreadCtx::statHits_("/threadctx/alloc", "hits", PerfCounter::COUNTER);
 
+__thread int NonBlockingThread::tcore_ = -1;
+__thread AsyncCtx AsyncCtx::tctx_;
+
+int
+bblocks::CurrentPoolCore()
+{
+	return NonBlockingThreadPool::CurrentCore();
+}
+
 //
 // NonBlockingThread
 //
 NonBlockingThreadPool::NonBlockingThreadPool()
 	: nextTh_(0)
+	, nactive_(0)
+	, minActive_(0)
+	, isSizerArmed_(false)
+	, isStopping_(false)
+	, lastSizedAt_(0)
+	, lastUnparkAt_(0)
+	, maxDepth_(0)
+	, targetDelay_(0)
+	, statActive_("/NBTP/active-threads", "threads", PerfCounter::COUNTER)
+	, statRejected_("/NBTP/rejected", "routines", PerfCounter::COUNTER)
 	, timekeeper_("/NBTP/time-keeper")
 {
 	Watchdog::Init();
+	CtxAccounting::Init();
 }
 
 void
-NonBlockingThreadPool::Start(const uint32_t ncpu)
+NonBlockingThreadPool::Start(const uint32_t ncpu, const uint32_t minActive)
 {
 	INVARIANT(ncpu <= SysConf::NumCores());
+	INVARIANT(minActive && minActive <= ncpu);
 
 	Guard _(&lock_);
 
@@ -50,11 +77,26 @@ NonBlockingThreadPool::Start(const uint32_t ncpu)
 	//
 	for (size_t i = 0; i < ncpu; ++i) {
 		NonBlockingThread * th = new NonBlockingThread("/th/" + STR(i), i);
+		th->codel().SetTarget(targetDelay_);
 		threads_.push_back(th);
 		th->StartNonBlockingThread();
 	}
 
 	Watchdog::Instance().Start(threads_.size());
+
+	nactive_ = minActive;
+	minActive_ = minActive;
+	isStopping_ = false;
+
+	if (minActive_ < ncpu) {
+		lastBusyTime_.assign(ncpu, 0);
+		lastSizedAt_ = Rdtsc::NowInMicroSec();
+
+		isSizerArmed_ = true;
+		INVARIANT(timekeeper_.ScheduleIn(SIZER_INTERVAL_MS, &sizer_));
+
+		INFO("/NBTP") << "Elastic pool. min " << minActive_ << " max " << ncpu;
+	}
 }
 
 void
@@ -65,13 +107,58 @@ NonBlockingThreadPool::Shutdown()
 	 */
 	INVARIANT(!ThreadCtx::tinst_);
 
+	/*
+	 * Stop the sizer, it may be on its way to run. A sizer in flight sees the stop and
+	 * disarms itself. Wait for it without the lock, it runs on a pool thread.
+	 */
+	isStopping_ = true;
+
+	while (isSizerArmed_) {
+		if (timekeeper_.Cancel(&sizer_)) {
+			isSizerArmed_ = false;
+		} else {
+			sched_yield();
+		}
+	}
+
 	Guard _(&lock_);
 
+	if (statActive_.Count()) {
+		INFO("/NBTP") << statActive_;
+	}
+
+	if (statRejected_.Count()) {
+		INFO("/NBTP") << statRejected_;
+	}
+
+	ostringstream tenants;
+	tenants << CtxAccounting::Instance();
+
+	if (!tenants.str().empty()) {
+		INFO("/NBTP") << "Accounting by tenant\n" << tenants.str();
+	}
+
+	ostringstream ops;
+	HwProfiler::Print(ops);
+
+	if (!ops.str().empty()) {
+		INFO("/NBTP") << "Counters by routine\n" << ops.str();
+	}
+
 	/* Shutdown timer service */
 	timekeeper_.Shutdown();
 
 	/* Kill async processors */
 	DestroyThreads();
+
+	/*
+	 * The threads published their charges as they exited
+	 */
+	MemAccount::Flush();
+
+	ostringstream mem;
+	MemAccount::Print(mem);
+	INFO("/NBTP") << "Memory by subsystem\n" << mem.str();
 }
 
 
@@ -81,15 +168,55 @@ NonBlockingThreadPool::~NonBlockingThreadPool()
 	Watchdog::Destroy();
 }
 
+/*
+ * Takes a pool thread out of epoch based reclamation while it sleeps on its queue
+ */
+struct EpochSleepGuard
+{
+	void Sleep() { Epoch::Offline(); }
+	void Wake() { Epoch::Online(); }
+};
+
 void *
 NonBlockingThread::ThreadMain()
 {
 	DisableThreadCancellation();
 
+	tcore_ = id_;
+
+	/*
+	 * Routines are short and non-blocking, so the boundary between routines is a natural
+	 * quiescent state for epoch based reclamation
+	 */
+	Epoch::Online();
+
+	int wasParked = -1;	// park state the spin budget is set for
+
 	try {
 		while (true)
 		{
-			ThreadRoutine * r = q_.Pop();
+			/*
+			 * A parked thread goes to sleep as soon as its queue is empty. The spin
+			 * budget is only touched when the park state changes.
+			 */
+			const int isParked = id_ >= NonBlockingThreadPool::Instance().nactive_.load(
+							memory_order_relaxed);
+
+			if (isParked != wasParked) {
+				q_.SetMaxSpin(isParked ? 0 : InQueue<ThreadRoutine>::MAX_SPIN);
+				wasParked = isParked;
+			}
+
+			ThreadRoutine * r = PopDeadline();
+
+			if (!r) {
+				/*
+				 * Don't hold back reclamation while we sleep, a pop that finds a
+				 * routine stays online and pays no fence
+				 */
+				EpochSleepGuard guard;
+				r = q_.Pop(guard);
+			}
 
 			const uint64_t & startInMicroSec = Rdtsc::NowInMicroSec();
 
@@ -103,11 +230,52 @@ NonBlockingThread::ThreadMain()
 				continue;
 			}
 
+			TRACE_INSTANT("pop", Depth());
+
+			if (r->pushedAtInMicroSec_) {
+				/*
+				 * Queue delay for admission control
+				 */
+				codel_.Update(Rdtsc::Elapsed(startInMicroSec, r->pushedAtInMicroSec_),
+					      startInMicroSec);
+				r->pushedAtInMicroSec_ = 0;
+
+				if (q_.IsEmpty()) {
+					codel_.Reset();
+				}
+			}
+
 			/* Start watch */
 			Watchdog::Instance().StartWatch(id_, startInMicroSec);
 
-			/* Execute */
-			r->Run();
+			/*
+			 * Execute. The routine can be gone after it runs, hold on to its context.
+			 */
+			const AsyncCtx ctx = r->actx_;
+
+			/*
+			 * Hardware counters are charged to the type of the routine
+			 */
+			const char * op = HwProfiler::IsEnabled() ? typeid(*r).name() : NULL;
+
+			TRACE_BEGIN("run", ctx.requestId_);
+
+			if (op) {
+				HwProfiler::Start();
+			}
+
+			if (!ctx.IsSet()) {
+				r->Run();
+			} else {
+				AsyncCtx::Scope _(ctx);
+				r->Run();
+			}
+
+			if (op) {
+				HwProfiler::Stop(op);
+			}
+
+			TRACE_END("run", ctx.requestId_);
 
 			const uint64_t & endInMicroSec = Rdtsc::NowInMicroSec();
 
@@ -118,9 +286,16 @@ NonBlockingThread::ThreadMain()
 			const uint32_t elapsedInMicroSec = Rdtsc::Elapsed(endInMicroSec,
 									  startInMicroSec);
 			statWatchdogTime_.Update(elapsedInMicroSec);
+			busyInMicroSec_ += elapsedInMicroSec;
+
+			if (ctx.IsSet()) {
+				CtxAccounting::Instance().Charge(ctx, elapsedInMicroSec);
+			}
 
                         /* Cleanup thread ctx memory */
                         ThreadCtx::GarbageCollect();
+
+			Epoch::Quiesce();
 		}
 	} catch (ThreadExitException & e) {
 		/*
@@ -131,11 +306,212 @@ NonBlockingThread::ThreadMain()
 		Watchdog::Instance().CancelWatch(id_, Rdtsc::NowInMicroSec());
 	}
 
+	Epoch::Offline();
+
 	INVARIANT(q_.IsEmpty());
 
+	tcore_ = -1;
+
 	return NULL;
 }
 
+void
+NonBlockingThreadPool::SetAdmission(const size_t maxDepth, const uint32_t targetDelayInMicroSec)
+{
+	Guard _(&lock_);
+
+	maxDepth_ = maxDepth;
+	targetDelay_ = targetDelayInMicroSec;
+
+	for (auto th : threads_) {
+		th->codel().SetTarget(targetDelayInMicroSec);
+	}
+
+	INFO("/NBTP") << "Admission. max-depth " << maxDepth
+		      << " target-delay " << targetDelayInMicroSec << " us";
+}
+
+NonBlockingThread *
+NonBlockingThreadPool::Admit()
+{
+	const size_t maxDepth = maxDepth_;
+	const uint32_t nactive = nactive_;
+
+	for (int i = 0; i < 2; ++i) {
+		NonBlockingThread * th = threads_[nextTh_++ % nactive];
+
+		if (th->Admits(maxDepth)) {
+			return th;
+		}
+	}
+
+	/*
+	 * A parked thread can take the load next time
+	 */
+	UnparkForBurst();
+
+	statRejected_.Update(/*val=*/ 1);
+	return NULL;
+}
+
+bool
+NonBlockingThreadPool::IsSaturated() const
+{
+	const size_t maxDepth = maxDepth_;
+
+	for (uint32_t i = 0; i < nactive_; ++i) {
+		if (threads_[i]->Admits(maxDepth)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+ThreadRoutine *
+NonBlockingThread::PopDeadline()
+{
+	if (!nedf_ || (nedfBurst_ >= MAX_EDF_BURST && !q_.IsEmpty())) {
+		nedfBurst_ = 0;
+		return NULL;
+	}
+
+	ThreadRoutine * r;
+
+	{
+		Guard _(&edfLock_);
+
+		if (edf_.IsEmpty()) {
+			return NULL;
+		}
+
+		r = edf_.Pop();
+		nedf_ = edf_.Size();
+	}
+
+	++nedfBurst_;
+
+	/*
+	 * Account how close to its deadline the routine starts
+	 */
+	const timespec now = Time::GetTimeSpec(/*msec=*/ 0);
+	const int64_t slackInMicroSec = (r->timeout_.tv_sec - now.tv_sec) * 1000 * 1000
+					+ (r->timeout_.tv_nsec - now.tv_nsec) / 1000;
+
+	if (slackInMicroSec >= 0) {
+		statDeadlineSlack_.Update(slackInMicroSec);
+	} else {
+		statDeadlineMiss_.Update(-slackInMicroSec);
+	}
+
+	return r;
+}
+
+bool
+NonBlockingThreadPool::Unpark()
+{
+	uint32_t n = nactive_;
+
+	while (n < threads_.size()) {
+		if (nactive_.compare_exchange_weak(n, n + 1)) {
+			DEBUG("/NBTP") << "Unparked thread " << n;
+			statActive_.Update(n + 1);
+			lastUnparkAt_ = Rdtsc::NowInMicroSec();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void
+NonBlockingThreadPool::UnparkForBurst()
+{
+	if (nactive_.load(memory_order_relaxed) >= threads_.size()) {
+		return;
+	}
+
+	/*
+	 * At most one thread per sizer interval, the sizer decides on anything more
+	 */
+	const uint64_t now = Rdtsc::NowInMicroSec();
+	uint64_t last = lastUnparkAt_;
+
+	if (Rdtsc::Elapsed(now, last) < SIZER_INTERVAL_MS * 1000
+	    || !lastUnparkAt_.compare_exchange_strong(last, now)) {
+		return;
+	}
+
+	Unpark();
+}
+
+bool
+NonBlockingThreadPool::Park()
+{
+	uint32_t n = nactive_;
+
+	while (n > minActive_) {
+		if (nactive_.compare_exchange_weak(n, n - 1)) {
+			/*
+			 * The thread runs what is queued already and goes to sleep
+			 */
+			DEBUG("/NBTP") << "Parked thread " << n - 1;
+			statActive_.Update(n - 1);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void
+NonBlockingThreadPool::Resize()
+{
+	ASSERT(isSizerArmed_);
+
+	if (isStopping_) {
+		isSizerArmed_ = false;
+		return;
+	}
+
+	const uint64_t now = Rdtsc::NowInMicroSec();
+	const uint64_t elapsed = Rdtsc::Elapsed(now, lastSizedAt_);
+	lastSizedAt_ = now;
+
+	const uint32_t nactive = nactive_;
+
+	/*
+	 * Utilization and queue depth of the active threads over the last interval
+	 */
+	uint64_t busy = 0;
+	size_t depth = 0;
+
+	for (size_t i = 0; i < threads_.size(); ++i) {
+		const uint64_t t = threads_[i]->BusyTime();
+
+		if (i < nactive) {
+			busy += t - lastBusyTime_[i];
+			depth += threads_[i]->Depth();
+		}
+
+		lastBusyTime_[i] = t;
+	}
+
+	const uint64_t utilPct = elapsed ? (busy * 100) / (elapsed * nactive) : 0;
+
+	/*
+	 * A thread that was unparked is kept for PARK_HOLD_MS, a burst does not flap the pool
+	 */
+	if (utilPct > HIGH_UTIL_PCT || depth > nactive * BURST_DEPTH) {
+		Unpark();
+	} else if (utilPct < LOW_UTIL_PCT && !depth
+		   && Rdtsc::Elapsed(now, lastUnparkAt_) >= PARK_HOLD_MS * 1000) {
+		Park();
+	}
+
+	INVARIANT(timekeeper_.ScheduleIn(SIZER_INTERVAL_MS, &sizer_));
+}
+
 bool
 NonBlockingThreadPool::ShouldYield()
 {
@@ -163,22 +539,26 @@ TimeKeeper::ThreadMain()
 
 		Guard _(&lock_);
 
-		INVARIANT(timers_.size() >= count);
 		INVARIANT(count == 1);
 
 		/*
 		 * Timers are ordered by the wait times, so we can start kicking off
-		 * starting from the front
+		 * starting from the front. The routine has to be unlinked before it is
+		 * scheduled, it is free to destroy itself once it runs. Cancelled timers
+		 * can leave us woken up with nothing due.
 		 */
-		const TimerEvent & t = *timers_.begin();
-		DEBUG(path_) << "Dispatching for time "
-			     << t.time_.tv_sec << "." << t.time_.tv_nsec;
+		const timespec now = Time::GetTimeSpec(/*msec=*/ 0);
 
-		NonBlockingThreadPool::Instance().Schedule(t.r_);
+		while (!timers_.IsEmpty() && IsDue(timers_.Min()->timeout_, now)) {
+			ThreadRoutine * r = timers_.Pop();
+			DEBUG(path_) << "Dispatching for time "
+				     << r->timeout_.tv_sec << "." << r->timeout_.tv_nsec;
+			TRACE_INSTANT("timer", r->actx_.requestId_);
 
-		timers_.erase(timers_.begin());
+			NonBlockingThreadPool::Instance().Schedule(r);
+		}
 
-		if (!timers_.empty()) {
+		if (!timers_.IsEmpty()) {
 			INVARIANT(SetTimer());
 		}
 	}
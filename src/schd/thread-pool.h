@@ -1,12 +1,14 @@
 #pragma once
 
 #include <stdexcept>
-#include <set>
 #include <atomic>
 
 #include <sys/timerfd.h>
  
 #include "buf/bufpool.h"
+#include "ds/intree.hpp"
+#include "perf/trace.h"
+#include "schd/async-ctx.h"
 #include "schd/thread.h"
 
 namespace bblocks {
@@ -15,12 +17,49 @@ class NonBlockingThread;
 
 //............................................................................... ThreadRoutine ....
 
-class ThreadRoutine : public InListElement<ThreadRoutine>
+/**
+ * Unit of work scheduled on the thread pool. The routine carries its own hooks for the run queue
+ * (InList) and the timer tree (InTree), so queueing or arming a timer does not allocate. The
+ * tree hook also serves the deadline lane, a routine is never armed and in the lane at once.
+ *
+ * The routine runs in the AsyncCtx it was created in, or armed in for a timer.
+ */
+class ThreadRoutine : public InListElement<ThreadRoutine>, public InTreeElement<ThreadRoutine>
 {
 public:
 
+	friend class TimeKeeper;
+	friend class NonBlockingThread;
+	friend class NonBlockingThreadPool;
+
+	ThreadRoutine() : pushedAtInMicroSec_(0), actx_(AsyncCtx::Current()) {}
+
 	virtual void Run() = 0;
 	virtual ~ThreadRoutine() {}
+
+private:
+
+	/*
+	 * Orders routines by timeout, routines with the same timeout keep the order they were
+	 * inserted in
+	 */
+	struct TimeoutLess
+	{
+		bool operator()(const ThreadRoutine & lhs, const ThreadRoutine & rhs) const
+		{
+			const timespec & l = lhs.timeout_;
+			const timespec & r = rhs.timeout_;
+
+			return l.tv_sec == r.tv_sec ? l.tv_nsec < r.tv_nsec : l.tv_sec < r.tv_sec;
+		}
+	};
+
+	typedef InTree<ThreadRoutine, TimeoutLess> tree_t;
+
+	timespec timeout_;		// Absolute expiry time when armed with TimeKeeper, or the
+					// deadline when in the deadline lane
+	uint64_t pushedAtInMicroSec_;	// Time queued to a thread, when queue delay is tracked
+	AsyncCtx actx_;			// Context to run in
 };
 
 //................................................................................... FnPtr*<*> ....
@@ -84,6 +123,90 @@ MEMBERFNPTR(2)  // MemberFnPtr2<_OBJ_, T1, T2>
 MEMBERFNPTR(3)  // MemberFnPtr3<_OBJ_, T1, T2, T3>
 MEMBERFNPTR(4)  // MemberFnPtr4<_OBJ_, T1, T2, T3, T4>
 
+//....................................................................................... CoDel ....
+
+/**
+ * @class CoDel
+ *
+ * Queue delay based overload detection, after CoDel. The owner of the queue feeds it the time
+ * every routine spent in the queue. A routine waiting less than the target, or the queue going
+ * empty, means the queue is keeping up. A delay above the target for a whole interval means a
+ * standing queue has built up, and the queue is in the dropping state until a routine waits less
+ * than the target again. While dropping, new work should be refused rather than queued.
+ *
+ * Updated by the owner only, read by anyone.
+ */
+class CoDel
+{
+public:
+
+	static const uint32_t DEFAULT_INTERVAL_US = 100 * 1000; // 100 ms
+
+	CoDel()
+		: targetInMicroSec_(0)
+		, intervalInMicroSec_(DEFAULT_INTERVAL_US)
+		, firstAboveInMicroSec_(0)
+		, isDropping_(false)
+	{}
+
+	/**
+	 * Target queue delay, 0 disables the tracking
+	 */
+	void SetTarget(const uint32_t targetInMicroSec,
+		       const uint32_t intervalInMicroSec = DEFAULT_INTERVAL_US)
+	{
+		intervalInMicroSec_ = intervalInMicroSec;
+		targetInMicroSec_ = targetInMicroSec;
+
+		if (!targetInMicroSec) {
+			isDropping_ = false;
+		}
+	}
+
+	bool IsEnabled() const
+	{
+		return targetInMicroSec_.load(memory_order_relaxed);
+	}
+
+	bool IsDropping() const
+	{
+		return isDropping_.load(memory_order_relaxed);
+	}
+
+	void Update(const uint64_t delayInMicroSec, const uint64_t nowInMicroSec)
+	{
+		if (delayInMicroSec < targetInMicroSec_) {
+			Reset();
+			return;
+		}
+
+		if (!firstAboveInMicroSec_) {
+			firstAboveInMicroSec_ = nowInMicroSec + intervalInMicroSec_;
+		} else if (nowInMicroSec >= firstAboveInMicroSec_ && !isDropping_) {
+			isDropping_ = true;
+		}
+	}
+
+	/**
+	 * The queue went empty
+	 */
+	void Reset()
+	{
+		firstAboveInMicroSec_ = 0;
+
+		if (isDropping_) {
+			isDropping_ = false;
+		}
+	}
+
+private:
+
+	atomic<uint32_t> targetInMicroSec_;
+	uint32_t intervalInMicroSec_;
+	uint64_t firstAboveInMicroSec_;	// when the delay has been above target for an interval
+	atomic<bool> isDropping_;
+};
+
 //........................................................................... NonBlockingThread ....
 
 class NonBlockingThread : public Thread
@@ -97,32 +220,122 @@ public:
 		, id_(id)
 		, exitMain_(false)
 		, q_(path)
+		, busyInMicroSec_(0)
+		, edfLock_(path + "/edf")
+		, nedf_(0)
+		, nedfBurst_(0)
+		, kick_(this)
+		, isKicked_(false)
 		, statWatchdogTime_(path + "/watchdogtime", "microsec", PerfCounter::TIME)
+		, statDeadlineSlack_(path + "/deadline-slack", "microsec", PerfCounter::TIME)
+		, statDeadlineMiss_(path + "/deadline-miss", "microsec", PerfCounter::TIME)
 	{}
 
 	~NonBlockingThread()
 	{
+		INVARIANT(edf_.IsEmpty());
+
 		INFO(log_) << statWatchdogTime_;
+
+		if (statDeadlineSlack_.Count() || statDeadlineMiss_.Count()) {
+			INFO(log_) << statDeadlineSlack_;
+			INFO(log_) << statDeadlineMiss_;
+		}
 	}
 
 	virtual void * ThreadMain();
 
+	uint32_t Id() const
+	{
+		return id_;
+	}
+
+	/*
+	 * Id of the pool thread running, -1 on other threads
+	 */
+	static __thread int tcore_;
+
 	void Push(ThreadRoutine * r)
 	{
+		if (codel_.IsEnabled()) {
+			r->pushedAtInMicroSec_ = Rdtsc::NowInMicroSec();
+		}
+
+		TRACE_INSTANT("push", id_);
+
 		q_.Push(r);
 	}
 
+	/**
+	 * Queue to the deadline lane, r->timeout_ holds the deadline. The lane is served earliest
+	 * deadline first and ahead of the FIFO queue.
+	 */
+	void PushDeadline(ThreadRoutine * r)
+	{
+		{
+			Guard _(&edfLock_);
+			edf_.Insert(r);
+			nedf_ = edf_.Size();
+		}
+
+		/*
+		 * The thread may be asleep on the FIFO queue
+		 */
+		if (!isKicked_.exchange(true)) {
+			Push(&kick_);
+		}
+	}
+
+	/**
+	 * Would the thread take more work, with at most maxDepth routines queued (0 for no
+	 * limit) and no standing queue
+	 */
+	bool Admits(const size_t maxDepth) const
+	{
+		return (!maxDepth || q_.Size() < maxDepth) && !codel_.IsDropping();
+	}
+
+	CoDel & codel()
+	{
+		return codel_;
+	}
+
 	bool IsEmpty() const
 	{
 		return q_.IsEmpty();
 	}
 
+	size_t Depth() const
+	{
+		return q_.Size() + nedf_;
+	}
+
+	/**
+	 * Deadline lane routines that started past their deadline
+	 */
+	uint64_t DeadlineMisses() const
+	{
+		return statDeadlineMiss_.Count();
+	}
+
+	/**
+	 * Time spent running routines since the thread started
+	 */
+	uint64_t BusyTime() const
+	{
+		return busyInMicroSec_;
+	}
+
 	virtual void Stop() override
 	{
 		INVARIANT(!exitMain_);
 		exitMain_ = true;
 
-		INVARIANT(q_.IsEmpty());
+		/*
+		 * The deadline lane can be drained ahead of its kick, which is harmless
+		 */
+		INVARIANT(q_.Size() <= (isKicked_ ? 1 : 0));
+		INVARIANT(!nedf_);
 
 		/*
 		 * Push a message so, we can wakeup the main thread and exit it
@@ -160,14 +373,49 @@ private:
 		}
 	};
 
+	/*
+	 * Wakes up the thread for the deadline lane, a no-op otherwise
+	 */
+	struct KickRoutine : ThreadRoutine
+	{
+		KickRoutine(NonBlockingThread * th) : th_(th) {}
+
+		virtual void Run() override
+		{
+			th_->isKicked_ = false;
+		}
+
+		NonBlockingThread * th_;
+	};
+
         /* Cleanup thread ctx memory if it is passed the threshold */
         void CleanupThreadCtx();
 
+	/*
+	 * Next routine from the deadline lane, NULL if the lane is empty or has had its turn
+	 */
+	ThreadRoutine * PopDeadline();
+
+	/*
+	 * Deadline lane routines run in a row before the FIFO queue gets a turn
+	 */
+	static const uint32_t MAX_EDF_BURST = 16;
+
 	const uint32_t id_;
 	bool exitMain_;
 	InQueue<ThreadRoutine> q_;
+	atomic<uint64_t> busyInMicroSec_;
+	CoDel codel_;
+	SpinMutex edfLock_;
+	ThreadRoutine::tree_t edf_;	// deadline lane
+	atomic<size_t> nedf_;		// edf_.Size(), readable without the lock
+	uint32_t nedfBurst_;
+	KickRoutine kick_;
+	atomic<bool> isKicked_;		// kick_ is queued
 
 	PerfCounter statWatchdogTime_;
+	PerfCounter statDeadlineSlack_;	// time left to the deadline, for routines on time
+	PerfCounter statDeadlineMiss_;	// time past the deadline, for routines late
 };
 
 // ................................................................................ TimeKeeper ....
@@ -188,13 +436,13 @@ public:
 	~TimeKeeper()
 	{
 		INVARIANT(fd_ == -1);
-		INVARIANT(timers_.empty());
+		INVARIANT(timers_.IsEmpty());
 	}
 
 	bool Init()
 	{
 		INVARIANT(fd_ == -1);
-		INVARIANT(timers_.empty());
+		INVARIANT(timers_.IsEmpty());
 		INVARIANT(!ThreadCtx::tinst_);
 
 		/*
@@ -234,7 +482,7 @@ public:
 		 * Since ThreadRoutine is opaque, we cannot assume anything about its construction
 		 * We demand that user clean up all timer events before stopping
 		 */
-		INVARIANT(timers_.empty());
+		INVARIANT(timers_.IsEmpty());
 
 		return true;
 	}
@@ -245,20 +493,55 @@ public:
 
 		DEBUG(path_) << "ScheduleIn. msec=" << msec << " r=" << (uint64_t) r;
 
-		timers_.insert(TimerEvent(Time::GetTimeSpec(msec), r));
+		r->timeout_ = Time::GetTimeSpec(msec);
+		r->actx_ = AsyncCtx::Current();
+		timers_.Insert(r);
 
 		return SetTimer();
 	}
 
+	/**
+	 * Disarm a timer. Returns false if the timer has already fired, in which case the routine
+	 * is on its way to the thread pool and will run.
+	 */
+	bool Cancel(ThreadRoutine * r)
+	{
+		Guard _(&lock_);
+
+		if (!timers_.IsLinked(r)) {
+			return false;
+		}
+
+		DEBUG(path_) << "Cancel. r=" << (uint64_t) r;
+
+		const bool isFirst = (timers_.Min() == r);
+
+		timers_.Unlink(r);
+
+		if (isFirst) {
+			/*
+			 * Rearm for the next timer. If there is none the timer fires with nothing
+			 * due, which is harmless.
+			 */
+			INVARIANT(timers_.IsEmpty() || SetTimer());
+		}
+
+		return true;
+	}
 
 private:
 
+	static bool IsDue(const timespec & t, const timespec & now)
+	{
+		return t.tv_sec == now.tv_sec ? t.tv_nsec <= now.tv_nsec : t.tv_sec < now.tv_sec;
+	}
+
 	bool SetTimer()
 	{
 		ASSERT(lock_.IsOwner());
-		INVARIANT(!timers_.empty());
+		INVARIANT(!timers_.IsEmpty());
 
-		const timespec time = timers_.begin()->time_;
+		const timespec time = timers_.Min()->timeout_;
 
 		itimerspec t;
 
@@ -282,31 +565,15 @@ private:
 
 	virtual void * ThreadMain() override;
 
-	struct TimerEvent
-	{
-		TimerEvent(const timespec time, ThreadRoutine * r)
-			: time_(time)
-			, r_(r)
-		{
-			INVARIANT(r_);
-		}
-
-		bool operator<(const TimerEvent & rhs)
-		{
-			return time_.tv_sec == rhs.time_.tv_sec ? time_.tv_nsec < rhs.time_.tv_nsec
-							        : time_.tv_sec < rhs.time_.tv_sec;
-		}
-
-		timespec time_;
-		ThreadRoutine * r_;
-	};
-
-	typedef multiset<TimerEvent> timer_set_t;
+	/*
+	 * Timers fire by expiry time, timers with the same expiry in the order they were armed
+	 */
+	typedef ThreadRoutine::tree_t timer_tree_t;
 
 	const string path_;
 	SpinMutex lock_;
 	int fd_;
-	timer_set_t timers_;
+	timer_tree_t timers_;
 };
 
 //....................................................................... NonBlockingThreadPool ....
@@ -343,19 +610,58 @@ public:
 		atomic<size_t> pendingCalls_;
 	};
 
+	static const uint32_t SIZER_INTERVAL_MS = 10;
+	static const uint32_t HIGH_UTIL_PCT = 75;	// unpark a thread above this
+	static const uint32_t LOW_UTIL_PCT = 25;	// park a thread below this
+	static const size_t BURST_DEPTH = 32;		// unpark right away above this
+	static const uint32_t PARK_HOLD_MS = 10 * SIZER_INTERVAL_MS; // keep unparked at least
+
 	NonBlockingThreadPool();
 
 	~NonBlockingThreadPool();
 
-	void Start(const uint32_t ncpu);
+	void Start(const uint32_t ncpu)
+	{
+		Start(ncpu, ncpu);
+	}
+
+	/**
+	 * Start ncpu threads and let the pool size itself between minActive and ncpu.
+	 *
+	 * Threads above the active count are parked. A parked thread is left out of the round
+	 * robin and sleeps without spinning once its queue is drained, it still runs routines
+	 * pushed to it explicitly. The sizer samples utilization and queue depth every
+	 * SIZER_INTERVAL_MS and parks or unparks one thread at a time. A push that finds the
+	 * queue deeper than BURST_DEPTH, or a refused TrySchedule, unparks a thread right away,
+	 * at most one per SIZER_INTERVAL_MS. A thread stays unparked for PARK_HOLD_MS at least.
+	 */
+	void Start(const uint32_t ncpu, const uint32_t minActive);
 
 	size_t ncpu() const
 	{
 		return threads_.size();
 	}
 
+	size_t nactive() const
+	{
+		return nactive_;
+	}
+
 	void Shutdown();
 
+	/**
+	 * Admission control for TrySchedule. A thread refuses work once maxDepth routines are
+	 * queued to it (0 for no limit), or while routines have been waiting longer than
+	 * targetDelayInMicroSec for a whole CoDel interval (0 to not track the delay). Schedule
+	 * is not subject to either.
+	 */
+	void SetAdmission(const size_t maxDepth, const uint32_t targetDelayInMicroSec);
+
+	/**
+	 * No active thread admits more work
+	 */
+	bool IsSaturated() const;
+
 	void Wakeup()
 	{
 		Guard _(&lock_);
@@ -376,7 +682,42 @@ public:
 		ThreadRoutine * r;								\
 		void * buf = BufferPool::Alloc<MemberFnPtr##n<_OBJ_, TENUM(T,n)> >();		\
 		r = new (buf) MemberFnPtr##n<_OBJ_, TENUM(T,n)>(obj, fn, TARG(t,n));		\
-		threads_[nextTh_++ % threads_.size()]->Push(r);					\
+		PushNext(r);									\
+	}											\
+												\
+	template<class _OBJ_, TDEF(T,n)>							\
+	bool TrySchedule(_OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)), TPARAM(T,t,n))		\
+	{											\
+		NonBlockingThread * th = Admit();						\
+		if (!th) {									\
+			return false;								\
+		}										\
+												\
+		ThreadRoutine * r;								\
+		void * buf = BufferPool::Alloc<MemberFnPtr##n<_OBJ_, TENUM(T,n)> >();		\
+		r = new (buf) MemberFnPtr##n<_OBJ_, TENUM(T,n)>(obj, fn, TARG(t,n));		\
+		th->Push(r);									\
+		return true;									\
+	}											\
+												\
+	template<class _OBJ_, TDEF(T,n)>							\
+	void ScheduleWithDeadline(const uint32_t msec, _OBJ_ * obj,				\
+				  void (_OBJ_::*fn)(TENUM(T,n)), TPARAM(T,t,n))			\
+	{											\
+		ThreadRoutine * r;								\
+		void * buf = BufferPool::Alloc<MemberFnPtr##n<_OBJ_, TENUM(T,n)> >();		\
+		r = new (buf) MemberFnPtr##n<_OBJ_, TENUM(T,n)>(obj, fn, TARG(t,n));		\
+		ScheduleWithDeadline(msec, r);							\
+	}											\
+												\
+	template<class _OBJ_, TDEF(T,n)>							\
+	void ScheduleOn(const uint32_t core, _OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)),	\
+	                TPARAM(T,t,n))								\
+	{											\
+		ThreadRoutine * r;								\
+		void * buf = BufferPool::Alloc<MemberFnPtr##n<_OBJ_, TENUM(T,n)> >();		\
+		r = new (buf) MemberFnPtr##n<_OBJ_, TENUM(T,n)>(obj, fn, TARG(t,n));		\
+		ScheduleOn(core, r);								\
 	}											\
 												\
 	template<TDEF(T,n)>									\
@@ -385,7 +726,7 @@ public:
 		ThreadRoutine * r;								\
 		void * buf = BufferPool::Alloc<FnPtr##n<TENUM(T,n)> >();			\
 		r = new (buf) FnPtr##n<TENUM(T,n)>(fn, TARG(t,n));				\
-		threads_[nextTh_++ % threads_.size()]->Push(r);					\
+		PushNext(r);									\
 	}											\
 												\
 	template<class _OBJ_, TDEF(T,n)>							\
@@ -432,7 +773,70 @@ public:
 
 	void Schedule(ThreadRoutine * r)
 	{
-		threads_[nextTh_++ % threads_.size()]->Push(r);
+		PushNext(r);
+	}
+
+	/**
+	 * Schedule to the deadline lane, to run within msec. Deadline routines run earliest
+	 * deadline first, ahead of the routines scheduled without one. A routine that starts past
+	 * its deadline still runs, and is accounted as a miss.
+	 */
+	void ScheduleWithDeadline(const uint32_t msec, ThreadRoutine * r)
+	{
+		r->timeout_ = Time::GetTimeSpec(msec);
+		threads_[nextTh_++ % nactive_]->PushDeadline(r);
+	}
+
+	/**
+	 * Deadline misses across the threads
+	 */
+	uint64_t DeadlineMisses() const
+	{
+		uint64_t n = 0;
+		for (auto th : threads_) {
+			n += th->DeadlineMisses();
+		}
+
+		return n;
+	}
+
+	/**
+	 * Schedule unless the pool is overloaded, see SetAdmission. On false the routine is left
+	 * with the caller.
+	 */
+	bool TrySchedule(ThreadRoutine * r)
+	{
+		NonBlockingThread * th = Admit();
+		if (!th) {
+			return false;
+		}
+
+		th->Push(r);
+		return true;
+	}
+
+	void ScheduleOn(const uint32_t core, ThreadRoutine * r)
+	{
+		INVARIANT(core < threads_.size());
+		threads_[core]->Push(r);
+	}
+
+	/**
+	 * Core of the calling thread, or -1 if it is not one of the pool threads
+	 */
+	static int CurrentCore()
+	{
+		return NonBlockingThread::tcore_;
+	}
+
+	void ScheduleIn(const uint32_t ms, ThreadRoutine * r)
+	{
+		INVARIANT(timekeeper_.ScheduleIn(ms, r));
+	}
+
+	bool CancelTimer(ThreadRoutine * r)
+	{
+		return timekeeper_.Cancel(r);
 	}
 
 	void Yield(ThreadRoutine * r)
@@ -450,7 +854,7 @@ public:
 		ThreadRoutine * r;								\
 		void * buf = BufferPool::Alloc<MemberFnPtr##n<_OBJ_, TENUM(T,n)> >();		\
 		r = new (buf) MemberFnPtr##n<_OBJ_, TENUM(T,n)>(obj, fn, TARG(t,n));	    	\
-		threads_[nextTh_++ % threads_.size()]->Push(r);					\
+		PushNext(r);									\
 	}											\
 
 	NBTP_SCHEDULE_BARRIER(1) // void ScheduleBarrier<T1>(...)
@@ -474,6 +878,41 @@ private:
 
 	typedef vector<NonBlockingThread *> threads_t;
 
+	/*
+	 * Periodic sizing of the pool
+	 */
+	struct SizerRoutine : ThreadRoutine
+	{
+		virtual void Run() override
+		{
+			NonBlockingThreadPool::Instance().Resize();
+		}
+	};
+
+	void PushNext(ThreadRoutine * r)
+	{
+		NonBlockingThread * th = threads_[nextTh_++ % nactive_];
+		th->Push(r);
+
+		if (th->Depth() > BURST_DEPTH) {
+			UnparkForBurst();
+		}
+	}
+
+	/*
+	 * Next thread in the round robin that admits work, the one after it as a second choice
+	 */
+	NonBlockingThread * Admit();
+
+	bool Unpark();
+	bool Park();
+
+	/*
+	 * Unpark from the scheduling path, rate limited to leave the sizing to the sizer
+	 */
+	void UnparkForBurst();
+	void Resize();
+
 	void DestroyThreads()
 	{
 		for (auto it = threads_.begin(); it != threads_.end(); ++it) {
@@ -493,6 +932,18 @@ private:
 	threads_t threads_;
 	WaitCondition condExit_;
 	uint32_t nextTh_;
+	atomic<uint32_t> nactive_;	// threads [0, nactive_) are in the round robin
+	uint32_t minActive_;
+	SizerRoutine sizer_;
+	atomic<bool> isSizerArmed_;
+	atomic<bool> isStopping_;
+	vector<uint64_t> lastBusyTime_;	// busy time of the threads at the last sizing
+	uint64_t lastSizedAt_;
+	atomic<uint64_t> lastUnparkAt_;	// microsec
+	atomic<size_t> maxDepth_;	// admission limit on queued routines per thread
+	uint32_t targetDelay_;		// admission target queue delay in microsec
+	PerfCounter statActive_;
+	PerfCounter statRejected_;	// work refused by TrySchedule
 	TimeKeeper timekeeper_;
 };
 
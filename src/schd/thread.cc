@@ -1,5 +1,6 @@
 #include "schd/thread.h"
 #include "schd/thread-ctx.h"
+#include "perf/trace.h"
 
 using namespace bblocks;
 
@@ -34,6 +35,7 @@ Thread::ThFn(void * args)
 	Thread * th = (Thread *) args;
 
 	ThreadCtx::Init(th);
+	Trace::SetThreadName(th->log_);
 
 	void * thstatus = th->ThreadMain();
 
@@ -9,6 +9,8 @@
 #include <zlib.h>
 #include <fstream>
 #include <atomic>
+#include <new>
+#include <sched.h>
 
 #include <tr1/memory>
 #include <boost/regex.hpp>
@@ -25,7 +27,10 @@ typedef int status_t;
 enum
 {
 	OK = 0,
-	FAIL = -1
+	FAIL = -1,
+	CANCELLED = -2,	// op was cancelled through its CancelToken
+	TIMEDOUT = -3,	// op did not complete before its deadline
+	NOMEM = -4	// op refused, its subsystem is over its hard memory limit
 };
 
 template<class T> using SharedPtr = std::shared_ptr<T>;
@@ -294,15 +299,114 @@ private:
 	T state_;
 };
 
+//........................................................................... SingletonRegistry ....
+
+/**
+ * Keeps track of the live singletons in the order they were initialized. Singletons live in
+ * static storage that is never destructed by the runtime, they are torn down explicitly in the
+ * reverse order of initialization (see BBlocks::Destroy), which side steps the static destruction
+ * order across translation units.
+ */
+class SingletonRegistry
+{
+public:
+
+	typedef void (*destroy_fn_t)();
+
+	static const size_t MAX_SINGLETONS = 64;
+
+	static void Add(destroy_fn_t fn)
+	{
+		Lock();
+		INVARIANT(Count() < MAX_SINGLETONS);
+		Fns()[Count()++] = fn;
+		Unlock();
+	}
+
+	static void Remove(destroy_fn_t fn)
+	{
+		Lock();
+
+		size_t j = 0;
+		for (size_t i = 0; i < Count(); ++i) {
+			if (Fns()[i] != fn) Fns()[j++] = Fns()[i];
+		}
+
+		Count() = j;
+
+		Unlock();
+	}
+
+	/**
+	 * Destroy all live singletons, last initialized first
+	 */
+	static void DestroyAll()
+	{
+		while (true) {
+			Lock();
+
+			if (!Count()) {
+				Unlock();
+				break;
+			}
+
+			destroy_fn_t fn = Fns()[Count() - 1];
+
+			Unlock();
+
+			/*
+			 * Destroy removes the singleton from the registry, and may destroy the
+			 * singletons it owns
+			 */
+			(*fn)();
+		}
+	}
+
+private:
+
+	/*
+	 * Function local statics with constant initializers, no guard and no destructor
+	 */
+	static atomic_flag & Flag()
+	{
+		static atomic_flag flag = ATOMIC_FLAG_INIT;
+		return flag;
+	}
+
+	static destroy_fn_t * Fns()
+	{
+		static destroy_fn_t fns[MAX_SINGLETONS];
+		return fns;
+	}
+
+	static size_t & Count()
+	{
+		static size_t count = 0;
+		return count;
+	}
+
+	static void Lock()
+	{
+		while (Flag().test_and_set(memory_order_acquire)) {
+			sched_yield();
+		}
+	}
+
+	static void Unlock()
+	{
+		Flag().clear(memory_order_release);
+	}
+};
+
 //................................................................................ Singleton<T> ....
 
 /**
  * A generic implementation of singleton design pattern
  *
- * TODO:
- * - Implement check and lock pattern and make it thread safe (refer to
- * architectural design pattern)
- *
+ * The instance lives in constant initialized static storage, so Instance() is the address of a
+ * global and costs nothing. Init() is thread safe, the first caller constructs the instance and
+ * concurrent callers wait for it to be ready. Destroy() runs the destructor and the singleton can
+ * be initialized again.
  */
 template<class T>
 class Singleton
@@ -311,30 +415,77 @@ public:
 
 	static void Init()
 	{
-		ASSERT(!Singleton<T>::instance_);
-		Singleton<T>::instance_ = new T();
-        }
+		int state = UNINIT;
+		while (!state_.compare_exchange_strong(state, INITIALIZING)) {
+			/*
+			 * Initialized or being initialized by someone else. A concurrent Destroy
+			 * takes the state back to UNINIT, start over then.
+			 */
+			while ((state = state_.load(memory_order_acquire)) == INITIALIZING) {
+				sched_yield();
+			}
+
+			if (state == READY) {
+				return;
+			}
+
+			ASSERT(state == UNINIT);
+		}
+
+		new (Storage::buf_) T();
+
+		/*
+		 * Register after construction, singletons created by the constructor go first
+		 * and are destroyed after us. Register before publishing, a Destroy that sees us
+		 * READY must find us in the registry.
+		 */
+		SingletonRegistry::Add(&Singleton<T>::Destroy);
+
+		state_.store(READY, memory_order_release);
+	}
 
 	static T & Instance()
 	{
-		ASSERT(Singleton<T>::instance_);
-		return *instance_;
+		ASSERT(state_.load(memory_order_relaxed) == READY);
+		return *reinterpret_cast<T *>(Storage::buf_);
+	}
+
+	static bool IsInit()
+	{
+		return state_.load(memory_order_acquire) == READY;
 	}
 
 	static void Destroy()
 	{
-		ASSERT(Singleton<T>::instance_);
-		delete Singleton<T>::instance_;
-		Singleton<T>::instance_ = NULL;
+		ASSERT(IsInit());
+
+		SingletonRegistry::Remove(&Singleton<T>::Destroy);
+
+		state_.store(INITIALIZING, memory_order_relaxed);
+		reinterpret_cast<T *>(Storage::buf_)->~T();
+		state_.store(UNINIT, memory_order_release);
 	}
 
 private:
 
-	static T * instance_;
+	enum State { UNINIT = 0, INITIALIZING, READY };
+
+	/*
+	 * Instantiated on first use, when T is complete
+	 */
+	struct Storage
+	{
+		alignas(T) static uint8_t buf_[sizeof(T)];
+	};
+
+	static atomic<int> state_;
 };
 
 template<class T>
-T * Singleton<T>::instance_ = NULL;
+alignas(T) uint8_t Singleton<T>::Storage::buf_[sizeof(T)];
+
+template<class T>
+atomic<int> Singleton<T>::state_(UNINIT);
 
 //................................................................................ BoundedQueue ....
 
@@ -0,0 +1,197 @@
+#include <boost/program_options.hpp>
+#include <string>
+#include <iostream>
+#include <unordered_map>
+
+#include "ds/concurrent-map.hpp"
+#include "test/unit/unit-test.h"
+
+using namespace std;
+using namespace bblocks;
+
+namespace po = boost::program_options;
+
+static string _log("/bmark_map");
+
+//................................................................................. LockedMap ....
+
+/*
+ * unordered_map guarded by a SpinMutex. This is the pattern used for lookup tables across the code
+ * base and is the baseline for the benchmark.
+ */
+class LockedMap
+{
+public:
+
+	LockedMap() : lock_("/bmark_map/lockedmap") {}
+
+	bool Get(const uint64_t k, uint64_t & v)
+	{
+		Guard _(&lock_);
+		auto it = map_.find(k);
+		if (it == map_.end()) return false;
+		v = it->second;
+		return true;
+	}
+
+	bool Put(const uint64_t k, const uint64_t v)
+	{
+		Guard _(&lock_);
+		return map_.insert(make_pair(k, v)).second || (map_[k] = v, false);
+	}
+
+	bool Erase(const uint64_t k)
+	{
+		Guard _(&lock_);
+		return map_.erase(k);
+	}
+
+private:
+
+	SpinMutex lock_;
+	unordered_map<uint64_t, uint64_t> map_;
+};
+
+//............................................................................... BenchThread ....
+
+template<class MAP>
+class BenchThread : public Thread
+{
+public:
+
+	BenchThread(MAP & map, const uint64_t nkeys, const int readpct,
+		    const atomic<bool> & stop)
+		: Thread("/bmark_map/th")
+		, map_(map)
+		, nkeys_(nkeys)
+		, readpct_(readpct)
+		, stop_(stop)
+		, ops_(0)
+	{}
+
+	virtual void * ThreadMain() override
+	{
+		uint64_t seed = (uint64_t) this;
+
+		while (!stop_) {
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			const uint64_t k = (seed >> 33) % nkeys_;
+			const int op = (seed >> 17) % 100;
+
+			if (op < readpct_) {
+				uint64_t v;
+				map_.Get(k, v);
+			} else if (op % 2) {
+				map_.Put(k, k);
+			} else {
+				map_.Erase(k);
+			}
+
+			++ops_;
+		}
+
+		return NULL;
+	}
+
+	uint64_t ops() const { return ops_; }
+
+private:
+
+	MAP & map_;
+	const uint64_t nkeys_;
+	const int readpct_;
+	const atomic<bool> & stop_;
+	uint64_t ops_;
+};
+
+//........................................................................................ Run ....
+
+template<class MAP>
+static void
+Run(const string & name, const int nthreads, const uint64_t nkeys, const int readpct,
+    const int seconds)
+{
+	MAP map;
+
+	for (uint64_t k = 0; k < nkeys; k += 2) {
+		map.Put(k, k);
+	}
+
+	atomic<bool> stop(false);
+	vector<BenchThread<MAP> *> ths;
+
+	for (int i = 0; i < nthreads; ++i) {
+		ths.push_back(new BenchThread<MAP>(map, nkeys, readpct, stop));
+	}
+
+	for (auto th : ths) {
+		th->StartBlockingThread();
+	}
+
+	sleep(seconds);
+	stop = true;
+
+	uint64_t ops = 0;
+	for (auto th : ths) {
+		th->Stop();
+		ops += th->ops();
+		delete th;
+	}
+
+	INFO(_log) << name
+		   << " threads " << nthreads
+		   << " keys " << nkeys
+		   << " read% " << readpct
+		   << " ops/s " << (ops / seconds);
+}
+
+//........................................................................................ Main ....
+
+int
+main(int argc, char ** argv)
+{
+	int nthreads = SysConf::NumCores();
+	int nkeys = 64 * 1024;
+	int readpct = 90;
+	int seconds = 5;
+
+	po::options_description desc("Options:");
+	desc.add_options()
+		("help",    "Print usage")
+		("threads", po::value<int>(&nthreads),
+			    "Threads (Default number of cores)")
+		("keys",    po::value<int>(&nkeys),
+			    "Key space (Default 64K)")
+		("read",    po::value<int>(&readpct),
+			    "Percentage of lookups (Default 90)")
+		("s",	    po::value<int>(&seconds),
+			    "Time in sec per run (Default 5)");
+
+	po::variables_map parg;
+
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), parg);
+		po::notify(parg);
+	} catch (...) {
+		cerr << "Error parsing command arguments." << endl;
+		cout << desc << endl;
+		return -1;
+	}
+
+	if (parg.count("help") || seconds <= 0 || nkeys <= 0) {
+		cout << desc << endl;
+		return -1;
+	}
+
+	InitTestSetup();
+
+	Run<LockedMap>("unordered_map+SpinMutex", nthreads, nkeys, readpct, seconds);
+	Run<ConcurrentMap<uint64_t, uint64_t> >("ConcurrentMap", nthreads, nkeys, readpct,
+						 seconds);
+
+	Epoch::Synchronize();
+
+	TeardownTestSetup();
+
+	return 0;
+}
@@ -0,0 +1,226 @@
+#include <boost/program_options.hpp>
+#include <string>
+#include <iostream>
+#include <atomic>
+#include <unistd.h>
+
+#include "net/epoll/mpio-epoll.h"
+#include "net/transport/tcp-linux.h"
+#include "test/unit/unit-test.h"
+
+using namespace std;
+using namespace bblocks;
+
+namespace po = boost::program_options;
+
+// log path
+static string _log("/bmark_conn_rate");
+
+//..................................................................... ConnectionRateBenchmark ....
+
+///
+/// @class ConnectionRateBenchmark
+///
+/// Measures connection setup rate with short lived loopback connections. Every connection is
+/// stopped at both ends as soon as it is established, and a new connect is issued in its place
+/// until the given number of connections have been made.
+///
+/// Client sockets bind to a different address in 127.1.0.0/16 for every `perip` connections, so
+/// ports held in TIME_WAIT do not exhaust the ephemeral range.
+///
+class ConnectionRateBenchmark : public CompletionHandle
+{
+public:
+
+	typedef ConnectionRateBenchmark This;
+
+	ConnectionRateBenchmark(const size_t nconn, const size_t perip, const size_t window,
+				const short port, const size_t npollth)
+		: nconn_(nconn)
+		, perip_(perip)
+		, window_(window)
+		, raddr_(SocketAddress::GetAddr(htonl(INADDR_LOOPBACK), port))
+		, sepoll_(npollth, "/server")
+		, cepoll_(npollth, "/client")
+		, server_(sepoll_, /*nprealloc=*/ window)
+		, connector_(cepoll_)
+		, nconnects_(0)
+		, nclosed_(0)
+	{}
+
+	/*
+	 * Start *-> Accepted -> Stop(ch) *-> StopDone
+	 *       *-> Connected -> Stop(ch) *-> StopDone
+	 *                     -> Connect (next in window)
+	 */
+
+	void Start(int)
+	{
+		SocketAddress addr(SocketAddress::ServerSocketAddr(raddr_));
+		int status = server_.Accept(addr, async_fn(this, &This::Accepted));
+		INVARIANT(status == 0);
+
+		for (size_t i = 0; i < window_ && i < nconn_; ++i) {
+			Connect();
+		}
+	}
+
+	void Accepted(int status, UnicastTransportChannel * ch) __async_fn__
+	{
+		INVARIANT(status == 0 && ch);
+
+		ch->Stop(async_fn(this, &This::StopDone, ch));
+	}
+
+	void Connected(int status, UnicastTransportChannel * ch) __async_fn__
+	{
+		INVARIANT(status == 0 && ch);
+
+		ch->Stop(async_fn(this, &This::StopDone, ch));
+
+		if (nconnects_ < nconn_) {
+			Connect();
+		}
+	}
+
+	void StopDone(int, UnicastTransportChannel * ch) __async_fn__
+	{
+		delete ch;
+
+		const size_t n = ++nclosed_;
+
+		if (!(n % (200 * 1000))) {
+			INFO(_log) << "Connections: " << n / 2;
+		}
+
+		if (n == 2 * nconn_) {
+			BBlocks::Wakeup();
+		}
+	}
+
+	/*
+	 * Stop *-> ServerStopped --> connector_.Stop *-> ConnectorStopped
+	 */
+
+	void Stop()
+	{
+		server_.Stop(async_fn(this, &This::ServerStopped));
+	}
+
+	void ServerStopped(int) __async_fn__
+	{
+		connector_.Stop(async_fn(this, &This::ConnectorStopped));
+	}
+
+	void ConnectorStopped(int) __async_fn__
+	{
+		BBlocks::Wakeup();
+	}
+
+private:
+
+	void Connect()
+	{
+		const size_t idx = nconnects_++;
+
+		/*
+		 * 127.1.x.y, y in [1, 250]
+		 */
+		const size_t ip = idx / perip_;
+		const in_addr_t laddr = htonl((127 << 24) | (1 << 16)
+					      | ((ip / 250) << 8) | (ip % 250 + 1));
+
+		SocketAddress addr(SocketAddress::GetAddr(laddr, /*port=*/ 0), raddr_);
+		int status = connector_.Connect(addr, async_fn(this, &This::Connected));
+		INVARIANT(status == 0);
+	}
+
+	const size_t nconn_;
+	const size_t perip_;
+	const size_t window_;
+	const sockaddr_in raddr_;
+	MultiPathEpoll sepoll_;
+	MultiPathEpoll cepoll_;
+	TCPServer server_;
+	TCPConnector connector_;
+	atomic<size_t> nconnects_;
+	atomic<size_t> nclosed_;
+};
+
+//........................................................................................ Main ....
+
+int
+main(int argc, char ** argv)
+{
+	int nconn = 100 * 1000;
+	int perip = 10 * 1000;
+	int window = 128;
+	int port = 9900;
+	int npollth = 2;
+	int ncpu = SysConf::NumCores();
+
+	po::options_description desc("Options:");
+	desc.add_options()
+		("help",    "Print usage")
+		("conn",    po::value<int>(&nconn),
+			    "Connections to make (Default 100K)")
+		("perip",   po::value<int>(&perip),
+			    "Connections per local address (Default 10K)")
+		("window",  po::value<int>(&window),
+			    "Connects in flight (Default 128)")
+		("port",    po::value<int>(&port),
+			    "Server port (Default 9900)")
+		("npollth", po::value<int>(&npollth),
+			    "Poller threads per side (Default 2)")
+		("ncpu",    po::value<int>(&ncpu),
+			    "CPUs to use");
+
+	po::variables_map parg;
+
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), parg);
+		po::notify(parg);
+	} catch (...) {
+		cerr << "Error parsing command arguments." << endl;
+		cout << desc << endl;
+		return -1;
+	}
+
+	if (parg.count("help") || nconn <= 0 || perip <= 0 || window <= 0) {
+		cout << desc << endl;
+		return -1;
+	}
+
+	InitTestSetup();
+	BBlocks::Start(ncpu);
+
+	INFO(_log) << "Running benchmark for"
+		   << " nconn " << nconn
+		   << " perip " << perip
+		   << " window " << window
+		   << " npollth " << npollth
+		   << " ncpu " << ncpu;
+
+	{
+		ConnectionRateBenchmark b(nconn, perip, window, port, npollth);
+
+		Timer timer;
+
+		BBlocks::Schedule(&b, &ConnectionRateBenchmark::Start, /*val=*/ 0);
+		BBlocks::Wait();
+
+		const uint64_t elapsedMs = timer.Elapsed();
+
+		INFO(_log) << "Connections " << nconn
+			   << " time " << elapsedMs << " ms"
+			   << " conn/sec " << (nconn * 1000.0) / (elapsedMs ? elapsedMs : 1);
+
+		b.Stop();
+		BBlocks::Wait();
+	}
+
+	BBlocks::Shutdown();
+
+	TeardownTestSetup();
+	return 0;
+}
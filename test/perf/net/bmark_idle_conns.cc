@@ -0,0 +1,292 @@
+#include <boost/program_options.hpp>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <atomic>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "net/epoll/mpio-epoll.h"
+#include "net/transport/tcp-linux.h"
+#include "schd/schd-helper.h"
+#include "test/unit/unit-test.h"
+
+using namespace std;
+using namespace bblocks;
+
+namespace po = boost::program_options;
+
+// log path
+static string _log("/bmark_idle_conns");
+
+/*
+ * Resident memory of the process in bytes
+ */
+static uint64_t
+ResidentBytes()
+{
+	ifstream statm("/proc/self/statm");
+	uint64_t size = 0, resident = 0;
+	statm >> size >> resident;
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+//...................................................................... IdleConnectionBenchmark ....
+
+///
+/// @class IdleConnectionBenchmark
+///
+/// Opens a given number of loopback connections and holds them idle, to measure the memory
+/// cost of a connection. Every connection has a channel at both ends.
+///
+/// Ephemeral ports are allocated per local address, so the client binds to a different address
+/// in 127.1.0.0/16 for every `perip` connections. Connects are issued in a window to stay within
+/// the listen backlog.
+///
+class IdleConnectionBenchmark : public CompletionHandle
+{
+public:
+
+	typedef IdleConnectionBenchmark This;
+
+	IdleConnectionBenchmark(const size_t nconn, const size_t perip, const size_t window,
+				const short port, const size_t npollth)
+		: nconn_(nconn)
+		, perip_(perip)
+		, window_(window)
+		, raddr_(SocketAddress::GetAddr(htonl(INADDR_LOOPBACK), port))
+		, sepoll_(npollth, "/server")
+		, cepoll_(npollth, "/client")
+		, server_(sepoll_)
+		, connector_(cepoll_)
+		, nconnects_(0)
+		, nclients_(0)
+		, nservers_(0)
+		, nestablished_(0)
+		, nstopped_(0)
+	{
+		clients_.resize(nconn_, NULL);
+		servers_.resize(nconn_, NULL);
+	}
+
+	/*
+	 * Start *-> Accepted
+	 *       *-> Connected --> Connect (next in window)
+	 */
+
+	void Start(int)
+	{
+		SocketAddress addr(SocketAddress::ServerSocketAddr(raddr_));
+		int status = server_.Accept(addr, async_fn(this, &This::Accepted));
+		INVARIANT(status == 0);
+
+		for (size_t i = 0; i < window_ && i < nconn_; ++i) {
+			Connect();
+		}
+	}
+
+	void Accepted(int status, UnicastTransportChannel * ch) __async_fn__
+	{
+		INVARIANT(status == 0 && ch);
+
+		const size_t idx = nservers_++;
+		INVARIANT(idx < nconn_);
+		servers_[idx] = ch;
+
+		Established();
+	}
+
+	void Connected(int status, UnicastTransportChannel * ch) __async_fn__
+	{
+		INVARIANT(status == 0 && ch);
+
+		const size_t idx = nclients_++;
+		INVARIANT(idx < nconn_);
+		clients_[idx] = ch;
+
+		if (nconnects_ < nconn_) {
+			Connect();
+		}
+
+		Established();
+	}
+
+	/*
+	 * Stop *-> StopDone ... --> server_.Stop *-> ServerStopped --> connector_.Stop
+	 *      *-> ConnectorStopped
+	 */
+
+	void Stop()
+	{
+		for (size_t i = 0; i < nconn_; ++i) {
+			clients_[i]->Stop(async_fn(this, &This::StopDone));
+			servers_[i]->Stop(async_fn(this, &This::StopDone));
+		}
+	}
+
+	void StopDone(int) __async_fn__
+	{
+		if (++nstopped_ == 2 * nconn_) {
+			server_.Stop(async_fn(this, &This::ServerStopped));
+		}
+	}
+
+	void ServerStopped(int) __async_fn__
+	{
+		connector_.Stop(async_fn(this, &This::ConnectorStopped));
+	}
+
+	void ConnectorStopped(int) __async_fn__
+	{
+		for (size_t i = 0; i < nconn_; ++i) {
+			delete clients_[i];
+			delete servers_[i];
+		}
+
+		BBlocks::Wakeup();
+	}
+
+private:
+
+	void Connect()
+	{
+		const size_t idx = nconnects_++;
+
+		/*
+		 * 127.1.x.y, y in [1, 250]
+		 */
+		const size_t ip = idx / perip_;
+		const in_addr_t laddr = htonl((127 << 24) | (1 << 16)
+					      | ((ip / 250) << 8) | (ip % 250 + 1));
+
+		SocketAddress addr(SocketAddress::GetAddr(laddr, /*port=*/ 0), raddr_);
+		int status = connector_.Connect(addr, async_fn(this, &This::Connected));
+		INVARIANT(status == 0);
+	}
+
+	void Established()
+	{
+		const size_t n = ++nestablished_;
+
+		if (!(n % (200 * 1000))) {
+			INFO(_log) << "Connections: " << n / 2;
+		}
+
+		if (n == 2 * nconn_) {
+			BBlocks::Wakeup();
+		}
+	}
+
+	const size_t nconn_;
+	const size_t perip_;
+	const size_t window_;
+	const sockaddr_in raddr_;
+	MultiPathEpoll sepoll_;
+	MultiPathEpoll cepoll_;
+	TCPServer server_;
+	TCPConnector connector_;
+	vector<UnicastTransportChannel *> clients_;
+	vector<UnicastTransportChannel *> servers_;
+	atomic<size_t> nconnects_;
+	atomic<size_t> nclients_;
+	atomic<size_t> nservers_;
+	atomic<size_t> nestablished_;
+	atomic<size_t> nstopped_;
+};
+
+//........................................................................................ Main ....
+
+int
+main(int argc, char ** argv)
+{
+	int nconn = 1000 * 1000;
+	int perip = 20 * 1000;
+	int window = 512;
+	int port = 9900;
+	int npollth = 2;
+	int ncpu = SysConf::NumCores();
+
+	po::options_description desc("Options:");
+	desc.add_options()
+		("help",    "Print usage")
+		("conn",    po::value<int>(&nconn),
+			    "Connections to hold (Default 1M)")
+		("perip",   po::value<int>(&perip),
+			    "Connections per local address (Default 20K)")
+		("window",  po::value<int>(&window),
+			    "Connects in flight (Default 512)")
+		("port",    po::value<int>(&port),
+			    "Server port (Default 9900)")
+		("npollth", po::value<int>(&npollth),
+			    "Poller threads per side (Default 2)")
+		("ncpu",    po::value<int>(&ncpu),
+			    "CPUs to use");
+
+	po::variables_map parg;
+
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), parg);
+		po::notify(parg);
+	} catch (...) {
+		cerr << "Error parsing command arguments." << endl;
+		cout << desc << endl;
+		return -1;
+	}
+
+	if (parg.count("help") || nconn <= 0 || perip <= 0 || window <= 0) {
+		cout << desc << endl;
+		return -1;
+	}
+
+	/*
+	 * Two fds per connection and some room for the rest of the process
+	 */
+	const size_t nfds = 2 * nconn + 1024;
+
+	rlimit rl;
+	int status = getrlimit(RLIMIT_NOFILE, &rl);
+	INVARIANT(status == 0);
+
+	if (rl.rlim_cur < nfds && !SysConf::SetMaxOpenFds(nfds)) {
+		cerr << "Error raising open file limit to " << nfds << endl;
+		return -1;
+	}
+
+	InitTestSetup();
+	BBlocks::Start(ncpu);
+
+	INFO(_log) << "Running benchmark for"
+		   << " nconn " << nconn
+		   << " perip " << perip
+		   << " window " << window
+		   << " npollth " << npollth
+		   << " ncpu " << ncpu;
+
+	{
+		IdleConnectionBenchmark b(nconn, perip, window, port, npollth);
+
+		const uint64_t startBytes = ResidentBytes();
+		Timer timer;
+
+		BBlocks::Schedule(&b, &IdleConnectionBenchmark::Start, /*val=*/ 0);
+		BBlocks::Wait();
+
+		const uint64_t elapsedMs = timer.Elapsed();
+		const uint64_t bytes = ResidentBytes() - startBytes;
+
+		INFO(_log) << "Connections " << nconn
+			   << " setup time " << elapsedMs << " ms"
+			   << " resident " << B2MB(bytes) << " MB"
+			   << " bytes/conn " << bytes / nconn
+			   << " bytes/channel " << bytes / (2 * nconn)
+			   << " sizeof(TCPChannel) " << sizeof(TCPChannel);
+
+		b.Stop();
+		BBlocks::Wait();
+	}
+
+	BBlocks::Shutdown();
+
+	TeardownTestSetup();
+	return 0;
+}
@@ -0,0 +1,167 @@
+#include "test/unit/unit-test.h"
+
+#include <list>
+#include <vector>
+
+#include "async.h"
+#include "bblocks.h"
+#include "buf/arena.h"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_arena";
+
+//...................................................................................... Object ....
+
+struct Object
+{
+	Object(vector<int> & order, const int id) : order_(order), id_(id) {}
+	~Object() { order_.push_back(id_); }
+
+	vector<int> & order_;
+	const int id_;
+};
+
+//................................................................................... TestArena ....
+
+class TestArena : public CompletionHandle
+{
+public:
+
+	typedef TestArena This;
+
+	static const int MAX_OBJS = 1000;
+
+	/*
+	 * Allocations are aligned and distinct, large ones get a block of their own, Reset
+	 * destroys objects last made first
+	 */
+	static void Basic()
+	{
+		Arena arena;
+
+		/*
+		 * Zero bytes on a fresh arena, before there is a chunk
+		 */
+		void * empty = arena.Alloc(/*size=*/ 0);
+		INVARIANT(empty && empty != arena.Alloc(/*size=*/ 0));
+		arena.Reset();
+
+		uint8_t * prev = NULL;
+		for (int i = 0; i < MAX_OBJS; ++i) {
+			uint8_t * p = (uint8_t *) arena.Alloc(/*size=*/ 24, /*align=*/ 8);
+			INVARIANT(!((uintptr_t) p % 8));
+			INVARIANT(p != prev);
+			memset(p, i, 24);
+			prev = p;
+		}
+
+		INVARIANT(arena.Size() == MAX_OBJS * 24);
+		INVARIANT(arena.Chunks() > 1);
+
+		void * aligned = arena.Alloc(/*size=*/ 1, /*align=*/ 64);
+		INVARIANT(!((uintptr_t) aligned % 64));
+
+		const size_t nchunks = arena.Chunks();
+		uint8_t * large = (uint8_t *) arena.Alloc(/*size=*/ 64 * 1024);
+		memset(large, 0, 64 * 1024);
+		INVARIANT(arena.Chunks() == nchunks);
+
+		vector<int> order;
+		for (int i = 0; i < 3; ++i) {
+			arena.New<Object>(order, i);
+		}
+
+		arena.Reset();
+
+		INVARIANT(order == vector<int>({ 2, 1, 0 }));
+		INVARIANT(!arena.Size() && !arena.Chunks());
+	}
+
+	/*
+	 * Containers over the arena, and over the heap without one
+	 */
+	static void Allocator()
+	{
+		Arena arena;
+
+		{
+			vector<int, ArenaAllocator<int> > v(&arena);
+			list<int, ArenaAllocator<int> > l(&arena);
+
+			for (int i = 0; i < MAX_OBJS; ++i) {
+				v.push_back(i);
+				l.push_back(i);
+			}
+
+			INVARIANT(v.size() == (size_t) MAX_OBJS && l.back() == MAX_OBJS - 1);
+			INVARIANT(arena.Size() >= MAX_OBJS * (sizeof(int) + 2 * sizeof(void *)));
+
+			vector<int, ArenaAllocator<int> > h;
+			h.push_back(1);
+			INVARIANT(!h.get_allocator().arena_);
+		}
+
+		arena.Reset();
+	}
+
+	/*
+	 * The arena goes with the request to the routines run for it
+	 */
+	static void Request()
+	{
+		BBlocks::Start();
+
+		TestArena t;
+
+		{
+			AsyncCtx::Scope _(AsyncCtx::Begin(/*requestId=*/ 1, /*tenant=*/ 0,
+							  /*budgetInMilliSec=*/ 0, &t.arena_));
+			BBlocks::Schedule(&t, &This::Run, /*val=*/ 10);
+		}
+
+		INVARIANT(!Arena::Current());
+
+		BBlocks::Wait();
+		BBlocks::Shutdown();
+
+		INVARIANT(t.arena_.Size() == 10 * sizeof(uint64_t));
+		t.arena_.Reset();
+	}
+
+	void Run(int n)
+	{
+		INVARIANT(Arena::Current() == &arena_);
+
+		/*
+		 * Chunks come from the BufferPool of the pool thread
+		 */
+		Arena::Current()->New<uint64_t>(n);
+
+		if (--n) {
+			BBlocks::Schedule(this, &This::Run, n);
+			return;
+		}
+
+		BBlocks::Wakeup();
+	}
+
+	Arena arena_;
+};
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(TestArena::Basic);
+	TEST(TestArena::Allocator);
+	TEST(TestArena::Request);
+
+	TeardownTestSetup();
+
+	return 0;
+}
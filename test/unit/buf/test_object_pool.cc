@@ -0,0 +1,199 @@
+#include "test/unit/unit-test.h"
+
+#include <thread>
+#include <vector>
+
+#include "async.h"
+#include "bblocks.h"
+#include "buf/object-pool.h"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_object_pool";
+
+//................................................................................... PoolObj ....
+
+struct PoolObj : PoolObject<PoolObj>
+{
+	PoolObj(const int val) : val_(val) { ++nobjs_; }
+	~PoolObj() { --nobjs_; }
+
+	int val_;
+	uint8_t pad_[100];
+
+	static atomic<int> nobjs_;
+};
+
+atomic<int> PoolObj::nobjs_(0);
+
+struct PlainObj
+{
+	PlainObj(const int a, const string & b) : a_(a), b_(b) {}
+
+	int a_;
+	string b_;
+};
+
+//........................................................................... TestObjectPool ....
+
+class TestObjectPool : public CompletionHandle
+{
+public:
+
+	typedef TestObjectPool This;
+
+	static const int MAX_ROUTINES = 100;
+	static const int MAX_OBJS = 100;
+
+	TestObjectPool() : pending_(MAX_ROUTINES) {}
+
+	/*
+	 * New and Delete run the constructor and destructor, freed memory is reused
+	 */
+	static void Basic()
+	{
+		ObjectPool<PlainObj> & pool = ObjectPool<PlainObj>::Instance();
+
+		PlainObj * o = ObjectPool<PlainObj>::New(1, "one");
+		INVARIANT(o->a_ == 1 && o->b_ == "one");
+		INVARIANT(pool.Live() == 1);
+
+		ObjectPool<PlainObj>::Delete(o);
+		INVARIANT(!pool.Live());
+
+		PlainObj * p = ObjectPool<PlainObj>::New(2, "two");
+		INVARIANT(p == o);
+		ObjectPool<PlainObj>::Delete(p);
+
+		/*
+		 * More than the cache holds goes to the depot
+		 */
+		vector<PlainObj *> objs;
+		for (size_t i = 0; i < 4 * ObjectPool<PlainObj>::CACHE_SIZE; ++i) {
+			objs.push_back(ObjectPool<PlainObj>::New(i, "obj"));
+		}
+
+		INVARIANT(pool.Live() == (int64_t) objs.size());
+
+		for (auto obj : objs) {
+			ObjectPool<PlainObj>::Delete(obj);
+		}
+
+		INVARIANT(!pool.Live());
+		INVARIANT(pool.DepotSize());
+
+		/*
+		 * Reserves fill the depot, they don't add up
+		 */
+		const size_t n = 2 * ObjectPool<PlainObj>::DEFAULT_DEPOT_SIZE;
+		pool.Reserve(n);
+		INVARIANT(pool.DepotSize() == n);
+
+		pool.Reserve(n);
+		pool.Reserve(n / 4);
+		INVARIANT(pool.DepotSize() == n);
+	}
+
+	/*
+	 * Objects opt in with the CRTP base, a thread that exits leaves its objects accounted
+	 */
+	static void Crtp()
+	{
+		ObjectPool<PoolObj> & pool = ObjectPool<PoolObj>::Instance();
+
+		PoolObj * o = new PoolObj(10);
+		INVARIANT(PoolObj::nobjs_ == 1);
+		INVARIANT(pool.Live() == 1);
+
+		vector<PoolObj *> objs;
+
+		thread th([&objs]() {
+			for (int i = 0; i < MAX_OBJS; ++i) {
+				objs.push_back(new PoolObj(i));
+			}
+
+			/*
+			 * Half is freed here, the rest outlives the thread
+			 */
+			for (int i = 0; i < MAX_OBJS / 2; ++i) {
+				delete objs.back();
+				objs.pop_back();
+			}
+		});
+		th.join();
+
+		INVARIANT(pool.Live() == 1 + MAX_OBJS / 2);
+
+		for (auto obj : objs) {
+			delete obj;
+		}
+
+		delete o;
+
+		INVARIANT(!PoolObj::nobjs_);
+		INVARIANT(!pool.Live());
+	}
+
+	/*
+	 * Objects allocated on one pool thread and freed on another
+	 */
+	static void Pool()
+	{
+		BBlocks::Start();
+
+		TestObjectPool t;
+
+		for (int i = 0; i < MAX_ROUTINES; ++i) {
+			BBlocks::Schedule(&t, &This::Alloc, /*val=*/ i);
+		}
+
+		BBlocks::Wait();
+		BBlocks::Shutdown();
+
+		INVARIANT(!PoolObj::nobjs_);
+		INVARIANT(!ObjectPool<PoolObj>::Instance().Live());
+	}
+
+	void Alloc(int val)
+	{
+		vector<PoolObj *> * objs = new vector<PoolObj *>();
+
+		for (int i = 0; i < MAX_OBJS; ++i) {
+			objs->push_back(new PoolObj(val));
+		}
+
+		BBlocks::Schedule(this, &This::Free, objs);
+	}
+
+	void Free(vector<PoolObj *> * objs)
+	{
+		for (auto obj : *objs) {
+			delete obj;
+		}
+
+		delete objs;
+
+		if (!--pending_) {
+			BBlocks::Wakeup();
+		}
+	}
+
+	atomic<int> pending_;
+};
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(TestObjectPool::Basic);
+	TEST(TestObjectPool::Crtp);
+	TEST(TestObjectPool::Pool);
+
+	TeardownTestSetup();
+
+	return 0;
+}
@@ -0,0 +1,203 @@
+#include <string>
+#include <iostream>
+
+#include "test/unit/unit-test.h"
+#include "ds/concurrent-map.hpp"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_concurrent_map";
+
+// ................................................................................. TestBasic ....
+
+void
+test_basic()
+{
+	ConcurrentMap<int, int> map(/*nbuckets=*/ 64);
+
+	INVARIANT(map.IsEmpty());
+
+	const int MAX_KEYS = 10 * 1024;
+
+	for (int i = 0; i < MAX_KEYS; ++i) {
+		INVARIANT(map.Insert(i, i * 2));
+		INVARIANT(!map.Insert(i, /*val=*/ 0));
+	}
+
+	INVARIANT(map.Size() == size_t(MAX_KEYS));
+	INVARIANT(map.Buckets() > 64);
+
+	for (int i = 0; i < MAX_KEYS; ++i) {
+		int v = 0;
+		INVARIANT(map.Get(i, v));
+		INVARIANT(v == i * 2);
+	}
+
+	for (int i = 0; i < MAX_KEYS; i += 2) {
+		INVARIANT(!map.Put(i, i * 3));
+		INVARIANT(map.Erase(i + 1));
+		INVARIANT(!map.Erase(i + 1));
+	}
+
+	INVARIANT(map.Size() == size_t(MAX_KEYS / 2));
+
+	size_t count = 0;
+	map.ForEach([&count](const int & k, const int & v) {
+		INVARIANT(!(k % 2));
+		INVARIANT(v == k * 3);
+		++count;
+	});
+
+	INVARIANT(count == size_t(MAX_KEYS / 2));
+
+	map.Clear();
+
+	INVARIANT(map.IsEmpty());
+	INVARIANT(!map.Contains(/*key=*/ 0));
+
+	Epoch::Synchronize();
+	INVARIANT(!Epoch::Pending());
+}
+
+// ................................................................................. TestSmall ....
+
+/*
+ * A map with a few stripes, as embedded per object, grows and erases like a large one
+ */
+void
+test_small()
+{
+	ConcurrentMap<int, int> map(/*nbuckets=*/ 4, /*nstripes=*/ 3);
+
+	const int MAX_KEYS = 1024;
+
+	for (int i = 0; i < MAX_KEYS; ++i) {
+		INVARIANT(map.Insert(i, i * 2));
+	}
+
+	INVARIANT(map.Size() == size_t(MAX_KEYS));
+	INVARIANT(map.Buckets() > 4);
+
+	for (int i = 0; i < MAX_KEYS; ++i) {
+		int v = 0;
+		INVARIANT(map.Erase(i, v));
+		INVARIANT(v == i * 2);
+		INVARIANT(!map.Erase(i, v));
+	}
+
+	INVARIANT(map.IsEmpty());
+
+	Epoch::Synchronize();
+	INVARIANT(!Epoch::Pending());
+}
+
+// ............................................................................ TestConcurrent ....
+
+class TestConcurrent
+{
+public:
+
+	typedef TestConcurrent This;
+
+	static const int MAX_WRITERS = 4;
+	static const int MAX_READERS = 4;
+	static const int MAX_KEYS = 16 * 1024;
+	static const int MAX_ROUNDS = 4;
+
+	TestConcurrent() : pending_(0), hits_(0) {}
+
+	void Write(int id)
+	{
+		/*
+		 * Each writer owns a disjoint range of keys and churns it
+		 */
+		for (int r = 0; r < MAX_ROUNDS; ++r) {
+			for (int i = id; i < MAX_KEYS; i += MAX_WRITERS) {
+				map_.Put(i, i);
+			}
+
+			for (int i = id; i < MAX_KEYS; i += MAX_WRITERS) {
+				if (r != MAX_ROUNDS - 1 || i % 2) {
+					map_.Erase(i);
+				}
+			}
+		}
+
+		Done();
+	}
+
+	void Read(int id)
+	{
+		for (int r = 0; r < MAX_ROUNDS; ++r) {
+			for (int i = 0; i < MAX_KEYS; ++i) {
+				int v;
+				if (map_.Get(i, v)) {
+					INVARIANT(v == i);
+					++hits_;
+				}
+			}
+		}
+
+		Done();
+	}
+
+	void Done()
+	{
+		if (!--pending_) {
+			BBlocks::Wakeup();
+		}
+	}
+
+	static void Run()
+	{
+		BBlocks::Start();
+
+		TestConcurrent t;
+		t.pending_ = MAX_WRITERS + MAX_READERS;
+
+		for (int i = 0; i < MAX_WRITERS; ++i) {
+			BBlocks::Schedule(&t, &This::Write, i);
+		}
+
+		for (int i = 0; i < MAX_READERS; ++i) {
+			BBlocks::Schedule(&t, &This::Read, i);
+		}
+
+		BBlocks::Wait();
+		BBlocks::Shutdown();
+
+		/*
+		 * Even keys of the last round survive
+		 */
+		INVARIANT(t.map_.Size() == size_t(MAX_KEYS / 2));
+
+		for (int i = 0; i < MAX_KEYS; ++i) {
+			INVARIANT(t.map_.Contains(i) == !(i % 2));
+		}
+
+		INFO(_log) << "Read hits " << t.hits_;
+
+		Epoch::Synchronize();
+	}
+
+	ConcurrentMap<int, int> map_;
+	atomic<int> pending_;
+	atomic<uint64_t> hits_;
+};
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(test_basic);
+	TEST(test_small);
+	TEST(TestConcurrent::Run);
+
+	TeardownTestSetup();
+
+	return 0;
+}
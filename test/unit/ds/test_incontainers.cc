@@ -0,0 +1,314 @@
+#include <string>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include "test/unit/unit-test.h"
+#include "ds/inslist.hpp"
+#include "ds/intree.hpp"
+#include "ds/inhash.hpp"
+#include "inlist.hpp"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_incontainers";
+
+struct Elem : InSListElement<Elem>, InTreeElement<Elem>, InHashElement<Elem>
+{
+	Elem(const int key = 0) : key_(key) {}
+
+	bool operator<(const Elem & rhs) const
+	{
+		return key_ < rhs.key_;
+	}
+
+	int key_;
+};
+
+// .................................................................................. TestSList ....
+
+void
+test_slist()
+{
+	const int MAX_ELEMS = 1024;
+	vector<Elem> elems(MAX_ELEMS);
+
+	InStack<Elem> s;
+	InSQueue<Elem> q;
+	InSQueue<Elem> q2;
+
+	for (int i = 0; i < MAX_ELEMS; ++i) {
+		elems[i].key_ = i;
+		s.Push(&elems[i]);
+	}
+
+	INVARIANT(s.Size() == size_t(MAX_ELEMS));
+
+	for (int i = MAX_ELEMS - 1; i >= 0; --i) {
+		INVARIANT(s.Pop()->key_ == i);
+	}
+
+	INVARIANT(s.IsEmpty());
+
+	for (int i = 0; i < MAX_ELEMS; ++i) {
+		(i < MAX_ELEMS / 2 ? q : q2).Push(&elems[i]);
+	}
+
+	q.Append(q2);
+
+	INVARIANT(q2.IsEmpty());
+	INVARIANT(q.Size() == size_t(MAX_ELEMS));
+
+	for (int i = 0; i < MAX_ELEMS; ++i) {
+		INVARIANT(q.Pop()->key_ == i);
+	}
+
+	INVARIANT(q.IsEmpty());
+
+	/*
+	 * Remove from the head, the middle and the tail
+	 */
+	for (int i = 0; i < 4; ++i) {
+		q.Push(&elems[i]);
+	}
+
+	INVARIANT(q.Remove(&elems[0]));
+	INVARIANT(q.Remove(&elems[2]));
+	INVARIANT(q.Remove(&elems[3]));
+	INVARIANT(!q.Remove(&elems[3]));
+	INVARIANT(q.Size() == 1);
+
+	q.Push(&elems[4]);
+	INVARIANT(q.Pop()->key_ == 1);
+	INVARIANT(q.Pop()->key_ == 4);
+	INVARIANT(q.IsEmpty());
+}
+
+// ................................................................................... TestTree ....
+
+/*
+ * Validate red-black properties and return the black height
+ */
+static int
+Validate(const Elem * e)
+{
+	if (!e) return 1;
+
+	if (e->left_) {
+		INVARIANT(e->left_->parent_ == e);
+		INVARIANT(!(*e < *e->left_));
+	}
+
+	if (e->right_) {
+		INVARIANT(e->right_->parent_ == e);
+		INVARIANT(!(*e->right_ < *e));
+	}
+
+	if (e->red_) {
+		INVARIANT(!e->left_ || !e->left_->red_);
+		INVARIANT(!e->right_ || !e->right_->red_);
+	}
+
+	const int lh = Validate(e->left_);
+	INVARIANT(lh == Validate(e->right_));
+
+	return lh + (e->red_ ? 0 : 1);
+}
+
+static void
+Validate(InTree<Elem> & t)
+{
+	const Elem * root = t.Min();
+	while (root && root->parent_) root = root->parent_;
+
+	INVARIANT(!root || !root->red_);
+	Validate(root);
+
+	size_t count = 0;
+	for (Elem * e = t.Min(); e; e = InTree<Elem>::Next(e)) {
+		Elem * next = InTree<Elem>::Next(e);
+		INVARIANT(!next || !(*next < *e));
+		++count;
+	}
+
+	INVARIANT(count == t.Size());
+}
+
+void
+test_tree()
+{
+	const int MAX_ELEMS = 4 * 1024;
+	vector<Elem> elems(MAX_ELEMS);
+
+	for (int i = 0; i < MAX_ELEMS; ++i) {
+		/*
+		 * Keys with duplicates
+		 */
+		elems[i].key_ = (i * 7919) % (MAX_ELEMS / 2);
+	}
+
+	InTree<Elem> t;
+
+	for (int i = 0; i < MAX_ELEMS; ++i) {
+		t.Insert(&elems[i]);
+	}
+
+	INVARIANT(t.Size() == size_t(MAX_ELEMS));
+	INVARIANT(t.Min()->key_ == 0);
+	Validate(t);
+
+	/*
+	 * Unlink every third element from the middle of the tree
+	 */
+	for (int i = 0; i < MAX_ELEMS; i += 3) {
+		INVARIANT(t.IsLinked(&elems[i]));
+		t.Unlink(&elems[i]);
+		INVARIANT(!t.IsLinked(&elems[i]));
+	}
+
+	Validate(t);
+
+	int last = -1;
+	while (!t.IsEmpty()) {
+		Elem * e = t.Pop();
+		INVARIANT(e->key_ >= last);
+		last = e->key_;
+	}
+
+	INVARIANT(!t.Size());
+}
+
+// ................................................................................... TestHash ....
+
+void
+test_hash()
+{
+	const int MAX_ELEMS = 4 * 1024;
+	vector<Elem> elems(MAX_ELEMS);
+
+	InHashTable<int, Elem, &Elem::key_> h(/*nbuckets=*/ 4);
+
+	for (int i = 0; i < MAX_ELEMS; ++i) {
+		elems[i].key_ = i;
+		INVARIANT(h.Insert(&elems[i]));
+	}
+
+	Elem dup(/*key=*/ 10);
+	INVARIANT(!h.Insert(&dup));
+
+	INVARIANT(h.Size() == size_t(MAX_ELEMS));
+
+	for (int i = 0; i < MAX_ELEMS; ++i) {
+		INVARIANT(h.Find(i) == &elems[i]);
+	}
+
+	for (int i = 0; i < MAX_ELEMS; i += 2) {
+		h.Unlink(&elems[i]);
+		INVARIANT(!h.Find(i));
+		INVARIANT(!h.Erase(i));
+	}
+
+	size_t count = 0;
+	h.ForEach([&count](Elem * e) {
+		INVARIANT(e->key_ % 2);
+		++count;
+	});
+
+	INVARIANT(count == size_t(MAX_ELEMS / 2));
+
+	for (int i = 1; i < MAX_ELEMS; i += 2) {
+		INVARIANT(h.Erase(i) == &elems[i]);
+	}
+
+	INVARIANT(h.IsEmpty());
+}
+
+// ................................................................................ TestInQueue ....
+
+struct QElem : InListElement<QElem>
+{
+};
+
+/*
+ * Spin budget follows the arrival rate and the policy
+ */
+void
+test_inqueue_spin()
+{
+	typedef InQueue<QElem> queue_t;
+
+	const int MAX_ELEMS = 64;
+	vector<QElem> elems(MAX_ELEMS);
+	queue_t q("/test_incontainers/q");
+
+	SpinPolicy::Set(SpinPolicy::LATENCY);
+	INVARIANT(q.SpinBudget() >= queue_t::DEFAULT_SPIN);
+
+	/*
+	 * Sparse arrivals, not worth spinning for unless asked for latency
+	 */
+	for (int i = 0; i < 16; ++i) {
+		q.Push(&elems[i]);
+		INVARIANT(q.Pop() == &elems[i]);
+		usleep(2 * 1000);
+	}
+
+	INVARIANT(q.SpinBudget() >= queue_t::DEFAULT_SPIN);
+
+	SpinPolicy::Set(SpinPolicy::BALANCED);
+	INVARIANT(!q.SpinBudget());
+
+	SpinPolicy::Set(SpinPolicy::POWER);
+	INVARIANT(!q.SpinBudget());
+
+	/*
+	 * Dense arrivals
+	 */
+	for (int j = 0; j < 4; ++j) {
+		for (int i = 0; i < MAX_ELEMS; ++i) {
+			q.Push(&elems[i]);
+		}
+
+		for (int i = 0; i < MAX_ELEMS; ++i) {
+			INVARIANT(q.Pop() == &elems[i]);
+		}
+	}
+
+	INVARIANT(q.SpinBudget() && q.SpinBudget() <= queue_t::POWER_MAX_SPIN);
+
+	SpinPolicy::Set(SpinPolicy::BALANCED);
+	const unsigned int budget = q.SpinBudget();
+	INVARIANT(budget);
+
+	/*
+	 * Spins that come up empty halve the budget
+	 */
+	INVARIANT(!q.Pop(/*ms=*/ 1));
+	INVARIANT(q.SpinMisses() == 1);
+	INVARIANT(q.SpinBudget() == max(budget / 2, queue_t::MIN_SPIN + 0));
+
+	for (int i = 0; i < 16; ++i) {
+		INVARIANT(!q.Pop(/*ms=*/ 1));
+	}
+
+	INVARIANT(q.SpinBudget() == queue_t::MIN_SPIN);
+	INVARIANT(q.IsEmpty());
+}
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(test_slist);
+	TEST(test_tree);
+	TEST(test_hash);
+	TEST(test_inqueue_spin);
+
+	TeardownTestSetup();
+
+	return 0;
+}
@@ -115,6 +115,48 @@ test_aio_basic()
     BBlocks::Shutdown();
 }
 
+void
+test_aio_opctl()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio;
+        SpinningDevice dev("obj/test.out", /*size=*/ 10 * 1024 * 1024, &aio);
+
+        int status = dev.OpenDevice();
+        INVARIANT(status > 0);
+
+        IOBuffer buf = IOBuffer::Alloc(4096);
+        buf.Fill('x');
+
+        /*
+         * Op that beats its deadline, the timer is disarmed on completion
+         */
+        AsyncWait<int> waiter;
+        status = dev.Write(buf, /*off=*/ 0, /*nblks=*/ 8,
+                           intr_fn(&waiter, &AsyncWait<int>::Done),
+                           OpCtl(/*timeoutMs=*/ 10 * 1000));
+        INVARIANT(status == 1);
+        INVARIANT(waiter.Wait() == 4096);
+
+        /*
+         * Op on a cancelled token fails right away
+         */
+        CancelToken token;
+        token.Cancel();
+
+        status = dev.Read(buf, /*off=*/ 0, /*nblks=*/ 8,
+                          intr_fn(&waiter, &AsyncWait<int>::Done),
+                          OpCtl(/*timeoutMs=*/ 0, &token));
+        INVARIANT(status == CANCELLED);
+
+        buf.Trash();
+    }
+
+    BBlocks::Shutdown();
+}
+
 //.................................................................... main ....
 
 int
@@ -125,6 +167,7 @@ main(int argc, char ** argv)
     InitTestSetup();
 
     TEST(test_aio_basic);
+    TEST(test_aio_opctl);
 
     TeardownTestSetup();
 
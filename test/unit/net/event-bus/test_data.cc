@@ -81,6 +81,91 @@ test_datatypes()
 	INVARIANT(data2.raw_ == rawdata);
 }
 
+// ........................................................................ test_arena_decode ....
+
+struct ArenaData : NetPacket
+{
+	ArenaData(Arena * arena)
+		: NetPacket(arena), str_(arena), lstr_(arena), lu32_(arena)
+	{
+		NetPacket::Add(i32_);
+		NetPacket::Add(str_);
+		NetPacket::Add(lstr_);
+		NetPacket::Add(lu32_);
+	}
+
+	UInt32 i32_;
+	ArenaString str_;
+	ArenaList<ArenaString> lstr_;
+	ArenaList<UInt32> lu32_;
+};
+
+static void
+test_arena_decode()
+{
+	Data data;
+
+	data.i16_.Set(1);
+	data.i32_.Set(2);
+	data.str_.Set("a string too long to be kept inline by std::string");
+	data.lstr_.Set(List<String>({ String("a"), String("b"), String("c") }));
+	data.lu32_.Set(List<UInt32>({ UInt32(2), UInt32(4), UInt32(16) }));
+
+	/*
+	 * Same layout on the wire as the leading fields of Data, less i16_
+	 */
+	NetPacket wire;
+	wire.Add(data.i32_);
+	wire.Add(data.str_);
+	wire.Add(data.lstr_);
+	wire.Add(data.lu32_);
+
+	IOBuffer buf = IOBuffer::Alloc(wire.Size());
+	size_t pos = 0;
+	wire.Encode(buf, pos);
+
+	/*
+	 * List<T>::Size is an upper bound, what went on the wire is exact
+	 */
+	const size_t size = pos;
+
+	Arena arena;
+
+	ArenaData * d = arena.New<ArenaData>(&arena);
+	pos = 0;
+	d->Decode(buf, pos, arena);
+
+	INVARIANT(pos == size);
+	INVARIANT(d->Size() == size);
+	INVARIANT(d->i32_ == 2);
+	INVARIANT(d->str_ == data.str_.Get());
+	INVARIANT(d->lstr_.Get().size() == 3);
+	INVARIANT(d->lstr_.Get()[2] == "c");
+	INVARIANT(d->lu32_ == data.lu32_.Get());
+	INVARIANT(d->str_.Get().get_allocator() == ArenaAllocator<char>(&arena));
+	INVARIANT(d->lstr_.Get()[0].Get().get_allocator() == ArenaAllocator<char>(&arena));
+
+	/*
+	 * Encodes back the same
+	 */
+	IOBuffer buf2 = IOBuffer::Alloc(d->Size());
+	pos = 0;
+	d->Encode(buf2, pos);
+	INVARIANT(pos == size);
+	INVARIANT(!memcmp(buf2.Ptr(), buf.Ptr(), size));
+
+	INFO(_log) << "Arena bytes " << arena.Size() << " chunks " << arena.Chunks();
+
+	/*
+	 * One reset frees the lot
+	 */
+	arena.Reset();
+	INVARIANT(!arena.Size());
+
+	buf.Trash();
+	buf2.Trash();
+}
+
 //........................................................................................ main ....
 
 int
@@ -91,6 +176,7 @@ main(int argc, char ** argv)
 	InitTestSetup();
 
 	TEST(test_datatypes);
+	TEST(test_arena_decode);
 
 	TeardownTestSetup();
 
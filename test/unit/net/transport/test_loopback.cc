@@ -0,0 +1,359 @@
+#include <list>
+#include <iostream>
+
+#include "test/unit/unit-test.h"
+#include "util.h"
+#include "net/transport/loopback.h"
+#include "async.h"
+
+using namespace std;
+using namespace bblocks;
+
+//............................................................................ BasicLoopbackTest ....
+
+/*
+ * Client streams buffers larger than the ring so writes and reads go async half way, the server
+ * checks them in order. Stopping the client fails the read the server has pending.
+ */
+class BasicLoopbackTest : public CompletionHandle
+{
+public:
+
+	typedef BasicLoopbackTest This;
+
+	static const uint32_t MAX_ITERATION = 100;
+	static const uint32_t BUFSIZE = 4 * 1024;
+	static const uint32_t RINGSIZE = 1000;
+
+	BasicLoopbackTest()
+		: log_("/testloopback/basic")
+		, lock_(log_)
+		, server_(RINGSIZE)
+		, addr_(SocketAddress::GetAddr("127.0.0.1", 9999))
+		, server_ch_(NULL)
+		, client_ch_(NULL)
+		, nread_(0)
+		, nwritten_(0)
+		, rbuf_(IOBuffer::Alloc(BUFSIZE))
+	{
+	}
+
+	~BasicLoopbackTest()
+	{
+		rbuf_.Trash();
+	}
+
+	void Start(int nonce)
+	{
+		int status = server_.Accept(SocketAddress::ServerSocketAddr(addr_),
+					    async_fn(this, &This::HandleServerConn));
+		INVARIANT(status == 0);
+
+		/*
+		 * The address is taken
+		 */
+		LoopbackAcceptor other;
+		status = other.Accept(SocketAddress::ServerSocketAddr(addr_),
+				      async_fn(this, &This::HandleServerConn));
+		INVARIANT(status == -1);
+
+		status = client_.Connect(SocketAddress(addr_), async_fn(this, &This::HandleClientConn));
+		INVARIANT(status == 0);
+	}
+
+	virtual void HandleServerConn(int status, UnicastTransportChannel * ch) __async_fn__
+	{
+		INVARIANT(status == 0);
+
+		server_ch_ = dynamic_cast<LoopbackChannel *>(ch);
+		INVARIANT(server_ch_);
+
+		ReadUntilBlocked();
+	}
+
+	virtual void HandleClientConn(int status, UnicastTransportChannel * ch) __async_fn__
+	{
+		INVARIANT(status == 0);
+
+		client_ch_ = dynamic_cast<LoopbackChannel *>(ch);
+		INVARIANT(client_ch_);
+
+		WriteUntilBlocked();
+	}
+
+	virtual void ReadDone(int status, IOBuffer buf) __async_fn__
+	{
+		if (status == -1) {
+			ClientGone();
+			return;
+		}
+
+		INVARIANT(status == (int) BUFSIZE);
+		INVARIANT(buf == rbuf_);
+
+		VerifyData();
+		ReadUntilBlocked();
+	}
+
+	virtual void WriteDone(int status, IOBuffer buf) __async_fn__
+	{
+		INVARIANT(status == (int) BUFSIZE);
+
+		buf.Trash();
+		++nwritten_;
+
+		WriteUntilBlocked();
+	}
+
+	void ClientStopped(int) __async_fn__
+	{
+		delete client_ch_;
+		client_ch_ = NULL;
+	}
+
+	void ServerChannelStopped(int) __async_fn__
+	{
+		delete server_ch_;
+		server_ch_ = NULL;
+
+		server_.Stop(async_fn(this, &This::ServerStopped));
+	}
+
+	void ServerStopped(int) __async_fn__
+	{
+		/*
+		 * Nobody listens now
+		 */
+		int status = client_.Connect(SocketAddress(addr_),
+					     async_fn(this, &This::HandleClientConn));
+		INVARIANT(status == -1);
+
+		client_.Stop(async_fn(this, &This::ConnectorStopped));
+	}
+
+	void ConnectorStopped(int) __async_fn__
+	{
+		BBlocks::Wakeup();
+	}
+
+private:
+
+	void WriteUntilBlocked()
+	{
+		Guard _(&lock_);
+
+		while (nwritten_ < MAX_ITERATION) {
+			IOBuffer buf = IOBuffer::Alloc(BUFSIZE);
+			buf.FillRandom();
+			cksum_.push_back(Adler32::Calc(buf.Ptr(), buf.Size()));
+
+			int status = client_ch_->Write(buf, async_fn(this, &This::WriteDone));
+			INVARIANT(status >= 0 && status <= (int) BUFSIZE);
+
+			if (status != (int) BUFSIZE) {
+				return;
+			}
+
+			buf.Trash();
+			++nwritten_;
+		}
+	}
+
+	void ReadUntilBlocked()
+	{
+		while (true) {
+			int status = server_ch_->Read(rbuf_, async_fn(this, &This::ReadDone));
+			INVARIANT(status >= -1 && status <= (int) BUFSIZE);
+
+			if (status == -1) {
+				ClientGone();
+				return;
+			}
+
+			if (status != (int) BUFSIZE) {
+				return;
+			}
+
+			VerifyData();
+		}
+	}
+
+	void ClientGone()
+	{
+		/*
+		 * Stopped once all was read, the read fails sync or async depending on the race
+		 */
+		INVARIANT(nread_ == MAX_ITERATION);
+		server_ch_->Stop(async_fn(this, &This::ServerChannelStopped));
+	}
+
+	void VerifyData()
+	{
+		Guard _(&lock_);
+
+		INVARIANT(!cksum_.empty());
+		INVARIANT(cksum_.front() == Adler32::Calc(rbuf_.Ptr(), rbuf_.Size()));
+		cksum_.pop_front();
+
+		if (++nread_ == MAX_ITERATION) {
+			INFO(log_) << "Stopping client";
+			int status = client_ch_->Stop(async_fn(this, &This::ClientStopped));
+			INVARIANT(status == 0);
+		}
+	}
+
+	string log_;
+	SpinMutex lock_;
+	LoopbackAcceptor server_;
+	LoopbackConnector client_;
+	sockaddr_in addr_;
+	LoopbackChannel * server_ch_;
+	LoopbackChannel * client_ch_;
+	list<uint32_t> cksum_;
+	uint32_t nread_;
+	uint32_t nwritten_;
+	IOBuffer rbuf_;
+};
+
+void
+test_loopback_basic()
+{
+	BBlocks::Start();
+
+	BasicLoopbackTest test;
+
+	BBlocks::Schedule(&test, &BasicLoopbackTest::Start, /*nonce=*/ 0);
+
+	BBlocks::Wait();
+	BBlocks::Shutdown();
+}
+
+//......................................................................... DeadlineLoopbackTest ....
+
+/*
+ * Reads on a quiet pair. The first runs into its deadline, the second is cancelled through its
+ * token and a read on a cancelled token fails right away. A peek larger than the ring can never
+ * complete and fails right away.
+ */
+class DeadlineLoopbackTest : public CompletionHandle
+{
+public:
+
+	typedef DeadlineLoopbackTest This;
+
+	static const uint32_t BUFSIZE = 100;
+	static const uint32_t TIMEOUT_MS = 10;
+
+	DeadlineLoopbackTest()
+		: a_(NULL)
+		, b_(NULL)
+		, rbuf_(IOBuffer::Alloc(BUFSIZE))
+	{
+		LoopbackChannel::NewPair(&a_, &b_);
+	}
+
+	~DeadlineLoopbackTest()
+	{
+		rbuf_.Trash();
+	}
+
+	void Start(int nonce)
+	{
+		IOBuffer big = IOBuffer::Alloc(LoopbackChannel::DEFAULT_RING_SIZE + 1);
+		int status = a_->Peek(big, async_fn(this, &This::ReadCancelled));
+		INVARIANT(status == -1);
+		big.Trash();
+
+		timer_.Reset();
+
+		status = a_->Read(rbuf_, async_fn(this, &This::ReadTimedOut), OpCtl(TIMEOUT_MS));
+		INVARIANT(status == 0);
+	}
+
+	virtual void ReadTimedOut(int status, IOBuffer buf) __async_fn__
+	{
+		INVARIANT(status == TIMEDOUT);
+		INVARIANT(buf.Ptr() == rbuf_.Ptr());
+		INVARIANT(timer_.Elapsed() + 1 >= TIMEOUT_MS);
+
+		int ret = a_->Read(rbuf_, async_fn(this, &This::ReadCancelled),
+				   OpCtl(/*timeoutMs=*/ 0, &token_));
+		INVARIANT(ret == 0);
+
+		token_.Cancel();
+	}
+
+	virtual void ReadCancelled(int status, IOBuffer buf) __async_fn__
+	{
+		INVARIANT(status == CANCELLED);
+		INVARIANT(buf.Ptr() == rbuf_.Ptr());
+
+		int ret = a_->Read(rbuf_, async_fn(this, &This::ReadCancelled),
+				   OpCtl(/*timeoutMs=*/ 0, &token_));
+		INVARIANT(ret == CANCELLED);
+
+		ret = a_->Stop(async_fn(this, &This::AStopped));
+		INVARIANT(ret == 0);
+	}
+
+	void AStopped(int) __async_fn__
+	{
+		delete a_;
+		a_ = NULL;
+
+		/*
+		 * The peer is gone, there is nothing to read or write
+		 */
+		int ret = b_->Read(rbuf_, async_fn(this, &This::ReadCancelled));
+		INVARIANT(ret == -1);
+
+		ret = b_->Write(rbuf_, async_fn(this, &This::ReadCancelled));
+		INVARIANT(ret == -1);
+
+		b_->Stop(async_fn(this, &This::BStopped));
+	}
+
+	void BStopped(int) __async_fn__
+	{
+		delete b_;
+		b_ = NULL;
+
+		BBlocks::Wakeup();
+	}
+
+private:
+
+	LoopbackChannel * a_;
+	LoopbackChannel * b_;
+	IOBuffer rbuf_;
+	CancelToken token_;
+	Timer timer_;
+};
+
+void
+test_loopback_deadline()
+{
+	BBlocks::Start();
+
+	DeadlineLoopbackTest test;
+
+	BBlocks::Schedule(&test, &DeadlineLoopbackTest::Start, /*nonce=*/ 0);
+
+	BBlocks::Wait();
+	BBlocks::Shutdown();
+}
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(test_loopback_basic);
+	TEST(test_loopback_deadline);
+
+	TeardownTestSetup();
+
+	return 0;
+}
@@ -231,6 +231,699 @@ test_tcp_basic()
     BBlocks::Shutdown();
 }
 
+//......................................................... coalescetcptest ....
+
+/*
+ * Client sends many small messages with write coalescing enabled, the server checks they arrive
+ * in order and the client checks they went out in fewer syscalls than messages
+ */
+class CoalesceTCPTest : public CompletionHandle
+{
+public:
+
+    typedef CoalesceTCPTest This;
+
+    static const uint32_t MAX_MSGS = 1024;
+    static const uint32_t MSGSIZE = 100;
+
+    CoalesceTCPTest()
+	: log_("/testtcp/coalesce")
+	, epoll_("/epoll")
+	, tcpServer_(epoll_)
+	, tcpClient_(epoll_)
+	, addr_(SocketAddress::GetAddr("127.0.0.1", 10099 + (rand() % 100)))
+	, server_ch_(NULL)
+	, client_ch_(NULL)
+	, rbuf_(IOBuffer::Alloc(MSGSIZE))
+	, nread_(0)
+	, nwritten_(0)
+	, isDone_(false)
+    {
+    }
+
+    ~CoalesceTCPTest()
+    {
+	rbuf_.Trash();
+    }
+
+    void Start(int nonce)
+    {
+	SocketAddress saddr = SocketAddress::ServerSocketAddr(addr_);
+
+	int status = tcpServer_.Accept(saddr, async_fn(this, &This::HandleServerConn));
+	INVARIANT(status == 0);
+
+	status = tcpClient_.Connect(SocketAddress(addr_), async_fn(this, &This::HandleClientConn));
+	INVARIANT(status == 0);
+    }
+
+    virtual void HandleServerConn(int status, UnicastTransportChannel * ch) __async_fn__
+    {
+	INVARIANT(status == 0);
+
+	server_ch_ = dynamic_cast<TCPChannel *>(ch);
+
+	ReadUntilBlocked();
+    }
+
+    virtual void HandleClientConn(int status, UnicastTransportChannel * ch) __async_fn__
+    {
+	INVARIANT(status == 0);
+
+	client_ch_ = dynamic_cast<TCPChannel *>(ch);
+	client_ch_->EnableCoalescing(TCPChannel::CoalesceOptions(/*maxBytes=*/ 16 * MSGSIZE,
+								 /*maxDelayMs=*/ 1));
+
+	for (uint32_t i = 0; i < MAX_MSGS; ++i) {
+	    IOBuffer buf = IOBuffer::Alloc(MSGSIZE);
+	    memset(buf.Ptr(), i % 256, MSGSIZE);
+
+	    /*
+	     * Writes are held and complete through the handle
+	     */
+	    status = client_ch_->Write(buf, async_fn(this, &This::WriteDone));
+	    INVARIANT(status == 0);
+	}
+
+	client_ch_->Flush();
+    }
+
+    virtual void WriteDone(int status, IOBuffer buf) __async_fn__
+    {
+	INVARIANT(status == (int) MSGSIZE);
+
+	buf.Trash();
+
+	++nwritten_;
+	MaybeStop();
+    }
+
+    virtual void ReadDone(int status, IOBuffer buf) __async_fn__
+    {
+	INVARIANT(status == (int) MSGSIZE);
+
+	VerifyData();
+	ReadUntilBlocked();
+    }
+
+    void ClientStopped(int) __async_fn__
+    {
+	delete client_ch_;
+	client_ch_ = NULL;
+
+	server_ch_->Stop(async_fn(this, &This::ServerChannelStopped));
+    }
+
+    void ServerChannelStopped(int) __async_fn__
+    {
+	delete server_ch_;
+	server_ch_ = NULL;
+
+	tcpServer_.Stop(async_fn(this, &This::ServerStopped));
+    }
+
+    void ServerStopped(int) __async_fn__
+    {
+	tcpClient_.Stop(async_fn(this, &This::ConnectorStopped));
+    }
+
+    void ConnectorStopped(int) __async_fn__
+    {
+	BBlocks::Wakeup();
+    }
+
+private:
+
+    void ReadUntilBlocked()
+    {
+	while (nread_ < MAX_MSGS) {
+	    int status = server_ch_->Read(rbuf_, async_fn(this, &This::ReadDone));
+	    INVARIANT(status >= 0 && status <= (int) MSGSIZE);
+
+	    if (status != (int) MSGSIZE) {
+		return;
+	    }
+
+	    VerifyData();
+	}
+    }
+
+    void VerifyData()
+    {
+	for (uint32_t i = 0; i < MSGSIZE; ++i) {
+	    INVARIANT(rbuf_.Ptr()[i] == nread_ % 256);
+	}
+
+	++nread_;
+	MaybeStop();
+    }
+
+    void MaybeStop()
+    {
+	if (nread_ < MAX_MSGS || nwritten_ < MAX_MSGS || isDone_.exchange(true)) {
+	    return;
+	}
+
+	const uint64_t nsyscalls = epoll_.statWriteBatch_.Count();
+
+	INFO(log_) << "Messages " << nread_ << " write syscalls " << nsyscalls;
+
+	INVARIANT(epoll_.statWriteBatch_.Value() == MAX_MSGS);
+	INVARIANT(nsyscalls < MAX_MSGS / 2);
+
+	int status = client_ch_->Stop(async_fn(this, &This::ClientStopped));
+	INVARIANT(status == 0);
+    }
+
+    string log_;
+    Epoll epoll_;
+    TCPServer tcpServer_;
+    TCPConnector tcpClient_;
+    sockaddr_in addr_;
+    TCPChannel * server_ch_;
+    TCPChannel * client_ch_;
+    IOBuffer rbuf_;
+    atomic<uint32_t> nread_;
+    atomic<uint32_t> nwritten_;
+    atomic<bool> isDone_;
+};
+
+void
+test_tcp_coalesce()
+{
+    BBlocks::Start();
+
+    CoalesceTCPTest test;
+
+    BBlocks::Schedule(&test, &CoalesceTCPTest::Start, /*nonce=*/ 0);
+
+    BBlocks::Wait();
+    BBlocks::Shutdown();
+}
+
+//......................................................... deadlinetcptest ....
+
+/*
+ * Server reads with nothing on the wire. The first read runs into its deadline, the second is
+ * cancelled through its token and a read on a cancelled token fails right away.
+ */
+class DeadlineTCPTest : public CompletionHandle
+{
+public:
+
+    typedef DeadlineTCPTest This;
+
+    static const uint32_t BUFSIZE = 100;
+    static const uint32_t TIMEOUT_MS = 10;
+
+    DeadlineTCPTest()
+	: log_("/testtcp/deadline")
+	, epoll_("/epoll")
+	, tcpServer_(epoll_)
+	, tcpClient_(epoll_)
+	, addr_(SocketAddress::GetAddr("127.0.0.1", 10199 + (rand() % 100)))
+	, server_ch_(NULL)
+	, client_ch_(NULL)
+	, rbuf_(IOBuffer::Alloc(BUFSIZE))
+	, nconn_(0)
+    {
+    }
+
+    ~DeadlineTCPTest()
+    {
+	rbuf_.Trash();
+    }
+
+    void Start(int nonce)
+    {
+	SocketAddress saddr = SocketAddress::ServerSocketAddr(addr_);
+
+	int status = tcpServer_.Accept(saddr, async_fn(this, &This::HandleServerConn));
+	INVARIANT(status == 0);
+
+	status = tcpClient_.Connect(SocketAddress(addr_), async_fn(this, &This::HandleClientConn));
+	INVARIANT(status == 0);
+    }
+
+    virtual void HandleServerConn(int status, UnicastTransportChannel * ch) __async_fn__
+    {
+	INVARIANT(status == 0);
+
+	server_ch_ = dynamic_cast<TCPChannel *>(ch);
+
+	if (++nconn_ == 2) {
+	    ReadWithDeadline();
+	}
+    }
+
+    virtual void HandleClientConn(int status, UnicastTransportChannel * ch) __async_fn__
+    {
+	INVARIANT(status == 0);
+
+	client_ch_ = dynamic_cast<TCPChannel *>(ch);
+
+	if (++nconn_ == 2) {
+	    ReadWithDeadline();
+	}
+    }
+
+    void ReadWithDeadline()
+    {
+	timer_.Reset();
+
+	int status = server_ch_->Read(rbuf_, async_fn(this, &This::ReadTimedOut),
+				      OpCtl(TIMEOUT_MS));
+	INVARIANT(status == 0);
+    }
+
+    virtual void ReadTimedOut(int status, IOBuffer buf) __async_fn__
+    {
+	INVARIANT(status == TIMEDOUT);
+	INVARIANT(buf.Ptr() == rbuf_.Ptr());
+	INVARIANT(timer_.Elapsed() + 1 >= TIMEOUT_MS);
+
+	int ret = server_ch_->Read(rbuf_, async_fn(this, &This::ReadCancelled),
+				   OpCtl(/*timeoutMs=*/ 0, &token_));
+	INVARIANT(ret == 0);
+
+	token_.Cancel();
+    }
+
+    virtual void ReadCancelled(int status, IOBuffer buf) __async_fn__
+    {
+	INVARIANT(status == CANCELLED);
+	INVARIANT(buf.Ptr() == rbuf_.Ptr());
+
+	int ret = server_ch_->Read(rbuf_, async_fn(this, &This::ReadCancelled),
+				   OpCtl(/*timeoutMs=*/ 0, &token_));
+	INVARIANT(ret == CANCELLED);
+
+	ret = client_ch_->Stop(async_fn(this, &This::ClientStopped));
+	INVARIANT(ret == 0);
+    }
+
+    void ClientStopped(int) __async_fn__
+    {
+	delete client_ch_;
+	client_ch_ = NULL;
+
+	server_ch_->Stop(async_fn(this, &This::ServerChannelStopped));
+    }
+
+    void ServerChannelStopped(int) __async_fn__
+    {
+	delete server_ch_;
+	server_ch_ = NULL;
+
+	tcpServer_.Stop(async_fn(this, &This::ServerStopped));
+    }
+
+    void ServerStopped(int) __async_fn__
+    {
+	tcpClient_.Stop(async_fn(this, &This::ConnectorStopped));
+    }
+
+    void ConnectorStopped(int) __async_fn__
+    {
+	BBlocks::Wakeup();
+    }
+
+private:
+
+    string log_;
+    Epoll epoll_;
+    TCPServer tcpServer_;
+    TCPConnector tcpClient_;
+    sockaddr_in addr_;
+    TCPChannel * server_ch_;
+    TCPChannel * client_ch_;
+    IOBuffer rbuf_;
+    CancelToken token_;
+    Timer timer_;
+    atomic<int> nconn_;
+};
+
+void
+test_tcp_deadline()
+{
+    BBlocks::Start();
+
+    DeadlineTCPTest test;
+
+    BBlocks::Schedule(&test, &DeadlineTCPTest::Start, /*nonce=*/ 0);
+
+    BBlocks::Wait();
+    BBlocks::Shutdown();
+}
+
+//............................................................................ idletcptest ....
+
+/*
+ * Opens a set of connections and moves one message over each. The channels hold no op state
+ * before and after, the IO is accounted to the poller and the channels go back to the pool.
+ */
+class IdleTCPTest : public CompletionHandle
+{
+public:
+
+    typedef IdleTCPTest This;
+
+    static const uint32_t NCONN = 32;
+    static const uint32_t BUFSIZE = 512;
+    static const size_t MAX_CHANNEL_SIZE = 128;
+
+    IdleTCPTest()
+	: lock_("/testtcp/idle")
+	, log_("/testtcp/idle")
+	, epoll_("/epoll")
+	, tcpServer_(epoll_)
+	, tcpClient_(epoll_)
+	, addr_(SocketAddress::GetAddr("127.0.0.1", 10299 + (rand() % 100)))
+	, nlive_(ObjectPool<TCPChannel>::Instance().Live())
+	, nread_(0)
+	, nwritten_(0)
+	, nstopped_(0)
+    {
+    }
+
+    void Start(int nonce)
+    {
+	INVARIANT(sizeof(TCPChannel) <= MAX_CHANNEL_SIZE);
+
+	SocketAddress saddr = SocketAddress::ServerSocketAddr(addr_);
+
+	int status = tcpServer_.Accept(saddr, async_fn(this, &This::HandleServerConn));
+	INVARIANT(status == 0);
+
+	for (uint32_t i = 0; i < NCONN; ++i) {
+	    status = tcpClient_.Connect(SocketAddress(addr_),
+					async_fn(this, &This::HandleClientConn));
+	    INVARIANT(status == 0);
+	}
+    }
+
+    virtual void HandleServerConn(int status, UnicastTransportChannel * ch) __async_fn__
+    {
+	INVARIANT(status == 0);
+
+	Guard _(&lock_);
+
+	server_chs_.push_back(dynamic_cast<TCPChannel *>(ch));
+	MaybeExchange();
+    }
+
+    virtual void HandleClientConn(int status, UnicastTransportChannel * ch) __async_fn__
+    {
+	INVARIANT(status == 0);
+
+	Guard _(&lock_);
+
+	client_chs_.push_back(dynamic_cast<TCPChannel *>(ch));
+	MaybeExchange();
+    }
+
+    virtual void ReadDone(int status, IOBuffer buf) __async_fn__
+    {
+	INVARIANT(status == (int) BUFSIZE);
+
+	buf.Trash();
+
+	++nread_;
+	MaybeVerify();
+    }
+
+    virtual void WriteDone(int status, IOBuffer buf) __async_fn__
+    {
+	INVARIANT(status == (int) BUFSIZE);
+
+	buf.Trash();
+
+	++nwritten_;
+	MaybeVerify();
+    }
+
+    void Stopped(int) __async_fn__
+    {
+	if (++nstopped_ < 2 * NCONN) {
+	    return;
+	}
+
+	for (auto ch : client_chs_) {
+	    delete ch;
+	}
+
+	for (auto ch : server_chs_) {
+	    delete ch;
+	}
+
+	INVARIANT(ObjectPool<TCPChannel>::Instance().Live() == nlive_);
+
+	tcpServer_.Stop(async_fn(this, &This::ServerStopped));
+    }
+
+    void ServerStopped(int) __async_fn__
+    {
+	tcpClient_.Stop(async_fn(this, &This::ConnectorStopped));
+    }
+
+    void ConnectorStopped(int) __async_fn__
+    {
+	BBlocks::Wakeup();
+    }
+
+private:
+
+    void MaybeExchange()
+    {
+	ASSERT(lock_.IsOwner());
+
+	if (server_chs_.size() < NCONN || client_chs_.size() < NCONN) {
+	    return;
+	}
+
+	INVARIANT(ObjectPool<TCPChannel>::Instance().Live() == nlive_ + 2 * NCONN);
+
+	/*
+	 * Fresh channels carry no op state, reads wait for the writes on the other side
+	 */
+	for (auto ch : server_chs_) {
+	    INVARIANT(ch->IsIdle());
+
+	    IOBuffer buf = IOBuffer::Alloc(BUFSIZE);
+	    int status = ch->Read(buf, async_fn(this, &This::ReadDone));
+	    INVARIANT(status >= 0 && status <= (int) BUFSIZE);
+
+	    if (status == (int) BUFSIZE) {
+		ReadDone(status, buf);
+	    }
+	}
+
+	for (auto ch : client_chs_) {
+	    INVARIANT(ch->IsIdle());
+
+	    IOBuffer buf = IOBuffer::Alloc(BUFSIZE);
+	    buf.FillRandom();
+
+	    int status = ch->Write(buf, async_fn(this, &This::WriteDone));
+	    INVARIANT(status >= 0 && status <= (int) BUFSIZE);
+
+	    if (status == (int) BUFSIZE) {
+		WriteDone(status, buf);
+	    }
+	}
+    }
+
+    void MaybeVerify()
+    {
+	if (nread_ < NCONN || nwritten_ < NCONN) {
+	    return;
+	}
+
+	BBlocks::Schedule(this, &This::Verify, /*nonce=*/ 0);
+    }
+
+    void Verify(int) __async_fn__
+    {
+	Guard _(&lock_);
+
+	INFO(log_) << "Read " << epoll_.statReadSize_.Value()
+		   << " bytes, wrote " << epoll_.statWriteSize_.Value() << " bytes";
+
+	/*
+	 * The IO went to the poller and the op state was released on completion
+	 */
+	INVARIANT(epoll_.statReadSize_.Value() == NCONN * BUFSIZE);
+	INVARIANT(epoll_.statWriteSize_.Value() == NCONN * BUFSIZE);
+
+	for (auto ch : server_chs_) {
+	    INVARIANT(ch->IsIdle());
+	    int status = ch->Stop(async_fn(this, &This::Stopped));
+	    INVARIANT(status == 0);
+	}
+
+	for (auto ch : client_chs_) {
+	    INVARIANT(ch->IsIdle());
+	    int status = ch->Stop(async_fn(this, &This::Stopped));
+	    INVARIANT(status == 0);
+	}
+    }
+
+    SpinMutex lock_;
+    string log_;
+    Epoll epoll_;
+    TCPServer tcpServer_;
+    TCPConnector tcpClient_;
+    sockaddr_in addr_;
+    const int64_t nlive_;
+    vector<TCPChannel *> server_chs_;
+    vector<TCPChannel *> client_chs_;
+    atomic<uint32_t> nread_;
+    atomic<uint32_t> nwritten_;
+    atomic<uint32_t> nstopped_;
+};
+
+void
+test_tcp_idle()
+{
+    BBlocks::Start();
+
+    IdleTCPTest test;
+
+    BBlocks::Schedule(&test, &IdleTCPTest::Start, /*nonce=*/ 0);
+
+    BBlocks::Wait();
+    BBlocks::Shutdown();
+}
+
+//........................................................................... bursttcptest ....
+
+/*
+ * A burst of connects larger than an accept batch. The server drains the backlog over several
+ * notifications and accepts every connection, on channels reserved up front.
+ */
+class BurstTCPTest : public CompletionHandle
+{
+public:
+
+    typedef BurstTCPTest This;
+
+    static const uint32_t NCONN = 3 * 64 + 1;
+
+    BurstTCPTest()
+	: log_("/testtcp/burst")
+	, epoll_("/epoll")
+	, tcpServer_(epoll_, /*nprealloc=*/ NCONN)
+	, tcpClient_(epoll_)
+	, addr_(SocketAddress::GetAddr("127.0.0.1", 10399 + (rand() % 100)))
+	, chs_(2 * NCONN, NULL)
+	, naccepted_(0)
+	, nconnected_(0)
+	, nready_(0)
+	, nstopped_(0)
+    {
+	INVARIANT(ObjectPool<TCPChannel>::Instance().DepotSize() >= NCONN);
+    }
+
+    void Start(int nonce)
+    {
+	SocketAddress saddr = SocketAddress::ServerSocketAddr(addr_);
+
+	int status = tcpServer_.Accept(saddr, async_fn(this, &This::HandleServerConn));
+	INVARIANT(status == 0);
+
+	for (uint32_t i = 0; i < NCONN; ++i) {
+	    status = tcpClient_.Connect(SocketAddress(addr_),
+					async_fn(this, &This::HandleClientConn));
+	    INVARIANT(status == 0);
+	}
+    }
+
+    virtual void HandleServerConn(int status, UnicastTransportChannel * ch) __async_fn__
+    {
+	INVARIANT(status == 0);
+
+	const uint32_t n = naccepted_++;
+	INVARIANT(n < NCONN);
+
+	chs_[n] = dynamic_cast<TCPChannel *>(ch);
+	MaybeStop();
+    }
+
+    virtual void HandleClientConn(int status, UnicastTransportChannel * ch) __async_fn__
+    {
+	INVARIANT(status == 0);
+
+	const uint32_t n = nconnected_++;
+	INVARIANT(n < NCONN);
+
+	chs_[NCONN + n] = dynamic_cast<TCPChannel *>(ch);
+	MaybeStop();
+    }
+
+    void Stopped(int) __async_fn__
+    {
+	if (++nstopped_ < 2 * NCONN) {
+	    return;
+	}
+
+	for (auto ch : chs_) {
+	    delete ch;
+	}
+
+	tcpServer_.Stop(async_fn(this, &This::ServerStopped));
+    }
+
+    void ServerStopped(int) __async_fn__
+    {
+	tcpClient_.Stop(async_fn(this, &This::ConnectorStopped));
+    }
+
+    void ConnectorStopped(int) __async_fn__
+    {
+	BBlocks::Wakeup();
+    }
+
+private:
+
+    void MaybeStop()
+    {
+	if (++nready_ < 2 * NCONN) {
+	    return;
+	}
+
+	INFO(log_) << "Accepted " << naccepted_ << " connected " << nconnected_;
+
+	for (auto ch : chs_) {
+	    int status = ch->Stop(async_fn(this, &This::Stopped));
+	    INVARIANT(status == 0);
+	}
+    }
+
+    string log_;
+    Epoll epoll_;
+    TCPServer tcpServer_;
+    TCPConnector tcpClient_;
+    sockaddr_in addr_;
+    vector<TCPChannel *> chs_;		// accepted, then connected
+    atomic<uint32_t> naccepted_;
+    atomic<uint32_t> nconnected_;
+    atomic<uint32_t> nready_;		// channels in chs_
+    atomic<uint32_t> nstopped_;
+};
+
+void
+test_tcp_burst()
+{
+    BBlocks::Start();
+
+    BurstTCPTest test;
+
+    BBlocks::Schedule(&test, &BurstTCPTest::Start, /*nonce=*/ 0);
+
+    BBlocks::Wait();
+    BBlocks::Shutdown();
+}
+
 //.................................................................... main ....
 
 int
@@ -241,6 +934,10 @@ main(int argc, char ** argv)
     InitTestSetup();
 
     TEST(test_tcp_basic);
+    TEST(test_tcp_coalesce);
+    TEST(test_tcp_deadline);
+    TEST(test_tcp_idle);
+    TEST(test_tcp_burst);
 
     TeardownTestSetup();
 
@@ -0,0 +1,132 @@
+#include "test/unit/unit-test.h"
+
+#include <string>
+#include <sstream>
+#include <iostream>
+
+#include "async.h"
+#include "bblocks.h"
+#include "perf/hw-counter.h"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_hw_counter";
+
+static volatile uint64_t sink_;
+
+static void
+Work()
+{
+	for (int i = 0; i < 100 * 1000; ++i) {
+		sink_ += i;
+	}
+}
+
+// ............................................................................. TestHwCounter ....
+
+/*
+ * Counters move with the work done, and routines on the pool are reported by their type
+ */
+class TestHwCounter : public CompletionHandle
+{
+public:
+
+	typedef TestHwCounter This;
+
+	static const int MAX_CALLS = 100;
+	static const int MAX_OPS = 10;
+
+	TestHwCounter() : pending_(MAX_CALLS) {}
+
+	void Run(int)
+	{
+		Work();
+
+		if (!--pending_) {
+			BBlocks::Wakeup();
+		}
+	}
+
+	static void Counters()
+	{
+		HwCounters c;
+
+		if (c.Open() == HwCounters::NONE) {
+			INFO(_log) << "perf_event is not available, skipping";
+			return;
+		}
+
+		INFO(_log) << "Mode " << (c.mode() == HwCounters::HARDWARE ? "hardware" : "software");
+
+		HwCounters::Sample start, end;
+		INVARIANT(c.Read(start));
+		Work();
+		INVARIANT(c.Read(end));
+
+		INVARIANT(end.val_[HwCounters::CYCLES] > start.val_[HwCounters::CYCLES]);
+	}
+
+	static void Profiler()
+	{
+		HwProfiler::Enable();
+
+		BBlocks::Start();
+
+		TestHwCounter t;
+
+		for (int i = 0; i < MAX_CALLS; ++i) {
+			BBlocks::Schedule(&t, &This::Run, /*val=*/ 0);
+		}
+
+		BBlocks::Wait();
+
+		for (int i = 0; i < MAX_OPS; ++i) {
+			HwProfiler::Start();
+			Work();
+			HwProfiler::Stop("test-op");
+		}
+
+		HwProfiler::Disable();
+
+		stringstream ss;
+		HwProfiler::Print(ss);
+
+		INFO(_log) << "\n" << ss.str();
+
+		if (HwProfiler::mode() != HwCounters::NONE) {
+			const HwProfiler::Stats s = HwProfiler::Get("test-op");
+			INVARIANT(s.nops_ == MAX_OPS);
+			INVARIANT(s.sum_.val_[HwCounters::CYCLES]);
+
+			INVARIANT(ss.str().find("TestHwCounter") != string::npos);
+		}
+
+		const string op = "bblocks::MemberFnPtr1<TestHwCounter, int>";
+		const uint64_t nops = HwProfiler::Get(op).nops_;
+
+		BBlocks::Shutdown();
+
+		/*
+		 * The pool threads are gone, their stats stay for the report
+		 */
+		INVARIANT(HwProfiler::Get(op).nops_ == nops);
+	}
+
+	atomic<int> pending_;
+};
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(TestHwCounter::Counters);
+	TEST(TestHwCounter::Profiler);
+
+	TeardownTestSetup();
+
+	return 0;
+}
@@ -0,0 +1,219 @@
+#include "test/unit/unit-test.h"
+
+#include <sstream>
+
+#include "async.h"
+#include "bblocks.h"
+#include "perf/mem-account.h"
+#include "net/transport/loopback.h"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_mem_account";
+
+static const size_t KiB = 1024;
+
+//.............................................................................. TestMemAccount ....
+
+class TestMemAccount : public CompletionHandle
+{
+public:
+
+	typedef TestMemAccount This;
+
+	TestMemAccount(const int nwait = 3) : a_(NULL), b_(NULL), nwait_(nwait), ndone_(0) {}
+
+	/*
+	 * Runs once the transport is back under its hard limit
+	 */
+	struct SpaceRoutine : ThreadRoutine
+	{
+		SpaceRoutine(TestMemAccount * t) : t_(t) {}
+
+		virtual void Run() override
+		{
+			INVARIANT(!MemAccount::IsOverHard(MemAccount::TRANSPORT));
+			t_->Done();
+			delete this;
+		}
+
+		TestMemAccount * t_;
+	};
+
+	/*
+	 * IOBuffers are accounted while they live, the levels follow the limits
+	 */
+	static void Limits()
+	{
+		MemAccount::Flush();
+		const int64_t base = MemAccount::Bytes(MemAccount::IOBUFFER);
+
+		IOBuffer buf = IOBuffer::Alloc(1024 * KiB);
+		MemAccount::Flush();
+		INVARIANT(MemAccount::Bytes(MemAccount::IOBUFFER) == base + 1024 * (int64_t) KiB);
+		INVARIANT(MemAccount::level(MemAccount::IOBUFFER) == MemAccount::NORMAL);
+		INVARIANT(!MemAccount::IsUnderPressure());
+		INVARIANT(!MemAccount::IsBufferPressure());
+
+		MemAccount::SetLimits(MemAccount::IOBUFFER, /*soft=*/ base + 512 * KiB,
+				      /*hard=*/ base + 2048 * KiB);
+		INVARIANT(MemAccount::level(MemAccount::IOBUFFER) == MemAccount::SOFT);
+		INVARIANT(MemAccount::IsUnderPressure());
+		INVARIANT(MemAccount::IsBufferPressure());
+
+		IOBuffer more = IOBuffer::Alloc(1024 * KiB);
+		MemAccount::Flush();
+		INVARIANT(MemAccount::IsOverHard(MemAccount::IOBUFFER));
+		INVARIANT(!IOBuffer::TryAlloc(KiB));
+
+		more.Trash();
+		buf.Trash();
+		MemAccount::Flush();
+
+		INVARIANT(MemAccount::Bytes(MemAccount::IOBUFFER) == base);
+		INVARIANT(MemAccount::level(MemAccount::IOBUFFER) == MemAccount::NORMAL);
+		INVARIANT(!MemAccount::IsUnderPressure());
+		INVARIANT(!MemAccount::IsBufferPressure());
+
+		IOBuffer again = IOBuffer::TryAlloc(KiB);
+		INVARIANT(again);
+		again.Trash();
+
+		MemAccount::SetLimits(MemAccount::IOBUFFER, /*soft=*/ 0, /*hard=*/ 0);
+
+		stringstream ss;
+		MemAccount::Print(ss);
+		INFO(_log) << "\n" << ss.str();
+	}
+
+	/*
+	 * Queued writes count against the transport, over its hard limit writes are refused until
+	 * it drains
+	 */
+	static void Transport()
+	{
+		BBlocks::Start();
+
+		TestMemAccount t;
+		LoopbackChannel::NewPair(&t.a_, &t.b_, /*ringSize=*/ KiB);
+
+		MemAccount::Flush();
+		const int64_t base = MemAccount::Bytes(MemAccount::TRANSPORT);
+
+		IOBuffer buf = IOBuffer::Alloc(4 * KiB);
+		int status = t.a_->Write(buf, async_fn(&t, &This::WriteDone));
+		INVARIANT(status == (int) KiB);
+
+		MemAccount::Flush();
+		INVARIANT(MemAccount::Bytes(MemAccount::TRANSPORT) > base + 4 * (int64_t) KiB);
+
+		MemAccount::SetLimits(MemAccount::TRANSPORT, /*soft=*/ 0, /*hard=*/ base + KiB);
+		INVARIANT(MemAccount::IsOverHard(MemAccount::TRANSPORT));
+		INVARIANT(!MemAccount::IsBufferPressure());
+
+		status = t.a_->Write(buf, async_fn(&t, &This::WriteDone));
+		INVARIANT(status == NOMEM);
+
+		MemAccount::WaitForSpace(MemAccount::TRANSPORT, new SpaceRoutine(&t));
+
+		MemAccount::SetLimits(MemAccount::TRANSPORT, /*soft=*/ 0, /*hard=*/ 0);
+
+		/*
+		 * Stop fails the queued write
+		 */
+		t.a_->Stop(async_fn(&t, &This::Stopped));
+		t.b_->Stop(async_fn(&t, &This::Stopped));
+
+		BBlocks::Wait();
+
+		delete t.a_;
+		delete t.b_;
+		buf.Trash();
+
+		BBlocks::Shutdown();
+	}
+
+	/*
+	 * A pool thread frees transport memory under the hard limit, the free is published
+	 * without waiting for the thread's batch to fill and the waiter runs
+	 */
+	static void Release()
+	{
+		BBlocks::Start();
+
+		TestMemAccount t(/*nwait=*/ 1);
+
+		MemAccount::Flush();
+		const int64_t base = MemAccount::Bytes(MemAccount::TRANSPORT);
+
+		MemAccount::Charge(MemAccount::TRANSPORT, 32 * KiB);
+		MemAccount::Flush();
+
+		MemAccount::SetLimits(MemAccount::TRANSPORT, /*soft=*/ 0, /*hard=*/ base + 16 * KiB);
+		INVARIANT(MemAccount::IsOverHard(MemAccount::TRANSPORT));
+
+		MemAccount::WaitForSpace(MemAccount::TRANSPORT, new SpaceRoutine(&t));
+
+		/*
+		 * Less than a batch, it would be held back by the pool thread otherwise
+		 */
+		BBlocks::Schedule(&t, &This::ReleaseTransport, (int64_t) (32 * KiB));
+
+		BBlocks::Wait();
+
+		MemAccount::Flush();
+		INVARIANT(MemAccount::Bytes(MemAccount::TRANSPORT) == base);
+
+		MemAccount::SetLimits(MemAccount::TRANSPORT, /*soft=*/ 0, /*hard=*/ 0);
+
+		BBlocks::Shutdown();
+	}
+
+	void ReleaseTransport(int64_t bytes)
+	{
+		INVARIANT(MemAccount::IsOverHard(MemAccount::TRANSPORT));
+		MemAccount::Release(MemAccount::TRANSPORT, bytes);
+	}
+
+	void WriteDone(int status, IOBuffer buf) __async_fn__
+	{
+		INVARIANT(status == -1);
+	}
+
+	void Stopped(int) __async_fn__
+	{
+		Done();
+	}
+
+	void Done()
+	{
+		/*
+		 * Both ends stopped and the waiter ran, or only the waiter
+		 */
+		if (++ndone_ == nwait_) {
+			BBlocks::Wakeup();
+		}
+	}
+
+	LoopbackChannel * a_;
+	LoopbackChannel * b_;
+	const int nwait_;
+	atomic<int> ndone_;
+};
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(TestMemAccount::Limits);
+	TEST(TestMemAccount::Transport);
+	TEST(TestMemAccount::Release);
+
+	TeardownTestSetup();
+
+	return 0;
+}
@@ -0,0 +1,169 @@
+#include "test/unit/unit-test.h"
+
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <signal.h>
+#include <unistd.h>
+
+#include "async.h"
+#include "bblocks.h"
+#include "perf/trace.h"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_trace";
+
+static size_t
+Count(const string & s, const string & what)
+{
+	size_t n = 0;
+	for (size_t pos = s.find(what); pos != string::npos; pos = s.find(what, pos + 1)) {
+		++n;
+	}
+
+	return n;
+}
+
+// .................................................................................. TestTrace ....
+
+/*
+ * Routines on the pool show up in the dump with their thread, the ring of a thread keeps only the
+ * latest events, and a signal writes the dump to a file
+ */
+class TestTrace : public CompletionHandle
+{
+public:
+
+	typedef TestTrace This;
+
+	static const size_t RING_SIZE = 1024;
+	static const int MAX_CALLS = 100;
+
+	TestTrace() : pending_(MAX_CALLS) {}
+
+	void Run(int i)
+	{
+		TRACE_BEGIN("test-routine", i);
+		TRACE_END("test-routine", i);
+
+		if (!--pending_) {
+			BBlocks::Wakeup();
+		}
+	}
+
+	static void Pool()
+	{
+		Trace::Enable(RING_SIZE);
+
+		BBlocks::Start();
+
+		TestTrace t;
+
+		for (int i = 0; i < MAX_CALLS; ++i) {
+			BBlocks::Schedule(&t, &This::Run, i);
+		}
+
+		BBlocks::Wait();
+
+		stringstream ss;
+		Trace::Dump(ss);
+		const string s = ss.str();
+
+		INVARIANT(s.find("{\"traceEvents\":[") == 0);
+		INVARIANT(s.find("\"name\":\"/th/0\"") != string::npos);
+		INVARIANT(Count(s, "\"name\":\"test-routine\",\"ph\":\"B\"") == MAX_CALLS);
+		INVARIANT(Count(s, "\"name\":\"test-routine\",\"ph\":\"E\"") == MAX_CALLS);
+		INVARIANT(Count(s, "\"name\":\"push\"") >= (size_t) MAX_CALLS);
+		INVARIANT(Count(s, "\"name\":\"run\",\"ph\":\"B\"") >= (size_t) MAX_CALLS);
+
+		BBlocks::Shutdown();
+	}
+
+	static void Wrap()
+	{
+		Trace::Enable(RING_SIZE);
+
+		for (size_t i = 0; i < 5 * RING_SIZE; ++i) {
+			TRACE_INSTANT("test-wrap", i);
+		}
+
+		stringstream ss;
+		Trace::Dump(ss);
+		const string s = ss.str();
+
+		/*
+		 * The oldest slot is left out, it could be under a write
+		 */
+		INVARIANT(Count(s, "\"name\":\"test-wrap\"") == RING_SIZE - 1);
+		INVARIANT(s.find("\"arg\":" + STR(5 * RING_SIZE - 1) + "}") != string::npos);
+		INVARIANT(s.find("\"arg\":" + STR(4 * RING_SIZE - 1) + "}") == string::npos);
+
+		/*
+		 * Nothing is recorded once disabled
+		 */
+		Trace::Disable();
+		TRACE_INSTANT("test-disabled", 0);
+
+		stringstream ss2;
+		Trace::Dump(ss2);
+		INVARIANT(ss2.str().find("test-disabled") == string::npos);
+	}
+
+	static void Signal()
+	{
+		const string path = "/tmp/test_trace." + STR(getpid()) + ".json";
+		unlink(path.c_str());
+
+		Trace::Enable(RING_SIZE);
+		TRACE_INSTANT("test-signal", 0);
+
+		Trace::DumpOnSignal(SIGUSR2, path);
+
+		int status = raise(SIGUSR2);
+		INVARIANT(!status);
+
+		/*
+		 * The dump is written by a helper thread, wait for it to complete
+		 */
+		string s;
+		for (int i = 0; i < 5 * 1000; ++i) {
+			ifstream file(path.c_str());
+			stringstream ss;
+			ss << file.rdbuf();
+			s = ss.str();
+
+			if (s.size() > 3 && s.substr(s.size() - 3) == "]}\n") break;
+
+			usleep(/*usec=*/ 1000);
+		}
+
+		INFO(_log) << "Dump size " << s.size();
+
+		INVARIANT(s.find("{\"traceEvents\":[") == 0);
+		INVARIANT(s.find("test-signal") != string::npos);
+
+		unlink(path.c_str());
+		Trace::Disable();
+	}
+
+	atomic<int> pending_;
+};
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(TestTrace::Pool);
+	TEST(TestTrace::Wrap);
+	TEST(TestTrace::Signal);
+
+	TeardownTestSetup();
+
+	return 0;
+}
@@ -0,0 +1,136 @@
+#include "test/unit/unit-test.h"
+
+#include <string>
+#include <iostream>
+#include <unistd.h>
+
+#include "async.h"
+#include "bblocks.h"
+#include "schd/ctx-accounting.h"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_async_ctx";
+
+// ............................................................................... TestAsyncCtx ....
+
+/*
+ * A request hops through Schedule, an offloaded call, a timer and a completion queue. Every hop
+ * has to run in the context of the request, and its time has to be charged to the tenant.
+ */
+class TestAsyncCtx : public CompletionHandle
+{
+public:
+
+	typedef TestAsyncCtx This;
+
+	static const uint64_t REQUEST_ID = 7;
+	static const uint32_t TENANT = 3;
+
+	TestAsyncCtx() : cq_(this, &This::Dequeued) {}
+
+	void Start(int)
+	{
+		Check();
+
+		BBlocks::Offload([]() {
+					 /*
+					  * Blocking threads are not charged, the context does
+					  * not matter here
+					  */
+					 return 0;
+				 },
+				 async_fn(this, &This::Offloaded));
+	}
+
+	void Offloaded(int) __async_fn__
+	{
+		Check();
+		BBlocks::ScheduleIn(/*msec=*/ 1, this, &This::Fired, /*val=*/ 0);
+	}
+
+	void Fired(int)
+	{
+		Check();
+
+		/*
+		 * Wake up the queue from outside the context, the event keeps the context of the
+		 * handler
+		 */
+		Fn<int> h = cqueue_fn(&cq_);
+
+		const AsyncCtx none;
+		AsyncCtx::Scope _(none);
+		h.Wakeup(/*val=*/ 0);
+	}
+
+	void Dequeued(int)
+	{
+		Check();
+
+		CtxAccounting::Instance().Finish(AsyncCtx::Current());
+		BBlocks::Wakeup();
+	}
+
+	void Check()
+	{
+		const AsyncCtx & ctx = AsyncCtx::Current();
+
+		INVARIANT(ctx.IsSet());
+		INVARIANT(ctx.requestId_ == REQUEST_ID);
+		INVARIANT(ctx.tenant_ == TENANT);
+	}
+
+	static void Run()
+	{
+		BBlocks::Start();
+
+		TestAsyncCtx t;
+
+		{
+			AsyncCtx::Scope _(AsyncCtx::Begin(REQUEST_ID, TENANT,
+							  /*budgetInMilliSec=*/ 10 * 1000));
+			BBlocks::Schedule(&t, &This::Start, /*val=*/ 0);
+		}
+
+		INVARIANT(!AsyncCtx::Current().IsSet());
+
+		BBlocks::Wait();
+
+		/*
+		 * Start, Offloaded, Fired and the queue. A routine is charged once it returns,
+		 * which can be after the request finished.
+		 */
+		for (int i = 0; i < 1000 && CtxAccounting::Instance().Get(TENANT).nroutines_ < 4; ++i) {
+			usleep(/*usec=*/ 1000);
+		}
+
+		const CtxAccounting::Stats s = CtxAccounting::Instance().Get(TENANT);
+
+		INFO(_log) << CtxAccounting::Instance();
+
+		INVARIANT(s.nroutines_ >= 4);
+		INVARIANT(s.nrequests_ == 1);
+		INVARIANT(!s.nlate_);
+		INVARIANT(!CtxAccounting::Instance().Get(TENANT + 1).nroutines_);
+
+		BBlocks::Shutdown();
+	}
+
+	CompletionQueue<int> cq_;
+};
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(TestAsyncCtx::Run);
+
+	TeardownTestSetup();
+
+	return 0;
+}
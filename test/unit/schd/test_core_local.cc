@@ -0,0 +1,97 @@
+#include "test/unit/unit-test.h"
+
+#include <string>
+#include <iostream>
+
+#include "async.h"
+#include "bblocks.h"
+#include "schd/core-local.hpp"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_core_local";
+
+// .............................................................................. TestCoreLocal ....
+
+/*
+ * Routines on every core and the main thread bump a sharded counter, the aggregate has to add up
+ */
+class TestCoreLocal : public CompletionHandle
+{
+public:
+
+	typedef TestCoreLocal This;
+
+	static const int MAX_CALLS = 10 * 1000;
+	static const int MAX_MAIN = 1000;
+
+	TestCoreLocal() : pending_(MAX_CALLS) {}
+
+	void Run(int)
+	{
+		++counter_.Local();
+
+		if (!--pending_) {
+			BBlocks::Wakeup();
+		}
+	}
+
+	static void Test()
+	{
+		BBlocks::Start();
+
+		TestCoreLocal t;
+
+		/*
+		 * Every instance is on cache lines of its own
+		 */
+		const uint8_t * prev = NULL;
+		t.counter_.Visit([&prev](const uint64_t & v) {
+					 const uint8_t * p = (const uint8_t *) &v;
+					 INVARIANT(!((uintptr_t) p % CACHELINE_SIZE));
+					 INVARIANT(!prev || p - prev >= CACHELINE_SIZE);
+					 prev = p;
+				 });
+
+		for (int i = 0; i < MAX_CALLS; ++i) {
+			BBlocks::Schedule(&t, &This::Run, /*val=*/ 0);
+		}
+
+		/*
+		 * The main thread is not a pool thread, it goes through the shared instance
+		 */
+		for (int i = 0; i < MAX_MAIN; ++i) {
+			t.counter_.Update([](uint64_t & v) { ++v; });
+		}
+
+		BBlocks::Wait();
+
+		const uint64_t total = t.counter_.Aggregate(/*init=*/ (uint64_t) 0,
+							    [](const uint64_t r, const uint64_t & v) {
+								    return r + v;
+							    });
+
+		INFO(_log) << "Total " << total << " over " << t.counter_.size() << " instances";
+		INVARIANT(total == MAX_CALLS + MAX_MAIN);
+
+		BBlocks::Shutdown();
+	}
+
+	atomic<int> pending_;
+	CoreLocal<uint64_t> counter_;
+};
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(TestCoreLocal::Test);
+
+	TeardownTestSetup();
+
+	return 0;
+}
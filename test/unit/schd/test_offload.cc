@@ -0,0 +1,225 @@
+#include "test/unit/unit-test.h"
+
+#include <string>
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "async.h"
+#include "bblocks.h"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_offload";
+
+// ................................................................................ TestOffload ....
+
+/*
+ * A routine offloads a batch of blocking calls. The pool has to grow to take them on and every
+ * result has to come back to the core that offloaded the call.
+ */
+class TestOffload : public CompletionHandle
+{
+public:
+
+	typedef TestOffload This;
+
+	static const int MAX_CALLS = 16;
+	static const uint32_t SLEEP_MS = 20;
+
+	TestOffload() : core_(-1), pending_(0) {}
+
+	void Start(int)
+	{
+		core_ = NonBlockingThreadPool::CurrentCore();
+		INVARIANT(core_ >= 0);
+
+		pending_ = MAX_CALLS;
+
+		for (int i = 0; i < MAX_CALLS; ++i) {
+			BBlocks::Offload([i]() {
+						 INVARIANT(NonBlockingThreadPool::CurrentCore() == -1);
+						 usleep(SLEEP_MS * 1000);
+						 return i;
+					 },
+					 async_fn(this, &This::Done));
+		}
+	}
+
+	void Done(int i) __async_fn__
+	{
+		INVARIANT(i >= 0 && i < MAX_CALLS);
+		INVARIANT(NonBlockingThreadPool::CurrentCore() == core_);
+
+		if (!--pending_) {
+			BBlocks::Wakeup();
+		}
+	}
+
+	static void Run()
+	{
+		BBlocks::Start();
+
+		const uint64_t nthreads = OffloadPool::Instance().statThreads_.Count();
+
+		TestOffload t;
+		BBlocks::Schedule(&t, &This::Start, /*val=*/ 0);
+
+		BBlocks::Wait();
+
+		INFO(_log) << "Offload threads " << OffloadPool::Instance().nthreads();
+
+		INVARIANT(OffloadPool::Instance().statThreads_.Count() > nthreads);
+		INVARIANT(OffloadPool::Instance().nthreads() <= OffloadPool::DEFAULT_MAX_THREADS);
+
+		BBlocks::Shutdown();
+	}
+
+	int core_;
+	atomic<int> pending_;
+};
+
+// ............................................................................ TestOffloadSync ....
+
+/*
+ * Offload from a thread outside the pool, with the thread count capped
+ */
+class TestOffloadSync : public CompletionHandle
+{
+public:
+
+	static const int MAX_CALLS = 32;
+	static const size_t MAX_THREADS = 2;
+
+	static void Run()
+	{
+		BBlocks::Start();
+		BBlocks::SetOffloadThreads(/*minth=*/ 1, MAX_THREADS);
+
+		for (int i = 0; i < MAX_CALLS; ++i) {
+			AsyncWait<int> waiter;
+			BBlocks::Offload([i]() { return i * 2; },
+					 intr_fn(&waiter, &AsyncWait<int>::Done));
+			INVARIANT(waiter.Wait() == i * 2);
+			INVARIANT(OffloadPool::Instance().nthreads() <= MAX_THREADS);
+		}
+
+		BBlocks::SetOffloadThreads(OffloadPool::DEFAULT_MIN_THREADS,
+					   OffloadPool::DEFAULT_MAX_THREADS);
+		BBlocks::Shutdown();
+	}
+};
+
+// ............................................................................ TestOffloadOpen ....
+
+/*
+ * Open a file from a pool routine. The open blocks, it runs on the offload pool and the fd comes
+ * back to the core that asked for it.
+ */
+class TestOffloadOpen : public CompletionHandle
+{
+public:
+
+	typedef TestOffloadOpen This;
+
+	TestOffloadOpen() : core_(-1) {}
+
+	void Start(int)
+	{
+		core_ = NonBlockingThreadPool::CurrentCore();
+		INVARIANT(core_ >= 0);
+
+		const bool ok = BBlocks::Offload([]() {
+			INVARIANT(NonBlockingThreadPool::CurrentCore() == -1);
+			return ::open("/dev/null", O_RDWR);
+		}, async_fn(this, &This::Opened));
+		INVARIANT(ok);
+	}
+
+	void Opened(int fd) __async_fn__
+	{
+		INVARIANT(fd >= 0);
+		INVARIANT(NonBlockingThreadPool::CurrentCore() == core_);
+
+		::close(fd);
+
+		BBlocks::Wakeup();
+	}
+
+	static void Run()
+	{
+		BBlocks::Start();
+
+		TestOffloadOpen t;
+		BBlocks::Schedule(&t, &This::Start, /*val=*/ 0);
+
+		BBlocks::Wait();
+		BBlocks::Shutdown();
+	}
+
+	int core_;
+};
+
+// ......................................................................... TestOffloadStopped ....
+
+/*
+ * Shutdown stops the offload pool before the thread pool. A routine that offloads in between is
+ * refused and its handler is never called.
+ */
+class TestOffloadStopped : public CompletionHandle
+{
+public:
+
+	typedef TestOffloadStopped This;
+
+	void Start(int)
+	{
+		const bool ok = BBlocks::Offload([]() { return 0; },
+						 async_fn(this, &This::Done));
+		INVARIANT(!ok);
+
+		BBlocks::Wakeup();
+	}
+
+	void Done(int) __async_fn__
+	{
+		DEADEND
+	}
+
+	static void Run()
+	{
+		BBlocks::Start();
+
+		OffloadPool::Instance().Shutdown();
+
+		TestOffloadStopped t;
+		BBlocks::Schedule(&t, &This::Start, /*val=*/ 0);
+
+		BBlocks::Wait();
+
+		/*
+		 * Shutdown stops the offload pool again
+		 */
+		OffloadPool::Instance().Start();
+
+		BBlocks::Shutdown();
+	}
+};
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(TestOffload::Run);
+	TEST(TestOffloadSync::Run);
+	TEST(TestOffloadOpen::Run);
+	TEST(TestOffloadStopped::Run);
+
+	TeardownTestSetup();
+
+	return 0;
+}
@@ -0,0 +1,110 @@
+#include "test/unit/unit-test.h"
+
+#include <string>
+#include <iostream>
+#include <vector>
+
+#include "schd/parallel.hpp"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_parallel";
+
+// ............................................................................... TestParallel ....
+
+/*
+ * Fill an array with ParallelFor, then sum it with ParallelReduce
+ */
+class TestParallel : public CompletionHandle
+{
+public:
+
+	typedef TestParallel This;
+
+	static const size_t MAX_ELEMS = 1024 * 1024;
+	static const size_t GRAIN = 4096;
+
+	TestParallel() : v_(MAX_ELEMS, 0), npieces_(0) {}
+
+	void Start(int)
+	{
+		ParallelFor(/*begin=*/ 0, MAX_ELEMS, GRAIN,
+			    [this](const size_t begin, const size_t end) {
+				    INVARIANT(begin < end && end - begin <= GRAIN);
+				    ++npieces_;
+				    for (size_t i = begin; i < end; ++i) {
+					    v_[i] = i;
+				    }
+			    },
+			    async_fn(this, &This::Filled));
+	}
+
+	void Filled(int status) __async_fn__
+	{
+		INVARIANT(!status);
+		INVARIANT(npieces_ >= MAX_ELEMS / GRAIN);
+
+		for (size_t i = 0; i < MAX_ELEMS; ++i) {
+			INVARIANT(v_[i] == i);
+		}
+
+		ParallelReduce(/*begin=*/ 0, MAX_ELEMS, GRAIN, /*identity=*/ (uint64_t) 0,
+			       [this](const size_t begin, const size_t end) {
+				       uint64_t sum = 0;
+				       for (size_t i = begin; i < end; ++i) {
+					       sum += v_[i];
+				       }
+				       return sum;
+			       },
+			       [](const uint64_t a, const uint64_t b) { return a + b; },
+			       async_fn(this, &This::Reduced));
+	}
+
+	void Reduced(uint64_t sum) __async_fn__
+	{
+		const uint64_t n = MAX_ELEMS;
+		INVARIANT(sum == n * (n - 1) / 2);
+
+		/*
+		 * Empty range completes right away
+		 */
+		ParallelFor(/*begin=*/ 10, /*end=*/ 10, GRAIN,
+			    [](const size_t, const size_t) { DEADEND },
+			    async_fn(this, &This::Done));
+	}
+
+	void Done(int status) __async_fn__
+	{
+		INVARIANT(!status);
+		BBlocks::Wakeup();
+	}
+
+	static void Run()
+	{
+		BBlocks::Start();
+
+		TestParallel t;
+		BBlocks::Schedule(&t, &This::Start, /*val=*/ 0);
+
+		BBlocks::Wait();
+		BBlocks::Shutdown();
+	}
+
+	vector<size_t> v_;
+	atomic<size_t> npieces_;
+};
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(TestParallel::Run);
+
+	TeardownTestSetup();
+
+	return 0;
+}
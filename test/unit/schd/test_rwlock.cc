@@ -0,0 +1,117 @@
+#include "test/unit/unit-test.h"
+
+#include <string>
+#include <iostream>
+
+#include "lock.h"
+#include "schd/thread.h"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_rwlock";
+
+// ................................................................................. TestRWLock ....
+
+/*
+ * Writers update a pair of counters in two steps, readers must never see a half updated pair
+ */
+class TestRWLock
+{
+public:
+
+	static const int MAX_READERS = 4;
+	static const int MAX_WRITERS = 2;
+	static const int MAX_ITER = 10 * 1000;
+
+	TestRWLock(RWLock & lock) : lock_(lock), a_(0), b_(0) {}
+
+	class Worker : public Thread
+	{
+	public:
+
+		Worker(TestRWLock & t, const bool isWriter)
+			: Thread("/test_rwlock/worker"), t_(t), isWriter_(isWriter)
+		{}
+
+		virtual void * ThreadMain() override
+		{
+			for (int i = 0; i < MAX_ITER; ++i) {
+				if (isWriter_) {
+					AutoWriteLock _(&t_.lock_);
+					t_.a_.store(t_.a_.load(memory_order_relaxed) + 1,
+						    memory_order_relaxed);
+					sched_yield();
+					t_.b_.store(t_.b_.load(memory_order_relaxed) + 1,
+						    memory_order_relaxed);
+				} else {
+					AutoReadLock _(&t_.lock_);
+					INVARIANT(t_.a_.load(memory_order_relaxed)
+						  == t_.b_.load(memory_order_relaxed));
+				}
+			}
+
+			return NULL;
+		}
+
+	private:
+
+		TestRWLock & t_;
+		const bool isWriter_;
+	};
+
+	static void Run(RWLock & lock)
+	{
+		TestRWLock t(lock);
+		vector<Worker *> ths;
+
+		for (int i = 0; i < MAX_READERS + MAX_WRITERS; ++i) {
+			ths.push_back(new Worker(t, /*isWriter=*/ i < MAX_WRITERS));
+		}
+
+		for (auto th : ths) {
+			th->StartBlockingThread();
+		}
+
+		for (auto th : ths) {
+			th->Stop();
+			delete th;
+		}
+
+		INVARIANT(t.a_ == MAX_WRITERS * MAX_ITER);
+		INVARIANT(t.b_ == MAX_WRITERS * MAX_ITER);
+	}
+
+	RWLock & lock_;
+	atomic<int> a_;
+	atomic<int> b_;
+};
+
+void
+test_pthread_rwlock()
+{
+	PThreadRWLock lock;
+	TestRWLock::Run(lock);
+}
+
+void
+test_distributed_rwlock()
+{
+	DistributedRWLock lock;
+	TestRWLock::Run(lock);
+}
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(test_pthread_rwlock);
+	TEST(test_distributed_rwlock);
+
+	TeardownTestSetup();
+
+	return 0;
+}
@@ -0,0 +1,202 @@
+#include "test/unit/unit-test.h"
+
+#include <string>
+#include <iostream>
+#include <vector>
+
+#include "lock.h"
+#include "schd/snapshot.hpp"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_snapshot";
+
+// ................................................................................ TestSeqLock ....
+
+/*
+ * Writer publishes pairs of equal values, readers should never see a torn pair
+ */
+class TestSeqLock
+{
+public:
+
+	static const int MAX_READERS = 2;
+	static const int MAX_ITER = 100 * 1000;
+
+	struct Pair
+	{
+		uint64_t a_;
+		uint64_t b_;
+	};
+
+	class Reader : public Thread
+	{
+	public:
+
+		Reader(TestSeqLock & t) : Thread("/test_snapshot/reader"), t_(t) {}
+
+		virtual void * ThreadMain() override
+		{
+			uint64_t last = 0;
+
+			while (!t_.done_) {
+				const Pair p = t_.lock_.Read();
+				INVARIANT(p.a_ == p.b_);
+				INVARIANT(p.a_ >= last);
+				last = p.a_;
+			}
+
+			return NULL;
+		}
+
+	private:
+
+		TestSeqLock & t_;
+	};
+
+	TestSeqLock() : done_(false) {}
+
+	static void Run()
+	{
+		TestSeqLock t;
+		vector<Reader *> ths;
+
+		for (int i = 0; i < MAX_READERS; ++i) {
+			ths.push_back(new Reader(t));
+			ths.back()->StartBlockingThread();
+		}
+
+		for (uint64_t i = 1; i <= MAX_ITER; ++i) {
+			Pair p;
+			p.a_ = p.b_ = i;
+			t.lock_.Write(p);
+		}
+
+		t.done_ = true;
+
+		for (auto th : ths) {
+			th->Stop();
+			delete th;
+		}
+
+		INVARIANT(t.lock_.Read().a_ == MAX_ITER);
+	}
+
+	SeqLock<Pair> lock_;
+	atomic<bool> done_;
+};
+
+// ............................................................................... TestSnapshot ....
+
+/*
+ * Routines on the thread pool read the snapshot without a guard while the main thread keeps
+ * publishing new versions
+ */
+class TestSnapshot
+{
+public:
+
+	typedef TestSnapshot This;
+
+	static const int MAX_ROUTINES = 16;
+	static const int MAX_UPDATES = 10 * 1000;
+	static const size_t MAX_ELEMS = 8;
+
+	TestSnapshot() : snapshot_(new vector<int>(MAX_ELEMS, 0)), pending_(0), done_(false) {}
+
+	void Read(int)
+	{
+		if (done_) {
+			if (!--pending_) {
+				BBlocks::Wakeup();
+			}
+
+			return;
+		}
+
+		/*
+		 * All elements of a version have the same value
+		 */
+		const vector<int> * v = snapshot_.Get();
+		INVARIANT(v->size() == MAX_ELEMS);
+		for (auto i : *v) {
+			INVARIANT(i == v->front());
+		}
+
+		BBlocks::Schedule(this, &This::Read, /*val=*/ 0);
+	}
+
+	static void Run()
+	{
+		BBlocks::Start();
+
+		TestSnapshot t;
+		t.pending_ = MAX_ROUTINES;
+
+		for (int i = 0; i < MAX_ROUTINES; ++i) {
+			BBlocks::Schedule(&t, &This::Read, /*val=*/ 0);
+		}
+
+		for (int i = 1; i <= MAX_UPDATES; ++i) {
+			if (i % 2) {
+				t.snapshot_.Set(new vector<int>(MAX_ELEMS, i));
+			} else {
+				t.snapshot_.Update([i](vector<int> & v) {
+					for (auto & e : v) e = i;
+				});
+			}
+		}
+
+		INVARIANT(t.snapshot_.Read([](const vector<int> & v) { return v.front(); })
+			  == MAX_UPDATES);
+
+		t.done_ = true;
+
+		BBlocks::Wait();
+		BBlocks::Shutdown();
+
+		Epoch::Synchronize();
+		INVARIANT(!Epoch::Pending());
+	}
+
+	Snapshot<vector<int> > snapshot_;
+	atomic<int> pending_;
+	atomic<bool> done_;
+};
+
+// .................................................................................. TestLogrc ....
+
+void
+test_logrc()
+{
+	const string path = "/test_snapshot/logrc";
+
+	INVARIANT(!Logger::Instance().IsDebugEnabled(path));
+
+	Logger::Instance().EnableDebug(path);
+	INVARIANT(Logger::Instance().IsDebugEnabled(path));
+
+	DEBUG(path) << "Debug enabled at runtime";
+
+	Logger::Instance().DisableDebug(path);
+	INVARIANT(!Logger::Instance().IsDebugEnabled(path));
+
+	Epoch::Synchronize();
+}
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(TestSeqLock::Run);
+	TEST(TestSnapshot::Run);
+	TEST(test_logrc);
+
+	TeardownTestSetup();
+
+	return 0;
+}
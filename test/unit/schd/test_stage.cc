@@ -0,0 +1,152 @@
+#include "test/unit/unit-test.h"
+
+#include <string>
+#include <iostream>
+#include <unistd.h>
+
+#include "schd/stage.hpp"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_stage";
+
+// .................................................................................. TestStage ....
+
+/*
+ * Three stage pipeline with small queues. The producer pushes faster than the pipeline drains
+ * and has to back off, every event has to make it to the last stage.
+ */
+class TestStage : public CompletionHandle
+{
+public:
+
+	typedef TestStage This;
+
+	static const int MAX_EVENTS = 100 * 1000;
+	static const size_t CAPACITY = 64;
+	static const size_t BATCH = 8;
+
+	/*
+	 * Doubles the value
+	 */
+	struct Double : Stage<int>
+	{
+		Double() : Stage<int>("/test/double", CAPACITY, /*share=*/ 2, BATCH) {}
+
+		virtual void Handle(int & e, vector<int> & out) override
+		{
+			out.push_back(e * 2);
+		}
+	};
+
+	/*
+	 * Turns the value into a string
+	 */
+	struct Format : Stage<int, string>
+	{
+		Format() : Stage<int, string>("/test/format", CAPACITY, /*share=*/ 1, BATCH) {}
+
+		virtual void Handle(int & e, vector<string> & out) override
+		{
+			out.push_back(STR(e));
+		}
+	};
+
+	/*
+	 * Adds up the values
+	 */
+	struct Sum : Stage<string>
+	{
+		Sum(TestStage & t) : Stage<string>("/test/sum", CAPACITY, /*share=*/ 1, BATCH), t_(t) {}
+
+		virtual void Handle(string & e, vector<string> &) override
+		{
+			t_.sum_ += atoi(e.c_str());
+
+			if (++t_.nrecv_ == MAX_EVENTS) {
+				BBlocks::Schedule(&t_, &TestStage::Done, /*val=*/ 0);
+			}
+		}
+
+		TestStage & t_;
+	};
+
+	TestStage() : sum_(0), nrecv_(0), nsent_(0), nstalls_(0), sum_stage_(*this)
+	{
+		double_.SetNext(&format_);
+		format_.SetNext(&sum_stage_);
+	}
+
+	void Produce(int)
+	{
+		while (nsent_ < MAX_EVENTS) {
+			if (!double_.TryPush(nsent_)) {
+				++nstalls_;
+				double_.WaitForSpace(async_fn(this, &This::Produce));
+				return;
+			}
+
+			++nsent_;
+		}
+	}
+
+	void Done(int)
+	{
+		const uint64_t n = MAX_EVENTS;
+		INVARIANT(sum_ == n * (n - 1));
+
+		INFO(_log) << "Producer stalls " << nstalls_
+			   << " pipeline stalls " << format_.statBlocked_.Count();
+
+		/*
+		 * The queues are tiny, the producer had to back off
+		 */
+		INVARIANT(nstalls_);
+
+		BBlocks::Wakeup();
+	}
+
+	static void Run()
+	{
+		BBlocks::Start();
+
+		{
+			TestStage t;
+			BBlocks::Schedule(&t, &This::Produce, /*val=*/ 0);
+
+			BBlocks::Wait();
+
+			/*
+			 * Let the routines that found the queues empty exit
+			 */
+			while (!t.double_.IsIdle() || !t.format_.IsIdle() || !t.sum_stage_.IsIdle()) {
+				usleep(/*usec=*/ 1000);
+			}
+		}
+
+		BBlocks::Shutdown();
+	}
+
+	uint64_t sum_;
+	int nrecv_;
+	int nsent_;
+	int nstalls_;
+	Double double_;
+	Format format_;
+	Sum sum_stage_;
+};
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(TestStage::Run);
+
+	TeardownTestSetup();
+
+	return 0;
+}
@@ -0,0 +1,222 @@
+#include "test/unit/unit-test.h"
+
+#include <string>
+#include <iostream>
+#include <unistd.h>
+
+#include "schd/task-graph.hpp"
+
+using namespace bblocks;
+using namespace std;
+
+static const string _log = "/test_task_graph";
+
+// ............................................................................... TestTaskGraph ....
+
+/*
+ * Diamond of three reads, a merge and two writes. The reads and writes are offloaded to blocking
+ * threads and complete out of the pool, the merge has to wait for all three reads and the writes
+ * for the merge.
+ */
+class TestTaskGraph : public CompletionHandle
+{
+public:
+
+	typedef TestTaskGraph This;
+
+	static const int NREADS = 3;
+	static const int NWRITES = 2;
+
+	TestTaskGraph() : nread_(0), nwritten_(0), isMerged_(false) {}
+
+	void Start(int)
+	{
+		TaskGraph::TaskId merge = g_.AddTask([this]() {
+							     INVARIANT(nread_ == NREADS);
+							     INVARIANT(!nwritten_);
+							     isMerged_ = true;
+						     });
+
+		for (int i = 0; i < NREADS; ++i) {
+			TaskGraph::TaskId read = g_.AddAsyncTask([this](const Fn<int> & done) {
+					BBlocks::Offload([this]() {
+								 usleep(/*usec=*/ 1000);
+								 ++nread_;
+								 return 0;
+							 },
+							 done);
+				});
+
+			g_.AddEdge(read, merge);
+		}
+
+		for (int i = 0; i < NWRITES; ++i) {
+			TaskGraph::TaskId write = g_.AddAsyncTask([this](const Fn<int> & done) {
+					INVARIANT(isMerged_);
+					BBlocks::Offload([this]() {
+								 ++nwritten_;
+								 return 0;
+							 },
+							 done);
+				});
+
+			g_.AddEdge(merge, write);
+		}
+
+		g_.Run(async_fn(this, &This::Done));
+	}
+
+	void Done(int status) __async_fn__
+	{
+		INVARIANT(!status);
+		INVARIANT(nread_ == NREADS);
+		INVARIANT(nwritten_ == NWRITES);
+		INVARIANT(isMerged_);
+
+		BBlocks::Wakeup();
+	}
+
+	static void Run()
+	{
+		BBlocks::Start();
+
+		TestTaskGraph t;
+		BBlocks::Schedule(&t, &This::Start, /*val=*/ 0);
+
+		BBlocks::Wait();
+		BBlocks::Shutdown();
+	}
+
+	TaskGraph g_;
+	atomic<int> nread_;
+	atomic<int> nwritten_;
+	bool isMerged_;
+};
+
+// .......................................................................... TestTaskGraphChain ....
+
+/*
+ * A chain of CPU tasks runs in order, every task on the core its predecessor completed on
+ */
+class TestTaskGraphChain : public CompletionHandle
+{
+public:
+
+	typedef TestTaskGraphChain This;
+
+	static const int NTASKS = 64;
+
+	TestTaskGraphChain() : next_(0), core_(-1) {}
+
+	void Start(int)
+	{
+		TaskGraph::TaskId prev = 0;
+
+		for (int i = 0; i < NTASKS; ++i) {
+			TaskGraph::TaskId id = g_.AddTask([this, i]() {
+							  INVARIANT(next_ == i);
+							  ++next_;
+
+							  const int core = NonBlockingThreadPool::CurrentCore();
+							  INVARIANT(core >= 0);
+							  INVARIANT(core_ == -1 || core == core_);
+							  core_ = core;
+						  });
+
+			if (i) {
+				g_.AddEdge(prev, id);
+			}
+
+			prev = id;
+		}
+
+		g_.Run(async_fn(this, &This::Done));
+	}
+
+	void Done(int status) __async_fn__
+	{
+		INVARIANT(!status);
+		INVARIANT(next_ == NTASKS);
+
+		BBlocks::Wakeup();
+	}
+
+	static void Run()
+	{
+		BBlocks::Start();
+
+		TestTaskGraphChain t;
+		BBlocks::Schedule(&t, &This::Start, /*val=*/ 0);
+
+		BBlocks::Wait();
+		BBlocks::Shutdown();
+	}
+
+	TaskGraph g_;
+	int next_;
+	int core_;
+};
+
+// ........................................................................ TestTaskGraphFailure ....
+
+/*
+ * A failed task fails the graph and its dependents are skipped
+ */
+class TestTaskGraphFailure : public CompletionHandle
+{
+public:
+
+	typedef TestTaskGraphFailure This;
+
+	TestTaskGraphFailure() : isSkipped_(true) {}
+
+	void Start(int)
+	{
+		TaskGraph::TaskId fail = g_.AddAsyncTask([](const Fn<int> & done) {
+								 Fn<int> h(done);
+								 h.Wakeup(/*status=*/ FAIL);
+							 });
+		TaskGraph::TaskId next = g_.AddTask([this]() { isSkipped_ = false; });
+		g_.AddEdge(fail, next);
+
+		g_.Run(async_fn(this, &This::Done));
+	}
+
+	void Done(int status) __async_fn__
+	{
+		INVARIANT(status == FAIL);
+		INVARIANT(isSkipped_);
+
+		BBlocks::Wakeup();
+	}
+
+	static void Run()
+	{
+		BBlocks::Start();
+
+		TestTaskGraphFailure t;
+		BBlocks::Schedule(&t, &This::Start, /*val=*/ 0);
+
+		BBlocks::Wait();
+		BBlocks::Shutdown();
+	}
+
+	TaskGraph g_;
+	bool isSkipped_;
+};
+
+//........................................................................................ main ....
+
+int
+main(int argc, char ** argv)
+{
+	InitTestSetup();
+
+	TEST(TestTaskGraph::Run);
+	TEST(TestTaskGraphChain::Run);
+	TEST(TestTaskGraphFailure::Run);
+
+	TeardownTestSetup();
+
+	return 0;
+}
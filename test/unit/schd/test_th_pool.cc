@@ -165,6 +165,237 @@ parallel_test()
     slaves.clear();
 }
 
+//................................................................................. ElasticTest ....
+
+/*
+ * A burst of CPU bound routines on a pool that starts with a single active thread. The pool
+ * has to grow for the burst and shrink back once it is idle.
+ */
+struct ElasticTest
+{
+	typedef ElasticTest This;
+
+	static const int MAX_CALLS = 1000;
+	static const uint64_t BUSY_MICROSEC = 500;
+
+	ElasticTest() : pending_(MAX_CALLS), maxActive_(0) {}
+
+	void Run(int)
+	{
+		const uint64_t start = Rdtsc::NowInMicroSec();
+		while (Rdtsc::ElapsedInMicroSec(start) < BUSY_MICROSEC);
+
+		size_t nactive = NonBlockingThreadPool::Instance().nactive();
+		size_t max = maxActive_;
+		while (nactive > max && !maxActive_.compare_exchange_weak(max, nactive));
+
+		if (!--pending_) {
+			BBlocks::Wakeup();
+		}
+	}
+
+	atomic<int> pending_;
+	atomic<size_t> maxActive_;
+};
+
+void
+elastic_test()
+{
+	const uint32_t ncpu = SysConf::NumCores();
+
+	BBlocks::Start(ncpu, /*minActive=*/ 1);
+
+	NonBlockingThreadPool & pool = NonBlockingThreadPool::Instance();
+	INVARIANT(pool.ncpu() == ncpu);
+	INVARIANT(pool.nactive() == 1);
+
+	ElasticTest t;
+	for (int i = 0; i < ElasticTest::MAX_CALLS; ++i) {
+		BBlocks::Schedule(&t, &ElasticTest::Run, /*nonce=*/ 0);
+	}
+
+	BBlocks::Wait();
+
+	cout << "Max active threads " << t.maxActive_ << " of " << ncpu << endl;
+	INVARIANT(ncpu == 1 || t.maxActive_ > 1);
+
+	/*
+	 * Idle pool parks down to the minimum
+	 */
+	for (int i = 0; i < 500 && pool.nactive() > 1; ++i) {
+		usleep(10 * 1000);
+	}
+
+	INVARIANT(pool.nactive() == 1);
+
+	BBlocks::Shutdown();
+}
+
+//............................................................................... AdmissionTest ....
+
+/*
+ * Work refused by the queue depth limit, then by the queue delay, and admitted again once the
+ * pool has caught up
+ */
+struct AdmissionTest
+{
+	typedef AdmissionTest This;
+
+	static const uint64_t BUSY_MICROSEC = 500;
+
+	AdmissionTest() : nran_(0) {}
+
+	void Run(int)
+	{
+		const uint64_t start = Rdtsc::NowInMicroSec();
+		while (Rdtsc::ElapsedInMicroSec(start) < BUSY_MICROSEC);
+
+		++nran_;
+	}
+
+	void WaitFor(const size_t n)
+	{
+		while (nran_ < n) {
+			usleep(1000);
+		}
+	}
+
+	atomic<size_t> nran_;
+};
+
+void
+admission_test()
+{
+	BBlocks::Start();
+
+	const size_t ncpu = BBlocks::ncpu();
+	AdmissionTest t;
+
+	/*
+	 * Queue depth
+	 */
+	static const size_t MAX_DEPTH = 8;
+	BBlocks::SetAdmission(MAX_DEPTH, /*targetDelayInMicroSec=*/ 0);
+
+	size_t nsent = 0;
+	size_t nrejected = 0;
+
+	for (size_t i = 0; i < 1000 * ncpu; ++i) {
+		if (BBlocks::TrySchedule(&t, &AdmissionTest::Run, /*nonce=*/ 0)) {
+			++nsent;
+		} else {
+			++nrejected;
+		}
+	}
+
+	t.WaitFor(nsent);
+
+	cout << "Depth limit. sent " << nsent << " rejected " << nrejected << endl;
+	INVARIANT(nrejected);
+	INVARIANT(!BBlocks::IsSaturated());
+
+	/*
+	 * Queue delay, a backlog of half a second on every thread
+	 */
+	BBlocks::SetAdmission(/*maxDepth=*/ 0, /*targetDelayInMicroSec=*/ 1000);
+
+	for (size_t i = 0; i < 1000 * ncpu; ++i) {
+		BBlocks::Schedule(&t, &AdmissionTest::Run, /*nonce=*/ 0);
+		++nsent;
+	}
+
+	bool isShed = false;
+	while (!isShed && t.nran_ < nsent) {
+		if (BBlocks::TrySchedule(&t, &AdmissionTest::Run, /*nonce=*/ 0)) {
+			++nsent;
+		} else {
+			isShed = true;
+		}
+
+		usleep(5 * 1000);
+	}
+
+	t.WaitFor(nsent);
+
+	cout << "Delay target. shed " << isShed << endl;
+	INVARIANT(isShed);
+
+	/*
+	 * The queues drained, work is admitted again
+	 */
+	INVARIANT(BBlocks::TrySchedule(&t, &AdmissionTest::Run, /*nonce=*/ 0));
+	t.WaitFor(++nsent);
+
+	BBlocks::SetAdmission(/*maxDepth=*/ 0, /*targetDelayInMicroSec=*/ 0);
+	BBlocks::Shutdown();
+}
+
+//................................................................................ DeadlineTest ....
+
+/*
+ * On a single thread, routines with a deadline run ahead of the routines queued before them,
+ * earliest deadline first
+ */
+struct DeadlineTest
+{
+	typedef DeadlineTest This;
+
+	static const int NFIFO = 10;
+	static const int NEDF = 5;
+
+	DeadlineTest() : pending_(NFIFO + NEDF + 1) {}
+
+	void Start(int)
+	{
+		for (int i = 0; i < NFIFO; ++i) {
+			BBlocks::Schedule(this, &This::Run, /*msec=*/ -1);
+		}
+
+		for (int i = NEDF; i > 0; --i) {
+			BBlocks::ScheduleWithDeadline(/*msec=*/ i * 10, this, &This::Run, i * 10);
+		}
+
+		/*
+		 * Due right away, starts late
+		 */
+		BBlocks::ScheduleWithDeadline(/*msec=*/ 0, this, &This::Run, /*msec=*/ 0);
+	}
+
+	void Run(int msec)
+	{
+		order_.push_back(msec);
+
+		if (!--pending_) {
+			BBlocks::Wakeup();
+		}
+	}
+
+	atomic<int> pending_;
+	vector<int> order_;
+};
+
+void
+deadline_test()
+{
+	BBlocks::Start(/*ncores=*/ 1, /*minActive=*/ 1);
+
+	DeadlineTest t;
+	BBlocks::Schedule(&t, &DeadlineTest::Start, /*nonce=*/ 0);
+
+	BBlocks::Wait();
+
+	INVARIANT(t.order_.size() == DeadlineTest::NFIFO + DeadlineTest::NEDF + 1);
+
+	for (size_t i = 0; i < t.order_.size(); ++i) {
+		const int expected = i <= DeadlineTest::NEDF ? i * 10 : -1;
+		INVARIANT(t.order_[i] == expected);
+	}
+
+	INVARIANT(NonBlockingThreadPool::Instance().DeadlineMisses() >= 1);
+
+	BBlocks::Shutdown();
+}
+
 int
 main(int argc, char ** argv)
 {
@@ -173,6 +404,9 @@ main(int argc, char ** argv)
     TEST(bufferpool_test);
     TEST(pingpong_test);
     TEST(parallel_test);
+    TEST(elastic_test);
+    TEST(admission_test);
+    TEST(deadline_test);
 
     TeardownTestSetup();
 
@@ -60,14 +60,11 @@ private:
 void InitTestSetup()
 {
     LogHelper::InitConsoleLogger();
-    RRCpuId::Init();
-    NonBlockingThreadPool::Init();
+    BBlocks::Init();
 }
 
 void TeardownTestSetup()
 {
-    NonBlockingThreadPool::Destroy();
-    RRCpuId::Destroy();
-    LogHelper::DestroyLogger();
+    BBlocks::Destroy();
 }
 